@@ -0,0 +1,76 @@
+//  MonsterFS: check the consistency of a file system, and repair it
+//
+//  For UC Santa Barbara Fall 2013 CS 270
+//
+//  usage: fsck.monsterfs [-n|-y] [-j threads] [device]
+//    -n: only check (the default), -y: repair what is found,
+//    -j: threads walking the inodes, one per CPU by default.
+//  exit status: 0 clean, 1 problems all repaired, 4 problems left, 8 error.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "monsterfs_funs.h"
+
+int main(int argc, char *argv[])
+{
+	int repair = 0;
+	int nr_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	int opt, res, fixed = 0;
+	const char *dev_path = BLOCK_DEV_PATH;
+	struct volume *v;
+
+	while ((opt = getopt(argc, argv, "nyj:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'n':
+			repair = 0;
+			break;
+		case 'y':
+			repair = 1;
+			break;
+		case 'j':
+			nr_threads = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n|-y] [-j threads] [device]\n", argv[0]);
+			return 8;
+		}
+	}
+	if (optind < argc)
+		dev_path = argv[optind];
+
+	printf("open %s...\n", dev_path);
+	v = vol_open(dev_path);
+	if (v == NULL)
+	{
+		fprintf(stderr, "error: cannot open %s with error: %s\n", dev_path, strerror(errno));
+		return 8;
+	}
+	vol_enter(v);
+	// -y replays the journal if the fs was not unmounted cleanly and frees
+	// the orphans; -n leaves the fs untouched.
+	if ((repair ? init_super() : init_super_ro()) != 0)
+	{
+		fprintf(stderr, "error: cannot read the file system on %s\n", dev_path);
+		vol_close(v);
+		return 8;
+	}
+	res = fsck(repair, nr_threads, &fixed);
+	if (vol_close(v) != 0)
+	{
+		fprintf(stderr, "error: cannot close %s with error: %s\n", dev_path, strerror(errno));
+		return 8;
+	}
+	if (res == -1)
+		return 8;
+	if (res > fixed)
+		return 4;
+	if (res > 0)
+		return 1;
+	return 0;
+}
@@ -11,12 +11,31 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "monsterfs_funs.h"
 
 #define DEFAULT_PERMS 0777
+#define BACKGROUND_INTERVAL	5	// seconds between background passes
+#define DIR_COMPACT_BATCH	8	// max dirs compacted per pass
+#define RECLAIM_PASS_INODES	4	// max unlinked files freed per pass
 
-static int map_inode_to_stat(struct in_core_inode *inode, struct stat *stbuf)
+// FUSE runs the callbacks below on several threads. The monsterfs library
+// does its own locking, so they call into it directly.
+static pthread_t bg_thread;
+static int bg_started;
+// bg_stop is set under bg_lock, and bg_wake wakes the thread from its wait.
+static pthread_mutex_t bg_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bg_wake = PTHREAD_COND_INITIALIZER;
+static int bg_stop;
+// 1: the kernel takes the attributes of the entries with readdir, so
+// m_readdir reads their inodes.
+static int readdir_plus;
+
+static int map_inode_to_stat(const struct in_core_inode *inode, struct stat *stbuf)
 {
   // TODO: access permission is not correct.
   // TODO: access time is not correct.
@@ -48,21 +67,16 @@ static int map_inode_to_stat(struct in_core_inode *inode, struct stat *stbuf)
 
 static int m_getattr(const char *path, struct stat *stbuf)
 {
-  struct in_core_inode *inode;
-  int res = 0;
+  struct in_core_inode attr;
+  int res;
 
   memset(stbuf, 0, sizeof(struct stat));
 
-  inode = namei_v2(path);
-  if(inode == NULL)
-  {
-	return -ENOENT;
-  }
-
-  if(map_inode_to_stat(inode, stbuf) == -1)
+  res = getattr_v2(path, &attr);
+  if(res == 0 && map_inode_to_stat(&attr, stbuf) == -1)
   {
 	fprintf(stderr, "map inode to stat error\n");
-    return -1;
+    res = -1;
   }
 
   return res;
@@ -87,69 +101,65 @@ static int m_mknod(const char *path, mode_t mode, dev_t dev)
 	return res;
 }
 
+struct fill_dir_arg {
+	void *buffer;
+	fuse_fill_dir_t filler;
+};
+
+// hands one entry of readdir_v2 to FUSE. Without readdirplus FUSE only looks
+// at the inode number and file type, which the dir entry already has.
+static int fill_dir(void *arg, const char *name, int i_num, int file_type,
+	const struct in_core_inode *attr, int next_off)
+{
+	struct fill_dir_arg *fa = (struct fill_dir_arg*)arg;
+	struct stat stbuf;
+	memset(&stbuf, 0, sizeof(stbuf));
+	if (attr != NULL)
+		map_inode_to_stat(attr, &stbuf);
+	else
+	{
+		stbuf.st_ino = i_num;
+		stbuf.st_mode = (file_type == DIRECTORY) ? S_IFDIR : S_IFREG;
+	}
+	return fa->filler(fa->buffer, name, &stbuf, next_off);
+}
+
 static int m_readdir(const char *path, void *buffer, fuse_fill_dir_t filler,
                          off_t offset, struct fuse_file_info *fi)
 {
-        (void) offset;
         (void) fi;
 
 #if _DEBUG
 	//printf("\nm_readdir gets called\n");
 #endif
-	struct in_core_inode* ci;
-	ci = namei_v2(path);
+	struct fill_dir_arg fa;
+	fa.buffer = buffer;
+	fa.filler = filler;
+	struct in_core_inode* ci = namei_v2(path);
+	int res = readdir_v2(ci, (int)offset, readdir_plus, fill_dir, &fa);
+	return res;
+}
+
+// an open dir handle keeps compaction from moving the entries under a
+// listing that is resumed from an offset. It holds the i_num of the dir,
+// not a reference to it.
+static int m_opendir(const char *path, struct fuse_file_info *fi)
+{
+	struct in_core_inode* ci = namei_v2(path);
 	if (ci == NULL)
 		return -ENOENT;
-	if (ci->file_type != DIRECTORY)
-		return -ENOTDIR;
-
-        int off;
-        struct directory_entry* dir_entry;
-        // TODO: needs optimization: read a block at a time for several dir entries look-up.
-        for (off = 0; off < MAX_ENTRY_OFFSET - DIR_ENTRY_LENGTH; off += DIR_ENTRY_LENGTH)
-        {
-                int blk_num;
-                int offset_blk;
-
-                if (bmap(ci, off, &blk_num, &offset_blk) == -1)
-                        return -ENXIO;  /* No such device or address */
-                char buf[BLK_SZ];
-                if (bread(blk_num, buf) == -1)
-                        return -ENOENT;  /* No such device or address */
-
-                dir_entry = (struct directory_entry*)(buf + offset_blk);
-		int i_num = dir_entry->inode_num;
-		if (i_num == BAD_I_NUM)  // the end of dir.
-			break;
-		if (i_num == EMPTY_I_NUM)  // not a valid entry, may be deleted.
-			continue;
-		// dir entry is valid, so show the entry.
-		struct in_core_inode* i_entry = iget(i_num);
-		if (i_entry == NULL)
-			return -ENOENT;
-		struct stat *stbuf = (struct stat*)malloc(sizeof(struct stat));
-		if (stbuf == NULL)
-			return -ENOMEM;
-		memset(stbuf, 0, sizeof(struct stat));
-		if (map_inode_to_stat(i_entry, stbuf) == -1)
-			return -EFAULT;
-		if (iput(i_entry) == -1)
-			return -ENOENT;  // TODO: needs to get a better errno
-		if (dir_entry == NULL)
-			return -ENOENT;
-		filler(buffer, dir_entry->file_name, stbuf, 0);
-	}
-        ci->last_accessed = get_time();
-        ci->modified = 1;
-        int res = iput(ci);
-        if (res != 0)
-        {
-                fprintf(stderr, "iput error in read_v2\n");
-                return -EIO;
-        }
-#if _DEBUG
-	//printf("readdir complete\n");
-#endif
+	int i_num = ci->i_num;
+	if (iput(ci) != 0)
+		return -EIO;
+	int res = dir_listing_begin(i_num);
+	if (res == 0)
+		fi->fh = (uint64_t)i_num;
+	return res;
+}
+
+static int m_releasedir(const char *path, struct fuse_file_info *fi)
+{
+	dir_listing_end((int)fi->fh);
 	return 0;
 }
 
@@ -210,6 +220,21 @@ static int m_write(const char *path, const char *buf, size_t size, off_t offset1
 	return res;
 }
 
+// close() is not fsync(): the changes go with the next group commit, when
+// the transaction is big enough or the background pass runs, so a burst of
+// small files shares one journal write. fsync() commits at once, lazytime
+// access times included.
+static int m_flush(const char *path, struct fuse_file_info *fi)
+{
+	return 0;
+}
+
+static int m_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+	int res = iflush(1) == 0 ? 0 : -EIO;
+	return res;
+}
+
 static int m_release(const char *path, struct fuse_file_info *fi)
 {
 #if _DEBUG
@@ -231,23 +256,138 @@ static int m_truncate(const char *path, off_t length1)
 	return res;
 }
 
+// background pass: free the blks of the large files unlinked, compact the
+// dirs that unlink left full of holes, refill the free ilist if creates
+// drained it, then write the inode updates since the last pass back to disk.
+static void *background_pass(void *arg)
+{
+	pthread_mutex_lock(&bg_lock);
+	while (!bg_stop)
+	{
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec += BACKGROUND_INTERVAL;
+		while (!bg_stop && pthread_cond_timedwait(&bg_wake, &bg_lock, &until) != ETIMEDOUT)
+			;
+		if (bg_stop)
+			break;
+		pthread_mutex_unlock(&bg_lock);
+		if (reclaim_pending(RECLAIM_PASS_INODES) == -1)
+			fprintf(stderr, "background orphan reclaim error\n");
+		if (dir_compact_pending(DIR_COMPACT_BATCH) == -1)
+			fprintf(stderr, "background dir compaction error\n");
+		if (fill_free_ilist_ahead() == -1)
+			fprintf(stderr, "background free ilist refill error\n");
+		if (iflush(0) == -1)
+			fprintf(stderr, "background inode write back error\n");
+		pthread_mutex_lock(&bg_lock);
+	}
+	pthread_mutex_unlock(&bg_lock);
+	return NULL;
+}
+
+// started by FUSE once mounted (and daemonized), so the thread survives.
+static void *m_init(struct fuse_conn_info *conn)
+{
+#ifdef FUSE_CAP_READDIRPLUS
+	if (conn->capable & FUSE_CAP_READDIRPLUS)
+		readdir_plus = 1;
+#endif
+	if (pthread_create(&bg_thread, NULL, background_pass, NULL) != 0)
+		fprintf(stderr, "error: cannot start background thread\n");
+	else
+		bg_started = 1;
+	return NULL;
+}
+
+static void m_destroy(void *private_data)
+{
+	// the volume is closed after fuse_main() returns: the background
+	// thread must be done with it before the final write back.
+	pthread_mutex_lock(&bg_lock);
+	bg_stop = 1;
+	pthread_cond_signal(&bg_wake);
+	pthread_mutex_unlock(&bg_lock);
+	if (bg_started)
+		pthread_join(bg_thread, NULL);
+	reclaim_pending(RECLAIM_QUEUE_SZ);
+	dir_compact_pending(DIR_COMPACT_QUEUE_SZ);
+	if (blk_mags_drain(0) == -1)
+		fprintf(stderr, "error: reserved blk write back at unmount\n");
+	if (iflush(1) == -1)
+		fprintf(stderr, "error: inode write back at unmount\n");
+	if (journal_checkpoint() == -1)
+		fprintf(stderr, "error: journal checkpoint at unmount\n");
+}
+
 static struct fuse_operations monster_oper = {
   .getattr    =     m_getattr,
   .mkdir      =     m_mkdir,
   .mknod      =     m_mknod,
+  .opendir    =     m_opendir,
   .readdir    =     m_readdir,
+  .releasedir =     m_releasedir,
   .rmdir      =     m_rmdir,
   //.create     =     m_create,  /* if create is not implemented, then mknod gets called when create a file*/
   .unlink     =     m_unlink,
   .open       =     m_open,
   .read       =     m_read,
   .write      =     m_write,
+  .flush      =     m_flush,
   .release    =     m_release,
+  .fsync      =     m_fsync,
   .truncate    =     m_truncate,
+  .init       =     m_init,
+  .destroy    =     m_destroy,
+};
+
+// atime mount options. they are handled here rather than by the kernel,
+// since reads update the access time in monsterfs, not in the VFS.
+enum {
+	KEY_STRICTATIME,
+	KEY_RELATIME,
+	KEY_NOATIME,
+	KEY_LAZYTIME,
 };
 
+static struct fuse_opt monster_opts[] = {
+	FUSE_OPT_KEY("strictatime", KEY_STRICTATIME),
+	FUSE_OPT_KEY("relatime", KEY_RELATIME),
+	FUSE_OPT_KEY("noatime", KEY_NOATIME),
+	FUSE_OPT_KEY("lazytime", KEY_LAZYTIME),
+	FUSE_OPT_END
+};
+
+static enum atime_mode opt_atime_mode = DEFAULT_ATIME_MODE;
+static int opt_lazytime;
+
+static int monster_opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs)
+{
+	switch (key)
+	{
+	case KEY_STRICTATIME:
+		opt_atime_mode = ATIME_STRICT;
+		return 0;
+	case KEY_RELATIME:
+		opt_atime_mode = ATIME_RELATIME;
+		return 0;
+	case KEY_NOATIME:
+		opt_atime_mode = ATIME_NOATIME;
+		return 0;
+	case KEY_LAZYTIME:
+		opt_lazytime = 1;
+		return 0;
+	}
+	return 1; // keep it for fuse_main()
+}
+
 int main(int argc, char *argv[])
 {
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	if (fuse_opt_parse(&args, NULL, monster_opts, monster_opt_proc) == -1)
+		return -1;
+	set_atime_opts(opt_atime_mode, opt_lazytime);
+
 	printf("open storage...\n");
 	if (init_storage() == -1)
 	{
@@ -272,6 +412,10 @@ int main(int argc, char *argv[])
 #endif
 	dump();
 	int ret = 0;
-	ret = fuse_main(argc, argv, &monster_oper, NULL);
+	ret = fuse_main(args.argc, args.argv, &monster_oper, NULL);
+	fuse_opt_free_args(&args);
+	// marks the fs clean, so the next mount skips recovery.
+	if (cleanup_storage() != 0)
+		fprintf(stderr, "error: close storage\n");
 	return ret;
 }
@@ -6,73 +6,252 @@
 #include <sys/types.h>
 #include <sys/time.h>
 #include <stdio.h>
+#include <stdarg.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "monsterfs_funs.h"
 
-static char *storage;                 // pointer to in-memory storage
-static unsigned int store_blk_off;    // storage block offset
-static int storage_fd;                // on-disk storage file desc
+static void init_iblk_cache(void);
+static void init_inode_table(void);
 
 static int max_single = DIRECT_BLKS_PER_INODE + RANGE_SINGLE; // max single indirect blk num
 static int max_double = DIRECT_BLKS_PER_INODE + RANGE_SINGLE + RANGE_DOUBLE; // max double indirect blk num
-struct namei_cache_element namei_cache[NAMEI_CACHE_SZ];
-struct timeval tv;
 
+/* Locking. The calls below may run on many threads at once. Each lock is
+ * taken in this order and released before a lock above it is taken:
+ *   commit_lock    one journal commit at a time
+ *   journal handle (journal_start(), taken at the start of an op)
+ *   inode rwlock (ilock(), a dir before the inodes in it)
+ *   byte-range lock (range_lock(), under a shared inode rwlock)
+ *   map_lock       an inode's block map and size, under a shared rwlock
+ *   namei_lock     namei cache
+ *   itable_lock    in-core inode table: hash, free list, ref_count
+ *   super_lock     superblk writes, inode table growth
+ *   blk_mags_lock  the list of block magazines
+ *   blk magazine   a thread's reserved free blks
+ *   ag lock        an allocation group: its free blk list and free ilist,
+ *                  one group at a time
+ *   iblk_lock      in-core inode blks
+ *   dir_hint_lock  dir free-slot hints and the compaction queue
+ *   reclaim_lock   the orphans waiting for reclaim_pending()
+ *   jblk_lock      the journaled blks
+ * The pool locks are taken last. Each volume has its own set of the locks
+ * from commit_lock down, but for the inode locks above map_lock.
+ * Lookups and getattr read the namei cache and the in-core inodes without
+ * any of these, through seqcounts: a writer, holding the lock above that
+ * serializes it, makes the count odd while it changes the object; a reader
+ * copies what it needs and uses the copy only if the count was even and
+ * the same before and after. */
+
+static void seq_write_begin(unsigned int *seq)
+{
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
 
-/********************* Layer0: storage algorithms ***************************/
-int init_storage()
+static void seq_write_end(unsigned int *seq)
 {
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
 
-#if IN_MEM_STORE
-  int dev_size = BLK_SZ * NUM_BLKS;
+// odd: a write is in progress, the read has to go the locked way.
+static unsigned int seq_read_begin(const unsigned int *seq)
+{
+	return __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+}
 
-  storage = (char *)malloc(dev_size);
-  char *initPtr;
-  int i;
+// 1: the object changed since seq_read_begin() returned start.
+static int seq_read_retry(const unsigned int *seq, unsigned int start)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return (start & 1) || __atomic_load_n(seq, __ATOMIC_RELAXED) != start;
+}
 
-  initPtr = &storage[0];
 
-  if(storage != NULL)
+/********************* Layer0: volumes ***************************/
+
+// in-core allocation groups, see struct ag_desc.
+struct ag {
+	struct ag_desc d;
+	int idx;
+	pthread_mutex_t lock;   // held by all users of d
+};
+
+// in-core hint of where a directory has room, see dir_hint_get().
+struct dir_hint {
+	int i_num;      // the directory, -1: hint unused
+	int free_lblk;  // dir blks before this one have no unused slot
+	int nr_holes;   // unused slots left by unlink since the last compaction
+	int queued;     // 1: waiting in dir_compact_queue
+};
+
+// a dir with open listings, see dir_listing_begin().
+struct dir_listing {
+	int i_num;      // the directory, -1: entry unused
+	int nr;         // open listings of it
+};
+
+// a thread's reserved free blks, see balloc().
+struct blk_magazine {
+	pthread_mutex_t lock;  // taken by its thread, and by blk_mags_drain()
+	int nr[NR_AGS];
+	int blks[NR_AGS][BLK_MAGAZINE_SZ];
+	struct volume *vol;    // the blks are of
+	struct blk_magazine *next;
+};
+
+// a journaled blk: its latest image, read instead of the home blk until the
+// next checkpoint writes it there.
+struct jblk {
+	int blk;
+	int in_trans;             // 1: on the trans list of the running transaction
+	char *buf;
+	struct jblk *hash_next;
+	struct jblk *trans_next;
+};
+
+// the metadata journal in core, see struct journal_header.
+struct journal {
+	int active;               // 0: metadata writes go home directly (mkfs)
+	int start;                // the header blk
+	int nr_blks;              // header included
+	int head;                 // where the next transaction goes
+	unsigned int seq;         // of the next transaction
+	unsigned int first_seq;   // of the first transaction behind the header
+	pthread_mutex_t commit_lock;  // one commit at a time, held over its I/O
+	// ops in progress, see journal_start()
+	pthread_mutex_t handle_lock;  // for the waits on the two below
+	pthread_cond_t handle_cond;
+	int nr_handles;           // atomic
+	int committing;           // atomic: JOURNAL_DRAINING, JOURNAL_SEALING or 0
+	int nr_ops;               // atomic: ops ended since the last commit
+	// the journaled blks
+	pthread_mutex_t jblk_lock; // held by all users of the below
+	struct jblk *hash[JOURNAL_HASH_SZ];
+	int nr_mapped;
+	unsigned char *mapped;    // a bit per disk blk: journaled; read without the lock
+	struct jblk *trans;       // changed by the running transaction
+	int nr_trans;
+	// freed blks kept off the free lists until a checkpoint, see journal_defer_free()
+	int *deferred;
+	int nr_deferred;
+	int max_deferred;
+	int nr_ready;             // the first nr_ready deferred blks are past a checkpoint
+};
+
+// everything of one mounted fs image: its device, superblk, allocators and
+// in-core caches. The calls of this file work on the volume the calling
+// thread entered with vol_enter(), or else on the one init_storage() opened.
+// The locks are those of the lock order above, one set per volume.
+struct volume {
+	// device
+	char *storage;                 // in-memory storage
+	int storage_fd;                // on-disk storage file desc
+	// superblk and allocation groups
+	struct super_block *super;
+	pthread_mutex_t super_lock;    // superblk writes and the inode table growth
+	struct ag ags[NR_AGS];
+	int ag_rotor;                  // the group of the next new dir
+	unsigned int ilist_low;        // one bit per group, set by ialloc() when the group's
+	                               // free ilist runs low, for fill_free_ilist_ahead()
+	struct blk_magazine *blk_mags; // of all threads
+	pthread_mutex_t blk_mags_lock;
+	pthread_key_t blk_mag_key;     // the calling thread's magazine
+	// in-core inode blks, see iblk_read()
+	char **iblk_cache;             // NULL: blk not read yet
+	unsigned char *iblk_dirty;     // 0, IBLK_DIRTY or IBLK_LAZY
+	int *iblk_loc;                 // disk blk of each inode blk
+	int nr_iblks;                  // # of entries in the arrays above
+	pthread_mutex_t iblk_lock;     // held by all users of the above
+	// in-core inode table, see iget()
+	int nr_inodes;
+	struct in_core_inode *inode_hash[INODE_HASH_SZ];
+	struct in_core_inode inode_free_list;  // list head only
+	pthread_mutex_t itable_lock;   // held by all users of the above
+	// namei cache
+	struct namei_cache_element namei_cache[NAMEI_CACHE_SZ];
+	pthread_mutex_t namei_lock;
+	// dir free-slot hints
+	struct dir_hint dir_hints[DIR_HINT_SZ];
+	int dir_compact_queue[DIR_COMPACT_QUEUE_SZ];
+	int nr_compact_queued;
+	struct dir_listing dir_listings[DIR_LISTING_SZ];
+	pthread_mutex_t dir_hint_lock; // held by all users of the above
+	// unlinked inodes whose blks are still to be freed, see reclaim_queue()
+	struct in_core_inode *reclaim_queue[RECLAIM_QUEUE_SZ];
+	int nr_reclaim_queued;
+	pthread_mutex_t reclaim_lock;
+	// metadata journal
+	struct journal journal;
+	// mount options
+	int read_only;                 // mounted by init_super_ro(): nothing is written
+	enum atime_mode atime_mode;
+	int atime_lazy;
+	int root_i_num;
+	int curr_dir_i_num;
+};
+
+static struct volume *default_vol;      // opened by init_storage()
+static __thread struct volume *cur_vol; // entered by the calling thread
+#define VOL (cur_vol != NULL ? cur_vol : default_vol)
+
+static void blk_mag_release(void *arg);
+static int iblk_flush(int lazy);
+static int jblk_mapped(struct journal *j, unsigned int blk);
+static int journal_read(unsigned int blk, char *buffer);
+static int journal_write(unsigned int blk, const char *buffer, int meta);
+static int journal_off(int discard);
+static int super_mark(int state);
+
+struct volume* vol_enter(struct volume *v)
+{
+	struct volume *prev = cur_vol;
+	cur_vol = v;
+	return prev;
+}
+
+// the device of v: the block device at dev_path, or in memory.
+static int open_storage(struct volume *v, const char *dev_path)
+{
+#if IN_MEM_STORE
+  v->storage = (char *)calloc(NUM_BLKS, BLK_SZ);
+  if (v->storage == NULL)
   {
-    for(i = 0; i < dev_size; ++i)
-    {
-      initPtr = 0;
-      initPtr++;
-    }
+    fprintf(stderr, "error: no memory for the storage.\n");
+    return -ENOMEM;
   }
-
-  storage_fd = IN_MEM_FD;
+  v->storage_fd = IN_MEM_FD;
 
 #else
 
-  storage_fd = open(BLOCK_DEV_PATH, O_RDWR); // | O_CREAT);
+  v->storage_fd = open(dev_path, O_RDWR); // | O_CREAT);
 
-  if (storage_fd == -1)
+  if (v->storage_fd == -1)
   {
-    fprintf(stderr, "error open storage.\n");
+    fprintf(stderr, "error open storage %s.\n", dev_path);
     return -ENODEV;
   }
-  printf("storage fd = %d\n", storage_fd);
+  printf("storage fd = %d\n", v->storage_fd);
 
 #endif
-
-  init_namei_cache();
-
-  return storage_fd;
+  return 0;
 }
 
-int cleanup_storage()
+static int close_storage(struct volume *v)
 {
   int ret_status;
 
 #if IN_MEM_STORE
 
-  free(storage);
+  free(v->storage);
   ret_status = 0;
 
 #else
 
-  ret_status = close(storage_fd);
+  ret_status = close(v->storage_fd);
   if (ret_status != 0)
   {
     fprintf(stderr, "close storage error\n");
@@ -83,6 +262,130 @@ int cleanup_storage()
   return ret_status;
 }
 
+struct volume* vol_open(const char *dev_path)
+{
+	int g;
+	struct volume *v = (struct volume*)calloc(1, sizeof(struct volume));
+	if (v == NULL)
+	{
+		fprintf(stderr, "error: no memory for a volume\n");
+		return NULL;
+	}
+	if (open_storage(v, dev_path) != 0)
+	{
+		free(v);
+		return NULL;
+	}
+	pthread_mutex_init(&v->super_lock, NULL);
+	for (g = 0; g < NR_AGS; g++)
+	{
+		v->ags[g].idx = g;
+		pthread_mutex_init(&v->ags[g].lock, NULL);
+	}
+	pthread_mutex_init(&v->blk_mags_lock, NULL);
+	pthread_key_create(&v->blk_mag_key, blk_mag_release);
+	pthread_mutex_init(&v->iblk_lock, NULL);
+	pthread_mutex_init(&v->itable_lock, NULL);
+	pthread_mutex_init(&v->namei_lock, NULL);
+	pthread_mutex_init(&v->dir_hint_lock, NULL);
+	pthread_mutex_init(&v->reclaim_lock, NULL);
+	pthread_mutex_init(&v->journal.commit_lock, NULL);
+	pthread_mutex_init(&v->journal.handle_lock, NULL);
+	pthread_cond_init(&v->journal.handle_cond, NULL);
+	pthread_mutex_init(&v->journal.jblk_lock, NULL);
+	v->atime_mode = DEFAULT_ATIME_MODE;
+
+	struct volume *prev = vol_enter(v);
+	init_namei_cache();
+	init_dir_hints();
+	init_iblk_cache();
+	init_inode_table();
+	vol_enter(prev);
+	return v;
+}
+
+int vol_close(struct volume *v)
+{
+	int res = 0;
+	int g;
+	if (v == NULL)
+		return -1;
+	struct volume *prev = vol_enter(v);
+	if (v->super != NULL && !v->read_only)
+	{
+		if (reclaim_pending(RECLAIM_QUEUE_SZ) == -1)
+		{
+			fprintf(stderr, "orphan reclaim error\n");
+			res = -1;
+		}
+		if (blk_mags_drain(0) == -1)
+		{
+			fprintf(stderr, "reserved blks write back error\n");
+			res = -1;
+		}
+		if (iflush(1) == -1)
+		{
+			fprintf(stderr, "inode table write back error\n");
+			res = -1;
+		}
+		if (journal_off(0) == -1)
+		{
+			fprintf(stderr, "journal checkpoint error\n");
+			res = -1;
+		}
+		// all is home: no recovery at the next mount.
+		if (res == 0 && super_mark(FS_CLEAN) == -1)
+			res = -1;
+	}
+	while (v->blk_mags != NULL)
+	{
+		struct blk_magazine *m = v->blk_mags;
+		v->blk_mags = m->next;
+		free(m);
+	}
+	pthread_key_delete(v->blk_mag_key);
+	init_iblk_cache();
+	init_inode_table();
+	vol_enter(prev == v ? NULL : prev);
+	if (close_storage(v) != 0)
+		res = -1;
+	pthread_mutex_destroy(&v->super_lock);
+	for (g = 0; g < NR_AGS; g++)
+		pthread_mutex_destroy(&v->ags[g].lock);
+	pthread_mutex_destroy(&v->blk_mags_lock);
+	pthread_mutex_destroy(&v->iblk_lock);
+	pthread_mutex_destroy(&v->itable_lock);
+	pthread_mutex_destroy(&v->namei_lock);
+	pthread_mutex_destroy(&v->dir_hint_lock);
+	pthread_mutex_destroy(&v->reclaim_lock);
+	pthread_mutex_destroy(&v->journal.commit_lock);
+	pthread_mutex_destroy(&v->journal.handle_lock);
+	pthread_cond_destroy(&v->journal.handle_cond);
+	pthread_mutex_destroy(&v->journal.jblk_lock);
+	free(v->journal.mapped);
+	free(v->journal.deferred);
+	if (default_vol == v)
+		default_vol = NULL;
+	free(v->super);
+	free(v);
+	return res;
+}
+
+/********************* Layer0: storage algorithms ***************************/
+int init_storage()
+{
+  struct volume *v = vol_open(BLOCK_DEV_PATH);
+  if (v == NULL)
+    return -1;
+  default_vol = v;
+  return v->storage_fd;
+}
+
+int cleanup_storage()
+{
+  return vol_close(default_vol);
+}
+
 static int reset_storage(void)
 {
 	int i;
@@ -99,11 +402,12 @@ static int reset_storage(void)
 	return 0;
 }
 
-int bread(unsigned int blk, char *buffer)
+// read nr blks from blk on, in one request.
+static int dev_read(unsigned int blk, char *buffer, int nr)
 {
   int ret_status;
 
-  if (blk >= NUM_BLKS)
+  if (blk + nr > NUM_BLKS)
   {
     fprintf(stderr, "bread error: blk num #%d exceeds max block num\n", blk);
     return -1;
@@ -111,18 +415,14 @@ int bread(unsigned int blk, char *buffer)
 
 #if IN_MEM_STORE
 
-  memcpy(buffer, &storage[blk*BLK_SZ], BLK_SZ);
+  memcpy(buffer, &VOL->storage[(size_t)blk*BLK_SZ], (size_t)nr * BLK_SZ);
   ret_status = 0;
 
 #else
 
-  ret_status = lseek(storage_fd, blk * BLK_SZ, SEEK_SET);
-
-  if(ret_status == -1)
-    return ret_status;
-
-  ret_status = read(storage_fd, buffer, BLK_SZ);
-  if(ret_status != BLK_SZ)
+  // no shared file offset, so threads can do I/O at the same time.
+  ret_status = pread(VOL->storage_fd, buffer, (size_t)nr * BLK_SZ, (off_t)blk * BLK_SZ);
+  if(ret_status != nr * BLK_SZ)
     ret_status = -1;
   else
     ret_status = 0;
@@ -132,30 +432,32 @@ int bread(unsigned int blk, char *buffer)
   return ret_status;
 }
 
-int bwrite(unsigned int blk, const char *buffer)
+// write nr blks from blk on, in one request.
+static int dev_write(unsigned int blk, const char *buffer, int nr)
 {
   int ret_status;
 
-  if (blk >= NUM_BLKS)
+  if (blk + nr > NUM_BLKS)
   {
     fprintf(stderr, "bwrite error: blk num exceeds max block num\n");
     return -1;
   }
+  if (VOL->read_only)
+  {
+    fprintf(stderr, "bwrite error: blk #%d of a read-only volume\n", blk);
+    return -1;
+  }
 
 #if IN_MEM_STORE
 
-  memcpy(&storage[blk*BLK_SZ], buffer, BLK_SZ);
+  memcpy(&VOL->storage[(size_t)blk*BLK_SZ], buffer, (size_t)nr * BLK_SZ);
   ret_status = 0;
 
 #else
 
-  ret_status = lseek(storage_fd, blk * BLK_SZ, SEEK_SET);
-
-  if(ret_status == -1)
-    return ret_status;
-
-  ret_status = write(storage_fd, buffer, BLK_SZ);
-  if(ret_status != BLK_SZ)
+  // no shared file offset, so threads can do I/O at the same time.
+  ret_status = pwrite(VOL->storage_fd, buffer, (size_t)nr * BLK_SZ, (off_t)blk * BLK_SZ);
+  if(ret_status != nr * BLK_SZ)
     ret_status = -1;
   else
     ret_status = 0;
@@ -165,2722 +467,6868 @@ int bwrite(unsigned int blk, const char *buffer)
   return ret_status;
 }
 
-/********************* Layer1: block algorithms ***************************/
-static struct super_block* super;
+// wait until the writes so far are on the device.
+static int dev_sync(void)
+{
+#if IN_MEM_STORE
+  return 0;
+#else
+  if (fdatasync(VOL->storage_fd) != 0)
+  {
+    fprintf(stderr, "error: storage sync\n");
+    return -1;
+  }
+  return 0;
+#endif
+}
 
-static void dump_buffer(char* buf)
+int bread(unsigned int blk, char *buffer)
 {
-	int *p = (int*)buf;
-	int j;
+  if (journal_read(blk, buffer) == 1)
+    return 0;
+  return dev_read(blk, buffer, 1);
+}
 
-  for (j = 0; j < BLK_SZ/4; j++)
-    printf("%d ", *p++);
+// bread() of the nr blks from blk on, in one request if none is journaled.
+static int bread_run(unsigned int blk, char *buffer, int nr)
+{
+  int i;
+  struct journal *j = &VOL->journal;
+  if (j->active && blk + nr <= NUM_BLKS)
+  {
+    for (i = 0; i < nr; i++)
+    {
+      if (jblk_mapped(j, blk + i))
+        break;
+    }
+    if (i < nr)
+    { // some are journaled: one at a time.
+      for (i = 0; i < nr; i++)
+      {
+        if (bread(blk + i, buffer + (size_t)i * BLK_SZ) == -1)
+          return -1;
+      }
+      return 0;
+    }
+  }
+  return dev_read(blk, buffer, nr);
+}
 
-  printf("\n");
+int bwrite(unsigned int blk, const char *buffer)
+{
+  int res = journal_write(blk, buffer, 0);
+  if (res != 0)
+    return res == 1 ? 0 : -1;
+  return dev_write(blk, buffer, 1);
 }
 
-void dump(void)
+int bwrite_meta(unsigned int blk, const char *buffer)
 {
-	dump_super();
-	//dump_datablks();
+  int res = journal_write(blk, buffer, 1);
+  if (res != 0)
+    return res == 1 ? 0 : -1;
+  return dev_write(blk, buffer, 1);
 }
 
-void dump_super(void)
+/********************* Layer0: metadata journal ***************************/
+
+/* Metadata blks are written with bwrite_meta(). Once the journal is on, the
+ * write only changes the in-core image of the blk (struct jblk), which
+ * bread() returns from then on, and puts the blk in the running
+ * transaction. The ops that change metadata run inside a journal handle,
+ * see journal_start(). A commit waits for the handles to end, adds the
+ * dirty inode blks, and writes the transaction behind the previous one in
+ * a single request: many ops, from any thread, share one commit. The blks
+ * go home only at a checkpoint, once the journal is half full or at
+ * unmount. A transaction that does not fit behind the last one has the
+ * journal redone home from disk first, so every commit is journaled.
+ * A metadata blk freed while the journal holds an image of it is kept off
+ * the free lists until the next checkpoint, so that no replay puts the old
+ * image back over what a new owner wrote there. A free blk list link blk,
+ * journaled while it is on the list and handed out for data, has its data
+ * written through the journal for the same reason. */
+
+#define JOURNAL_DRAINING	1	// a commit waits for the running handles, new ops wait
+#define JOURNAL_SEALING		2	// a commit takes the transaction, all handles wait
+
+static __thread int handle_depth;  // journal handles the calling thread holds, nested
+
+static int jblk_mapped(struct journal *j, unsigned int blk)
 {
-        int i, j;
+	return (__atomic_load_n(&j->mapped[blk >> 3], __ATOMIC_ACQUIRE) >> (blk & 7)) & 1;
+}
 
-        printf("\n\ndumping super block...\n\n");
-        printf("sizeof superblock = %u\n", sizeof(struct super_block));
-        printf("sizeof disk_inode = %u, in_core_inode = %u\n", sizeof(struct disk_inode), sizeof(struct in_core_inode));
-        printf("block size = %d, total blocks = %d, filesystem size = %lld\n", super->blk_size, super->num_blks, super->fs_size);
-        printf("max free blks = %d, num of free blks = %d\n", super->max_free_blks, super->num_free_blks);
-        printf("data block offset = %d\n", super->data_blk_offset);
-        printf("free_blk_list_head = %d\n", super->free_blk_list_head);
-        printf("next_free_blk_idx = %d\n", super->next_free_blk_idx);
-        printf("max free inodes = %d, num of free inodes = %d\n", super->max_free_inodes, super->num_free_inodes);
-        printf("remembered inode = %d\n", super->remembered_inode);
-        printf("free inode list: ");
+// called with jblk_lock held.
+static struct jblk *jblk_find(struct journal *j, unsigned int blk)
+{
+	struct jblk *e = j->hash[blk % JOURNAL_HASH_SZ];
+	while (e != NULL && e->blk != (int)blk)
+		e = e->hash_next;
+	return e;
+}
 
-        for (i = 0; i < MAX_FREE_ILIST_SIZE; i++)
-                printf("%d ", super->free_ilist[i]);
+// fill buffer from the in-core image if blk is journaled. returns 1 if it
+// was, 0 if the blk is read from the device.
+static int journal_read(unsigned int blk, char *buffer)
+{
+	struct journal *j = &VOL->journal;
+	struct jblk *e;
+	if (!j->active || blk >= NUM_BLKS || !jblk_mapped(j, blk))
+		return 0;
+	pthread_mutex_lock(&j->jblk_lock);
+	e = jblk_find(j, blk);
+	if (e != NULL)
+		memcpy(buffer, e->buf, BLK_SZ);
+	pthread_mutex_unlock(&j->jblk_lock);
+	return e != NULL;
+}
 
-        printf("\nnext_free_inode_idx = %d\n", super->next_free_inode_idx);
+// a write of blk: into the running transaction if blk is journaled, or if it
+// is metadata (meta). returns 1 if taken, 0 if the blk is written to the
+// device, -1 on error.
+static int journal_write(unsigned int blk, const char *buffer, int meta)
+{
+	struct journal *j = &VOL->journal;
+	if (!j->active || blk >= NUM_BLKS || (!meta && !jblk_mapped(j, blk)))
+		return 0;
+	pthread_mutex_lock(&j->jblk_lock);
+	struct jblk *e = jblk_find(j, blk);
+	if (e == NULL)
+	{
+		if (!meta)
+		{ // went home meanwhile
+			pthread_mutex_unlock(&j->jblk_lock);
+			return 0;
+		}
+		e = (struct jblk*)malloc(sizeof(struct jblk));
+		char *buf = (char*)pool_alloc(POOL_BLK_BUF);
+		if (e == NULL || buf == NULL)
+		{
+			pthread_mutex_unlock(&j->jblk_lock);
+			free(e);
+			pool_free(POOL_BLK_BUF, buf);
+			fprintf(stderr, "error: no memory to journal blk %d\n", blk);
+			return -1;
+		}
+		e->blk = blk;
+		e->buf = buf;
+		e->in_trans = 0;
+		e->hash_next = j->hash[blk % JOURNAL_HASH_SZ];
+		j->hash[blk % JOURNAL_HASH_SZ] = e;
+		j->nr_mapped++;
+		__atomic_or_fetch(&j->mapped[blk >> 3], 1 << (blk & 7), __ATOMIC_RELEASE);
+	}
+	memcpy(e->buf, buffer, BLK_SZ);
+	if (!e->in_trans)
+	{
+		e->in_trans = 1;
+		e->trans_next = j->trans;
+		j->trans = e;
+		__atomic_add_fetch(&j->nr_trans, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&j->jblk_lock);
+	return 1;
 }
 
-void dump_datablks(void)
+// blk is being freed. If the journal holds an image of it, it is kept off
+// the free lists until the next checkpoint. returns 1 if it is, 0 if the blk
+// can be freed now, -1 on error.
+static int journal_defer_free(unsigned int blk)
 {
-      	char buf[BLK_SZ];
+	struct journal *j = &VOL->journal;
+	if (!j->active || blk >= NUM_BLKS || !jblk_mapped(j, blk))
+		return 0;
+	pthread_mutex_lock(&j->jblk_lock);
+	if (j->nr_deferred == j->max_deferred)
+	{
+		int max = j->max_deferred > 0 ? j->max_deferred * 2 : JOURNAL_TRANS_BLKS;
+		int *deferred = (int*)realloc(j->deferred, max * sizeof(int));
+		if (deferred == NULL)
+		{
+			pthread_mutex_unlock(&j->jblk_lock);
+			fprintf(stderr, "error: no memory to defer the free of blk %d\n", blk);
+			return -1;
+		}
+		j->deferred = deferred;
+		j->max_deferred = max;
+	}
+	j->deferred[j->nr_deferred++] = blk;
+	pthread_mutex_unlock(&j->jblk_lock);
+	return 1;
+}
+
+unsigned int journal_csum(unsigned int csum, const char *blk)
+{
+	const unsigned int *p = (const unsigned int*)blk;
 	int i;
-        for (i = 0; i < NUM_BLKS; i++)
-        {
-                printf("blk #%d: ", i);
-                //int *p = (int*)(disk[i].data);
-            		if(bread(i, buf) == -1)
-            		{
-            			fprintf(stderr, "error: bread failure.\n");
-            			return;
-             		}
-            		dump_buffer(buf);
-        }
+	for (i = 0; i < BLK_SZ / 4; i++)
+		csum = ((csum << 1) | (csum >> 31)) ^ p[i];
+	return csum;
 }
 
-static int update_super(void)
+static int journal_blocked(struct journal *j, int top)
 {
-        // write superblk to disk
-	char buf[BLK_SZ];
-        memset(buf, 0, sizeof(buf));
-        memcpy(buf, super, sizeof(struct super_block));
-        if (bwrite(0, buf) == -1)
-        {
-                fprintf(stderr, "error: bwrite superblk#0 when update superblk\n");
-                return -1;
-        }
-	return 0;
+	int c = __atomic_load_n(&j->committing, __ATOMIC_SEQ_CST);
+	return c == JOURNAL_SEALING || (c == JOURNAL_DRAINING && top);
 }
 
-/* create free blk list on top of the disk blocks */
-static int init_free_blk_list(void)
+static int journal_commit(int lazy, int checkpoint);
+
+// the running transaction has JOURNAL_TRANS_BLKS blks: the next top op
+// goes into a new one. An op in progress may still add its blks.
+static int journal_trans_full(void)
 {
-        int offset = super->data_blk_offset;
-        int* p;
-        int i;
-      	char buf[BLK_SZ];
+	struct journal *j = &VOL->journal;
+	return j->active && __atomic_load_n(&j->nr_trans, __ATOMIC_RELAXED) >= JOURNAL_TRANS_BLKS;
+}
 
-      	printf("\n\ninit free blk list....\n");
-        for (;offset < super->num_blks; offset += FREE_BLKS_PER_LINK)
-        {
-		memset(buf, 0, sizeof(buf));
+// the calling thread starts an op that changes metadata: a commit does not
+// take the transaction until the op ends, so an op is in one transaction as
+// a whole. top: the thread holds no lock, and a new op waits here while a
+// commit is waiting for the ops in progress; it commits a full transaction
+// first, so ops from many threads do not pile up past what the journal
+// holds. Below top, e.g. in iput(), the thread may hold locks the running
+// ops wait for, so it only waits while the transaction is taken, which
+// needs none of them.
+static void journal_start(int top)
+{
+	struct journal *j = &VOL->journal;
+	if (handle_depth > 0)
+	{
+		handle_depth++;
+		return;
+	}
+	if (top && journal_trans_full())
+		journal_commit(0, 0);
+	handle_depth++;
+	for (;;)
+	{
+		if (journal_blocked(j, top))
+		{
+			pthread_mutex_lock(&j->handle_lock);
+			while (journal_blocked(j, top))
+				pthread_cond_wait(&j->handle_cond, &j->handle_lock);
+			pthread_mutex_unlock(&j->handle_lock);
+		}
+		__atomic_add_fetch(&j->nr_handles, 1, __ATOMIC_SEQ_CST);
+		if (!journal_blocked(j, top))
+			return;
+		// a commit started meanwhile
+		if (__atomic_sub_fetch(&j->nr_handles, 1, __ATOMIC_SEQ_CST) == 0)
+		{
+			pthread_mutex_lock(&j->handle_lock);
+			pthread_cond_broadcast(&j->handle_cond);
+			pthread_mutex_unlock(&j->handle_lock);
+		}
+	}
+}
 
-            		p = (int*)buf;
+// the op is done. a top op that fills the transaction commits it.
+static void journal_stop(int top)
+{
+	struct journal *j = &VOL->journal;
+	if (--handle_depth > 0)
+		return;
+	if (__atomic_sub_fetch(&j->nr_handles, 1, __ATOMIC_SEQ_CST) == 0
+	  && __atomic_load_n(&j->committing, __ATOMIC_SEQ_CST) != 0)
+	{
+		pthread_mutex_lock(&j->handle_lock);
+		pthread_cond_broadcast(&j->handle_cond);
+		pthread_mutex_unlock(&j->handle_lock);
+	}
+	if (!top || !j->active)
+		return;
+	int ops = __atomic_add_fetch(&j->nr_ops, 1, __ATOMIC_RELAXED);
+	int nr = __atomic_load_n(&j->nr_trans, __ATOMIC_RELAXED);
+	if (nr >= JOURNAL_TRANS_BLKS || (ops >= JOURNAL_COMMIT_OPS && nr > 0))
+		journal_commit(0, 0);
+}
 
-                // set next data index block pointer
-                if (offset + FREE_BLKS_PER_LINK >= super->num_blks)
-                        *p++ = 0; // end of the free blocks?  -JH
-                                  // this is the blk_num that points to the next link,
-                                  // if there are no more links of free blks, then it should
-                                  // be zero, so that you know this is the last link.
-                                  // not necessarily, because you can also know from the
-                                  // super->num_free_blks that there are no more free blks.
-                                  // but just leave it here. We can discuss more later.
-                else
-                        *p++ = offset + FREE_BLKS_PER_LINK;
+// let the ops waiting on a commit go on.
+static void journal_reopen(struct journal *j)
+{
+	pthread_mutex_lock(&j->handle_lock);
+	__atomic_store_n(&j->committing, 0, __ATOMIC_SEQ_CST);
+	pthread_cond_broadcast(&j->handle_cond);
+	pthread_mutex_unlock(&j->handle_lock);
+}
 
-                // fill in the data index blocks with free block indices
-                for(i = 1; i < FREE_BLKS_PER_LINK && offset + i < super->num_blks; i++)
-                        *p++ = offset + i;
+static int cmp_jblk(const void *a, const void *b)
+{
+	return (*(struct jblk* const*)a)->blk - (*(struct jblk* const*)b)->blk;
+}
 
-                // write data index block back to storage
-            		if (bwrite(offset, buf) == -1)
-            		{
-            			fprintf(stderr, "error: bwrite wrong when init free blk list\n");
-            			return -1;
-            		}
-        }
+// the running transaction as it goes on disk: descriptor, images, commit
+// blk. The trans list is emptied. called with jblk_lock held.
+static char *journal_seal(struct journal *j, int n)
+{
+	char *run = (char*)calloc(n + 2, BLK_SZ);
+	struct journal_desc *desc = (struct journal_desc*)run;
+	struct journal_commit *commit = (struct journal_commit*)(run + (size_t)(n + 1) * BLK_SZ);
+	struct jblk *e;
+	int i = 0;
+	if (run == NULL)
+	{
+		fprintf(stderr, "error: no memory for a journal commit\n");
+		return NULL;
+	}
+	desc->magic = JOURNAL_DESC_MAGIC;
+	desc->seq = j->seq;
+	desc->nr = n;
+	for (e = j->trans; e != NULL; e = e->trans_next, i++)
+	{
+		desc->blks[i] = e->blk;
+		memcpy(run + (size_t)(i + 1) * BLK_SZ, e->buf, BLK_SZ);
+	}
+	commit->magic = JOURNAL_COMMIT_MAGIC;
+	commit->seq = j->seq;
+	commit->nr = n;
+	commit->csum = 0;
+	for (i = 0; i <= n; i++)
+		commit->csum = journal_csum(commit->csum, run + (size_t)i * BLK_SZ);
+	return run;
+}
 
-        printf("complete init free blk list\n");
-        return 0;
+static void journal_trans_clear(struct journal *j)
+{
+	struct jblk *e;
+	for (e = j->trans; e != NULL; e = e->trans_next)
+		e->in_trans = 0;
+	j->trans = NULL;
+	__atomic_store_n(&j->nr_trans, 0, __ATOMIC_RELAXED);
 }
 
-int balloc(void)
+static int journal_write_header(struct journal *j)
 {
-        int blk_num;
-/*
-        if (super->locked == 1)
-        {
-                fprintf(stderr, "error: super block locked\n");
-                return -1;
-        }
-*/
-        if (super->num_free_blks == 0)
-        {
-                fprintf(stderr, "no free block: num_free_blks==0\n");
-                return -1;
-        }
-#if _DEBUG
-        printf("  next free blk idx = %d\n", super->next_free_blk_idx);
-#endif
-      	char buf[BLK_SZ];
-	      int old_list_head = super->free_blk_list_head;
+	char buf[BLK_SZ];
+	struct journal_header *h = (struct journal_header*)buf;
+	memset(buf, 0, sizeof(buf));
+	h->magic = JOURNAL_HEADER_MAGIC;
+	h->seq = j->seq;
+	h->nr_blks = j->nr_blks;
+	return dev_write(j->start, buf, 1);
+}
 
-        if (bread(old_list_head, buf) == -1)
-	      {
-		      fprintf(stderr, "error: bread wrong when balloc\n");
-		      return -1;
-	      }
+// write every journaled blk home, in blk order, and start the journal over.
+// write: 0 to drop the images instead (mkfs). called with jblk_lock held and
+// no op running.
+static int journal_checkpoint_locked(struct journal *j, int write)
+{
+	struct jblk **all = NULL;
+	struct jblk *e;
+	int res = 0;
+	int i, n = 0;
+	if (j->nr_mapped > 0)
+	{
+		all = (struct jblk**)malloc(j->nr_mapped * sizeof(struct jblk*));
+		if (all == NULL)
+		{
+			fprintf(stderr, "error: no memory for a journal checkpoint\n");
+			return -1;
+		}
+	}
+	for (i = 0; i < JOURNAL_HASH_SZ; i++)
+	{
+		for (e = j->hash[i]; e != NULL; e = e->hash_next)
+			all[n++] = e;
+	}
+	qsort(all, n, sizeof(struct jblk*), cmp_jblk);
+	for (i = 0; write && i < n && res == 0; i++)
+		res = dev_write(all[i]->blk, all[i]->buf, 1);
+	if (write && res == 0)
+		res = dev_sync();
+	if (res == -1)
+	{ // the images stay in core and in the journal.
+		fprintf(stderr, "error: journal checkpoint\n");
+		free(all);
+		return -1;
+	}
+	j->head = j->start + 1;
+	j->first_seq = j->seq;
+	if (write && (journal_write_header(j) == -1 || dev_sync() == -1))
+		res = -1;
+	// no replay reaches the deferred blks now; dropped with the fs at mkfs.
+	if (!write)
+		j->nr_deferred = 0;
+	j->nr_ready = j->nr_deferred;
+	for (i = 0; i < n; i++)
+	{
+		e = all[i];
+		__atomic_and_fetch(&j->mapped[e->blk >> 3], ~(1 << (e->blk & 7)), __ATOMIC_RELEASE);
+		pool_free(POOL_BLK_BUF, e->buf);
+		free(e);
+	}
+	free(all);
+	memset(j->hash, 0, sizeof(j->hash));
+	j->nr_mapped = 0;
+	journal_trans_clear(j);
+	return res;
+}
 
-        if (super->next_free_blk_idx == 0)
-        {
-                int* freelist_head = (int*)buf;
+static int journal_replay(struct journal *j, unsigned int *seq);
+static int journal_free_deferred(void);
 
-		            blk_num = super->free_blk_list_head;
-                super->free_blk_list_head = freelist_head[0];
-#if _DEBUG
-                printf("  blk #%d allocated, free_blk_list_head changed\n", blk_num);
-#endif
-                super->next_free_blk_idx = 1;
-        }
-        else if (super->next_free_blk_idx < FREE_BLKS_PER_LINK)
-        {
-                int* freelist_head = (int*)buf;
-                blk_num = freelist_head[super->next_free_blk_idx];
-                /* This is the case when there are no more free blks in the final
-                link. The final blk is the link itself. So, need to change the
-                blk_num to the link itself, and update free_blk_list_head. */
-                if (blk_num == 0)
-                {
-                        blk_num = super->free_blk_list_head;
-                        super->free_blk_list_head = 0;
-                        super->next_free_blk_idx = 1;
-#if _DEBUG
-                        printf("  blk #%d allocated\n", blk_num);
-#endif
-                }
-                else
-                {
-                        freelist_head[super->next_free_blk_idx] = 0;
-#if _DEBUG
-                        printf("  blk #%d allocated\n", blk_num);
-#endif
-                        super->next_free_blk_idx += 1;
-                        super->next_free_blk_idx %= FREE_BLKS_PER_LINK;
-                }
-        }
-        else
-        {
-                fprintf(stderr, "wrong next_free_blk_idx\n");
-                return -1;
-        }
-
-      	if (bwrite(old_list_head, buf) == -1)
-	      {
-		      fprintf(stderr, "error: bwrite when balloc\n");
-		      return -1;
-	      }
-
-        super->num_free_blks -= 1;
-	if (update_super() == -1)
+// make room for a transaction that does not fit behind the last one: the
+// committed transactions go home, and the journal starts over. They are
+// redone from the journal on disk, since the images in core already have
+// the running transaction in them. called with jblk_lock held and no op
+// running.
+static int journal_wrap(struct journal *j)
+{
+	unsigned int seq = j->first_seq;
+	if (journal_replay(j, &seq) == -1)
+		return -1;
+	if (seq != j->seq)
 	{
-		fprintf(stderr, "update superblk error\n");
+		fprintf(stderr, "error: journal holds transactions up to %u, not %u\n", seq, j->seq);
 		return -1;
 	}
-/*
-        super->locked = 0;
-        super->modified = 1;
-*/
-        return blk_num;
+	j->head = j->start + 1;
+	j->first_seq = j->seq;
+	if (journal_write_header(j) == -1 || dev_sync() == -1)
+		return -1;
+	return 0;
 }
 
-int bfree(int blk_num)
+// group commit: the ops that ended since the last commit go to the journal
+// in one transaction. With checkpoint, or once the journal is half full, the
+// journaled blks go home too. journal_start() keeps a transaction well below
+// the size of the journal; one that is bigger anyway can only go home
+// unjournaled.
+static int journal_commit(int lazy, int checkpoint)
 {
-/*
-        if (super->locked == 1)
-        {
-                fprintf(stderr, "error: super block locked\n");
-                return -1;
-        }
-*/
-#if _DEBUG
-        printf("  want to free blk_num = %d\n", blk_num);
-#endif
-        if (blk_num < super->data_blk_offset)
-        {
-                fprintf(stderr, "error: trying to free a non-data block %d, or disk is busted: super->data_blk_offset = %d\n", blk_num, super->data_blk_offset);
-                return -1;
-        }
-	if (blk_num >= NUM_BLKS)
+	struct journal *j = &VOL->journal;
+	int res = 0;
+	if (!j->active || handle_depth > 0)
+		return 0;
+	pthread_mutex_lock(&j->commit_lock);
+	pthread_mutex_lock(&j->handle_lock);
+	__atomic_store_n(&j->committing, JOURNAL_DRAINING, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&j->nr_handles, __ATOMIC_SEQ_CST) > 0)
+		pthread_cond_wait(&j->handle_cond, &j->handle_lock);
+	__atomic_store_n(&j->committing, JOURNAL_SEALING, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&j->nr_handles, __ATOMIC_SEQ_CST) > 0)
+		pthread_cond_wait(&j->handle_cond, &j->handle_lock);
+	pthread_mutex_unlock(&j->handle_lock);
+
+	// no op is running: take the transaction, with the inode blks it dirtied.
+	if (iblk_flush(lazy) == -1)
+		res = -1;
+	pthread_mutex_lock(&j->jblk_lock);
+	int n = j->nr_trans;
+	int pos = j->head;
+	char *run = NULL;
+	__atomic_store_n(&j->nr_ops, 0, __ATOMIC_RELAXED);
+	if (n > JOURNAL_DESC_MAX || n + 3 > j->nr_blks)
 	{
-		fprintf(stderr, "error: try to free a blk#%d that exceeds num_blks\n", blk_num);
-		return -1;
+		fprintf(stderr, "error: a transaction of %d blks is bigger than the journal\n", n);
+		res = -1;
+		checkpoint = 1;
+		journal_trans_clear(j);
 	}
-	else if (blk_num == 0)
+	else if (n > 0)
 	{
-                fprintf(stderr, "error: trying to free blk #0\n");
-                return -1;
-	}
-#if _DEBUG
-        printf("  next free blk idx = %d\n", super->next_free_blk_idx);
-#endif
-	char buf[BLK_SZ];
-	char zero_buf[BLK_SZ];
-	memset(zero_buf, 0, sizeof(zero_buf));
-	/* indicates current free list link head full, so need to put the freed
-	   blk_num as the new free list link head. */
-        if (super->next_free_blk_idx == 1)
-        {
-/*
-		if (bread(blk_num, buf) == -1)
+		if (pos + n + 2 > j->start + j->nr_blks)
 		{
-			fprintf(stderr, "error: bread wrong when bfree\n");
-			return -1;
+			if (journal_wrap(j) == -1)
+			{
+				fprintf(stderr, "error: journal wrap for a commit of %d blks\n", n);
+				res = -1;
+			}
+			pos = j->head;
 		}
-*/
-		memset(buf, 0, sizeof(buf));
-                int* freelist_head = (int*)buf;
-                freelist_head[0] = super->free_blk_list_head;
-                super->free_blk_list_head = blk_num;
-                super->next_free_blk_idx = 0;
-#if _DEBUG
-                printf("  blk# %d freed\n", blk_num);
-#endif
-		if (bwrite(blk_num, buf) == -1)
+		if (res == 0)
+			run = journal_seal(j, n);
+		if (run == NULL)
+		{ // the transaction stays in core for the next commit.
+			res = -1;
+			checkpoint = 0;
+		}
+		else
 		{
-			fprintf(stderr, "error: bwrite wrong when bfree\n");
-			return -1;
+			j->head += n + 2;
+			j->seq++;
+			journal_trans_clear(j);
+			if (j->head - j->start > j->nr_blks / 2)
+				checkpoint = 1;
 		}
-        }
-        else if (super->next_free_blk_idx == 0)
-        {
-		if (bread(super->free_blk_list_head, buf) == -1)
+	}
+	if (!checkpoint)
+	{ // the next ops go on while this transaction is written.
+		pthread_mutex_unlock(&j->jblk_lock);
+		journal_reopen(j);
+	}
+	if (run != NULL && (dev_write(pos, run, n + 2) == -1 || dev_sync() == -1))
+	{
+		fprintf(stderr, "error: journal commit of %d blks at blk %d\n", n, pos);
+		res = -1;
+	}
+	free(run);
+	if (checkpoint)
+	{
+		if (journal_checkpoint_locked(j, 1) == -1)
+			res = -1;
+		pthread_mutex_unlock(&j->jblk_lock);
+		journal_reopen(j);
+	}
+	pthread_mutex_unlock(&j->commit_lock);
+	if (checkpoint && journal_free_deferred() == -1)
+		res = -1;
+	return res;
+}
+
+int journal_checkpoint(void)
+{
+	int res = journal_commit(1, 1);
+	// the deferred blks given back make a transaction of their own.
+	if (res == 0 && VOL->journal.nr_mapped > 0)
+		res = journal_commit(1, 1);
+	return res;
+}
+
+// turn the journal on, empty, for the next transaction seq.
+static int journal_on(unsigned int seq)
+{
+	struct journal *j = &VOL->journal;
+	if (VOL->super->journal_blks <= 0)
+		return 0; // a fs without a journal
+	if (j->mapped == NULL)
+	{
+		j->mapped = (unsigned char*)calloc(NUM_BLKS / 8 + 1, 1);
+		if (j->mapped == NULL)
 		{
-			fprintf(stderr, "error: bread wrong when bfree\n");
+			fprintf(stderr, "error: no memory for the journal\n");
 			return -1;
 		}
-                super->next_free_blk_idx = FREE_BLKS_PER_LINK - 1;
-                int* freelist_head = (int*)buf;
-                freelist_head[super->next_free_blk_idx] = blk_num;
-		if (bwrite(blk_num, zero_buf) == -1)
+	}
+	j->start = VOL->super->journal_blk;
+	j->nr_blks = VOL->super->journal_blks;
+	j->head = j->start + 1;
+	j->seq = seq;
+	j->first_seq = seq;
+	j->nr_deferred = j->nr_ready = 0;
+	j->active = 1;
+	return 0;
+}
+
+// turn the journal off: the metadata writes go home directly from now on.
+// discard: drop the journaled blks instead of writing them home.
+static int journal_off(int discard)
+{
+	struct journal *j = &VOL->journal;
+	int res = 0;
+	if (!j->active)
+		return 0;
+	if (!discard)
+		res = journal_checkpoint();
+	pthread_mutex_lock(&j->jblk_lock);
+	if (discard)
+		journal_checkpoint_locked(j, 0);
+	j->active = 0;
+	pthread_mutex_unlock(&j->jblk_lock);
+	return res;
+}
+
+// a new, empty journal. called by mkfs.
+static int journal_format(void)
+{
+	struct journal *j = &VOL->journal;
+	if (VOL->super->journal_blks <= 0)
+		return 0;
+	j->start = VOL->super->journal_blk;
+	j->nr_blks = VOL->super->journal_blks;
+	j->seq = 1;
+	if (journal_write_header(j) == -1)
+	{
+		fprintf(stderr, "error: write journal header\n");
+		return -1;
+	}
+	return journal_on(1);
+}
+
+// set the state of the fs in the superblk on disk. Written home directly,
+// with the journal off.
+static int super_mark(int state)
+{
+	char buf[BLK_SZ];
+	VOL->super->state = state;
+	memset(buf, 0, sizeof(buf));
+	memcpy(buf, VOL->super, sizeof(struct super_block));
+	if (dev_write(0, buf, 1) == -1 || dev_sync() == -1)
+	{
+		fprintf(stderr, "error: write superblk state\n");
+		return -1;
+	}
+	return 0;
+}
+
+// redo the transactions committed since the last checkpoint, oldest first:
+// their images go home. Stops at the first transaction not complete on disk.
+// *seq: that of the first transaction, advanced past the ones replayed.
+// called at mount, before the journal is on, and by journal_wrap(). returns
+// the # of transactions replayed, -1 on error.
+static int journal_replay(struct journal *j, unsigned int *seq)
+{
+	char buf[BLK_SZ];
+	struct journal_desc *d = (struct journal_desc*)buf;
+	int pos = j->start + 1;
+	int end = j->start + j->nr_blks;
+	int n = 0;
+	int i;
+	while (pos + 2 <= end)
+	{
+		if (dev_read(pos, buf, 1) == -1)
+			return -1;
+		if (d->magic != JOURNAL_DESC_MAGIC || d->seq != *seq
+		  || d->nr <= 0 || d->nr > JOURNAL_DESC_MAX || pos + d->nr + 2 > end)
+			break;
+		int nr = d->nr;
+		char *run = (char*)malloc((size_t)(nr + 2) * BLK_SZ);
+		if (run == NULL)
 		{
-			fprintf(stderr, "bwrite error when zeroing the blk #%d\n", blk_num);
+			fprintf(stderr, "error: no memory for journal replay\n");
 			return -1;
 		}
-#if _DEBUG
-                printf("  blk# %d freed\n", blk_num);
-#endif
-		if (bwrite(super->free_blk_list_head, buf) == -1)
+		if (dev_read(pos, run, nr + 2) == -1)
 		{
-			fprintf(stderr, "error: bwrite wrong when bfree\n");
+			free(run);
 			return -1;
 		}
-        }
-        else if (super->next_free_blk_idx > 1
-                && super->next_free_blk_idx < FREE_BLKS_PER_LINK)
-        {
-		if (bread(super->free_blk_list_head, buf) == -1)
+		struct journal_desc *desc = (struct journal_desc*)run;
+		struct journal_commit *commit = (struct journal_commit*)(run + (size_t)(nr + 1) * BLK_SZ);
+		unsigned int csum = 0;
+		for (i = 0; i <= nr; i++)
+			csum = journal_csum(csum, run + (size_t)i * BLK_SZ);
+		if (commit->magic != JOURNAL_COMMIT_MAGIC || commit->seq != *seq
+		  || commit->nr != nr || commit->csum != csum)
+		{ // torn: the crash came before its commit blk was on disk.
+			free(run);
+			break;
+		}
+		for (i = 0; i < nr; i++)
 		{
-			fprintf(stderr, "error: bread wrong when bfree\n");
-			return -1;
+			if (dev_write(desc->blks[i], run + (size_t)(i + 1) * BLK_SZ, 1) == -1)
+			{
+				fprintf(stderr, "error: journal replay of blk %d\n", desc->blks[i]);
+				free(run);
+				return -1;
+			}
 		}
-                super->next_free_blk_idx -= 1;
-                int* freelist_head = (int*)buf;
-                freelist_head[super->next_free_blk_idx] = blk_num;
-		if (bwrite(blk_num, zero_buf) == -1)
+		free(run);
+		pos += nr + 2;
+		(*seq)++;
+		n++;
+	}
+	if (n > 0 && dev_sync() == -1)
+		return -1;
+	return n;
+}
+
+// the journal of a fs being mounted. A fs not unmounted cleanly gets its
+// committed transactions replayed first, and its superblk read again. The
+// fs is marked FS_DIRTY on disk before the journal is on.
+static int journal_open(void)
+{
+	struct journal *j = &VOL->journal;
+	char buf[BLK_SZ];
+	struct journal_header *h = (struct journal_header*)buf;
+	if (VOL->super->journal_blks <= 0)
+		return 0;
+	if (dev_read(VOL->super->journal_blk, buf, 1) == -1)
+		return -1;
+	if (h->magic != JOURNAL_HEADER_MAGIC || h->nr_blks != VOL->super->journal_blks)
+	{
+		fprintf(stderr, "error: bad journal header\n");
+		return -1;
+	}
+	j->start = VOL->super->journal_blk;
+	j->nr_blks = VOL->super->journal_blks;
+	j->seq = h->seq;
+	if (VOL->read_only)
+	{ // the journal stays off, the fs as the last checkpoint left it.
+		if (VOL->super->state != FS_CLEAN)
+			printf("recovery: skipped, the fs is read-only; what the journal holds is not seen\n");
+		return 0;
+	}
+	if (VOL->super->state != FS_CLEAN)
+	{
+		int n = journal_replay(j, &j->seq);
+		if (n == -1)
 		{
-			fprintf(stderr, "bwrite error when zeroing the blk #%d\n", blk_num);
+			fprintf(stderr, "error: journal replay\n");
 			return -1;
 		}
-#if _DEBUG
-                printf("  blk# %d freed\n", blk_num);
-#endif
-		if (bwrite(super->free_blk_list_head, buf) == -1)
+		if (n > 0)
 		{
-			fprintf(stderr, "error: bwrite wrong when bfree\n");
-			return -1;
+			// the replayed transactions are home: the journal starts over.
+			if (journal_write_header(j) == -1 || dev_sync() == -1)
+				return -1;
+			if (dev_read(0, buf, 1) == -1)
+				return -1;
+			memcpy(VOL->super, buf, sizeof(struct super_block));
 		}
-        }
-        else
-        {
-                fprintf(stderr, "wrong next_free_blk_idx\n");
-                return -1;
-        }
-        super->num_free_blks += 1;
-	if (update_super() == -1)
-	{
-		fprintf(stderr, "update superblk error in bfree\n");
-		return -1;
+		printf("recovery: %d journal transactions replayed\n", n);
 	}
-/*
-        super->locked = 0;
-        super->modified = 1;
-*/
-        return 0;
+	if (super_mark(FS_DIRTY) == -1)
+		return -1;
+	return journal_on(j->seq);
 }
 
+/********************* Layer0: object pools ***************************/
+
+struct obj_pool {
+	const char *name;
+	size_t obj_sz;
+	void *free_objs;     // free objects, linked through their first word
+	pthread_mutex_t lock;
+	// occupancy
+	int nr_slabs;
+	int nr_in_use;       // handed out by pool_alloc(), atomic
+	int nr_free;         // on free_objs, not counting magazines
+};
+
+struct pool_magazine {
+	int nr;
+	void *objs[POOL_MAGAZINE_SZ];
+};
+
+static struct obj_pool obj_pools[NR_OBJ_POOLS] = {
+	[POOL_BLK_BUF] = { "blk_buf", BLK_SZ, NULL, PTHREAD_MUTEX_INITIALIZER },
+	[POOL_INODE] = { "inode", sizeof(struct in_core_inode), NULL, PTHREAD_MUTEX_INITIALIZER },
+};
+static __thread struct pool_magazine magazines[NR_OBJ_POOLS];
+static __thread int magazines_registered; // for pool_mags_release() at thread exit
+static pthread_key_t pool_mag_key;
+static pthread_once_t pool_mag_once = PTHREAD_ONCE_INIT;
+
+// a thread exits: the objects in its magazines go back to the pools.
+static void pool_mags_release(void *arg)
+{
+	struct pool_magazine *mags = (struct pool_magazine*)arg;
+	int i;
+	for (i = 0; i < NR_OBJ_POOLS; i++)
+	{
+		struct obj_pool *pool = &obj_pools[i];
+		struct pool_magazine *mag = &mags[i];
+		pthread_mutex_lock(&pool->lock);
+		while (mag->nr > 0)
+		{
+			void **o = (void**)mag->objs[--mag->nr];
+			*o = pool->free_objs;
+			pool->free_objs = o;
+			pool->nr_free++;
+		}
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
 
-/************************* Layer 1: inode algorithms ********************************/
-
-// search on disk free inodes and add them on the free ilist
-// when free ilist is empty.
-static int fill_free_ilist(void)
+static void pool_mag_key_create(void)
 {
-        int blk_num;
-        int i, offset;
-        char buf[BLK_SZ]; // bigger than block size
-        int k = super->remembered_inode;
-        int remembered_i = k;
-        if (k >= super->max_free_inodes)
-        {
-                fprintf(stderr, "error: inode %d exceeds maximum inode num\n", k);
-                return -1;
-        }
-        for (i = 0; i < MAX_FREE_ILIST_SIZE; i++)
-        {
-                //printf("i = %d\n", i);
-                while(k < super->max_free_inodes)
-                {
-                        blk_num = 1 + k / INODES_PER_BLK;
-                        offset = k % INODES_PER_BLK;
-                        //printf("blk_num = %d, offset = %d\n", blk_num, offset);
-                        if (bread(blk_num, buf) == -1)
-			{
-				fprintf(stderr, "error: bread when fill free ilist\n");
-				return -1;
-			}
-                        //printf("after bread\n");
-                        struct disk_inode* pi = (struct disk_inode*)buf;
-                        struct disk_inode* q = pi + offset;
-                        //printf("after q\n");
-                        if (q->file_type == UNUSED)
-                        {
-                                //printf("free_ilist[%d] = %d\n", i, k);
-                                super->free_ilist[i] = k;
-                                if (k > remembered_i)
-                                        remembered_i = k;
-                                k++;
-                                break;
-                        }
-                        k++;
-                }
-        }
-        super->remembered_inode = remembered_i;
-        //printf("complete: i = %d\n", i);
-        while (i < MAX_FREE_ILIST_SIZE)
-        {
-                printf("empty free ilist i=%d\n", i);
-                super->free_ilist[i] = -1;
-        }
-        return 0;
+	pthread_key_create(&pool_mag_key, pool_mags_release);
 }
 
-static int init_free_ilist(void)
+// the first use of the magazines by a thread: they are given back when it exits.
+static void pool_mags_register(void)
 {
-        fill_free_ilist();
-        printf("complete init free ilist\n");
-        return 0;
+	pthread_once(&pool_mag_once, pool_mag_key_create);
+	pthread_setspecific(pool_mag_key, magazines);
+	magazines_registered = 1;
 }
 
-int get_time(void)
+// carve a new slab into free objects. called with the pool lock held.
+static int pool_grow(struct obj_pool *pool)
 {
-	//struct timeval tv;
-	if (gettimeofday(&tv, NULL) != 0)
+	char *slab;
+	int i;
+	// cache line aligned, for objects laid out by cache line.
+	if (posix_memalign((void**)&slab, CACHE_LINE_SZ, pool->obj_sz * POOL_SLAB_OBJS) != 0)
 	{
-		fprintf(stderr, "error in get_time\n");
-		return 0;
+		fprintf(stderr, "error: no memory for a %s slab\n", pool->name);
+		return -1;
 	}
-	int res = tv.tv_sec;
-	return res;
+	for (i = 0; i < POOL_SLAB_OBJS; i++)
+	{
+		void **obj = (void**)(slab + i * pool->obj_sz);
+		*obj = pool->free_objs;
+		pool->free_objs = obj;
+	}
+	pool->nr_slabs++;
+	pool->nr_free += POOL_SLAB_OBJS;
+	return 0;
 }
 
-static int init_disk_inode(struct disk_inode* di)
+void* pool_alloc(enum obj_pool_id id)
 {
-        di->file_type = REGULAR;
-        strncpy(di->owner_id, "unknown", FILE_OWNER_ID_LEN);
-        di->access_permission = 0777;
-        di->last_accessed = get_time();
-        di->last_modified = get_time();
-        di->inode_last_mod = get_time();
-        di->link_count = 0;  // TODO: really?
-        di->file_size = 0;
-        di->blks_in_use = 0;
-        int i;
-        for(i = 0; i < DIRECT_BLKS_PER_INODE; i++)
-        {
-                di->block_addr[i] = 0;
-        }
-	di->single_ind_blk = 0;
-	di->double_ind_blk = 0;
+	struct obj_pool *pool = &obj_pools[id];
+	struct pool_magazine *mag = &magazines[id];
+	if (!magazines_registered)
+		pool_mags_register();
+	if (mag->nr == 0)
+	{ // refill half the magazine from the pool
+		pthread_mutex_lock(&pool->lock);
+		while (mag->nr < POOL_MAGAZINE_SZ / 2)
+		{
+			if (pool->free_objs == NULL && pool_grow(pool) == -1)
+				break;
+			void **obj = (void**)pool->free_objs;
+			pool->free_objs = *obj;
+			pool->nr_free--;
+			mag->objs[mag->nr++] = obj;
+		}
+		pthread_mutex_unlock(&pool->lock);
+		if (mag->nr == 0)
+			return NULL;
+	}
+	__atomic_add_fetch(&pool->nr_in_use, 1, __ATOMIC_RELAXED);
+	return mag->objs[--mag->nr];
 }
 
-static int init_in_core_inode(struct in_core_inode* ci, int i_num)
+void pool_free(enum obj_pool_id id, void *obj)
 {
-        ci->file_type = REGULAR;
-        strncpy(ci->owner_id, "unknown", FILE_OWNER_ID_LEN);
-        ci->access_permission = 0777;
-        ci->last_accessed = get_time();
-        ci->last_modified = get_time();
-        ci->inode_last_mod = get_time();
-        ci->link_count = 1;
-        ci->file_size = 0;
-        ci->blks_in_use = 0;
-        int i;
-        for(i = 0; i < DIRECT_BLKS_PER_INODE; i++)
-        {
-                ci->block_addr[i] = 0;
-        }
-	ci->single_ind_blk = 0;
-	ci->double_ind_blk = 0;
-        ci->locked = 0;
-        ci->modified = 1;
-        ci->i_num = i_num;
-        return 0;
+	struct obj_pool *pool = &obj_pools[id];
+	struct pool_magazine *mag = &magazines[id];
+	if (obj == NULL)
+		return;
+	if (!magazines_registered)
+		pool_mags_register();
+	if (mag->nr == POOL_MAGAZINE_SZ)
+	{ // drain half the magazine to the pool
+		pthread_mutex_lock(&pool->lock);
+		while (mag->nr > POOL_MAGAZINE_SZ / 2)
+		{
+			void **o = (void**)mag->objs[--mag->nr];
+			*o = pool->free_objs;
+			pool->free_objs = o;
+			pool->nr_free++;
+		}
+		pthread_mutex_unlock(&pool->lock);
+	}
+	mag->objs[mag->nr++] = obj;
+	__atomic_sub_fetch(&pool->nr_in_use, 1, __ATOMIC_RELAXED);
 }
 
-static int init_inode_from_disk(struct in_core_inode* ci, const struct disk_inode* di, int i_num)
+void dump_pools(void)
 {
-        ci->file_type = di->file_type;
-        strncpy(ci->owner_id, di->owner_id, FILE_OWNER_ID_LEN);
-        ci->access_permission = di->access_permission;
-        ci->last_accessed = di->last_accessed;
-        ci->last_modified = di->last_modified;
-        ci->inode_last_mod = di->inode_last_mod;
-        ci->link_count = di->link_count;
-        ci->file_size = di->file_size;
-        ci->blks_in_use = di->blks_in_use;
-        int i;
-        for(i = 0; i < DIRECT_BLKS_PER_INODE; i++)
-        {
-                ci->block_addr[i] = di->block_addr[i];
-        }
-	ci->single_ind_blk = di->single_ind_blk;
-	ci->double_ind_blk = di->double_ind_blk;
-        ci->locked = 0;
-        ci->modified = 0;
-        ci->i_num = i_num;
-        return 0;
+	int i;
+	for (i = 0; i < NR_OBJ_POOLS; i++)
+	{
+		struct obj_pool *pool = &obj_pools[i];
+		printf("pool %s: obj size %zu, slabs %d, in use %d, free %d\n",
+		  pool->name, pool->obj_sz, pool->nr_slabs,
+		  __atomic_load_n(&pool->nr_in_use, __ATOMIC_RELAXED), pool->nr_free);
+	}
 }
 
-static int init_inode_from_kernel(struct disk_inode* dst, const struct in_core_inode* src)
-{
-        dst->file_type = src->file_type;
-        strncpy(dst->owner_id, src->owner_id, FILE_OWNER_ID_LEN);
-        dst->access_permission = src->access_permission;
-        dst->last_accessed = src->last_accessed;
-        dst->last_modified = src->last_modified;
-        dst->inode_last_mod = src->inode_last_mod;
-        dst->link_count = src->link_count;
-        dst->file_size = src->file_size;
-        dst->blks_in_use = src->blks_in_use;
-        int i;
-        for(i = 0; i < DIRECT_BLKS_PER_INODE; i++)
-        {
-                dst->block_addr[i] = src->block_addr[i];
-        }
-	dst->single_ind_blk = src->single_ind_blk;
-	dst->double_ind_blk = src->double_ind_blk;
-        return 0;
+/********************* Layer1: block algorithms ***************************/
+
+static void dump_buffer(char* buf)
+{
+	int *p = (int*)buf;
+	int j;
+
+  for (j = 0; j < BLK_SZ/4; j++)
+    printf("%d ", *p++);
+
+  printf("\n");
 }
 
-/* allocate in-core inodes */
-struct in_core_inode* ialloc(void)
+void dump(void)
 {
-        int ret;
-        struct in_core_inode* ci = NULL;
-        char buf[BLK_SZ];
-	if (super->num_free_inodes <= 0)
-	{
-		fprintf(stderr, "error: no more free inodes on disk\n");
-		return NULL;
-	}
-        while (1)
-        {
-/*
-                if (super->locked == 1)
-                {
-                        // TODO: sleep
-                        continue;
-                }
-*/
-                /* ilist empty in superblock */
-                if (super->next_free_inode_idx == MAX_FREE_ILIST_SIZE)
-                {
-//                        super->locked = 1;
-                        ret = fill_free_ilist();
-//                        super->locked = 0;
-                        if (ret == -1)
-                        {
-                                fprintf(stderr, "error: free ilist not filled\n");
-                                return NULL;
-                        }
-                }
-                int i_num = super->free_ilist[super->next_free_inode_idx];
-#if _DEBUG
-                printf("  i_num = %d\n", i_num);
-#endif
-                super->free_ilist[super->next_free_inode_idx] = -1;
-                super->next_free_inode_idx += 1;
-                ci = (struct in_core_inode*)malloc(sizeof(struct in_core_inode));
-                init_in_core_inode(ci, i_num);
-                int blk_num = 1 + i_num / INODES_PER_BLK;
-                int offset = i_num % INODES_PER_BLK;
-                if (bread(blk_num, buf) == -1)
-                {
-                        fprintf(stderr, "error: bread blk#%d when ialloc\n", blk_num);
-                        return NULL;
-                }
-                struct disk_inode* di = (struct disk_inode*)buf;
-                di = di + offset;
-                if (di->file_type != 0) /* inode is not free */
-                {
-                        //TODO
-                        fprintf(stderr, "error: inode not free after all\n");
-                        continue;
-                }
-                init_disk_inode(di);
-                /////
-                /////
-                if (bwrite(blk_num, buf) == -1)
-                {
-                        fprintf(stderr, "error: bwrite blk#%d when ialloc\n", blk_num);
-                        return NULL;
-                }
-                super->num_free_inodes -= 1;
-		if (update_super() == -1)
-		{
-			fprintf(stderr, "update superblk error\n");
-			return NULL;
-		}
-                return ci;
-        }
+	dump_super();
+	//dump_datablks();
 }
 
-int ifree(struct in_core_inode* ci)
+void dump_super(void)
 {
-        int i_num = ci->i_num;
-/*
-        if (super->locked == 1)
-        {
-                fprintf(stderr, "error: superblk locked\n");
-                return -1;
-        }
-*/
+        int i, j;
 
-#if _DEBUG
-        printf(" free i_num = %d\n", i_num);
-#endif
-        if (i_num >= super->max_free_inodes)
-        {
-                fprintf(stderr, "error: i_num exceeds max inode num\n");
-                return -1;
-        }
-        if (super->next_free_inode_idx == 0) /* free ilist full*/
-        {
-                if (i_num < super->remembered_inode)
-                {
-                        super->remembered_inode = i_num;
-                }
-        }
-        else if (super->next_free_inode_idx <= MAX_FREE_ILIST_SIZE)
-        {
-                super->next_free_inode_idx --;
-                super->free_ilist[super->next_free_inode_idx] = i_num;
-        }
-        else
+        printf("\n\ndumping super block...\n\n");
+        printf("sizeof superblock = %u\n", sizeof(struct super_block));
+        printf("sizeof disk_inode = %u, in_core_inode = %u\n", sizeof(struct disk_inode), sizeof(struct in_core_inode));
+        printf("block size = %d, total blocks = %d, filesystem size = %lld\n", VOL->super->blk_size, VOL->super->num_blks, VOL->super->fs_size);
+        printf("max free blks = %d, num of free blks = %d\n", VOL->super->max_free_blks, VOL->super->num_free_blks);
+        printf("data block offset = %d\n", VOL->super->data_blk_offset);
+        printf("max free inodes = %d, num of free inodes = %d\n", VOL->super->max_free_inodes, VOL->super->num_free_inodes);
+        printf("allocation groups = %d, blks per group = %d\n", VOL->super->nr_ags, VOL->super->ag_blks);
+        for (i = 0; i < VOL->super->nr_ags; i++)
         {
-                fprintf(stderr, "error: wrong next_free_inode_idx\n");
-                return -1;
+                struct ag_desc *d = &VOL->ags[i].d;
+                printf("group %d: blks %d..%d, free blks %d, free_blk_list_head = %d, next_free_blk_idx = %d\n",
+                  i, d->first_blk, d->first_blk + d->nr_blks - 1, d->num_free_blks,
+                  d->free_blk_list_head, d->next_free_blk_idx);
+                printf("  free inodes %d, remembered inode = %d, free inode list: ",
+                  d->num_free_inodes, d->remembered_inode);
+                for (j = d->next_free_inode_idx; j < AG_ILIST_SIZE; j++)
+                        printf("%d ", d->free_ilist[j]);
+                printf("\n");
         }
-        char buf[BLK_SZ];
-        int blk_num = 1 + i_num / INODES_PER_BLK;
-        int offset = i_num % INODES_PER_BLK;
-        if (bread(blk_num, buf) == -1)
+}
+
+void dump_datablks(void)
+{
+      	char buf[BLK_SZ];
+	int i;
+        for (i = 0; i < NUM_BLKS; i++)
         {
-                fprintf(stderr, "error: bread blk#%d\n", blk_num);
-                return -1;
+                printf("blk #%d: ", i);
+                //int *p = (int*)(disk[i].data);
+            		if(bread(i, buf) == -1)
+            		{
+            			fprintf(stderr, "error: bread failure.\n");
+            			return;
+             		}
+            		dump_buffer(buf);
         }
-        struct disk_inode* di = (struct disk_inode*)buf;
-        di = di + offset;
-        di->file_type = UNUSED;
-        if (bwrite(blk_num, buf) == -1)
+}
+
+static int update_super(void)
+{
+        // write superblk to disk
+	char buf[BLK_SZ];
+        memset(buf, 0, sizeof(buf));
+        memcpy(buf, VOL->super, sizeof(struct super_block));
+        if (bwrite_meta(0, buf) == -1)
         {
-                fprintf(stderr, "error: bwrite blk#%d\n", blk_num);
+                fprintf(stderr, "error: bwrite superblk#0 when update superblk\n");
                 return -1;
         }
-        free(ci); // ultimately free the in-core inode structure
-	ci = NULL;
-        super->num_free_inodes += 1;
-	if (update_super() == -1)
-	{
-		fprintf(stderr, "update superblk error\n");
+	return 0;
+}
+
+/************************* Layer 1: allocation groups ***************************/
+
+// the group of a data blk, -1 for a blk outside the data blks.
+static int ag_of_blk(int blk_num)
+{
+	if (blk_num < VOL->super->data_blk_offset || blk_num >= VOL->super->num_blks)
 		return -1;
-	}
-        return 0;
+	int g = (blk_num - VOL->super->data_blk_offset) / VOL->super->ag_blks;
+	return g < VOL->super->nr_ags ? g : VOL->super->nr_ags - 1;
 }
 
-// map a logical file byte offset to file system block
-// given an inode and byte offset, return a blk_num and byte offset in the block
-int bmap(const struct in_core_inode* ci, const int off, int* ret_blk_num,
-	int* ret_off_blk)
+// the group of inode i_num: inode blks are dealt out to the groups in turn.
+static int ag_of_inode(int i_num)
+{
+	return (i_num / INODES_PER_BLK) % VOL->super->nr_ags;
+}
+
+// the group the calling thread allocates in. set from the inode being
+// allocated for, so a file's blks stay near each other and its inode;
+// otherwise each thread starts in a group of its own.
+static __thread int ag_hint = -1;
+
+static int ag_next(void)
+{
+	return __atomic_fetch_add(&VOL->ag_rotor, 1, __ATOMIC_RELAXED) % VOL->super->nr_ags;
+}
+
+static void ag_hint_inode(int i_num)
+{
+	ag_hint = ag_of_inode(i_num);
+}
+
+static int ag_pick(void)
+{
+	if (ag_hint < 0 || ag_hint >= VOL->super->nr_ags)
+		ag_hint = ag_next();
+	return ag_hint;
+}
+
+// write the header of group ag. called with the group locked.
+static int ag_write(struct ag *ag)
 {
-	int logical_blk;
-	int blk_num;
-	int off_blk;
-	logical_blk = off / BLK_SZ;
-	off_blk = off % BLK_SZ;
 	char buf[BLK_SZ];
-	if (logical_blk < DIRECT_BLKS_PER_INODE)
+	memset(buf, 0, sizeof(buf));
+	memcpy(buf, &ag->d, sizeof(struct ag_desc));
+	if (bwrite_meta(ag->d.first_blk, buf) == -1)
 	{
-		blk_num = ci->block_addr[logical_blk];
+		fprintf(stderr, "error: bwrite group %d header blk#%d\n", ag->idx, ag->d.first_blk);
+		return -1;
 	}
-	else if (logical_blk < max_single)
+	return 0;
+}
+
+// read the group headers in core and sum up the free counts of the superblk.
+static int ag_load(void)
+{
+	char buf[BLK_SZ];
+	int g;
+	int free_blks = 0;
+	int free_inodes = 0;
+	if (VOL->super->nr_ags < 1 || VOL->super->nr_ags > NR_AGS)
 	{
-		blk_num = ci->single_ind_blk;
-		logical_blk -= DIRECT_BLKS_PER_INODE;
-		if (bread(blk_num, buf) == -1)
-		{
-			fprintf(stderr, "bread error when bmap blk#%d\n", blk_num);
-			return -1;
-		}
-		int *p = (int*)buf;
-		blk_num = p[logical_blk];
+		fprintf(stderr, "error: %d allocation groups, at most %d supported\n", VOL->super->nr_ags, NR_AGS);
+		return -1;
 	}
-	else if (logical_blk < max_double)
+	for (g = 0; g < VOL->super->nr_ags; g++)
 	{
-		blk_num = ci->double_ind_blk;
-		if (bread(blk_num, buf) == -1)
-		{
-			fprintf(stderr, "bread error when bmap blk#%d\n", blk_num);
-			return -1;
-		}
-		int *p = (int*)buf;
-		logical_blk -= max_single;
-		int indirect_blk = logical_blk / RANGE_SINGLE;
-		int indirect_off = logical_blk % RANGE_SINGLE;
-		blk_num = p[indirect_blk];
-		if (bread(blk_num, buf) == -1)
+		if (bread(VOL->super->data_blk_offset + g * VOL->super->ag_blks, buf) == -1)
 		{
-			fprintf(stderr, "bread error when bmap blk#%d\n", blk_num);
+			fprintf(stderr, "error: bread group %d header\n", g);
 			return -1;
 		}
-		p = (int*)buf;
-		blk_num = p[indirect_off];
-	}
-	else
-	{
-		fprintf(stderr, "logical blk num %d out of max range\n", logical_blk);
-		return -1;
+		memcpy(&VOL->ags[g].d, buf, sizeof(struct ag_desc));
+		VOL->ags[g].idx = g;
+		free_blks += VOL->ags[g].d.num_free_blks;
+		free_inodes += VOL->ags[g].d.num_free_inodes;
 	}
-	*ret_blk_num = blk_num;
-	*ret_off_blk = off_blk;
+	VOL->super->num_free_blks = free_blks;
+	VOL->super->num_free_inodes = free_inodes;
 	return 0;
 }
 
-struct in_core_inode* iget(int i_num)
+/* create the free blk list of group ag on top of its data blocks */
+static int init_free_blk_list(struct ag *ag)
 {
-	int blk_num = 1 + i_num / INODES_PER_BLK;
-	int offset = i_num % INODES_PER_BLK;
-	char buf[BLK_SZ];
-	if (bread(blk_num, buf) == -1)
-	{
-		fprintf(stderr, "error: bread blk#%d when iget\n", blk_num);
-		return NULL;
-	}
-	struct disk_inode *di = (struct disk_inode*)buf;
-	di = di + offset;
-	struct in_core_inode *ci = (struct in_core_inode*)malloc(sizeof(struct in_core_inode));
-	init_inode_from_disk(ci, di, i_num);
-	ci->locked = 1;
-	return ci;
+        int offset = ag->d.first_blk + 1;
+        int end = ag->d.first_blk + ag->d.nr_blks;
+        int* p;
+        int i;
+      	char buf[BLK_SZ];
+
+        ag->d.free_blk_list_head = offset;
+        ag->d.next_free_blk_idx = 1;
+        ag->d.num_free_blks = end - offset;
+        for (;offset < end; offset += FREE_BLKS_PER_LINK)
+        {
+		memset(buf, 0, sizeof(buf));
+
+            		p = (int*)buf;
+
+                // set next data index block pointer
+                if (offset + FREE_BLKS_PER_LINK >= end)
+                        *p++ = 0; // end of the free blocks?  -JH
+                                  // this is the blk_num that points to the next link,
+                                  // if there are no more links of free blks, then it should
+                                  // be zero, so that you know this is the last link.
+                                  // not necessarily, because you can also know from the
+                                  // ag->d.num_free_blks that there are no more free blks.
+                                  // but just leave it here. We can discuss more later.
+                else
+                        *p++ = offset + FREE_BLKS_PER_LINK;
+
+                // fill in the data index blocks with free block indices
+                for(i = 1; i < FREE_BLKS_PER_LINK && offset + i < end; i++)
+                        *p++ = offset + i;
+
+                // write data index block back to storage
+            		if (bwrite_meta(offset, buf) == -1)
+            		{
+            			fprintf(stderr, "error: bwrite wrong when init free blk list\n");
+            			return -1;
+            		}
+        }
+        return 0;
 }
 
-static int free_disk_blocks(struct in_core_inode* ci)
+// split the data blks into groups, each with its free blk list and its share
+// of the fixed inode blks, and write their headers.
+static int init_ags_on_disk(void)
 {
-	int i;
-	int blk_num;
-	// free direct blocks
-#if _DEBUG
-	printf("free direct blocks\n");
-#endif
-	for (i = 0; i < DIRECT_BLKS_PER_INODE; i++)
+	int g, iblk;
+      	printf("\n\ninit allocation groups....\n");
+	for (g = 0; g < VOL->super->nr_ags; g++)
 	{
-		blk_num = ci->block_addr[i];
-		if (blk_num == 0)
-			continue;
-		if (bfree(blk_num) == -1)
-		{
-			fprintf(stderr, "bfree error when free disk blk#%d\n", blk_num);
+		struct ag *ag = &VOL->ags[g];
+		memset(&ag->d, 0, sizeof(ag->d));
+		ag->idx = g;
+		ag->d.first_blk = VOL->super->data_blk_offset + g * VOL->super->ag_blks;
+		ag->d.nr_blks = g < VOL->super->nr_ags - 1 ? VOL->super->ag_blks
+		  : VOL->super->num_blks - ag->d.first_blk;
+		if (init_free_blk_list(ag) == -1)
+			return -1;
+		for (iblk = g; iblk < VOL->super->nr_iblks; iblk += VOL->super->nr_ags)
+			ag->d.num_free_inodes += INODES_PER_BLK;
+		ag->d.remembered_inode = g * INODES_PER_BLK;
+		ag->d.next_free_inode_idx = AG_ILIST_SIZE; // empty, filled by init_free_ilist()
+		if (ag_write(ag) == -1)
 			return -1;
-		}
-		ci->block_addr[i] = 0;
 	}
+        printf("complete init allocation groups\n");
+	return 0;
+}
 
-	// free single indirect blks
-	if (ci->blks_in_use <= DIRECT_BLKS_PER_INODE)
-		goto finish_free_disk_blks;
+// take a free blk off the free blk list of group ag. The caller writes the
+// group header and accounts for the blk. called with the group locked.
+static int balloc_ag(struct ag *ag)
+{
+        int blk_num;
+        if (ag->d.num_free_blks == 0)
+        {
+                fprintf(stderr, "no free block: num_free_blks==0\n");
+                return -1;
+        }
 #if _DEBUG
-	printf("free single indirect blocks\n");
+        printf("  next free blk idx = %d\n", ag->d.next_free_blk_idx);
 #endif
-	blk_num = ci->single_ind_blk;
-	if (blk_num == 0) // doesn't in use.
-		goto free_double_indirect;
-	char buf[BLK_SZ];
-	if (bread(blk_num, buf) == -1)
-	{
-		fprintf(stderr, "bread error blk#%d when free single indirect\n", blk_num);
-		return -1;
-	}
-	int *p = (int*)buf;
-	for (i = 0; i < RANGE_SINGLE; i++)
-	{
-		blk_num = p[i];
-		if (blk_num == 0)
-			continue;
-		if (bfree(blk_num) == -1)
+      	char buf[BLK_SZ];
+	      int old_list_head = ag->d.free_blk_list_head;
+
+        if (bread(old_list_head, buf) == -1)
+	      {
+		      fprintf(stderr, "error: bread wrong when balloc\n");
+		      return -1;
+	      }
+
+        if (ag->d.next_free_blk_idx == 0)
+        {
+                int* freelist_head = (int*)buf;
+
+		            blk_num = ag->d.free_blk_list_head;
+                ag->d.free_blk_list_head = freelist_head[0];
+                // the link blk itself is handed out, its entries all taken.
+                freelist_head[0] = 0;
+#if _DEBUG
+                printf("  blk #%d allocated, free_blk_list_head changed\n", blk_num);
+#endif
+                ag->d.next_free_blk_idx = 1;
+        }
+        else if (ag->d.next_free_blk_idx < FREE_BLKS_PER_LINK)
+        {
+                int* freelist_head = (int*)buf;
+                blk_num = freelist_head[ag->d.next_free_blk_idx];
+                /* This is the case when there are no more free blks in the final
+                link. The final blk is the link itself. So, need to change the
+                blk_num to the link itself, and update free_blk_list_head. */
+                if (blk_num == 0)
+                {
+                        blk_num = ag->d.free_blk_list_head;
+                        ag->d.free_blk_list_head = 0;
+                        ag->d.next_free_blk_idx = 1;
+#if _DEBUG
+                        printf("  blk #%d allocated\n", blk_num);
+#endif
+                }
+                else
+                {
+                        freelist_head[ag->d.next_free_blk_idx] = 0;
+#if _DEBUG
+                        printf("  blk #%d allocated\n", blk_num);
+#endif
+                        ag->d.next_free_blk_idx += 1;
+                        ag->d.next_free_blk_idx %= FREE_BLKS_PER_LINK;
+                }
+        }
+        else
+        {
+                fprintf(stderr, "wrong next_free_blk_idx\n");
+                return -1;
+        }
+
+      	if (bwrite_meta(old_list_head, buf) == -1)
+	      {
+		      fprintf(stderr, "error: bwrite when balloc\n");
+		      return -1;
+	      }
+
+        ag->d.num_free_blks -= 1;
+        return blk_num;
+}
+
+// put blk_num back on the free blk list of its group ag. The caller writes
+// the group header and accounts for the blk. called with the group locked.
+static int bfree_ag(struct ag *ag, int blk_num)
+{
+#if _DEBUG
+        printf("  want to free blk_num = %d\n", blk_num);
+#endif
+        if (blk_num <= ag->d.first_blk || blk_num >= ag->d.first_blk + ag->d.nr_blks)
+        {
+                fprintf(stderr, "error: trying to free blk %d, not a data blk of group %d\n", blk_num, ag->idx);
+                return -1;
+        }
+#if _DEBUG
+        printf("  next free blk idx = %d\n", ag->d.next_free_blk_idx);
+#endif
+	char buf[BLK_SZ];
+	/* indicates current free list link head full, so need to put the freed
+	   blk_num as the new free list link head. */
+        if (ag->d.next_free_blk_idx == 1)
+        {
+/*
+		if (bread(blk_num, buf) == -1)
 		{
-			fprintf(stderr, "bfree error when free disk blk#%d\n", blk_num);
+			fprintf(stderr, "error: bread wrong when bfree\n");
 			return -1;
 		}
-	}
-	// TODO: fatal error, no update to the disk!!!
-	blk_num = ci->single_ind_blk;
-	if (bfree(blk_num) == -1)
-	{
-		fprintf(stderr, "bfree error blk#%d when free single indirect\n", blk_num);
-		return -1;
-	}
-	ci->single_ind_blk = 0;
-
-	// free double indirect blks
-	if (ci->blks_in_use <= max_single)
-		goto finish_free_disk_blks;
-free_double_indirect:
+*/
+		memset(buf, 0, sizeof(buf));
+                int* freelist_head = (int*)buf;
+                freelist_head[0] = ag->d.free_blk_list_head;
+                ag->d.free_blk_list_head = blk_num;
+                ag->d.next_free_blk_idx = 0;
 #if _DEBUG
-	printf("free double indirect blocks\n");
+                printf("  blk# %d freed\n", blk_num);
 #endif
-	blk_num = ci->double_ind_blk;
-	if (blk_num == 0) // doesn't in use.
-		return 0;
-	if (bread(blk_num, buf) == -1)
-	{
-		fprintf(stderr, "bread error blk#%d when free single indirect\n", blk_num);
-		return -1;
-	}
-	p = (int*)buf;
-	for (i = 0; i < RANGE_SINGLE; i++)
-	{
-		blk_num = p[i];
-		if (blk_num == 0)
-			continue;
-		char buf2[BLK_SZ];
-		if (bread(blk_num, buf2) == -1)
+		if (bwrite_meta(blk_num, buf) == -1)
 		{
-			fprintf(stderr, "bread error blk#%d when free double indirect\n", blk_num);
+			fprintf(stderr, "error: bwrite wrong when bfree\n");
 			return -1;
 		}
-		int *q = (int*)buf2;
-		int j;
-		for (j = 0; j < RANGE_SINGLE; j++)
+        }
+        else if (ag->d.next_free_blk_idx == 0)
+        {
+		if (bread(ag->d.free_blk_list_head, buf) == -1)
 		{
-			if (q[j] == 0)
-				continue;
-			if (bfree(q[j]) == -1)
-			{
-				fprintf(stderr, "bfree error blk# %d when free single indirect in double indirect\n", q[j]);
-				return -1;
-			}
+			fprintf(stderr, "error: bread wrong when bfree\n");
+			return -1;
 		}
-		if (bfree(p[i]) == -1)
+                ag->d.next_free_blk_idx = FREE_BLKS_PER_LINK - 1;
+                int* freelist_head = (int*)buf;
+                freelist_head[ag->d.next_free_blk_idx] = blk_num;
+#if _DEBUG
+                printf("  blk# %d freed\n", blk_num);
+#endif
+		if (bwrite_meta(ag->d.free_blk_list_head, buf) == -1)
 		{
-			fprintf(stderr, "bfree error blk# %d for single indirect blk table in double indirect\n", p[i]);
+			fprintf(stderr, "error: bwrite wrong when bfree\n");
 			return -1;
 		}
-	}
-	blk_num = ci->double_ind_blk;
-	if (bfree(blk_num) == -1)
-	{
-		fprintf(stderr, "bfree error blk#%d when free single indirect\n", blk_num);
-		return -1;
-	}
-	ci->double_ind_blk = 0;
-finish_free_disk_blks:
-	return 0;
+        }
+        else if (ag->d.next_free_blk_idx > 1
+                && ag->d.next_free_blk_idx < FREE_BLKS_PER_LINK)
+        {
+		if (bread(ag->d.free_blk_list_head, buf) == -1)
+		{
+			fprintf(stderr, "error: bread wrong when bfree\n");
+			return -1;
+		}
+                ag->d.next_free_blk_idx -= 1;
+                int* freelist_head = (int*)buf;
+                freelist_head[ag->d.next_free_blk_idx] = blk_num;
+#if _DEBUG
+                printf("  blk# %d freed\n", blk_num);
+#endif
+		if (bwrite_meta(ag->d.free_blk_list_head, buf) == -1)
+		{
+			fprintf(stderr, "error: bwrite wrong when bfree\n");
+			return -1;
+		}
+        }
+        else
+        {
+                fprintf(stderr, "wrong next_free_blk_idx\n");
+                return -1;
+        }
+        ag->d.num_free_blks += 1;
+        return 0;
 }
 
-static int free_blks_for_truncate(struct in_core_inode *ci, int new_blks_in_use);
-
-// release an inode
-int iput(struct in_core_inode* ci)
+// take a free blk straight from a group, from group ag if it has one. a
+// group another thread has locked is passed over for the next one first, so
+// that threads allocating at once spread over the groups instead of queueing
+// up on one lock.
+static int balloc_from(int ag)
 {
-	/*if (ci->locked == 1)
-	{
-		fprintf(stderr, "warn: inode locked\n");
-		return -1;
-	}*/
-	if (ci == NULL)
-	{
-		fprintf(stderr, "ci is null pointer\n");
-		return -1;
-	}
-	ci->locked = 1;
-	if (1)
+	int i;
+	int n = VOL->super->nr_ags;
+	for (i = 0; i < 2 * n; i++)
 	{
-		if (ci->link_count == 0)
+		struct ag *a = &VOL->ags[(ag + i) % n];
+		if (i < n)
 		{
-			// free all disk blocks
-			//if (truncate_v2(ci, 0) != 0)
-			if (free_disk_blocks(ci) == -1)
-			//if (free_blks_for_truncate(ci, 0) != 0)
-			{
-				fprintf(stderr, "error truncate all disk blocks in iput\n");
-				return -1;
-			}
-			//ci->file_type = 0; // will be set in ifree().
-			// free inode
-			if (ifree(ci) == -1)
-			{
-				fprintf(stderr, "error: ifree when iput\n");
-				return -1;
-			}
+			if (pthread_mutex_trylock(&a->lock) != 0)
+				continue;
 		}
-		if (ci && ci->modified == 1) // update disk inode from in-core inode
+		else
+			pthread_mutex_lock(&a->lock);
+		int blk_num = a->d.num_free_blks > 0 ? balloc_ag(a) : -1;
+		if (blk_num != -1 && ag_write(a) == -1)
 		{
-			int i_num = ci->i_num;
-			int blk_num = 1 + i_num / INODES_PER_BLK;
-			int offset = i_num % INODES_PER_BLK;
-			// the reason why we need to call bread() is because we just want to
-			// update the inode in question, and leave the other inodes unmodified.
-			char buf[BLK_SZ];
-			if (bread(blk_num, buf) == -1)
-			{
-				fprintf(stderr, "bread error blk# %d when iput\n", blk_num);
-				return -1;
-			}
-			struct disk_inode* di = (struct disk_inode*)buf;
-			di = di + offset;
-			init_inode_from_kernel(di, ci);
-			if (bwrite(blk_num, buf) == -1)
-			{
-				fprintf(stderr, "bwrite error blk#%d when iput\n", blk_num);
-				return -1;
-			}
+			fprintf(stderr, "update group header error\n");
+			bfree_ag(a, blk_num);
+			blk_num = -1;
+		}
+		pthread_mutex_unlock(&a->lock);
+		if (blk_num != -1)
+		{
+			__atomic_sub_fetch(&VOL->super->num_free_blks, 1, __ATOMIC_RELAXED);
+			return blk_num;
 		}
-		// no free list for inode cache.
 	}
-	ci->locked = 0;
-	return 0;
+	return -1;
 }
 
-void dump_in_core_inode(struct in_core_inode* ci)
+/* Block magazines. Each thread keeps a few free blks of every group reserved
+ * in a magazine of its own, and balloc() and bfree() work on it alone. It is
+ * refilled from, and drained to, the group's free blk list half a magazine at
+ * a time, under the group lock and with one header write. The reserved blks
+ * are off the group free lists but still counted free in
+ * super->num_free_blks, which changes only when a blk is handed out or given
+ * back. They go back to the groups when the thread exits and at
+ * blk_mags_drain(); if the fs is not unmounted cleanly they are lost.
+ * A thread has a magazine per volume, found through the volume's key. */
+
+// move blks of group g from the magazine back to the group free list until
+// nr are left. called with the magazine locked.
+static int blk_mag_put_back(struct blk_magazine *m, int g, int nr)
 {
-	printf("\n\ndumping in-core inode\n\n");
-	printf("file_type = %d\n", ci->file_type);
-	printf("owner = %s\n", ci->owner_id);
-	printf("access_permission = %d\n", ci->access_permission);
-	printf("last_accessed = %d\n", ci->last_accessed);
-	printf("last_modified = %d\n", ci->last_modified);
-	printf("inode_last_mod = %d\n", ci->inode_last_mod);
-	printf("link_count = %d\n", ci->link_count);
-	printf("file_size = %d\n", ci->file_size);
-	printf("blks_in_use = %d\n", ci->blks_in_use);
-	printf("direct block addr = \n");
-	int i;
-	for (i = 0; i < DIRECT_BLKS_PER_INODE; i++)
+	struct ag *ag = &VOL->ags[g];
+	int res = 0;
+	if (m->nr[g] <= nr)
+		return 0;
+	pthread_mutex_lock(&ag->lock);
+	while (m->nr[g] > nr)
 	{
-		printf("%d ", ci->block_addr[i]);
+		if (bfree_ag(ag, m->blks[g][m->nr[g] - 1]) == -1)
+		{
+			res = -1;
+			break;
+		}
+		m->nr[g]--;
 	}
-	printf("\nindirect single blk# = %d, indirect double blk# = %d\n",
-		ci->single_ind_blk, ci->double_ind_blk);
-	printf("locked = %d\n", ci->locked);
-	printf("i_num = %d\n", ci->i_num);
+	if (ag_write(ag) == -1)
+		res = -1;
+	pthread_mutex_unlock(&ag->lock);
+	return res;
 }
 
-/************************* Layer 1: make fs ***********************************/
-static int create_superblk(void)
+// refill half the magazine of group g. called with the magazine locked.
+static void blk_mag_refill(struct blk_magazine *m, int g)
 {
-	super = (struct super_block*)malloc(sizeof(struct super_block));
-	if (super == NULL)
+	struct ag *ag = &VOL->ags[g];
+	pthread_mutex_lock(&ag->lock);
+	int nr = m->nr[g];
+	while (m->nr[g] < BLK_MAGAZINE_SZ / 2 && ag->d.num_free_blks > 0)
 	{
-		fprintf(stderr, "create superblk error: no memory\n");
-		return -1;
+		int blk_num = balloc_ag(ag);
+		if (blk_num == -1)
+			break;
+		m->blks[g][m->nr[g]++] = blk_num;
 	}
-        super->blk_size = BLK_SZ;
-        super->num_blks = NUM_BLKS;
-        super->fs_size = (long)(super->blk_size) * (long)(super->num_blks);
-        /* disk blocks */
-        super->max_free_blks = super->num_free_blks = NUM_BLKS - 1 - ILIST_SPACE;
-        super->data_blk_offset = ILIST_SPACE + 1;
-        super->free_blk_list_head = super->data_blk_offset;
-        super->next_free_blk_idx = 1;
-        /* inodes */
-        super->max_free_inodes = super->num_free_inodes = INODES_PER_BLK * ILIST_SPACE;
-        memset(super->free_ilist, 0, sizeof(super->free_ilist));
-        super->next_free_inode_idx = 0;
-/*
-        super->modified = 0;
-        super->locked = 0;
-*/
-
-        return 0;
+	if (m->nr[g] != nr && ag_write(ag) == -1)
+	{
+		fprintf(stderr, "update group header error\n");
+		pthread_mutex_unlock(&ag->lock);
+		blk_mag_put_back(m, g, nr);
+		return;
+	}
+	pthread_mutex_unlock(&ag->lock);
 }
 
-static int read_superblk(void)
+// give every blk of magazine m back to its group.
+static int blk_mag_empty(struct blk_magazine *m)
 {
-	int blk_num = 0;
-	char buf[BLK_SZ];
-	memset(buf, 0, sizeof(buf));
-	if (bread(blk_num, buf) == -1)
+	int g;
+	int res = 0;
+	pthread_mutex_lock(&m->lock);
+	for (g = 0; VOL->super != NULL && g < VOL->super->nr_ags; g++)
 	{
-		fprintf(stderr, "bread error in read_superblk\n");
-		return -1;
+		if (blk_mag_put_back(m, g, 0) == -1)
+			res = -1;
 	}
-	super = (struct super_block*)malloc(sizeof(struct super_block));
-	if (super == NULL)
+	pthread_mutex_unlock(&m->lock);
+	return res;
+}
+
+// at thread exit.
+static void blk_mag_release(void *arg)
+{
+	struct blk_magazine *m = (struct blk_magazine*)arg;
+	struct blk_magazine **pp;
+	struct volume *prev = vol_enter(m->vol);
+	pthread_mutex_lock(&VOL->blk_mags_lock);
+	for (pp = &VOL->blk_mags; *pp != NULL; pp = &(*pp)->next)
 	{
-		fprintf(stderr, "create superblk error: no memory\n");
-		return -1;
+		if (*pp == m)
+		{
+			*pp = m->next;
+			break;
+		}
 	}
-	memcpy(super, buf, sizeof(struct super_block));
-	return 0;
+	pthread_mutex_unlock(&VOL->blk_mags_lock);
+	journal_start(1);
+	blk_mag_empty(m);
+	journal_stop(1);
+	pthread_mutex_destroy(&m->lock);
+	free(m);
+	vol_enter(prev);
 }
 
-static int root_i_num;
-//static struct in_core_inode* curr_dir_inode;
-static int curr_dir_i_num;
+// the calling thread's magazine, NULL if there is no memory for one.
+static struct blk_magazine *blk_mag_get(void)
+{
+	struct blk_magazine *m = (struct blk_magazine*)pthread_getspecific(VOL->blk_mag_key);
+	if (m != NULL)
+		return m;
+	m = (struct blk_magazine*)calloc(1, sizeof(struct blk_magazine));
+	if (m == NULL)
+		return NULL;
+	pthread_mutex_init(&m->lock, NULL);
+	m->vol = VOL;
+	pthread_setspecific(VOL->blk_mag_key, m);
+	pthread_mutex_lock(&VOL->blk_mags_lock);
+	m->next = VOL->blk_mags;
+	VOL->blk_mags = m;
+	pthread_mutex_unlock(&VOL->blk_mags_lock);
+	return m;
+}
 
-int mkrootdir(void)
+int blk_mags_drain(int discard)
 {
-	struct in_core_inode *r = ialloc();
-	if (r == NULL)
+	struct blk_magazine *m;
+	int res = 0;
+	pthread_mutex_lock(&VOL->blk_mags_lock);
+	for (m = VOL->blk_mags; m != NULL; m = m->next)
 	{
-		fprintf(stderr, "ialloc error in mkrootdir\n");
-		return -1;
-	}
-	root_i_num = r->i_num;
-	r->file_type = DIRECTORY;
-	strncpy(r->owner_id, "root2", FILE_OWNER_ID_LEN);
-	r->file_size = BLK_SZ;  // root dir has one block that is equal to BLK_SZ.
-	r->blks_in_use = 1;  // root dir has one block that is equal to BLK_SZ.
-	int blk_num = balloc();
-	if (blk_num == -1)
-	{
-		fprintf(stderr, "balloc error in mkrootdir\n");
-		return -1;
+		if (discard)
+		{
+			pthread_mutex_lock(&m->lock);
+			memset(m->nr, 0, sizeof(m->nr));
+			pthread_mutex_unlock(&m->lock);
+		}
+		else if (blk_mag_empty(m) == -1)
+			res = -1;
 	}
-	r->block_addr[0] = blk_num;
-	char buf[BLK_SZ];
-	memset(buf, 0, sizeof(buf));
-	struct directory_entry *entry;
-	entry = (struct directory_entry*)buf;
-	strncpy(entry->file_name, ".", FILE_NAME_LEN);
-	entry->inode_num = root_i_num;
-	entry++;
-	strncpy(entry->file_name, "..", FILE_NAME_LEN);
-	entry->inode_num = root_i_num;
-	// indicate the end of a directory
-	entry++;
-	entry->inode_num = BAD_I_NUM;
-	if (bwrite(blk_num, buf) == -1)
+	pthread_mutex_unlock(&VOL->blk_mags_lock);
+	return res;
+}
+
+int balloc(void)
+{
+	int g = ag_pick();
+	struct blk_magazine *m = blk_mag_get();
+	int blk_num = -1;
+	if (m != NULL)
 	{
-		fprintf(stderr, "bwrite error blk#%d in mkrootdir\n", blk_num);
-		return -1;
+		pthread_mutex_lock(&m->lock);
+		if (m->nr[g] == 0)
+			blk_mag_refill(m, g);
+		if (m->nr[g] > 0)
+			blk_num = m->blks[g][--m->nr[g]];
+		pthread_mutex_unlock(&m->lock);
+		if (blk_num != -1)
+		{
+			__atomic_sub_fetch(&VOL->super->num_free_blks, 1, __ATOMIC_RELAXED);
+			return blk_num;
+		}
 	}
-	if (iput(r) == -1)
+	// group g is out of blks: any other group, and at last the blks
+	// other threads have reserved.
+	blk_num = balloc_from(g);
+	if (blk_num == -1 && __atomic_load_n(&VOL->super->num_free_blks, __ATOMIC_RELAXED) > 0)
 	{
-		fprintf(stderr, "iput error in mkrootdir\n");
-		return -1;
+		blk_mags_drain(0);
+		blk_num = balloc_from(g);
 	}
-	return 0;
+	if (blk_num == -1)
+		fprintf(stderr, "no free block: num_free_blks==0\n");
+	return blk_num;
 }
 
-/* the mkfs system call creates superblock, free blk list and free ilist on disk
- * return 0: successful; return -1: failure.
- */
-int mkfs(void)
+static int bfree_now(int g, int blk_num);
+
+int bfree(int blk_num)
 {
-	printf("reset storage...\n");
-	if (reset_storage() == -1)
-	{
-		fprintf(stderr, "error: reset storage\n");
-		return -1;
-	}
-        create_superblk();
-        init_free_blk_list();
-        init_free_ilist();
-	if (mkrootdir() == -1)
+	int g = ag_of_blk(blk_num);
+	if (g < 0)
 	{
-		fprintf(stderr, "error when mkrootdir\n");
+		fprintf(stderr, "error: trying to free a non-data block %d, or disk is busted: super->data_blk_offset = %d\n", blk_num, VOL->super->data_blk_offset);
 		return -1;
 	}
-	if (update_super() == -1)
+	if (blk_num == VOL->ags[g].d.first_blk)
 	{
-		fprintf(stderr, "update superblk error\n");
+		fprintf(stderr, "error: trying to free the header blk %d of group %d\n", blk_num, g);
 		return -1;
 	}
-	curr_dir_i_num = root_i_num; // init current directory
-        return 0;
+	int res = journal_defer_free(blk_num);
+	if (res == 0)
+		res = bfree_now(g, blk_num);
+	if (res != -1)
+		__atomic_add_fetch(&VOL->super->num_free_blks, 1, __ATOMIC_RELAXED);
+	return res == -1 ? -1 : 0;
 }
 
-int init_super(void)
+// blks deferred by journal_defer_free() until a checkpoint that is past now
+// go on the free lists of their groups, not in a magazine: vol_close() gives
+// the last ones back after the magazines are drained. They are counted free
+// already. returns -1 on error.
+static int journal_free_deferred(void)
 {
-	if (read_superblk() != 0)
+	struct journal *j = &VOL->journal;
+	int *blks = NULL;
+	int i, n;
+	int res = 0;
+	pthread_mutex_lock(&j->jblk_lock);
+	n = j->nr_ready;
+	if (n > 0)
 	{
-		fprintf(stderr, "read_superblk error in init_super\n");
-		return -1;
+		blks = (int*)malloc(n * sizeof(int));
+		if (blks == NULL)
+		{
+			pthread_mutex_unlock(&j->jblk_lock);
+			fprintf(stderr, "error: no memory to free the deferred blks\n");
+			return -1;
+		}
+		memcpy(blks, j->deferred, n * sizeof(int));
+		memmove(j->deferred, j->deferred + n, (j->nr_deferred - n) * sizeof(int));
+		j->nr_deferred -= n;
+		j->nr_ready = 0;
 	}
-	//init_free_ilist();
-	curr_dir_i_num = root_i_num; // init current directory
-	return 0;
+	pthread_mutex_unlock(&j->jblk_lock);
+	if (n == 0)
+		return 0;
+	journal_start(0);
+	for (i = 0; i < n; i++)
+	{
+		struct ag *ag = &VOL->ags[ag_of_blk(blks[i])];
+		pthread_mutex_lock(&ag->lock);
+		if (bfree_ag(ag, blks[i]) == -1 || ag_write(ag) == -1)
+			res = -1;
+		pthread_mutex_unlock(&ag->lock);
+	}
+	journal_stop(0);
+	free(blks);
+	return res;
 }
 
-void init_namei_cache()
+// put blk_num of group g in the calling thread's magazine, or else on the
+// free list of g. The caller accounts for it.
+static int bfree_now(int g, int blk_num)
 {
-	int j;
-
-	//gettimeofday(&tv, NULL);
-	get_time();
-
-	for(j = 0; j < NAMEI_CACHE_SZ; ++j)
+	// a free blk keeps its old data: who allocates it writes it whole, or
+	// zeroes it first, see hole_fill().
+	struct blk_magazine *m = blk_mag_get();
+	int res = 0;
+	if (m == NULL)
 	{
-		namei_cache[j].path[0] = '\0';
-		namei_cache[j].iNode = NULL;
-		namei_cache[j].timestamp = tv.tv_sec;	// stamp everything NOW
+		pthread_mutex_lock(&VOL->ags[g].lock);
+		res = bfree_ag(&VOL->ags[g], blk_num);
+		if (res == 0 && ag_write(&VOL->ags[g]) == -1)
+			res = -1;
+		pthread_mutex_unlock(&VOL->ags[g].lock);
 	}
-
-	return;
+	else
+	{
+		pthread_mutex_lock(&m->lock);
+		if (m->nr[g] == BLK_MAGAZINE_SZ) // drain half the magazine to the group
+			res = blk_mag_put_back(m, g, BLK_MAGAZINE_SZ / 2);
+		if (res == 0)
+			m->blks[g][m->nr[g]++] = blk_num;
+		pthread_mutex_unlock(&m->lock);
+	}
+	return res;
 }
 
-struct namei_cache_element *find_namei_cache_by_path(const char *path)
+/************************* Layer 1: inode blk cache ********************************/
+
+// in-core copies of the inode table blks, indexed by inode blk: inode i_num
+// is in inode blk i_num / INODES_PER_BLK. The whole table is read in when
+// the fs is mounted (a blk not read yet is read on first use). Inode updates
+// only change the in-core copy and mark its blk dirty; iflush() writes the
+// dirty blks back in one pass.
+//
+// The first ILIST_SPACE inode blks are disk blks 1..ILIST_SPACE. igrow()
+// adds more from the data blks; the disk blk of each of those is kept in the
+// inode map blks listed in the superblk.
+
+#define IBLK_DIRTY	1
+#define IBLK_LAZY	2	// only access times changed
+
+static void init_iblk_cache(void)
 {
 	int i;
+	for (i = 0; i < VOL->nr_iblks; i++)
+		pool_free(POOL_BLK_BUF, VOL->iblk_cache[i]);
+	free(VOL->iblk_cache);
+	free(VOL->iblk_dirty);
+	free(VOL->iblk_loc);
+	VOL->iblk_cache = NULL;
+	VOL->iblk_dirty = NULL;
+	VOL->iblk_loc = NULL;
+	VOL->nr_iblks = 0;
+}
 
-	for(i = 0; i < NAMEI_CACHE_SZ; ++i)
+// make room for n inode blks in the in-core arrays.
+static int iblk_resize(int n)
+{
+	char **cache = (char**)realloc(VOL->iblk_cache, n * sizeof(char*));
+	if (cache != NULL)
+		VOL->iblk_cache = cache;
+	unsigned char *dirty = (unsigned char*)realloc(VOL->iblk_dirty, n);
+	if (dirty != NULL)
+		VOL->iblk_dirty = dirty;
+	int *loc = (int*)realloc(VOL->iblk_loc, n * sizeof(int));
+	if (loc != NULL)
+		VOL->iblk_loc = loc;
+	if (cache == NULL || dirty == NULL || loc == NULL)
 	{
-		if(strcmp(path, namei_cache[i].path) == 0)
-			return &namei_cache[i];
+		fprintf(stderr, "error: no memory for %d inode blks\n", n);
+		return -1;
 	}
-
-	return NULL;
+	for (; VOL->nr_iblks < n; VOL->nr_iblks++)
+	{
+		VOL->iblk_cache[VOL->nr_iblks] = NULL;
+		VOL->iblk_dirty[VOL->nr_iblks] = 0;
+		VOL->iblk_loc[VOL->nr_iblks] = 0;
+	}
+	return 0;
 }
 
-struct namei_cache_element *find_namei_cache_by_oldest()
+// build the inode blk -> disk blk map of the superblk in core.
+static int iblk_map_load(void)
 {
-	int tstamp, oldest, i;
-
-	get_time();
-	tstamp = tv.tv_sec;
-
-	for(i = 0; i < NAMEI_CACHE_SZ; ++i)
+	int buf[FREE_BLKS_PER_LINK];
+	int i;
+	init_iblk_cache();
+	if (iblk_resize(VOL->super->nr_iblks) == -1)
+		return -1;
+	for (i = 0; i < VOL->nr_iblks; i++)
 	{
-		if(tstamp > namei_cache[i].timestamp)
+		if (i < ILIST_SPACE)
 		{
-			oldest = i;
-			tstamp = namei_cache[i].timestamp;
+			VOL->iblk_loc[i] = 1 + i;
+			continue;
 		}
+		int e = i - ILIST_SPACE;
+		if (e % FREE_BLKS_PER_LINK == 0
+		  && bread(VOL->super->imap_blks[e / FREE_BLKS_PER_LINK], (char*)buf) == -1)
+		{
+			fprintf(stderr, "error: bread inode map blk#%d\n", VOL->super->imap_blks[e / FREE_BLKS_PER_LINK]);
+			return -1;
+		}
+		VOL->iblk_loc[i] = buf[e % FREE_BLKS_PER_LINK];
 	}
-
-	return &namei_cache[oldest];
+	return 0;
 }
 
-struct in_core_inode* namei_v2(const char* path_name)
+// returns the in-core copy of inode blk iblk, NULL on error.
+static char* iblk_read(int iblk)
 {
-	struct in_core_inode* working_inode;
-	char *path_tok;
-	struct directory_entry* dir_entry;
-	char path[MAX_PATH_LEN];
-#if USE_NAMEI_CACHE
-	struct namei_cache_element *cached_path = NULL;
-
-	// look in cache for this path
-	if((cached_path = find_namei_cache_by_path(path_name)) !=
-		NULL)
-	{
-		//gettimeofday(&tv, NULL);
-		get_time();
-		cached_path->timestamp = tv.tv_sec;
-//#if _DEBUG
-		printf("namei: found cached path for %s\n",
-			path_name);
-//#endif
-
-		return cached_path->iNode;
-	}
-
-	// path not cached, search fs for path
-#endif
-	strncpy(path, path_name, MAX_PATH_LEN);
-	if (path == NULL)
+	if (iblk < 0 || iblk >= VOL->nr_iblks)
 	{
-		fprintf(stderr, "error: path = NULL\n");
+		fprintf(stderr, "error: no inode blk %d\n", iblk);
 		return NULL;
 	}
-
-	if (path[0] == '/')
+	if (VOL->iblk_cache[iblk] == NULL)
 	{
-		working_inode = iget(root_i_num);
-		if (working_inode == NULL)
+		char *buf = (char*)pool_alloc(POOL_BLK_BUF);
+		if (buf == NULL)
 		{
-			fprintf(stderr, "error: get root inode fails in namei_v2\n");
+			fprintf(stderr, "error: no memory for inode blk %d\n", iblk);
 			return NULL;
 		}
-	}
-	else
-	{
-		working_inode = iget(curr_dir_i_num);
-		if (working_inode == NULL)
+		if (bread(VOL->iblk_loc[iblk], buf) == -1)
 		{
-			fprintf(stderr, "error: get current directory inode fails in namei_v2\n");
+			fprintf(stderr, "error: bread inode blk#%d\n", VOL->iblk_loc[iblk]);
+			pool_free(POOL_BLK_BUF, buf);
 			return NULL;
 		}
+		VOL->iblk_cache[iblk] = buf;
 	}
+	return VOL->iblk_cache[iblk];
+}
 
-	path_tok = strtok(path, "/");
-	while (path_tok)
+// the in-core copy of inode blk iblk was changed in place.
+static int iblk_write(int iblk)
+{
+	VOL->iblk_dirty[iblk] = IBLK_DIRTY;
+	return 0;
+}
+
+// like iblk_write(), for an access time update under lazytime.
+static void iblk_write_lazy(int iblk)
+{
+	if (VOL->iblk_dirty[iblk] == 0)
+		VOL->iblk_dirty[iblk] = IBLK_LAZY;
+}
+
+// write the dirty in-core inode blks with bwrite_meta().
+static int iblk_flush(int lazy)
+{
+	int i;
+	int res = 0;
+	pthread_mutex_lock(&VOL->iblk_lock);
+	for (i = 0; i < VOL->nr_iblks; i++)
 	{
-#if _DEBUG
-		printf("path_tok = %s\n", path_tok);
-#endif
-		if (working_inode->file_type != DIRECTORY)
+		if (VOL->iblk_dirty[i] == 0 || (VOL->iblk_dirty[i] == IBLK_LAZY && !lazy))
+			continue;
+		if (bwrite_meta(VOL->iblk_loc[i], VOL->iblk_cache[i]) == -1)
 		{
-			fprintf(stderr, "error: curr working dir is not a directory\n");
-			return NULL;
+			fprintf(stderr, "error: bwrite inode blk#%d in iflush\n", VOL->iblk_loc[i]);
+			res = -1;
+			break;
 		}
-		// TODO: check access permissions
-		if (working_inode->i_num == root_i_num && strcmp(path_tok, "..") == 0)
+		VOL->iblk_dirty[i] = 0;
+	}
+	pthread_mutex_unlock(&VOL->iblk_lock);
+	return res;
+}
+
+int iflush(int lazy)
+{
+	if (!VOL->journal.active || handle_depth > 0)
+		return iblk_flush(lazy);
+	return journal_commit(lazy, 0);
+}
+
+// read the whole inode table in core, each run of inode blks that lie next
+// to each other on disk in one request.
+static int iblk_load(void)
+{
+	int i, n;
+	if (iblk_map_load() == -1)
+		return -1;
+	char *run = (char*)malloc((size_t)READ_RUN_BLKS * BLK_SZ);
+	if (run == NULL)
+	{
+		fprintf(stderr, "error: no memory to load the inode table\n");
+		return -1;
+	}
+	for (i = 0; i < VOL->nr_iblks; i += n)
+	{
+		for (n = 1; n < READ_RUN_BLKS && i + n < VOL->nr_iblks
+		  && VOL->iblk_loc[i + n] == VOL->iblk_loc[i] + n; n++)
+			;
+		if (bread_run(VOL->iblk_loc[i], run, n) == -1)
 		{
-			path_tok = strtok(NULL, "/");
-			continue;
+			fprintf(stderr, "error: bread inode blks #%d-%d\n", VOL->iblk_loc[i], VOL->iblk_loc[i] + n - 1);
+			free(run);
+			return -1;
 		}
-		// read directory entry by entry
-		//dir_entry = (struct directory_entry*)(working_inode->block_addr[0]);
-		int off;  // the offset of dir entry in a directory
-		for (off = 0; off < MAX_ENTRY_OFFSET; off += DIR_ENTRY_LENGTH)
+		int k;
+		for (k = 0; k < n; k++)
 		{
-#if _DEBUG
-			printf("off of the directory is %d\n", off);
-#endif
-			int blk_num;
-			int offset_blk; // offset in a disk block
-			if (bmap(working_inode, off, &blk_num, &offset_blk) == -1)
+			if (VOL->iblk_cache[i + k] != NULL)
+				continue;
+			char *buf = (char*)pool_alloc(POOL_BLK_BUF);
+			if (buf == NULL)
 			{
-				fprintf(stderr, "bmap error in namei_v2\n");
-				return NULL;
+				fprintf(stderr, "error: no memory for inode blk %d\n", i + k);
+				free(run);
+				return -1;
 			}
-			char buf[BLK_SZ];
-			if (bread(blk_num, buf) == -1)
+			memcpy(buf, run + (size_t)k * BLK_SZ, BLK_SZ);
+			VOL->iblk_cache[i + k] = buf;
+		}
+	}
+	free(run);
+	return 0;
+}
+
+// add nr inode blks taken from the data blks. They start out in core, all
+// inodes free, and reach the disk with the next iflush(). Each goes to the
+// group it is dealt out to, and is taken from that group's data blks.
+// called with super_lock held.
+static int igrow(int nr)
+{
+	int map[FREE_BLKS_PER_LINK];
+	int map_blk = 0;
+	int added;
+	int res = 0;
+	pthread_mutex_lock(&VOL->iblk_lock);
+	res = iblk_resize(VOL->super->nr_iblks + nr);
+	pthread_mutex_unlock(&VOL->iblk_lock);
+	if (res == -1)
+		return -1;
+	for (added = 0; added < nr; added++)
+	{
+		int iblk = VOL->super->nr_iblks;
+		int g = iblk % VOL->super->nr_ags;
+		int e = iblk - ILIST_SPACE;
+		if (e >= IMAP_BLKS * FREE_BLKS_PER_LINK)
+		{
+			fprintf(stderr, "error: inode map full\n");
+			break;
+		}
+		if (map_blk != VOL->super->imap_blks[e / FREE_BLKS_PER_LINK] || map_blk == 0)
+		{
+			if (map_blk != 0 && bwrite_meta(map_blk, (char*)map) == -1)
 			{
-				fprintf(stderr, "bread error blk# %d in namei_v2\n", blk_num);
-				return NULL;
+				res = -1;
+				break;
 			}
-			dir_entry = (struct directory_entry*)(buf + offset_blk);
-#if _DEBUG
-			printf("get a dir entry, i_num = %d, filename = (%s)\n", dir_entry->inode_num, dir_entry->file_name);
-#endif
-			if (dir_entry->inode_num == BAD_I_NUM)
-			{// the search reaches the end of the dir entry. TODO: remove printf.
-#if _DEBUG
-				printf("cannot find the inode in curr dir for token %s\n", path_tok);
-#endif
-				return NULL;
+			map_blk = VOL->super->imap_blks[e / FREE_BLKS_PER_LINK];
+			if (map_blk == 0)
+			{ // a new inode map blk
+				map_blk = balloc_from(g);
+				if (map_blk == -1)
+					break;
+				VOL->super->imap_blks[e / FREE_BLKS_PER_LINK] = map_blk;
+				memset(map, 0, sizeof(map));
 			}
-			if (dir_entry->inode_num == EMPTY_I_NUM)
-				continue;
-			if (strcmp(dir_entry->file_name, path_tok) == 0)
+			else if (bread(map_blk, (char*)map) == -1)
 			{
-				int i_num = (int)(dir_entry->inode_num);
-				if (iput(working_inode) == -1)
-				{
-					fprintf(stderr, "iput error in namei_v2\n");
-					return NULL;
-				}
-				working_inode = iget(i_num);
-				if (working_inode == NULL)
-				{
-					fprintf(stderr, "iget error in namei_v2\n");
-					return NULL;
-				}
+				map_blk = 0;
+				res = -1;
 				break;
 			}
 		}
-		if (off == MAX_ENTRY_OFFSET)
-		{// already reaches the max entries, but not found.
-			printf("cannot find the inode until the max entries in curr_dir for token %s\n", path_tok);
-			return NULL;
+		int blk_num = balloc_from(g);
+		if (blk_num == -1)
+			break;
+		char *buf = (char*)pool_alloc(POOL_BLK_BUF);
+		if (buf == NULL)
+		{
+			bfree(blk_num);
+			break;
+		}
+		memset(buf, 0, BLK_SZ);  // all inodes UNUSED
+		map[e % FREE_BLKS_PER_LINK] = blk_num;
+		pthread_mutex_lock(&VOL->iblk_lock);
+		VOL->iblk_cache[iblk] = buf;
+		VOL->iblk_loc[iblk] = blk_num;
+		VOL->iblk_dirty[iblk] = IBLK_DIRTY;
+		VOL->super->nr_iblks++;
+		pthread_mutex_unlock(&VOL->iblk_lock);
+		pthread_mutex_lock(&VOL->ags[g].lock);
+		VOL->ags[g].d.num_free_inodes += INODES_PER_BLK;
+		if (ag_write(&VOL->ags[g]) == -1)
+			res = -1;
+		pthread_mutex_unlock(&VOL->ags[g].lock);
+		__atomic_add_fetch(&VOL->super->max_free_inodes, INODES_PER_BLK, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&VOL->super->num_free_inodes, INODES_PER_BLK, __ATOMIC_RELAXED);
+		if (res == -1)
+		{
+			added++;
+			break;
 		}
-
-		path_tok = strtok(NULL, "/");
 	}
+	if (map_blk != 0 && bwrite_meta(map_blk, (char*)map) == -1)
+		res = -1;
+	if (update_super() == -1)
+		res = -1;
+	return res == -1 ? -1 : added;
+}
 
-#if USE_NAMEI_CACHE
-	// replace oldest cached path with this one
-	//gettimeofday(&tv, NULL);
-	get_time();
-	if(cached_path == NULL)
+int iprefetch(const int *i_nums, int n)
+{
+	if (n <= 0)
+		return 0;
+	int blks[n];
+	int nr_blks = 0;
+	int i, j;
+	pthread_mutex_lock(&VOL->iblk_lock);
+	// sorted, distinct inode blks that are not in core yet
+	for (i = 0; i < n; i++)
 	{
-		cached_path = find_namei_cache_by_oldest();
-		strncpy(cached_path->path, path_name, strlen(path_name));
-		cached_path->iNode = working_inode;
+		int iblk = i_nums[i] / INODES_PER_BLK;
+		if (i_nums[i] < 0 || iblk >= VOL->nr_iblks || VOL->iblk_cache[iblk] != NULL)
+			continue;
+		for (j = nr_blks; j > 0 && blks[j - 1] > iblk; j--)
+			blks[j] = blks[j - 1];
+		if (j > 0 && blks[j - 1] == iblk)
+		{ // already there, undo the shift
+			for (; j < nr_blks; j++)
+				blks[j] = blks[j + 1];
+			continue;
+		}
+		blks[j] = iblk;
+		nr_blks++;
 	}
-	cached_path->timestamp = tv.tv_sec;
-//#if _DEBUG
-	printf("namei: cached mapping to path %s\n",
-		path_name);
-//#endif
-#endif
-
-	working_inode->locked = 1;
-	return working_inode;
+	for (i = 0; i < nr_blks; i++)
+	{
+		if (iblk_read(blks[i]) == NULL)
+		{
+			nr_blks = -1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&VOL->iblk_lock);
+	return nr_blks;
 }
 
-int separate_node_name(const char *path, char *node_name)
+/************************* Layer 1: in-core inode table ********************************/
+
+// one in-core copy per inode, found through a hash on i_num. an inode whose
+// last reference is dropped goes to the end of the free list but stays on its
+// hash chain, so a later iget() of it is served without disk access until
+// its slot is taken for another inode from the front of the free list.
+// slots come from POOL_INODE until there are INODE_TABLE_SZ of them.
+
+static void namei_cache_forget(int i_num);
+
+static void ifree_list_remove(struct in_core_inode *ci)
 {
-  return separate_node(path, node_name, 1);
+	ci->free_prev->free_next = ci->free_next;
+	ci->free_next->free_prev = ci->free_prev;
+	ci->free_prev = ci->free_next = NULL;
 }
 
-int separate_node_path(const char *path, char *node_path)
+// at_front: the slot is reused first, for inodes that are no longer valid.
+static void ifree_list_add(struct in_core_inode *ci, int at_front)
 {
-  return separate_node(path, node_path, 0);
+	struct in_core_inode *prev = at_front ? &VOL->inode_free_list : VOL->inode_free_list.free_prev;
+	ci->free_prev = prev;
+	ci->free_next = prev->free_next;
+	prev->free_next->free_prev = ci;
+	prev->free_next = ci;
 }
 
-int separate_node(const char *path, char *node_part, int part)
+static void ihash_remove(struct in_core_inode *ci)
 {
-  char node_path[strlen(path)];
-  char node_name[strlen(path)];
-  int l = 0;
-  int substr_len = 0;
-
-  l = strlen(path);
-  do
-  {
-    ++substr_len;
+	struct in_core_inode **pp = &VOL->inode_hash[ci->i_num % INODE_HASH_SZ];
+	while (*pp != NULL && *pp != ci)
+		pp = &(*pp)->hash_next;
+	if (*pp == ci)
+		*pp = ci->hash_next;
+	ci->hash_next = NULL;
+	ci->i_num = -1;
+}
 
-    if(path[l] == '/')
-    {
-      if(l == strlen(path)-1)
-      {
-        //printf("no node name\n");
-        return 0;
-      }
+static void ihash_insert(struct in_core_inode *ci, int i_num)
+{
+	struct in_core_inode **head = &VOL->inode_hash[i_num % INODE_HASH_SZ];
+	ci->i_num = i_num;
+	ci->hash_next = *head;
+	*head = ci;
+}
 
-      memcpy(node_name, &path[l+1], substr_len);
-      break;
-    }
+static void init_inode_table(void)
+{
+	memset(VOL->inode_hash, 0, sizeof(VOL->inode_hash));
+	if (VOL->inode_free_list.free_next != NULL)
+	{ // from a previous init: give the inactive inodes back.
+		while (VOL->inode_free_list.free_next != &VOL->inode_free_list)
+		{
+			struct in_core_inode *ci = VOL->inode_free_list.free_next;
+			ifree_list_remove(ci);
+			pthread_rwlock_destroy(&ci->rwlock);
+			pthread_mutex_destroy(&ci->map_lock);
+			pool_free(POOL_INODE, ci);
+		}
+	}
+	VOL->inode_free_list.free_prev = VOL->inode_free_list.free_next = &VOL->inode_free_list;
+	VOL->nr_inodes = 0;
+	VOL->nr_reclaim_queued = 0; // their references went with the table
+}
 
-    --l;
+// all in-core inodes are referenced.
+static int itable_full(void)
+{
+	return VOL->nr_inodes == INODE_TABLE_SZ && VOL->inode_free_list.free_next == &VOL->inode_free_list;
+}
 
-  } while(l >= 0);
+static struct in_core_inode* ifind(int i_num)
+{
+	struct in_core_inode *ci = VOL->inode_hash[i_num % INODE_HASH_SZ];
+	while (ci != NULL && ci->i_num != i_num)
+		ci = ci->hash_next;
+	return ci;
+}
 
-  //printf("l = %d\n", l);
-  if(l == 0)
-  {
-    memcpy(node_path, "/\0", 2);
-  }
-  else
+// take the least recently used free in-core inode for i_num, NULL if all
+// in-core inodes are referenced. its seqcount is left odd until the caller
+// has filled it in.
+static struct in_core_inode* itable_alloc(int i_num)
+{
+	struct in_core_inode *ci = NULL;
+	if (VOL->nr_inodes < INODE_TABLE_SZ)
+	{
+		ci = (struct in_core_inode*)pool_alloc(POOL_INODE);
+		if (ci != NULL)
+		{
+			VOL->nr_inodes++;
+			ci->i_num = -1;
+			ci->hash_next = NULL;
+			ci->seq = 0;
+			ci->excl = 0;
+			ci->ranges = NULL;
+			pthread_rwlock_init(&ci->rwlock, NULL);
+			pthread_mutex_init(&ci->map_lock, NULL);
+		}
+	}
+	if (ci == NULL)
+	{
+		ci = VOL->inode_free_list.free_next;
+		if (ci == &VOL->inode_free_list)
+		{
+			fprintf(stderr, "error: in-core inode table full\n");
+			return NULL;
+		}
+		ifree_list_remove(ci);
+		if (ci->i_num >= 0)
+			ihash_remove(ci);
+	}
+	seq_write_begin(&ci->seq);
+	ihash_insert(ci, i_num);
+	ci->ref_count = 1;
+	return ci;
+}
+
+/************************* Layer 1: inode algorithms ********************************/
+
+// search on disk free inodes and add them on the free ilist
+// when free ilist is empty.
+
+static int cmp_i_num(const void *a, const void *b)
+{
+	return *(const int*)a - *(const int*)b;
+}
+
+// top up the free ilist of a group. The group's in-core inode blks are
+// scanned a whole blk at a time from remembered_inode on, and the free inodes
+// found go in front of the ones still in the list, lowest first.
+// called with the group locked.
+static int fill_free_ilist(struct ag *ag)
+{
+        struct ag_desc *d = &ag->d;
+        int room = d->next_free_inode_idx;  // the list is used from here to its end
+        int nr_listed = AG_ILIST_SIZE - room;
+        int listed[AG_ILIST_SIZE];  // sorted, to skip inodes already listed
+        int found[AG_ILIST_SIZE];
+        int n = 0;
+        int k = d->remembered_inode;
+        int iblk, offset;
+        pthread_mutex_lock(&VOL->iblk_lock);
+        if (k >= VOL->super->nr_iblks * INODES_PER_BLK || (k / INODES_PER_BLK) % VOL->super->nr_ags != ag->idx)
+        {
+                pthread_mutex_unlock(&VOL->iblk_lock);
+                fprintf(stderr, "error: inode %d not in group %d\n", k, ag->idx);
+                return -1;
+        }
+        memcpy(listed, &d->free_ilist[room], nr_listed * sizeof(int));
+        qsort(listed, nr_listed, sizeof(int), cmp_i_num);
+        for (iblk = k / INODES_PER_BLK, offset = k % INODES_PER_BLK;
+          n < room && iblk < VOL->super->nr_iblks; iblk += VOL->super->nr_ags, offset = 0)
+        {
+                struct disk_inode *di = (struct disk_inode*)iblk_read(iblk);
+                if (di == NULL)
+                {
+                        fprintf(stderr, "error: bread when fill free ilist\n");
+                        pthread_mutex_unlock(&VOL->iblk_lock);
+                        return -1;
+                }
+                for (; offset < INODES_PER_BLK && n < room; offset++)
+                {
+                        if (di[offset].file_type != UNUSED)
+                                continue;
+                        k = iblk * INODES_PER_BLK + offset;
+                        if (nr_listed > 0 && bsearch(&k, listed, nr_listed, sizeof(int), cmp_i_num) != NULL)
+                                continue;
+                        found[n++] = k;
+                }
+        }
+        pthread_mutex_unlock(&VOL->iblk_lock);
+        if (n > 0)
+                d->remembered_inode = found[n - 1];
+        memcpy(&d->free_ilist[room - n], found, n * sizeof(int));
+        d->next_free_inode_idx = room - n;
+        return 0;
+}
+
+int fill_free_ilist_ahead(void)
+{
+        int res = 0;
+        int g;
+        unsigned int low = __atomic_exchange_n(&VOL->ilist_low, 0, __ATOMIC_ACQ_REL);
+        if (low == 0)
+                return 0;
+        journal_start(1);
+        // free inodes running out too: add inode blks before creates need them.
+        if (__atomic_load_n(&VOL->super->num_free_inodes, __ATOMIC_RELAXED) < ILIST_LOW_WATER)
+        {
+                pthread_mutex_lock(&VOL->super_lock);
+                if (VOL->super->num_free_inodes < ILIST_LOW_WATER && igrow(IGROW_BLKS) == -1)
+                {
+                        fprintf(stderr, "error: inode table growth ahead\n");
+                        res = -1;
+                }
+                pthread_mutex_unlock(&VOL->super_lock);
+        }
+        for (g = 0; g < VOL->super->nr_ags; g++)
+        {
+                struct ag *ag = &VOL->ags[g];
+                if (!(low & (1u << g)))
+                        continue;
+                pthread_mutex_lock(&ag->lock);
+                int before = ag->d.next_free_inode_idx;
+                if (fill_free_ilist(ag) == -1 || ag_write(ag) == -1)
+                {
+                        fprintf(stderr, "error: free ilist refill ahead\n");
+                        res = -1;
+                }
+                else if (res != -1)
+                        res += before - ag->d.next_free_inode_idx;
+                pthread_mutex_unlock(&ag->lock);
+        }
+        journal_stop(1);
+        return res;
+}
+
+static int init_free_ilist(void)
+{
+        int g;
+        for (g = 0; g < VOL->super->nr_ags; g++)
+        {
+                pthread_mutex_lock(&VOL->ags[g].lock);
+                fill_free_ilist(&VOL->ags[g]);
+                ag_write(&VOL->ags[g]);
+                pthread_mutex_unlock(&VOL->ags[g].lock);
+        }
+        printf("complete init free ilist\n");
+        return 0;
+}
+
+int get_time(void)
+{
+	struct timeval tv;
+	if (gettimeofday(&tv, NULL) != 0)
+	{
+		fprintf(stderr, "error in get_time\n");
+		return 0;
+	}
+	int res = tv.tv_sec;
+	return res;
+}
+
+static int init_disk_inode(struct disk_inode* di)
+{
+        di->file_type = REGULAR;
+        strncpy(di->owner_id, "unknown", FILE_OWNER_ID_LEN);
+        di->access_permission = 0777;
+        di->last_accessed = get_time();
+        di->last_modified = get_time();
+        di->inode_last_mod = get_time();
+        di->link_count = 0;  // TODO: really?
+        di->file_size = 0;
+        di->blks_in_use = 0;
+        int i;
+        for(i = 0; i < DIRECT_BLKS_PER_INODE; i++)
+        {
+                di->block_addr[i] = 0;
+        }
+	di->single_ind_blk = 0;
+	di->double_ind_blk = 0;
+	return 0;
+}
+
+static int init_in_core_inode(struct in_core_inode* ci, int i_num)
+{
+        init_disk_inode(&ci->disk);
+        ci->link_count = 1;
+        ci->modified = 1;
+        ci->atime_dirty = 0;
+        ci->i_num = i_num;
+        return 0;
+}
+
+static int init_inode_from_disk(struct in_core_inode* ci, const struct disk_inode* di, int i_num)
+{
+        ci->disk = *di;
+        ci->modified = 0;
+        ci->atime_dirty = 0;
+        ci->i_num = i_num;
+        return 0;
+}
+
+static int init_inode_from_kernel(struct disk_inode* dst, const struct in_core_inode* src)
+{
+        *dst = src->disk;
+        return 0;
+}
+
+static int ifree_disk(int i_num);
+
+// take a free inode from the free ilist of a group and mark it in use on
+// disk. returns its i_num, -1 on error or when the group has no free inodes.
+// called with the group locked.
+static int ialloc_disk(struct ag *ag)
+{
+        struct ag_desc *d = &ag->d;
+        int ret;
+        if (d->num_free_inodes <= 0)
+                return -1;
+        while (1)
+        {
+                /* ilist empty in the group */
+                if (d->next_free_inode_idx == AG_ILIST_SIZE)
+                {
+                        ret = fill_free_ilist(ag);
+                        if (ret == -1 || d->next_free_inode_idx == AG_ILIST_SIZE)
+                        {
+                                fprintf(stderr, "error: free ilist of group %d not filled\n", ag->idx);
+                                return -1;
+                        }
+                }
+                int i_num = d->free_ilist[d->next_free_inode_idx];
+#if _DEBUG
+                printf("  i_num = %d (group %d)\n", i_num, ag->idx);
+#endif
+                d->free_ilist[d->next_free_inode_idx] = -1;
+                d->next_free_inode_idx += 1;
+#if ILIST_ASYNC_REFILL
+                if (AG_ILIST_SIZE - d->next_free_inode_idx < AG_ILIST_LOW_WATER)
+                        __atomic_or_fetch(&VOL->ilist_low, 1u << ag->idx, __ATOMIC_RELEASE);
+#endif
+                int iblk = i_num / INODES_PER_BLK;
+                int offset = i_num % INODES_PER_BLK;
+                pthread_mutex_lock(&VOL->iblk_lock);
+                char *buf = iblk_read(iblk);
+                if (buf == NULL)
+                {
+                        pthread_mutex_unlock(&VOL->iblk_lock);
+                        fprintf(stderr, "error: bread inode blk %d when ialloc\n", iblk);
+                        return -1;
+                }
+                struct disk_inode* di = (struct disk_inode*)buf;
+                di = di + offset;
+                if (di->file_type != 0) /* inode is not free */
+                {
+                        //TODO
+                        pthread_mutex_unlock(&VOL->iblk_lock);
+                        fprintf(stderr, "error: inode not free after all\n");
+                        continue;
+                }
+                init_disk_inode(di);
+                iblk_write(iblk);
+                pthread_mutex_unlock(&VOL->iblk_lock);
+                d->num_free_inodes -= 1;
+                __atomic_sub_fetch(&VOL->super->num_free_inodes, 1, __ATOMIC_RELAXED);
+		if (ag_write(ag) == -1)
+		{
+			fprintf(stderr, "update group %d header error\n", ag->idx);
+			return -1;
+		}
+                return i_num;
+        }
+}
+
+// allocate an in-core inode, from group ag if it has a free inode, else
+// from the next group that has. The inode table grows once every group
+// has run out.
+static struct in_core_inode* ialloc_ag(int ag)
+{
+        struct in_core_inode* ci = NULL;
+	// checked first, so an inode is rarely taken from disk without a slot.
+	pthread_mutex_lock(&VOL->itable_lock);
+	int full = itable_full();
+	pthread_mutex_unlock(&VOL->itable_lock);
+	if (full)
+	{
+		fprintf(stderr, "error: in-core inode table full\n");
+		return NULL;
+	}
+	int i_num = -1;
+	int tries, i;
+	for (tries = 0; tries < 2 && i_num == -1; tries++)
+	{
+		for (i = 0; i < VOL->super->nr_ags && i_num == -1; i++)
+		{
+			struct ag *g = &VOL->ags[(ag + i) % VOL->super->nr_ags];
+			pthread_mutex_lock(&g->lock);
+			i_num = ialloc_disk(g);
+			pthread_mutex_unlock(&g->lock);
+		}
+		if (i_num != -1 || tries > 0)
+			break;
+		pthread_mutex_lock(&VOL->super_lock);
+		int grown = VOL->super->num_free_inodes > 0 || igrow(IGROW_BLKS) > 0;
+		pthread_mutex_unlock(&VOL->super_lock);
+		if (!grown)
+			break;
+	}
+	if (i_num == -1)
+	{
+		fprintf(stderr, "error: no more free inodes on disk\n");
+		return NULL;
+	}
+	pthread_mutex_lock(&VOL->itable_lock);
+	ci = itable_alloc(i_num);
+	if (ci != NULL)
+	{
+		init_in_core_inode(ci, i_num);
+		seq_write_end(&ci->seq);
+	}
+	pthread_mutex_unlock(&VOL->itable_lock);
+	if (ci == NULL) // the table filled up meanwhile
+		ifree_disk(i_num);
+	return ci;
+}
+
+/* allocate in-core inodes */
+struct in_core_inode* ialloc(void)
+{
+	return ialloc_ag(ag_pick());
+}
+
+// put inode i_num back on the free ilist of its group and mark it unused
+// on disk.
+static int ifree_disk(int i_num)
+{
+        int res = 0;
+        if (i_num >= __atomic_load_n(&VOL->super->max_free_inodes, __ATOMIC_RELAXED))
+        {
+                fprintf(stderr, "error: i_num exceeds max inode num\n");
+                return -1;
+        }
+        struct ag *ag = &VOL->ags[ag_of_inode(i_num)];
+        struct ag_desc *d = &ag->d;
+        pthread_mutex_lock(&ag->lock);
+        pthread_mutex_lock(&VOL->iblk_lock);
+        int iblk = i_num / INODES_PER_BLK;
+        int offset = i_num % INODES_PER_BLK;
+        char *buf = iblk_read(iblk);
+        if (buf == NULL)
+        {
+                fprintf(stderr, "error: bread inode blk %d\n", iblk);
+                res = -1;
+        }
+        else
+        {
+                ((struct disk_inode*)buf + offset)->file_type = UNUSED;
+                iblk_write(iblk);
+        }
+        pthread_mutex_unlock(&VOL->iblk_lock);
+        if (res == 0)
+        {
+                if (d->next_free_inode_idx == 0) /* free ilist full*/
+                {
+                        if (i_num < d->remembered_inode)
+                                d->remembered_inode = i_num;
+                }
+                else
+                {
+                        d->next_free_inode_idx --;
+                        d->free_ilist[d->next_free_inode_idx] = i_num;
+                }
+                d->num_free_inodes += 1;
+                __atomic_add_fetch(&VOL->super->num_free_inodes, 1, __ATOMIC_RELAXED);
+                if (ag_write(ag) == -1)
+                {
+                        fprintf(stderr, "update group %d header error\n", ag->idx);
+                        res = -1;
+                }
+        }
+        pthread_mutex_unlock(&ag->lock);
+        return res;
+}
+
+int ifree(struct in_core_inode* ci)
+{
+        int i_num = ci->i_num;
+#if _DEBUG
+        printf(" free i_num = %d\n", i_num);
+#endif
+        // the in-core inode is no longer valid: drop it from the namei cache
+        // and the inode table before i_num can be handed out again, and give
+        // its slot out first.
+        namei_cache_forget(i_num);
+        pthread_mutex_lock(&VOL->itable_lock);
+        if (ci->i_num >= 0)
+                ihash_remove(ci);
+        pthread_mutex_unlock(&VOL->itable_lock);
+        int res = ifree_disk(i_num);
+        pthread_mutex_lock(&VOL->itable_lock);
+        if (ci->ref_count > 0)
+        {
+                ci->ref_count = 0;
+                ifree_list_add(ci, 1);
+        }
+        pthread_mutex_unlock(&VOL->itable_lock);
+        return res;
+}
+
+// map a logical file byte offset to file system block
+// given an inode and byte offset, return a blk_num and byte offset in the block
+// blk_num 0 is a hole: the blk (or the indirect table above it) was never
+// written, and reads as zeros.
+int bmap(const struct in_core_inode* ci, const int off, int* ret_blk_num,
+	int* ret_off_blk)
+{
+	int logical_blk;
+	int blk_num;
+	int off_blk;
+	logical_blk = off / BLK_SZ;
+	off_blk = off % BLK_SZ;
+	char buf[BLK_SZ];
+	if (logical_blk < DIRECT_BLKS_PER_INODE)
+	{
+		blk_num = ci->block_addr[logical_blk];
+	}
+	else if (logical_blk < max_single)
+	{
+		blk_num = ci->single_ind_blk;
+		logical_blk -= DIRECT_BLKS_PER_INODE;
+		if (blk_num == 0)
+			goto bmap_out;
+		if (bread(blk_num, buf) == -1)
+		{
+			fprintf(stderr, "bread error when bmap blk#%d\n", blk_num);
+			return -1;
+		}
+		int *p = (int*)buf;
+		blk_num = p[logical_blk];
+	}
+	else if (logical_blk < max_double)
+	{
+		blk_num = ci->double_ind_blk;
+		if (blk_num == 0)
+			goto bmap_out;
+		if (bread(blk_num, buf) == -1)
+		{
+			fprintf(stderr, "bread error when bmap blk#%d\n", blk_num);
+			return -1;
+		}
+		int *p = (int*)buf;
+		logical_blk -= max_single;
+		int indirect_blk = logical_blk / RANGE_SINGLE;
+		int indirect_off = logical_blk % RANGE_SINGLE;
+		blk_num = p[indirect_blk];
+		if (blk_num == 0)
+			goto bmap_out;
+		if (bread(blk_num, buf) == -1)
+		{
+			fprintf(stderr, "bread error when bmap blk#%d\n", blk_num);
+			return -1;
+		}
+		p = (int*)buf;
+		blk_num = p[indirect_off];
+	}
+	else
+	{
+		fprintf(stderr, "logical blk num %d out of max range\n", logical_blk);
+		return -1;
+	}
+bmap_out:
+	*ret_blk_num = blk_num;
+	*ret_off_blk = off_blk;
+	return 0;
+}
+
+// fill the hole at block pointer *slot with a new blk. An indirect table
+// (table == 1) is zeroed on disk; a data blk is left to the caller's write.
+// returns 1 if a blk was allocated, 0 if *slot was mapped, -1 on error.
+static int hole_fill(int *slot, int table)
+{
+	char buf[BLK_SZ];
+	int blk_num;
+	if (*slot != 0)
+		return 0;
+	blk_num = balloc();
+	if (blk_num == -1)
+	{
+		fprintf(stderr, "balloc error when filling a hole\n");
+		return -1;
+	}
+	if (table)
+	{
+		memset(buf, 0, sizeof(buf));
+		if (bwrite_meta(blk_num, buf) == -1)
+		{
+			fprintf(stderr, "bwrite error blk# %d for an indirect table\n", blk_num);
+			return -1;
+		}
+	}
+	*slot = blk_num;
+	return 1;
+}
+
+// return entry idx of indirect table blk tbl, filling a hole with a new blk.
+// *fresh is set to 1 if the blk is new. returns -1 on error.
+static int ind_entry_alloc(int tbl, int idx, int table, int *fresh)
+{
+	char buf[BLK_SZ];
+	int res;
+	if (bread(tbl, buf) == -1)
+	{
+		fprintf(stderr, "bread error blk# %d in ind_entry_alloc\n", tbl);
+		return -1;
+	}
+	int *p = (int*)buf;
+	res = hole_fill(&p[idx], table);
+	if (res == -1)
+		return -1;
+	if (res == 1 && bwrite_meta(tbl, buf) == -1)
+	{
+		fprintf(stderr, "bwrite error blk# %d in ind_entry_alloc\n", tbl);
+		return -1;
+	}
+	*fresh = res;
+	return p[idx];
+}
+
+// bmap() for a write: a hole at off gets a data blk, and the indirect tables
+// above it, before it is mapped. *fresh is set to 1 if the data blk is new,
+// so the caller need not read it.
+static int bmap_alloc(struct in_core_inode *ci, int off, int *ret_blk_num,
+	int *ret_off_blk, int *fresh)
+{
+	int logical_blk = off / BLK_SZ;
+	int blk_num;
+	int tbl_fresh;
+	*fresh = 0;
+	ag_hint_inode(ci->i_num);
+	if (logical_blk < DIRECT_BLKS_PER_INODE)
+	{
+		*fresh = hole_fill(&ci->block_addr[logical_blk], 0);
+		blk_num = *fresh == -1 ? -1 : ci->block_addr[logical_blk];
+	}
+	else if (logical_blk < max_single)
+	{
+		if (hole_fill(&ci->single_ind_blk, 1) == -1)
+			return -1;
+		blk_num = ind_entry_alloc(ci->single_ind_blk,
+			logical_blk - DIRECT_BLKS_PER_INODE, 0, fresh);
+	}
+	else if (logical_blk < max_double)
+	{
+		logical_blk -= max_single;
+		if (hole_fill(&ci->double_ind_blk, 1) == -1)
+			return -1;
+		blk_num = ind_entry_alloc(ci->double_ind_blk,
+			logical_blk / RANGE_SINGLE, 1, &tbl_fresh);
+		if (blk_num == -1)
+			return -1;
+		blk_num = ind_entry_alloc(blk_num, logical_blk % RANGE_SINGLE, 0, fresh);
+	}
+	else
+	{
+		fprintf(stderr, "logical blk num %d out of max range\n", logical_blk);
+		return -1;
+	}
+	if (blk_num == -1)
+		return -1;
+	ci->modified = 1;
+	*ret_blk_num = blk_num;
+	*ret_off_blk = off % BLK_SZ;
+	return 0;
+}
+
+// returns 1 if the BLK_SZ bytes at buf are all zero.
+static int blk_is_zero(const char *buf)
+{
+	int i;
+#ifdef __SSE2__
+	// OR 64 bytes together per step, stop at the first non-zero step.
+	const __m128i *p = (const __m128i*)buf;
+	__m128i zero = _mm_setzero_si128();
+	for (i = 0; i < BLK_SZ / 16; i += 4)
+	{
+		__m128i acc = _mm_or_si128(
+			_mm_or_si128(_mm_loadu_si128(p + i), _mm_loadu_si128(p + i + 1)),
+			_mm_or_si128(_mm_loadu_si128(p + i + 2), _mm_loadu_si128(p + i + 3)));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xffff)
+			return 0;
+	}
+#else
+	const unsigned long *p = (const unsigned long*)buf;
+	for (i = 0; i < BLK_SZ / sizeof(unsigned long); i++)
+		if (p[i] != 0)
+			return 0;
+#endif
+	return 1;
+}
+
+// turn logical blk lblk of ci back into a hole, freeing its data blk.
+// The indirect tables stay until truncate or ifree releases them.
+static int bmap_punch(struct in_core_inode *ci, int lblk)
+{
+	char buf[BLK_SZ];
+	int tbl;
+	int idx;
+	int blk_num;
+	if (lblk < DIRECT_BLKS_PER_INODE)
+	{
+		blk_num = ci->block_addr[lblk];
+		if (blk_num != 0 && bfree(blk_num) == -1)
+			return -1;
+		ci->block_addr[lblk] = 0;
+		ci->modified = 1;
+		return 0;
+	}
+	if (lblk < max_single)
+	{
+		tbl = ci->single_ind_blk;
+		idx = lblk - DIRECT_BLKS_PER_INODE;
+	}
+	else
+	{
+		if (ci->double_ind_blk == 0)
+			return 0;
+		if (bread(ci->double_ind_blk, buf) == -1)
+			return -1;
+		lblk -= max_single;
+		tbl = ((int*)buf)[lblk / RANGE_SINGLE];
+		idx = lblk % RANGE_SINGLE;
+	}
+	if (tbl == 0)
+		return 0;
+	if (bread(tbl, buf) == -1)
+		return -1;
+	blk_num = ((int*)buf)[idx];
+	if (blk_num == 0)
+		return 0;
+	((int*)buf)[idx] = 0;
+	if (bwrite_meta(tbl, buf) == -1 || bfree(blk_num) == -1)
+	{
+		fprintf(stderr, "error punching blk# %d from table blk# %d\n", blk_num, tbl);
+		return -1;
+	}
+	return 0;
+}
+
+// the first logical blk after hole lblk that may be mapped. Skips the rest of
+// an indirect table that was never allocated.
+static int bmap_hole_end(const struct in_core_inode *ci, int lblk)
+{
+	char buf[BLK_SZ];
+	if (lblk < DIRECT_BLKS_PER_INODE)
+		return lblk + 1;
+	if (lblk < max_single)
+		return ci->single_ind_blk == 0 ? max_single : lblk + 1;
+	if (ci->double_ind_blk == 0)
+		return max_double;
+	if (bread(ci->double_ind_blk, buf) == -1)
+		return lblk + 1;
+	int rel = lblk - max_single;
+	if (((int*)buf)[rel / RANGE_SINGLE] == 0)
+		return max_single + (rel / RANGE_SINGLE + 1) * RANGE_SINGLE;
+	return lblk + 1;
+}
+
+struct in_core_inode* iget(int i_num)
+{
+	pthread_mutex_lock(&VOL->itable_lock);
+	struct in_core_inode *ci = ifind(i_num);
+	if (ci != NULL)
+	{
+		if (ci->link_count == 0)
+			ci = NULL;  // being freed by its last iput().
+		else
+		{
+			if (ci->ref_count == 0)
+				ifree_list_remove(ci);
+			ci->ref_count++;
+		}
+		pthread_mutex_unlock(&VOL->itable_lock);
+		return ci;
+	}
+	int iblk = i_num / INODES_PER_BLK;
+	int offset = i_num % INODES_PER_BLK;
+	pthread_mutex_lock(&VOL->iblk_lock);
+	char *buf = iblk_read(iblk);
+	if (buf == NULL)
+		fprintf(stderr, "error: bread inode blk %d when iget\n", iblk);
+	else
+	{
+		ci = itable_alloc(i_num);
+		if (ci != NULL)
+		{
+			init_inode_from_disk(ci, (struct disk_inode*)buf + offset, i_num);
+			seq_write_end(&ci->seq);
+		}
+	}
+	pthread_mutex_unlock(&VOL->iblk_lock);
+	pthread_mutex_unlock(&VOL->itable_lock);
+	return ci;
+}
+
+int iget_batch(const int *i_nums, int n, struct in_core_inode **out)
+{
+	int i;
+	if (iprefetch(i_nums, n) == -1)
+		return -1;
+	for (i = 0; i < n; i++)
+	{
+		out[i] = iget(i_nums[i]);
+		if (out[i] == NULL)
+		{
+			fprintf(stderr, "iget error inode#%d in iget_batch\n", i_nums[i]);
+			while (--i >= 0)
+				iput(out[i]);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int free_disk_blocks(struct in_core_inode* ci)
+{
+	int i;
+	int blk_num;
+	if (INODE_IS_INLINE(ci))
+	{ // no blks, the block map holds the data.
+		memset(INODE_INLINE_DATA(ci), 0, INLINE_DATA_LEN);
+		return 0;
+	}
+	// free direct blocks
+#if _DEBUG
+	printf("free direct blocks\n");
+#endif
+	for (i = 0; i < DIRECT_BLKS_PER_INODE; i++)
+	{
+		blk_num = ci->block_addr[i];
+		if (blk_num == 0)
+			continue;
+		if (bfree(blk_num) == -1)
+		{
+			fprintf(stderr, "bfree error when free disk blk#%d\n", blk_num);
+			return -1;
+		}
+		ci->block_addr[i] = 0;
+	}
+
+	// free single indirect blks
+	if (ci->blks_in_use <= DIRECT_BLKS_PER_INODE)
+		goto finish_free_disk_blks;
+#if _DEBUG
+	printf("free single indirect blocks\n");
+#endif
+	blk_num = ci->single_ind_blk;
+	if (blk_num == 0) // doesn't in use.
+		goto free_double_indirect;
+	char buf[BLK_SZ];
+	if (bread(blk_num, buf) == -1)
+	{
+		fprintf(stderr, "bread error blk#%d when free single indirect\n", blk_num);
+		return -1;
+	}
+	int *p = (int*)buf;
+	for (i = 0; i < RANGE_SINGLE; i++)
+	{
+		blk_num = p[i];
+		if (blk_num == 0)
+			continue;
+		if (bfree(blk_num) == -1)
+		{
+			fprintf(stderr, "bfree error when free disk blk#%d\n", blk_num);
+			return -1;
+		}
+	}
+	// TODO: fatal error, no update to the disk!!!
+	blk_num = ci->single_ind_blk;
+	if (bfree(blk_num) == -1)
+	{
+		fprintf(stderr, "bfree error blk#%d when free single indirect\n", blk_num);
+		return -1;
+	}
+	ci->single_ind_blk = 0;
+
+	// free double indirect blks
+	if (ci->blks_in_use <= max_single)
+		goto finish_free_disk_blks;
+free_double_indirect:
+#if _DEBUG
+	printf("free double indirect blocks\n");
+#endif
+	blk_num = ci->double_ind_blk;
+	if (blk_num == 0) // doesn't in use.
+		return 0;
+	if (bread(blk_num, buf) == -1)
+	{
+		fprintf(stderr, "bread error blk#%d when free single indirect\n", blk_num);
+		return -1;
+	}
+	p = (int*)buf;
+	for (i = 0; i < RANGE_SINGLE; i++)
+	{
+		blk_num = p[i];
+		if (blk_num == 0)
+			continue;
+		char buf2[BLK_SZ];
+		if (bread(blk_num, buf2) == -1)
+		{
+			fprintf(stderr, "bread error blk#%d when free double indirect\n", blk_num);
+			return -1;
+		}
+		int *q = (int*)buf2;
+		int j;
+		for (j = 0; j < RANGE_SINGLE; j++)
+		{
+			if (q[j] == 0)
+				continue;
+			if (bfree(q[j]) == -1)
+			{
+				fprintf(stderr, "bfree error blk# %d when free single indirect in double indirect\n", q[j]);
+				return -1;
+			}
+		}
+		if (bfree(p[i]) == -1)
+		{
+			fprintf(stderr, "bfree error blk# %d for single indirect blk table in double indirect\n", p[i]);
+			return -1;
+		}
+	}
+	blk_num = ci->double_ind_blk;
+	if (bfree(blk_num) == -1)
+	{
+		fprintf(stderr, "bfree error blk#%d when free single indirect\n", blk_num);
+		return -1;
+	}
+	ci->double_ind_blk = 0;
+finish_free_disk_blks:
+	return 0;
+}
+
+static int free_blks_for_truncate(struct in_core_inode *ci, int new_blks_in_use);
+static int alloc_blks_for_truncate(struct in_core_inode *ci, int new_blks_in_use);
+static int reclaim_queue(struct in_core_inode *ci);
+
+void set_atime_opts(enum atime_mode mode, int lazy)
+{
+	VOL->atime_mode = mode;
+	VOL->atime_lazy = lazy;
+}
+
+// a read of ci: update its access time as the atime mode asks.
+// readers only hold ci shared, so the stores race; they all store the
+// same kind of value, and the last one wins.
+static void touch_atime(struct in_core_inode *ci)
+{
+	int now = get_time();
+	int last = __atomic_load_n(&ci->last_accessed, __ATOMIC_RELAXED);
+	if (VOL->atime_mode == ATIME_NOATIME)
+		return;
+	if (VOL->atime_mode == ATIME_RELATIME
+	  && last > __atomic_load_n(&ci->last_modified, __ATOMIC_RELAXED)
+	  && last > __atomic_load_n(&ci->inode_last_mod, __ATOMIC_RELAXED)
+	  && now - last < RELATIME_MAX_AGE)
+		return;
+	__atomic_store_n(&ci->last_accessed, now, __ATOMIC_RELAXED);
+	if (VOL->atime_lazy)
+		__atomic_store_n(&ci->atime_dirty, 1, __ATOMIC_RELAXED);
+	else
+		__atomic_store_n(&ci->modified, 1, __ATOMIC_RELAXED);
+}
+
+// a write's update of the times. touch_atime() reads them under a shared
+// rwlock, without map_lock.
+static void touch_mtime(struct in_core_inode *ci)
+{
+	int now = get_time();
+	__atomic_store_n(&ci->last_modified, now, __ATOMIC_RELAXED);
+	__atomic_store_n(&ci->inode_last_mod, now, __ATOMIC_RELAXED);
+	__atomic_store_n(&ci->modified, 1, __ATOMIC_RELAXED);
+}
+
+// copy a modified in-core inode to its in-core inode blk.
+// called with itable_lock held.
+static int iwrite_back(struct in_core_inode* ci)
+{
+	int i_num = ci->i_num;
+	int iblk = i_num / INODES_PER_BLK;
+	int offset = i_num % INODES_PER_BLK;
+	if (ci->modified == 0 && ci->atime_dirty == 0)
+		return 0;
+	pthread_mutex_lock(&VOL->iblk_lock);
+	char *buf = iblk_read(iblk);
+	if (buf == NULL)
+	{
+		pthread_mutex_unlock(&VOL->iblk_lock);
+		fprintf(stderr, "bread error inode blk %d when iput\n", iblk);
+		return -1;
+	}
+	struct disk_inode* di = (struct disk_inode*)buf + offset;
+	if (ci->modified == 1) // update disk inode from in-core inode
+	{
+		// only the inode in question is updated in the in-core inode blk,
+		// the other inodes in it are left unmodified.
+		init_inode_from_kernel(di, ci);
+		iblk_write(iblk);
+	}
+	else // lazytime: only the access time changed.
+	{
+		di->last_accessed = ci->last_accessed;
+		iblk_write_lazy(iblk);
+	}
+	pthread_mutex_unlock(&VOL->iblk_lock);
+	ci->modified = 0;
+	ci->atime_dirty = 0;
+	return 0;
+}
+
+// release an inode
+int iput(struct in_core_inode* ci)
+{
+	if (ci == NULL)
+	{
+		fprintf(stderr, "ci is null pointer\n");
+		return -1;
+	}
+	pthread_mutex_lock(&VOL->itable_lock);
+	if (ci->ref_count <= 0)
+	{
+		pthread_mutex_unlock(&VOL->itable_lock);
+		fprintf(stderr, "error: iput inode#%d without reference\n", ci->i_num);
+		return -1;
+	}
+	if (ci->ref_count > 1)
+	{
+		ci->ref_count--;
+		pthread_mutex_unlock(&VOL->itable_lock);
+		return 0;
+	}
+	// the last reference
+	if (ci->link_count == 0)
+	{
+		// the reference is kept until ifree(), so the slot is not reused
+		// while the blks are freed. iget() no longer hands the inode out.
+		pthread_mutex_unlock(&VOL->itable_lock);
+		// a large file is left an orphan, freed later by reclaim_pending().
+		if (ci->blks_in_use > RECLAIM_MIN_BLKS && reclaim_queue(ci) == 0)
+			return 0;
+		journal_start(0);
+		if (free_disk_blocks(ci) == -1)
+		{
+			journal_stop(0);
+			fprintf(stderr, "error truncate all disk blocks in iput\n");
+			return -1;
+		}
+		// free inode, and the in-core inode with it.
+		if (ifree(ci) == -1)
+		{
+			journal_stop(0);
+			fprintf(stderr, "error: ifree when iput\n");
+			return -1;
+		}
+		journal_stop(0);
+		return 0;
+	}
+	int res = iwrite_back(ci);
+	// inactive, but kept in the inode table for the next iget().
+	ci->ref_count = 0;
+	ifree_list_add(ci, 0);
+	pthread_mutex_unlock(&VOL->itable_lock);
+	return res;
+}
+
+/* Unlinking a large file does not wait for its blks to be freed. Its last
+ * iput() writes the inode back with link_count 0, which marks it an orphan
+ * on disk, and leaves its reference in the reclaim queue. The background
+ * pass frees the blks with reclaim_pending(), RECLAIM_BATCH of them per
+ * transaction from the end of the file, and the inode last. A crash in
+ * between leaves a smaller orphan, which the next mount finds in the inode
+ * table and queues again, see orphan_scan(). */
+
+// returns 0 if ci, on its last reference with link_count 0, is queued, -1
+// if the queue is full and the caller frees it.
+static int reclaim_queue(struct in_core_inode *ci)
+{
+	int res = -1;
+	// first to disk, with the unlink that made it an orphan.
+	ci->modified = 1;
+	pthread_mutex_lock(&VOL->itable_lock);
+	int written = iwrite_back(ci);
+	pthread_mutex_unlock(&VOL->itable_lock);
+	if (written == -1)
+		return -1;
+	pthread_mutex_lock(&VOL->reclaim_lock);
+	if (VOL->nr_reclaim_queued < RECLAIM_QUEUE_SZ)
+	{
+		VOL->reclaim_queue[VOL->nr_reclaim_queued++] = ci;
+		res = 0;
+	}
+	pthread_mutex_unlock(&VOL->reclaim_lock);
+	return res;
+}
+
+// free the blks of ci past keep_blks, RECLAIM_BATCH of them per transaction
+// from the end of the file, until at most RECLAIM_BATCH are left: the file
+// is cut a batch at a time, and so is what a crash leaves. returns with a
+// transaction started, -1 on error.
+static int free_blks_in_batches(struct in_core_inode *ci, int keep_blks)
+{
+	int res = 0;
+	for (;;)
+	{
+		journal_start(1);
+		ilock(ci, 1);
+		if (ci->blks_in_use - keep_blks <= RECLAIM_BATCH)
+			break;
+		int n = ci->blks_in_use - RECLAIM_BATCH;
+		res = free_blks_for_truncate(ci, n);
+		ci->blks_in_use = n;
+		if (ci->file_size > n * BLK_SZ)
+			ci->file_size = n * BLK_SZ;
+		ci->modified = 1;
+		iunlock(ci);
+		pthread_mutex_lock(&VOL->itable_lock);
+		if (res == 0)
+			res = iwrite_back(ci);
+		pthread_mutex_unlock(&VOL->itable_lock);
+		if (res == -1)
+			return -1;
+		journal_stop(1);
+	}
+	iunlock(ci);
+	return 0;
+}
+
+// free the blks of orphan ci a batch at a time, then ci itself.
+static int reclaim(struct in_core_inode *ci)
+{
+	int res = free_blks_in_batches(ci, 0);
+	if (res == 0)
+	{
+		ilock(ci, 1);
+		res = free_disk_blocks(ci);
+		iunlock(ci);
+	}
+	if (res == 0 && ifree(ci) == -1)
+		res = -1;
+	journal_stop(1);
+	if (res == -1)
+		fprintf(stderr, "error: reclaim of orphan i_num %d\n", ci->i_num);
+	return res;
+}
+
+int reclaim_pending(int max_inodes)
+{
+	int done = 0;
+	while (done < max_inodes)
+	{
+		struct in_core_inode *ci = NULL;
+		pthread_mutex_lock(&VOL->reclaim_lock);
+		if (VOL->nr_reclaim_queued > 0)
+			ci = VOL->reclaim_queue[--VOL->nr_reclaim_queued];
+		pthread_mutex_unlock(&VOL->reclaim_lock);
+		if (ci == NULL)
+			break;
+		if (reclaim(ci) == -1)
+			return -1;
+		done++;
+	}
+	return done;
+}
+
+// queue the orphans a crash left behind, or free them if the queue is
+// full. the inode table is in core, so the scan costs no I/O.
+static int orphan_scan(void)
+{
+	int i_num;
+	for (i_num = 0; i_num < VOL->nr_iblks * INODES_PER_BLK; i_num++)
+	{
+		struct disk_inode *di = (struct disk_inode*)VOL->iblk_cache[i_num / INODES_PER_BLK]
+		  + i_num % INODES_PER_BLK;
+		if (di->file_type == UNUSED || di->link_count != 0)
+			continue;
+		struct in_core_inode *ci = iget(i_num);
+		if (ci == NULL)
+			return -1;
+		if (reclaim_queue(ci) == -1 && reclaim(ci) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+// per-inode lock: shared to read a file or search a dir, exclusive to
+// change the data, block map or dir entries of the inode.
+// an exclusive holder keeps the seqcount odd, see getattr_v2().
+void ilock(struct in_core_inode* ci, int excl)
+{
+	if (excl)
+	{
+		pthread_rwlock_wrlock(&ci->rwlock);
+		ci->excl = 1;
+		seq_write_begin(&ci->seq);
+	}
+	else
+		pthread_rwlock_rdlock(&ci->rwlock);
+}
+
+void iunlock(struct in_core_inode* ci)
+{
+	// the changes of the op go to the inode blk as it ends, not with the last
+	// reference: a dir held open by a listing is still in the next commit.
+	// shared holders change the block map and size under map_lock.
+	if (__atomic_load_n(&ci->modified, __ATOMIC_RELAXED))
+	{
+		if (!ci->excl)
+			pthread_mutex_lock(&ci->map_lock);
+		pthread_mutex_lock(&VOL->itable_lock);
+		if (iwrite_back(ci) == -1)
+			fprintf(stderr, "error: write back of inode %d at the end of an op\n", ci->i_num);
+		pthread_mutex_unlock(&VOL->itable_lock);
+		if (!ci->excl)
+			pthread_mutex_unlock(&ci->map_lock);
+	}
+	if (ci->excl)
+	{ // only set while no shared holder exists.
+		ci->excl = 0;
+		seq_write_end(&ci->seq);
+	}
+	pthread_rwlock_unlock(&ci->rwlock);
+}
+
+// iunlock() and iput(), for the calls that release ci when they return.
+static int iunlock_put(struct in_core_inode* ci)
+{
+	iunlock(ci);
+	return iput(ci);
+}
+
+/* byte-range locks. read_v2 and write_v2 hold the inode rwlock shared and
+ * lock just the blks they touch, so reads and writes of disjoint parts of a
+ * file run in parallel; overlapping ones wait, a read only for a write. The
+ * ranges are rounded out to whole blks, since a partial blk write rewrites
+ * the whole blk. The held ranges hang off the inode, on the caller's stack,
+ * and waiters sleep on one of RANGE_LOCK_HASH_SZ queues picked by inode. */
+struct range_lock {
+	int start;    // first byte, blk aligned
+	int end;      // byte after the last, blk aligned
+	int excl;     // 1: a write
+	struct range_lock *next;
+};
+
+static struct range_wait {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} range_waits[RANGE_LOCK_HASH_SZ] = {
+	[0 ... RANGE_LOCK_HASH_SZ - 1] = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER },
+};
+
+static struct range_wait *range_wait_of(const struct in_core_inode *ci)
+{
+	return &range_waits[((unsigned long)ci / sizeof(*ci)) % RANGE_LOCK_HASH_SZ];
+}
+
+static int range_conflict(const struct in_core_inode *ci, const struct range_lock *rl)
+{
+	const struct range_lock *r;
+	for (r = ci->ranges; r != NULL; r = r->next)
+		if (r->start < rl->end && rl->start < r->end && (r->excl || rl->excl))
+			return 1;
+	return 0;
+}
+
+static void range_lock(struct in_core_inode *ci, struct range_lock *rl, int off, int len, int excl)
+{
+	struct range_wait *w = range_wait_of(ci);
+	rl->start = off / BLK_SZ * BLK_SZ;
+	rl->end = (off + len + BLK_SZ - 1) / BLK_SZ * BLK_SZ;
+	rl->excl = excl;
+	pthread_mutex_lock(&w->lock);
+	while (range_conflict(ci, rl))
+		pthread_cond_wait(&w->cond, &w->lock);
+	rl->next = ci->ranges;
+	ci->ranges = rl;
+	pthread_mutex_unlock(&w->lock);
+}
+
+static void range_unlock(struct in_core_inode *ci, struct range_lock *rl)
+{
+	struct range_wait *w = range_wait_of(ci);
+	struct range_lock **pp;
+	pthread_mutex_lock(&w->lock);
+	for (pp = &ci->ranges; *pp != rl; pp = &(*pp)->next)
+		;
+	*pp = rl->next;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+}
+
+// change the block map or the size of ci under a shared rwlock. a reader of
+// the map holds map_lock alone, a writer also makes the seqcount odd.
+static void imap_begin(struct in_core_inode *ci)
+{
+	pthread_mutex_lock(&ci->map_lock);
+	seq_write_begin(&ci->seq);
+}
+
+static void imap_end(struct in_core_inode *ci)
+{
+	seq_write_end(&ci->seq);
+	pthread_mutex_unlock(&ci->map_lock);
+}
+
+void dump_in_core_inode(struct in_core_inode* ci)
+{
+	printf("\n\ndumping in-core inode\n\n");
+	printf("file_type = %d\n", ci->file_type);
+	printf("owner = %s\n", ci->owner_id);
+	printf("access_permission = %d\n", ci->access_permission);
+	printf("last_accessed = %d\n", ci->last_accessed);
+	printf("last_modified = %d\n", ci->last_modified);
+	printf("inode_last_mod = %d\n", ci->inode_last_mod);
+	printf("link_count = %d\n", ci->link_count);
+	printf("file_size = %d\n", ci->file_size);
+	printf("blks_in_use = %d\n", ci->blks_in_use);
+	printf("direct block addr = \n");
+	int i;
+	for (i = 0; i < DIRECT_BLKS_PER_INODE; i++)
+	{
+		printf("%d ", ci->block_addr[i]);
+	}
+	printf("\nindirect single blk# = %d, indirect double blk# = %d\n",
+		ci->single_ind_blk, ci->double_ind_blk);
+	printf("i_num = %d\n", ci->i_num);
+}
+
+/************************* Layer 1: directory blocks ***************************/
+
+// FNV-1a hash of a file name, kept in the dir block header.
+static unsigned int dir_name_hash(const char *name, int len)
+{
+	unsigned int h = 2166136261u;
+	int i;
+	for (i = 0; i < len; i++)
+	{
+		h ^= (unsigned char)name[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+// an empty dir block: all slots unused.
+static void dir_block_init(struct dir_block *db)
+{
+	int i;
+	memset(db, 0, sizeof(struct dir_block));
+	for (i = 0; i < DIR_ENTRIES_PER_BLK; i++)
+		db->inode_num[i] = EMPTY_I_NUM;
+}
+
+// put the entry (name, i_num) into an unused slot of a dir block
+static void dir_block_set(struct dir_block *db, int slot, const char *name,
+	int i_num, int file_type)
+{
+	int len = strlen(name);
+	strncpy(db->file_name[slot], name, FILE_NAME_LEN);
+	db->name_len[slot] = len;
+	db->name_hash[slot] = dir_name_hash(name, len);
+	db->inode_num[slot] = i_num;
+	db->file_type[slot] = file_type;
+	db->nr_used += 1;
+}
+
+static void dir_block_clear(struct dir_block *db, int slot)
+{
+	db->inode_num[slot] = EMPTY_I_NUM;
+	db->nr_used -= 1;
+}
+
+// returns the slot of name in a dir block, -1 if it is not there.
+// Hashes are compared 4 slots at a time, names only on a hash hit.
+static int dir_block_lookup(const struct dir_block *db, const char *name,
+	int len, unsigned int hash)
+{
+	int i;
+#ifdef __SSE2__
+	__m128i key = _mm_set1_epi32((int)hash);
+	for (i = 0; i < DIR_ENTRIES_PER_BLK; i += 4)
+	{
+		__m128i h = _mm_loadu_si128((const __m128i*)&db->name_hash[i]);
+		int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(h, key)));
+		while (mask)
+		{
+			int j = i + __builtin_ctz(mask);
+			mask &= mask - 1;
+			if (db->inode_num[j] != EMPTY_I_NUM && db->name_len[j] == len
+			  && memcmp(db->file_name[j], name, len) == 0)
+				return j;
+		}
+	}
+#else
+	for (i = 0; i < DIR_ENTRIES_PER_BLK; i++)
+	{
+		if (db->name_hash[i] != hash || db->inode_num[i] == EMPTY_I_NUM)
+			continue;
+		if (db->name_len[i] == len && memcmp(db->file_name[i], name, len) == 0)
+			return i;
+	}
+#endif
+	return -1;
+}
+
+static int dir_hint_free_lblk(const struct in_core_inode *ci);
+static void dir_hint_update(const struct in_core_inode *ci, int lblk, int full);
+
+// where a dir entry lives: logical dir blk, disk blk and slot
+struct dir_pos {
+	int lblk;
+	int blk_num;
+	int slot;
+};
+
+// read the logical dir block lblk of directory ci
+static int dir_bread(const struct in_core_inode *ci, int lblk, int *ret_blk_num,
+	struct dir_block *db)
+{
+	int blk_num;
+	int offset_blk;
+	if (bmap(ci, lblk * BLK_SZ, &blk_num, &offset_blk) == -1)
+	{
+		fprintf(stderr, "bmap error for dir blk %d of i_num %d\n", lblk, ci->i_num);
+		return -1;
+	}
+	if (bread(blk_num, (char*)db) == -1)
+	{
+		fprintf(stderr, "bread error blk# %d of dir i_num %d\n", blk_num, ci->i_num);
+		return -1;
+	}
+	if (ret_blk_num != NULL)
+		*ret_blk_num = blk_num;
+	return 0;
+}
+
+// look name up in directory ci. Returns its i_num, -ENOENT if not found or
+// -EIO. db is left holding the dir block of the entry, whose position is
+// stored in pos (may be NULL).
+static int dir_lookup(const struct in_core_inode *ci, const char *name,
+	struct dir_block *db, struct dir_pos *pos)
+{
+	int len = strlen(name);
+	unsigned int hash = dir_name_hash(name, len);
+	int lblk;
+	int blk_num;
+	int slot;
+	for (lblk = 0; lblk < ci->blks_in_use; lblk++)
+	{
+		if (dir_bread(ci, lblk, &blk_num, db) == -1)
+			return -EIO;
+		if (db->nr_used == 0)
+			continue;
+		slot = dir_block_lookup(db, name, len, hash);
+		if (slot == -1)
+			continue;
+		if (pos != NULL)
+		{
+			pos->lblk = lblk;
+			pos->blk_num = blk_num;
+			pos->slot = slot;
+		}
+		return db->inode_num[slot];
+	}
+	return -ENOENT;
+}
+
+// add one more dir block to the end of directory ci, through the regular
+// blk allocation path. db is set up as the new (empty) dir block.
+static int dir_grow(struct in_core_inode *ci, struct dir_block *db, struct dir_pos *pos)
+{
+	int new_blks_in_use = ci->blks_in_use + 1;
+	int offset_blk;
+	if (new_blks_in_use > MAX_DIR_BLKS)
+	{
+		fprintf(stderr, "error: dir i_num %d has reached max size\n", ci->i_num);
+		return -ENOSPC;
+	}
+	if (alloc_blks_for_truncate(ci, new_blks_in_use) != 0)
+	{
+		fprintf(stderr, "alloc blks error when growing dir i_num %d\n", ci->i_num);
+		return -ENOSPC;
+	}
+	ci->blks_in_use = new_blks_in_use;
+	ci->file_size = new_blks_in_use * BLK_SZ;
+	ci->modified = 1;
+	pos->lblk = new_blks_in_use - 1;
+	pos->slot = 0;
+	if (bmap(ci, pos->lblk * BLK_SZ, &pos->blk_num, &offset_blk) == -1)
+	{
+		fprintf(stderr, "bmap error when growing dir i_num %d\n", ci->i_num);
+		return -EIO;
+	}
+	dir_block_init(db);
+	if (bwrite_meta(pos->blk_num, (char*)db) == -1)
+	{
+		fprintf(stderr, "bwrite error blk# %d when growing dir\n", pos->blk_num);
+		return -EIO;
+	}
+	return 0;
+}
+
+// find an unused slot in directory ci, growing the directory if it is full.
+// The search starts from the dir's free-slot hint. db is left holding the dir
+// block of the slot, whose position is in pos.
+static int dir_find_free(struct in_core_inode *ci, struct dir_block *db,
+	struct dir_pos *pos)
+{
+	int lblk;
+	int slot;
+	for (lblk = dir_hint_free_lblk(ci); lblk < ci->blks_in_use; lblk++)
+	{
+		if (dir_bread(ci, lblk, &pos->blk_num, db) == -1)
+			return -EIO;
+		if (db->nr_used == DIR_ENTRIES_PER_BLK)
+		{
+			dir_hint_update(ci, lblk, 1);
+			continue;
+		}
+		for (slot = 0; slot < DIR_ENTRIES_PER_BLK; slot++)
+		{
+			if (db->inode_num[slot] == EMPTY_I_NUM)
+			{
+				pos->lblk = lblk;
+				pos->slot = slot;
+				return 0;
+			}
+		}
+	}
+	return dir_grow(ci, db, pos);
+}
+
+// give the empty dir blks at the end of directory ci back to the free list.
+// The first dir blk ("." and "..") is always kept.
+static int dir_shrink(struct in_core_inode *ci)
+{
+	struct dir_block db;
+	int new_blks_in_use = ci->blks_in_use;
+	while (new_blks_in_use > 1)
+	{
+		if (dir_bread(ci, new_blks_in_use - 1, NULL, &db) == -1)
+			return -EIO;
+		if (db.nr_used != 0)
+			break;
+		new_blks_in_use--;
+	}
+	if (new_blks_in_use == ci->blks_in_use)
+		return 0;
+	if (free_blks_for_truncate(ci, new_blks_in_use) != 0)
+	{
+		fprintf(stderr, "free blks error when shrinking dir i_num %d\n", ci->i_num);
+		return -EIO;
+	}
+	ci->blks_in_use = new_blks_in_use;
+	ci->file_size = new_blks_in_use * BLK_SZ;
+	ci->modified = 1;
+	return 0;
+}
+
+/************************* Layer 1: directory free-slot hints *****************/
+
+// in-core hint of where a directory has room, so an insert can skip the dir
+// blks known to be full. Hints live in a small table indexed by i_num, see
+// struct dir_hint; losing one only costs a scan from the first dir blk.
+
+void init_dir_hints(void)
+{
+	int i;
+	for (i = 0; i < DIR_HINT_SZ; i++)
+	{
+		VOL->dir_hints[i].i_num = -1;
+		VOL->dir_hints[i].free_lblk = 0;
+		VOL->dir_hints[i].nr_holes = 0;
+		VOL->dir_hints[i].queued = 0;
+	}
+	VOL->nr_compact_queued = 0;
+	for (i = 0; i < DIR_LISTING_SZ; i++)
+	{
+		VOL->dir_listings[i].i_num = -1;
+		VOL->dir_listings[i].nr = 0;
+	}
+}
+
+// the hint for dir i_num, taking over the table entry if it belongs to
+// another dir. called with dir_hint_lock held.
+static struct dir_hint* dir_hint_get(int i_num)
+{
+	struct dir_hint *h = &VOL->dir_hints[i_num % DIR_HINT_SZ];
+	if (h->i_num != i_num && !h->queued)
+	{
+		h->i_num = i_num;
+		h->free_lblk = 0;
+		h->nr_holes = 0;
+	}
+	return h->i_num == i_num ? h : NULL;
+}
+
+// first dir blk of ci that may have an unused slot
+static int dir_hint_free_lblk(const struct in_core_inode *ci)
+{
+	int lblk = 0;
+	pthread_mutex_lock(&VOL->dir_hint_lock);
+	struct dir_hint *h = dir_hint_get(ci->i_num);
+	if (h != NULL && h->free_lblk <= ci->blks_in_use)
+		lblk = h->free_lblk;
+	pthread_mutex_unlock(&VOL->dir_hint_lock);
+	return lblk;
+}
+
+// dir blk lblk of ci has no unused slot before (full = 1) or after (full = 0)
+// this call.
+static void dir_hint_update(const struct in_core_inode *ci, int lblk, int full)
+{
+	pthread_mutex_lock(&VOL->dir_hint_lock);
+	struct dir_hint *h = dir_hint_get(ci->i_num);
+	if (h != NULL && full && h->free_lblk == lblk)
+		h->free_lblk = lblk + 1;
+	else if (h != NULL && !full && lblk < h->free_lblk)
+		h->free_lblk = lblk;
+	pthread_mutex_unlock(&VOL->dir_hint_lock);
+}
+
+// i_num is a new directory: drop whatever was known about a previous user
+// of the i_num.
+static void dir_hint_forget(int i_num)
+{
+	pthread_mutex_lock(&VOL->dir_hint_lock);
+	struct dir_hint *h = &VOL->dir_hints[i_num % DIR_HINT_SZ];
+	if (h->i_num == i_num)
+	{
+		h->free_lblk = 0;
+		h->nr_holes = 0;
+	}
+	pthread_mutex_unlock(&VOL->dir_hint_lock);
+}
+
+// queue the dir of h for compaction if enough holes have piled up. ci: the
+// dir, NULL if not at hand, then dir_compact() finds out if it has a blk to
+// give back. called with dir_hint_lock held.
+static void dir_hint_queue(struct dir_hint *h, const struct in_core_inode *ci)
+{
+	if (h->nr_holes >= DIR_COMPACT_HOLES && !h->queued && (ci == NULL || ci->blks_in_use > 1)
+	  && VOL->nr_compact_queued < DIR_COMPACT_QUEUE_SZ)
+	{
+		h->queued = 1;
+		VOL->dir_compact_queue[VOL->nr_compact_queued++] = h->i_num;
+	}
+}
+
+// a slot of dir ci was freed by unlink: queue ci for compaction once enough
+// holes have piled up.
+static void dir_hint_hole(const struct in_core_inode *ci, int lblk)
+{
+	pthread_mutex_lock(&VOL->dir_hint_lock);
+	struct dir_hint *h = dir_hint_get(ci->i_num);
+	if (h != NULL)
+	{
+		if (lblk < h->free_lblk)
+			h->free_lblk = lblk;
+		h->nr_holes += 1;
+		dir_hint_queue(h, ci);
+	}
+	pthread_mutex_unlock(&VOL->dir_hint_lock);
+}
+
+/************************* Layer 1: make fs ***********************************/
+// the in-core superblk, kept for the life of the volume: a mkfs or
+// remount of a volume that has one reuses it.
+static struct super_block* superblk_get(void)
+{
+	if (VOL->super == NULL)
+		VOL->super = (struct super_block*)malloc(sizeof(struct super_block));
+	if (VOL->super == NULL)
+		fprintf(stderr, "create superblk error: no memory\n");
+	return VOL->super;
+}
+
+static int create_superblk(void)
+{
+	if (superblk_get() == NULL)
+		return -1;
+	memset(VOL->super, 0, sizeof(struct super_block));
+        VOL->super->magic = SUPER_MAGIC;
+        VOL->super->version = FS_VERSION;
+        VOL->super->blk_size = BLK_SZ;
+        VOL->super->num_blks = NUM_BLKS;
+        VOL->super->fs_size = (long)(VOL->super->blk_size) * (long)(VOL->super->num_blks);
+        /* journal, after the inode blks */
+        VOL->super->journal_blk = ILIST_SPACE + 1;
+        VOL->super->journal_blks = JOURNAL_BLKS;
+        VOL->super->state = FS_DIRTY;
+        /* disk blocks */
+        VOL->super->data_blk_offset = ILIST_SPACE + 1 + JOURNAL_BLKS;
+        /* allocation groups, each starting with its header blk */
+        VOL->super->nr_ags = NR_AGS;
+        VOL->super->ag_blks = (NUM_BLKS - VOL->super->data_blk_offset) / NR_AGS;
+        VOL->super->max_free_blks = VOL->super->num_free_blks = NUM_BLKS - VOL->super->data_blk_offset - NR_AGS;
+        /* inodes */
+        VOL->super->max_free_inodes = VOL->super->num_free_inodes = INODES_PER_BLK * ILIST_SPACE;
+        VOL->super->nr_iblks = ILIST_SPACE;
+        memset(VOL->super->imap_blks, 0, sizeof(VOL->super->imap_blks));
+/*
+        super->modified = 0;
+        super->locked = 0;
+*/
+
+        return 0;
+}
+
+static int read_superblk(void)
+{
+	int blk_num = 0;
+	char buf[BLK_SZ];
+	memset(buf, 0, sizeof(buf));
+	if (bread(blk_num, buf) == -1)
+	{
+		fprintf(stderr, "bread error in read_superblk\n");
+		return -1;
+	}
+	if (superblk_get() == NULL)
+		return -1;
+	memcpy(VOL->super, buf, sizeof(struct super_block));
+	// the layout is not compatible across versions: refuse to touch a fs
+	// this code cannot read, rather than take it apart.
+	if (VOL->super->magic != SUPER_MAGIC)
+	{
+		fprintf(stderr, "no monsterfs found, or made before format versions: run rebuild\n");
+		return -1;
+	}
+	if (VOL->super->version != FS_VERSION)
+	{
+		fprintf(stderr, "monsterfs format version %d, this build reads version %d\n",
+		  VOL->super->version, FS_VERSION);
+		return -1;
+	}
+	if (VOL->super->blk_size != BLK_SZ || VOL->super->num_blks != NUM_BLKS)
+	{
+		fprintf(stderr, "monsterfs of %d blks of %d bytes, this build expects %d blks of %d bytes\n",
+		  VOL->super->num_blks, VOL->super->blk_size, NUM_BLKS, BLK_SZ);
+		return -1;
+	}
+	return 0;
+}
+
+int mkrootdir(void)
+{
+	struct in_core_inode *r = ialloc_ag(0);
+	if (r == NULL)
+	{
+		fprintf(stderr, "ialloc error in mkrootdir\n");
+		return -1;
+	}
+	VOL->root_i_num = r->i_num;
+	r->file_type = DIRECTORY;
+	strncpy(r->owner_id, "root2", FILE_OWNER_ID_LEN);
+	r->file_size = BLK_SZ;  // root dir has one block that is equal to BLK_SZ.
+	r->blks_in_use = 1;  // root dir has one block that is equal to BLK_SZ.
+	ag_hint_inode(VOL->root_i_num);
+	int blk_num = balloc();
+	if (blk_num == -1)
+	{
+		fprintf(stderr, "balloc error in mkrootdir\n");
+		return -1;
+	}
+	r->block_addr[0] = blk_num;
+	struct dir_block db;
+	dir_block_init(&db);
+	dir_block_set(&db, 0, ".", VOL->root_i_num, DIRECTORY);
+	dir_block_set(&db, 1, "..", VOL->root_i_num, DIRECTORY);
+	if (bwrite_meta(blk_num, (char*)&db) == -1)
+	{
+		fprintf(stderr, "bwrite error blk#%d in mkrootdir\n", blk_num);
+		return -1;
+	}
+	if (iput(r) == -1)
+	{
+		fprintf(stderr, "iput error in mkrootdir\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* the mkfs system call creates superblock, free blk list and free ilist on disk
+ * return 0: successful; return -1: failure.
+ */
+int mkfs(void)
+{
+	printf("reset storage...\n");
+	blk_mags_drain(1);
+	journal_off(1);
+	if (reset_storage() == -1)
+	{
+		fprintf(stderr, "error: reset storage\n");
+		return -1;
+	}
+	init_iblk_cache();
+	init_inode_table();
+	init_namei_cache();
+        create_superblk();
+	if (iblk_map_load() == -1)
+	{
+		fprintf(stderr, "error: inode map\n");
+		return -1;
+	}
+        init_ags_on_disk();
+        init_free_ilist();
+	if (mkrootdir() == -1)
+	{
+		fprintf(stderr, "error when mkrootdir\n");
+		return -1;
+	}
+	if (update_super() == -1)
+	{
+		fprintf(stderr, "update superblk error\n");
+		return -1;
+	}
+	if (iflush(1) == -1)
+	{
+		fprintf(stderr, "inode table write back error in mkfs\n");
+		return -1;
+	}
+	if (journal_format() == -1)
+	{
+		fprintf(stderr, "error: journal format\n");
+		return -1;
+	}
+	VOL->curr_dir_i_num = VOL->root_i_num; // init current directory
+        return 0;
+}
+
+static int free_lists_recover(void);
+
+static int mount_super(int read_only)
+{
+	VOL->read_only = read_only;
+	if (read_superblk() != 0)
+	{
+		fprintf(stderr, "read_superblk error in init_super\n");
+		return -1;
+	}
+	int crashed = VOL->super->state != FS_CLEAN;
+	// after a crash, the journal brings the metadata up to date first.
+	if (journal_open() == -1)
+	{
+		fprintf(stderr, "journal recovery error in init_super\n");
+		return -1;
+	}
+	if (ag_load() == -1)
+	{
+		fprintf(stderr, "read allocation groups error in init_super\n");
+		return -1;
+	}
+	if (iblk_load() == -1)
+	{
+		fprintf(stderr, "read inode table error in init_super\n");
+		return -1;
+	}
+	if (!read_only && crashed && free_lists_recover() == -1)
+	{
+		fprintf(stderr, "free blk list recovery error in init_super\n");
+		return -1;
+	}
+	if (!read_only && orphan_scan() == -1)
+	{
+		fprintf(stderr, "orphan reclaim error in init_super\n");
+		return -1;
+	}
+	VOL->curr_dir_i_num = VOL->root_i_num; // init current directory
+	return 0;
+}
+
+int init_super(void)
+{
+	return mount_super(0);
+}
+
+int init_super_ro(void)
+{
+	return mount_super(1);
+}
+
+void init_namei_cache()
+{
+	int j;
+
+	int now = get_time();
+
+	for(j = 0; j < NAMEI_CACHE_SZ; ++j)
+	{
+		VOL->namei_cache[j].path[0] = '\0';
+		VOL->namei_cache[j].i_num = -1;
+		VOL->namei_cache[j].timestamp = now;	// stamp everything NOW
+		VOL->namei_cache[j].ci = NULL;
+		VOL->namei_cache[j].seq = 0;
+	}
+
+	return;
+}
+
+struct namei_cache_element *find_namei_cache_by_path(const char *path)
+{
+	int i;
+
+	for(i = 0; i < NAMEI_CACHE_SZ; ++i)
+	{
+		if(strcmp(path, VOL->namei_cache[i].path) == 0)
+			return &VOL->namei_cache[i];
+	}
+
+	return NULL;
+}
+
+struct namei_cache_element *find_namei_cache_by_oldest()
+{
+	int tstamp, oldest = 0, i;
+
+	tstamp = get_time();
+
+	for(i = 0; i < NAMEI_CACHE_SZ; ++i)
+	{
+		if(tstamp > VOL->namei_cache[i].timestamp)
+		{
+			oldest = i;
+			tstamp = VOL->namei_cache[i].timestamp;
+		}
+	}
+
+	return &VOL->namei_cache[oldest];
+}
+
+// called when inode i_num goes away, so no cached path leads to it anymore.
+static void namei_cache_forget(int i_num)
+{
+	int i;
+
+	pthread_mutex_lock(&VOL->namei_lock);
+	for(i = 0; i < NAMEI_CACHE_SZ; ++i)
+	{
+		if(VOL->namei_cache[i].i_num == i_num)
+		{
+			seq_write_begin(&VOL->namei_cache[i].seq);
+			VOL->namei_cache[i].path[0] = '\0';
+			VOL->namei_cache[i].i_num = -1;
+			seq_write_end(&VOL->namei_cache[i].seq);
+		}
+	}
+	pthread_mutex_unlock(&VOL->namei_lock);
+}
+
+#if USE_NAMEI_CACHE
+// look path up in the namei cache without namei_lock. the entry found is only
+// known to map path to *i_num and *ci while seq_read_retry() of its seqcount
+// and *seq fails.
+static struct namei_cache_element *namei_cache_peek(const char *path,
+	unsigned int *seq, int *i_num, struct in_core_inode **ci)
+{
+	int i;
+	int now = get_time();
+
+	for(i = 0; i < NAMEI_CACHE_SZ; ++i)
+	{
+		struct namei_cache_element *e = &VOL->namei_cache[i];
+		unsigned int start = seq_read_begin(&e->seq);
+		if (start & 1)
+			continue;
+		if (strncmp(path, e->path, MAX_PATH_LEN) != 0)
+			continue;
+		*i_num = e->i_num;
+		*ci = e->ci;
+		if (seq_read_retry(&e->seq, start) || *i_num < 0)
+			return NULL;
+		// a plain store, and only once a second, so that hits on a hot
+		// path do not keep taking its cache line from each other.
+		if (e->timestamp != now)
+			__atomic_store_n(&e->timestamp, now, __ATOMIC_RELAXED);
+		*seq = start;
+		return e;
+	}
+	return NULL;
+}
+#endif
+
+struct in_core_inode* namei_v2(const char* path_name)
+{
+	struct in_core_inode* working_inode;
+	struct in_core_inode* next_inode;
+	char *path_tok;
+	char *save_ptr;
+	char path[MAX_PATH_LEN];
+	if (strlen(path_name) >= MAX_PATH_LEN)
+		return NULL;
+#if USE_NAMEI_CACHE
+	struct namei_cache_element *cached_path = NULL;
+	unsigned int seq;
+	int i_num;
+
+	// look in cache for this path. the inode is freed only after its entries
+	// are dropped (see namei_cache_forget()), so if the entry is unchanged
+	// once iget() returned, the inode held is the one path leads to.
+	if((cached_path = namei_cache_peek(path_name, &seq, &i_num, &working_inode)) !=
+		NULL)
+	{
+#if _DEBUG
+		printf("namei: found cached path for %s\n",
+			path_name);
+#endif
+		struct in_core_inode *cached_inode = working_inode;
+		working_inode = iget(i_num);
+		if (working_inode != NULL && seq_read_retry(&cached_path->seq, seq))
+		{
+			iput(working_inode);
+			working_inode = NULL;
+		}
+		if (working_inode != NULL)
+		{
+			if (working_inode != cached_inode)
+			{ // read back into another slot, point getattr_v2() at it.
+				pthread_mutex_lock(&VOL->namei_lock);
+				if (cached_path->seq == seq)
+				{
+					seq_write_begin(&cached_path->seq);
+					cached_path->ci = working_inode;
+					seq_write_end(&cached_path->seq);
+				}
+				pthread_mutex_unlock(&VOL->namei_lock);
+			}
+			return working_inode;
+		}
+		// being removed or replaced, look the path up again.
+	}
+
+	// path not cached, search fs for path
+#endif
+	strncpy(path, path_name, MAX_PATH_LEN);
+	if (path == NULL)
+	{
+		fprintf(stderr, "error: path = NULL\n");
+		return NULL;
+	}
+
+	if (path[0] == '/')
+	{
+		working_inode = iget(VOL->root_i_num);
+		if (working_inode == NULL)
+		{
+			fprintf(stderr, "error: get root inode fails in namei_v2\n");
+			return NULL;
+		}
+	}
+	else
+	{
+		working_inode = iget(VOL->curr_dir_i_num);
+		if (working_inode == NULL)
+		{
+			fprintf(stderr, "error: get current directory inode fails in namei_v2\n");
+			return NULL;
+		}
+	}
+
+	path_tok = strtok_r(path, "/", &save_ptr);
+	while (path_tok)
+	{
+#if _DEBUG
+		printf("path_tok = %s\n", path_tok);
+#endif
+		ilock(working_inode, 0);
+		if (working_inode->file_type != DIRECTORY)
+		{
+			fprintf(stderr, "error: curr working dir is not a directory\n");
+			iunlock_put(working_inode);
+			return NULL;
+		}
+		// TODO: check access permissions
+		if (working_inode->i_num == VOL->root_i_num && strcmp(path_tok, "..") == 0)
+		{
+			iunlock(working_inode);
+			path_tok = strtok_r(NULL, "/", &save_ptr);
+			continue;
+		}
+		struct dir_block db;
+		int i_num = dir_lookup(working_inode, path_tok, &db, NULL);
+		// taken before the dir is unlocked, so an unlink cannot free it
+		// in between.
+		next_inode = i_num < 0 ? NULL : iget(i_num);
+		if (iunlock_put(working_inode) == -1)
+		{
+			fprintf(stderr, "iput error in namei_v2\n");
+			if (next_inode != NULL)
+				iput(next_inode);
+			return NULL;
+		}
+		if (next_inode == NULL)
+		{
+#if _DEBUG
+			printf("cannot find the inode in curr dir for token %s\n", path_tok);
+#endif
+			return NULL;
+		}
+		working_inode = next_inode;
+
+		path_tok = strtok_r(NULL, "/", &save_ptr);
+	}
+
+#if USE_NAMEI_CACHE
+	// replace oldest cached path with this one
+	pthread_mutex_lock(&VOL->namei_lock);
+	cached_path = find_namei_cache_by_path(path_name);
+	if(cached_path == NULL)
+		cached_path = find_namei_cache_by_oldest();
+	seq_write_begin(&cached_path->seq);
+	strncpy(cached_path->path, path_name, MAX_PATH_LEN - 1);
+	cached_path->path[MAX_PATH_LEN - 1] = '\0';
+	cached_path->i_num = working_inode->i_num;
+	cached_path->ci = working_inode;
+	cached_path->timestamp = get_time();
+	seq_write_end(&cached_path->seq);
+	pthread_mutex_unlock(&VOL->namei_lock);
+#if _DEBUG
+	printf("namei: cached mapping to path %s\n",
+		path_name);
+#endif
+#endif
+
+	return working_inode;
+}
+
+// the hit path takes no lock and writes nothing shared: the cache entry and
+// the in-core inode are read under their seqcounts. in-core inodes are never
+// given back to malloc, so one whose slot was taken since the path was
+// cached is still safe to read, its i_num just does not match.
+int getattr_v2(const char* path_name, struct in_core_inode *attr)
+{
+	struct in_core_inode *ci;
+#if USE_NAMEI_CACHE
+	struct namei_cache_element *e;
+	unsigned int seq;
+	unsigned int iseq;
+	int i_num;
+
+	e = namei_cache_peek(path_name, &seq, &i_num, &ci);
+	if (e != NULL && ci != NULL)
+	{
+		iseq = seq_read_begin(&ci->seq);
+		attr->disk = ci->disk;
+		attr->i_num = ci->i_num;
+		if (!seq_read_retry(&ci->seq, iseq) && attr->i_num == i_num
+		  && attr->link_count > 0 && !seq_read_retry(&e->seq, seq))
+			return 0;
+	}
+#endif
+	ci = namei_v2(path_name);
+	if (ci == NULL)
+		return -ENOENT;
+	ilock(ci, 0);
+	attr->disk = ci->disk;
+	attr->i_num = ci->i_num;
+	iunlock(ci);
+	iput(ci);
+	return 0;
+}
+
+int separate_node_name(const char *path, char *node_name)
+{
+  return separate_node(path, node_name, 1);
+}
+
+int separate_node_path(const char *path, char *node_path)
+{
+  return separate_node(path, node_path, 0);
+}
+
+int separate_node(const char *path, char *node_part, int part)
+{
+  char node_path[strlen(path) + 1];
+  char node_name[strlen(path) + 1];
+  int l = 0;
+  int substr_len = 0;
+
+  l = strlen(path);
+  do
+  {
+    ++substr_len;
+
+    if(path[l] == '/')
+    {
+      if(l == strlen(path)-1)
+      {
+        //printf("no node name\n");
+        return 0;
+      }
+
+      memcpy(node_name, &path[l+1], substr_len);
+      break;
+    }
+
+    --l;
+
+  } while(l >= 0);
+
+  //printf("l = %d\n", l);
+  if(l == 0)
+  {
+    memcpy(node_path, "/\0", 2);
+  }
+  else
   {
     memcpy(node_path, path, l);
     node_path[l] = '\0';  // fix a bug: need to add an end char.
   }
 
-  if(part == 0)
-  {
-    memcpy(node_part, node_path, strlen(node_path) + 1);
-  }
-  else
-  {
-    memcpy(node_part, node_name, strlen(node_name) + 1);
-  }
+  if(part == 0)
+  {
+    memcpy(node_part, node_path, strlen(node_path) + 1);
+  }
+  else
+  {
+    memcpy(node_part, node_name, strlen(node_name) + 1);
+  }
+
+  return 1;
+}
+
+/* use separate utilities to split the end of the path and the rest of the path.
+   the end of the path should exist in the current filesystem, and should be a directory
+*/
+static int do_mkdir(const char* path_name, int mode)
+{
+	struct in_core_inode *ci;
+	char path[MAX_PATH_LEN];
+	if (strlen(path_name) >= MAX_PATH_LEN)
+		return -ENAMETOOLONG;
+	strncpy(path, path_name, MAX_PATH_LEN);
+	char node_name[MAX_PATH_LEN];
+	char node_path[MAX_PATH_LEN];
+	if (path == NULL)
+	{
+		fprintf(stderr, "error: path = NULL during mkdir\n");
+		return -1;
+	}
+	// seperate node and path to node in 2 strings (mkdir needs this)
+	separate_node_name(path, node_name);
+	separate_node_path(path, node_path);
+#if _DEBUG
+	printf("node_path = %s\n", node_path);
+	printf("node_name = %s\n", node_name);
+#endif
+	if (strlen(node_name) >= FILE_NAME_LEN)
+		return -ENAMETOOLONG;
+
+	ci = namei_v2(node_path);
+	if (ci == NULL)
+	{
+		fprintf(stderr, "mkdir: cannot create directory %s: No such file or directory\n", path);
+		return -1;
+	}
+#if _DEBUG
+	printf("i_num of working_dir = %d\n", ci->i_num);
+#endif
+	// held until the entry is written, so a racing create of the same name
+	// finds it.
+	ilock(ci, 1);
+	// create a directory node_path under inode ci
+
+	struct dir_pos pos;
+	struct dir_block db;
+	if (dir_lookup(ci, node_name, &db, NULL) >= 0)
+	{
+		iunlock_put(ci);
+		return -EEXIST;
+	}
+	int res = dir_find_free(ci, &db, &pos);
+	if (res < 0)
+	{
+		fprintf(stderr, "error: no dir entry can be added in %s\n", node_path);
+		iunlock_put(ci);
+		return res;
+	}
+	// there is dir entry space left in this slot
+	// new dirs are spread over the groups, their files stay with them.
+	struct in_core_inode* new_inode = ialloc_ag(ag_next());
+	if (new_inode == NULL)
+	{
+		fprintf(stderr, "ialloc error in mkdir_v2\n");
+		iunlock_put(ci);
+		return -1;
+	}
+	int new_i_num = new_inode->i_num;
+	new_inode->file_type = DIRECTORY;
+	new_inode->file_size = BLK_SZ;
+	new_inode->blks_in_use = 1;
+	// need to add "." and ".." to a new directory inode.
+	ag_hint_inode(new_i_num);
+	int new_dir_blk = balloc();
+	if (new_dir_blk == -1)
+	{
+		fprintf(stderr, "balloc error in mkdir_v2\n");
+		iput(new_inode);
+		iunlock_put(ci);
+		return -1;
+	}
+	new_inode->block_addr[0] = new_dir_blk;
+	dir_hint_forget(new_i_num);
+	struct dir_block new_db;
+	dir_block_init(&new_db);
+	dir_block_set(&new_db, 0, ".", new_i_num, DIRECTORY);   // himself
+	dir_block_set(&new_db, 1, "..", ci->i_num, DIRECTORY);  // his parent inode
+	if (bwrite_meta(new_dir_blk, (char*)&new_db) == -1)
+	{
+		fprintf(stderr, "bwrite error in mkdir_v2\n");
+		iput(new_inode);
+		iunlock_put(ci);
+		return -1;
+	}
+
+	// the last step is to update to the disk
+	if (iput(new_inode) == -1)
+	{
+		fprintf(stderr, "iput error in mkdir_v2\n");
+		iunlock_put(ci);
+		return -1;
+	}
+	dir_block_set(&db, pos.slot, node_name, new_i_num, DIRECTORY);
+	if (bwrite_meta(pos.blk_num, (char*)&db) == -1)
+	{
+		fprintf(stderr, "bwrite error in mkdir_v2\n");
+		iunlock_put(ci);
+		return -1;
+	}
+	if (db.nr_used == DIR_ENTRIES_PER_BLK)
+		dir_hint_update(ci, pos.lblk, 1);
+	// the parent dir inode may have grown a blk.
+	if (iunlock_put(ci) == -1)
+	{
+		fprintf(stderr, "iput error in mkdir_v2\n");
+		return -1;
+	}
+	return 0;
+}
 
-  return 1;
+int mkdir_v2(const char* path_name, int mode)
+{
+	journal_start(1);
+	int res = do_mkdir(path_name, mode);
+	journal_stop(1);
+	return res;
+}
+
+// removes a directory and a file
+static int do_unlink(const char *path_name)
+{
+	struct in_core_inode *ci;
+	char path[MAX_PATH_LEN];
+	if (strlen(path_name) >= MAX_PATH_LEN)
+		return -ENAMETOOLONG;
+	strncpy(path, path_name, MAX_PATH_LEN);
+	char node_name[MAX_PATH_LEN];
+	char node_path[MAX_PATH_LEN];
+	if (path == NULL)
+	{
+		fprintf(stderr, "error: path = NULL in unlink\n");
+		return -1;
+	}
+	// seperate node and path to node in 2 strings (mkdir needs this)
+	separate_node_name(path, node_name);
+	separate_node_path(path, node_path);
+#if _DEBUG
+	printf("node_path = %s\n", node_path);
+	printf("node_name = %s\n", node_name);
+#endif
+	// "." and ".." are never removed.
+	if (strcmp(node_name, ".") == 0 || strcmp(node_name, "..") == 0)
+		return -EINVAL;
+
+	ci = namei_v2(node_path);
+	if (ci == NULL)
+	{
+		fprintf(stderr, "rmdir: cannot find path to directory %s\n", path);
+		return -ENOENT;
+	}
+#if _DEBUG
+	printf("i_num of working_dir = %d\n", ci->i_num);
+#endif
+	ilock(ci, 1);
+	struct dir_pos pos;
+	struct dir_block db;
+	int i_num = dir_lookup(ci, node_name, &db, &pos);
+	if (i_num < 0)
+	{
+		fprintf(stderr, "cannot find the directory to delete\n");
+		iunlock_put(ci);
+		return i_num;
+	}
+	// find the directory. read it and delete it.
+	struct in_core_inode *target_inode = iget(i_num);
+	if (target_inode == NULL)
+	{
+		fprintf(stderr, "no disk inode corresponding to this i_num %d\n", i_num);
+		iunlock_put(ci);
+		return -ENOENT;
+	}
+	// TODO: remove all entries in the target_inode as a directory if it contains entries.
+	// remove the directory. the entry goes first, so the inode is no longer
+	// reachable by the time its last iput() frees it.
+	dir_block_clear(&db, pos.slot); // reset inode num to indicate it is free.
+	if (bwrite_meta(pos.blk_num, (char*)&db) == -1)
+	{
+		fprintf(stderr, "bwrite error in unlink\n");
+		iput(target_inode);
+		iunlock_put(ci);
+		return -EIO;
+	}
+	ilock(target_inode, 1);
+	if (target_inode->link_count > 0)
+		target_inode->link_count --;
+	target_inode->modified = 1;
+	if (iunlock_put(target_inode) == -1)
+	{
+		fprintf(stderr, "iput error i_num = %d in unlink\n", i_num);
+		iunlock_put(ci);
+		return -EIO;
+	}
+	dir_hint_hole(ci, pos.lblk);
+	// the last dir blk became empty, so the dir can shrink.
+	if (db.nr_used == 0 && pos.lblk == ci->blks_in_use - 1)
+	{
+		if (dir_shrink(ci) != 0)
+		{
+			fprintf(stderr, "dir_shrink error in unlink\n");
+			iunlock_put(ci);
+			return -EIO;
+		}
+	}
+	if (iunlock_put(ci) == -1)
+	{
+		fprintf(stderr, "iput error in unlink\n");
+		return -EIO;
+	}
+	return 0;
+}
+
+int unlink(const char *path_name)
+{
+	journal_start(1);
+	int res = do_unlink(path_name);
+	journal_stop(1);
+	return res;
+}
+
+/* use separate utilities to split the end of the path and the rest of the path.
+   the end of the path should exist in the current filesystem, and should be a directory
+*/
+static int do_mknod(const char* path_name, int mode, int dev)
+{
+	struct in_core_inode *ci;
+	char path[MAX_PATH_LEN];
+	if (strlen(path_name) >= MAX_PATH_LEN)
+		return -ENAMETOOLONG;
+	strncpy(path, path_name, MAX_PATH_LEN);
+	char node_name[MAX_PATH_LEN];
+	char node_path[MAX_PATH_LEN];
+	if (path == NULL)
+	{
+		fprintf(stderr, "error: path = NULL during mknod_v2\n");
+		return -1;
+	}
+	separate_node_name(path, node_name);
+	separate_node_path(path, node_path);
+#if _DEBUG
+	printf("node_path = %s\n", node_path);
+	printf("node_name = %s\n", node_name);
+#endif
+	if (strlen(node_name) >= FILE_NAME_LEN)
+		return -ENAMETOOLONG;
+
+	ci = namei_v2(node_path);
+	if (ci == NULL)
+	{
+		fprintf(stderr, "mknod_v2: cannot create directory %s: No such file or directory\n", path);
+		return -1;
+	}
+#if _DEBUG
+	printf("i_num of working_dir = %d\n", ci->i_num);
+#endif
+	ilock(ci, 1);
+	// create a file node_path under inode ci
+
+	struct dir_pos pos;
+	struct dir_block db;
+	if (dir_lookup(ci, node_name, &db, NULL) >= 0)
+	{
+		iunlock_put(ci);
+		return -EEXIST;
+	}
+	int res = dir_find_free(ci, &db, &pos);
+	if (res < 0)
+	{
+		fprintf(stderr, "error: no dir entry can be added in %s\n", node_path);
+		iunlock_put(ci);
+		return res;
+	}
+	// there is dir entry space left in this slot
+	struct in_core_inode* new_inode = ialloc_ag(ag_of_inode(ci->i_num));
+	if (new_inode == NULL)
+	{
+		fprintf(stderr, "ialloc error in mknod_v2\n");
+		iunlock_put(ci);
+		return -1;
+	}
+	int new_i_num = new_inode->i_num;
+	new_inode->file_type = REGULAR;
+	new_inode->file_size = 0;
+	new_inode->blks_in_use = 0;
+	// the last step is to update to the disk
+	if (iput(new_inode) == -1)
+	{
+		fprintf(stderr, "iput error in mknod_v2\n");
+		iunlock_put(ci);
+		return -1;
+	}
+	dir_block_set(&db, pos.slot, node_name, new_i_num, REGULAR);
+	if (bwrite_meta(pos.blk_num, (char*)&db) == -1)
+	{
+		fprintf(stderr, "bwrite error in mknod_v2\n");
+		iunlock_put(ci);
+		return -1;
+	}
+	if (db.nr_used == DIR_ENTRIES_PER_BLK)
+		dir_hint_update(ci, pos.lblk, 1);
+	// the parent dir inode may have grown a blk.
+	if (iunlock_put(ci) == -1)
+	{
+		fprintf(stderr, "iput error in mknod_v2\n");
+		return -1;
+	}
+	return 0;
+}
+
+int mknod_v2(const char* path_name, int mode, int dev)
+{
+	journal_start(1);
+	int res = do_mknod(path_name, mode, dev);
+	journal_stop(1);
+	return res;
+}
+
+int rmdir(const char* path)
+{
+	return unlink(path);
+}
+
+// an entry's offset is its position in the dir: lblk * DIR_ENTRIES_PER_BLK + slot.
+// The offset handed to filler is the one of the next entry, so a listing
+// resumes where the previous call stopped without rescanning the dir.
+int readdir_v2(struct in_core_inode* ci, int off, int plus, dir_filler_t filler, void *arg)
+{
+	if (ci == NULL)
+		return -ENOENT;
+	if (ci->file_type != DIRECTORY)
+	{
+		iput(ci);
+		return -ENOTDIR;
+	}
+	ilock(ci, 0);
+	struct dir_block db;
+	struct in_core_inode attr;
+	int lblk = off / DIR_ENTRIES_PER_BLK;
+	int slot = off % DIR_ENTRIES_PER_BLK;
+	int res = 0;
+	for (; lblk < ci->blks_in_use; lblk++, slot = 0)
+	{
+		if (dir_bread(ci, lblk, NULL, &db) == -1)
+		{
+			res = -EIO;
+			break;
+		}
+#if IPREFETCH_ON_READDIR
+		// bring in the inode blks of the whole dir blk at once, in blk order,
+		// instead of one bread per entry as the filler asks for it.
+		if (plus && db.nr_used > 0 && iprefetch(db.inode_num + slot, DIR_ENTRIES_PER_BLK - slot) == -1)
+		{
+			res = -EIO;
+			break;
+		}
+#endif
+		for (; slot < DIR_ENTRIES_PER_BLK; slot++)
+		{
+			int i_num = db.inode_num[slot];
+			if (i_num == EMPTY_I_NUM)  // not a valid entry, may be deleted.
+				continue;
+			const struct in_core_inode *pattr = NULL;
+			if (plus)
+			{
+				int iblk = i_num / INODES_PER_BLK;
+				pthread_mutex_lock(&VOL->iblk_lock);
+				char *ibuf = iblk_read(iblk);
+				if (ibuf == NULL)
+				{
+					pthread_mutex_unlock(&VOL->iblk_lock);
+					fprintf(stderr, "bread error inode blk %d in readdir_v2\n", iblk);
+					res = -EIO;
+					goto done;
+				}
+				init_inode_from_disk(&attr, (struct disk_inode*)ibuf + i_num % INODES_PER_BLK, i_num);
+				pthread_mutex_unlock(&VOL->iblk_lock);
+				pattr = &attr;
+			}
+			if (filler(arg, db.file_name[slot], i_num, db.file_type[slot], pattr,
+			  lblk * DIR_ENTRIES_PER_BLK + slot + 1) != 0)
+				goto done;
+		}
+	}
+done:
+	touch_atime(ci);
+	if (iunlock_put(ci) != 0)
+	{
+		fprintf(stderr, "iput error in readdir_v2\n");
+		return -EIO;
+	}
+	return res;
+}
+
+/******************* directory compaction *********************************/
+
+// squeeze the unused slots out of directory ci: live entries are moved
+// from the dir blks at the end into the holes of the dir blks at the start,
+// then the emptied dir blks at the end are freed. Stops once the running
+// transaction is full; ci is queued again for the rest.
+static int dir_compact_blks(struct in_core_inode *ci)
+{
+	struct dir_block front, back;
+	int front_blk, back_blk;
+	int front_dirty = 0, back_dirty = 0;
+	int stopped = 0;
+	int f = 0;
+	int b = ci->blks_in_use - 1;
+	int fs = 0, bs = 0;  // slots in front and back
+	if (dir_bread(ci, f, &front_blk, &front) == -1
+	  || (b > f && dir_bread(ci, b, &back_blk, &back) == -1))
+		return -1;
+	while (f < b)
+	{
+		if (journal_trans_full())
+		{
+			stopped = 1;
+			break;
+		}
+		if (front.nr_used == DIR_ENTRIES_PER_BLK)
+		{ // front dir blk full, go to the next one.
+			if (front_dirty && bwrite_meta(front_blk, (char*)&front) == -1)
+				return -1;
+			front_dirty = 0;
+			fs = 0;
+			if (++f == b)
+				break;
+			if (dir_bread(ci, f, &front_blk, &front) == -1)
+				return -1;
+			continue;
+		}
+		if (back.nr_used == 0)
+		{ // back dir blk emptied, go to the previous one.
+			if (back_dirty && bwrite_meta(back_blk, (char*)&back) == -1)
+				return -1;
+			back_dirty = 0;
+			bs = 0;
+			if (--b == f)
+				break;
+			if (dir_bread(ci, b, &back_blk, &back) == -1)
+				return -1;
+			continue;
+		}
+		while (front.inode_num[fs] != EMPTY_I_NUM)
+			fs++;
+		while (back.inode_num[bs] == EMPTY_I_NUM)
+			bs++;
+		// move the entry from back to front
+		front.name_hash[fs] = back.name_hash[bs];
+		front.name_len[fs] = back.name_len[bs];
+		front.file_type[fs] = back.file_type[bs];
+		memcpy(front.file_name[fs], back.file_name[bs], FILE_NAME_LEN);
+		front.inode_num[fs] = back.inode_num[bs];
+		front.nr_used += 1;
+		dir_block_clear(&back, bs);
+		front_dirty = back_dirty = 1;
+	}
+	if (front_dirty && bwrite_meta(front_blk, (char*)&front) == -1)
+		return -1;
+	if (back_dirty && bwrite_meta(back_blk, (char*)&back) == -1)
+		return -1;
+
+	pthread_mutex_lock(&VOL->dir_hint_lock);
+	struct dir_hint *h = dir_hint_get(ci->i_num);
+	if (h != NULL)
+	{
+		h->free_lblk = f;
+		if (stopped)
+			dir_hint_queue(h, ci);
+		else
+			h->nr_holes = 0;
+	}
+	pthread_mutex_unlock(&VOL->dir_hint_lock);
+	if (dir_shrink(ci) != 0)
+	{
+		fprintf(stderr, "dir_shrink error in dir_compact\n");
+		return -1;
+	}
+	return 0;
+}
+
+// the open listings of dir i_num, NULL if none. called with dir_hint_lock held.
+static struct dir_listing *dir_listing_find(int i_num)
+{
+	int i;
+	for (i = 0; i < DIR_LISTING_SZ; i++)
+	{
+		if (VOL->dir_listings[i].nr > 0 && VOL->dir_listings[i].i_num == i_num)
+			return &VOL->dir_listings[i];
+	}
+	return NULL;
+}
+
+static int dir_compact(int i_num)
+{
+	struct in_core_inode *ci = iget(i_num);
+	if (ci == NULL) // being removed since it was queued.
+		return 0;
+	int res = 0;
+	ilock(ci, 1);
+	// skipped if removed since it was queued, or while it is being listed:
+	// dir_listing_end() queues it again.
+	pthread_mutex_lock(&VOL->dir_hint_lock);
+	int listed = dir_listing_find(i_num) != NULL;
+	pthread_mutex_unlock(&VOL->dir_hint_lock);
+	if (ci->file_type == DIRECTORY && ci->link_count > 0 && !listed)
+		res = dir_compact_blks(ci);
+	if (iunlock_put(ci) != 0)
+		return -1;
+	return res;
+}
+
+int dir_listing_begin(int i_num)
+{
+	struct dir_listing *l;
+	int i;
+	pthread_mutex_lock(&VOL->dir_hint_lock);
+	l = dir_listing_find(i_num);
+	for (i = 0; l == NULL && i < DIR_LISTING_SZ; i++)
+	{
+		if (VOL->dir_listings[i].nr == 0)
+		{
+			l = &VOL->dir_listings[i];
+			l->i_num = i_num;
+		}
+	}
+	if (l != NULL)
+		l->nr += 1;
+	pthread_mutex_unlock(&VOL->dir_hint_lock);
+	return l != NULL ? 0 : -ENFILE;
+}
+
+void dir_listing_end(int i_num)
+{
+	pthread_mutex_lock(&VOL->dir_hint_lock);
+	struct dir_listing *l = dir_listing_find(i_num);
+	if (l != NULL && --l->nr == 0)
+	{ // compaction may have been skipped for the listing.
+		l->i_num = -1;
+		struct dir_hint *h = dir_hint_get(i_num);
+		if (h != NULL)
+			dir_hint_queue(h, NULL);
+	}
+	pthread_mutex_unlock(&VOL->dir_hint_lock);
+}
+
+int dir_compact_pending(int max_dirs)
+{
+	int done = 0;
+	while (done < max_dirs)
+	{
+		pthread_mutex_lock(&VOL->dir_hint_lock);
+		int i_num = VOL->nr_compact_queued > 0 ? VOL->dir_compact_queue[--VOL->nr_compact_queued] : -1;
+		if (i_num >= 0)
+			VOL->dir_hints[i_num % DIR_HINT_SZ].queued = 0;
+		pthread_mutex_unlock(&VOL->dir_hint_lock);
+		if (i_num < 0)
+			break;
+		journal_start(1);
+		int res = dir_compact(i_num);
+		journal_stop(1);
+		if (res != 0)
+		{
+			fprintf(stderr, "dir_compact error i_num %d\n", i_num);
+			return -1;
+		}
+		done++;
+	}
+	return done;
+}
+
+/******************* file operations *************************************/
+
+#if 0
+int open_v2(const char* path, int mode)
+{
+	struct in_core_inode* ci;
+	struct file_table_entry* ft_ent;
+	int fd;
+
+	ci = namei_v2(path);
+	if (ci == NULL)
+	{
+		fprintf(stderr, "error: file not found\n");
+		return -1;
+	}
+	// TODO: check permissions
+
+	// allocate file table entry for inode
+
+	// TODO: how to truncate a file
+
+	ci->locked = 0;
+	return fd;
 }
+#endif
+
+// on success: returns the number of bytes read is returned. 0: end of file
+// on failure: returns -1
+/******************* inline data *************************************/
 
-/* use separate utilities to split the end of the path and the rest of the path.
-   the end of the path should exist in the current filesystem, and should be a directory
-*/
-int mkdir_v2(const char* path_name, int mode)
+// move the inline data of ci out to a data blk, so ci gets a block map.
+static int inline_unpack(struct in_core_inode *ci)
 {
-	struct in_core_inode *ci;
-	char path[MAX_PATH_LEN];
-	strncpy(path, path_name, MAX_PATH_LEN);
-	char node_name[strlen(path_name)];
-	char node_path[strlen(path_name)];
-	if (path == NULL)
+	char blk_buf[BLK_SZ];
+	memset(blk_buf, 0, sizeof(blk_buf));
+	memcpy(blk_buf, INODE_INLINE_DATA(ci), ci->file_size);
+	memset(INODE_INLINE_DATA(ci), 0, INLINE_DATA_LEN);
+	if (alloc_blks_for_truncate(ci, 1) != 0)
 	{
-		fprintf(stderr, "error: path = NULL during mkdir\n");
+		fprintf(stderr, "alloc blk error in inline_unpack\n");
+		memcpy(INODE_INLINE_DATA(ci), blk_buf, ci->file_size);
 		return -1;
 	}
-	// seperate node and path to node in 2 strings (mkdir needs this)
-	separate_node_name(path, node_name);
-	separate_node_path(path, node_path);
-#if _DEBUG
-	printf("node_path = %s\n", node_path);
-	printf("node_name = %s\n", node_name);
-#endif
-
-	ci = namei_v2(node_path);
-	if (ci == NULL)
+	ci->blks_in_use = 1;
+	ci->modified = 1;
+	if (bwrite(ci->block_addr[0], blk_buf) == -1)
 	{
-		fprintf(stderr, "mkdir: cannot create directory %s: No such file or directory\n", path);
+		fprintf(stderr, "bwrite error blk# %d in inline_unpack\n", ci->block_addr[0]);
 		return -1;
 	}
-#if _DEBUG
-	printf("i_num of working_dir = %d\n", ci->i_num);
-#endif
-	// create a directory node_path under inode ci
+	return 0;
+}
+
+// write to a file that stays within INLINE_DATA_LEN bytes.
+static int write_inline(struct in_core_inode *ci, const char *buf, int size, int offset)
+{
+	// the bytes between the old end and offset are still zero.
+	memcpy(INODE_INLINE_DATA(ci) + offset, buf, size);
+	if (offset + size > ci->file_size)
+		ci->file_size = offset + size;
+	touch_mtime(ci);
+	return size;
+}
 
-	int off;
-	struct directory_entry* dir_entry;
-	// TODO: needs optimization: read a block at a time for several dir entries look-up.
-	// TODO: for each entry, needs to see if inode num is either -2 or -1, if it is, then it is a free entry, meaning dir could be added to this entry.
-	for (off = 0; off < MAX_ENTRY_OFFSET - DIR_ENTRY_LENGTH; off += DIR_ENTRY_LENGTH)
+// reads under a shared rwlock and a range lock, so the blks read do not
+// change meanwhile; the block map may, and is looked at under map_lock.
+static int read_range(struct in_core_inode* ci, char* buf, int size, int offset)
+{
+	int res;
+	int count = 0; // the bytes that are copied to buf
+	pthread_mutex_lock(&ci->map_lock);
+	if (offset > ci->file_size)
+	{
+		fprintf(stderr, "read error: offset %d exceeds file size %d\n", offset, ci->file_size);
+		pthread_mutex_unlock(&ci->map_lock);
+		return 0;
+	}
+	if (offset + size > ci->file_size)
 	{
+		size = ci->file_size - offset;  // update the max bytes to read.
 #if _DEBUG
-		printf("offset = %d\n", off);
+		printf("the bytes to read exceeds file_size %d, size updated = %d\n", ci->file_size, size);
 #endif
+	}
+	if (INODE_IS_INLINE(ci) && size > 0)
+	{ // no data blk to read.
+		memcpy(buf, INODE_INLINE_DATA(ci) + offset, size);
+		count = size;
+	}
+	pthread_mutex_unlock(&ci->map_lock);
+	while (count < size)
+	{
 		int blk_num;
-		int offset_blk;
-		if (bmap(ci, off, &blk_num, &offset_blk) == -1)
+		int offset_blk;  // offset in disk block
+		pthread_mutex_lock(&ci->map_lock);
+		res = bmap(ci, offset + count, &blk_num, &offset_blk);
+		pthread_mutex_unlock(&ci->map_lock);
+		if (res != 0)
 		{
-			fprintf(stderr, "bmap error in mkdir_v2\n");
-			return -EFAULT; // bad address
+			fprintf(stderr, "bmap error in read\n");
+			memset(buf + count, 0, size - count);
+			return -EFAULT;
 		}
 #if _DEBUG
 		printf("blk_num = %d\n", blk_num);
 		printf("offset_blk = %d\n", offset_blk);
 #endif
-		char buf[BLK_SZ];
-		if (bread(blk_num, buf) == -1)
+		char blk_buf[BLK_SZ];
+		if (blk_num == 0) // a hole, no I/O.
+			memset(blk_buf, 0, sizeof(blk_buf));
+		res = blk_num == 0 ? 0 : bread(blk_num, blk_buf);
+		if (res != 0)
 		{
-			fprintf(stderr, "bread error in mkdir_v2\n");
-			return -EIO; // cannot read disk
+			fprintf(stderr, "bread error blk# %d in read\n", blk_num);
+			memset(buf + count, 0, size - count);
+			return -EIO;
 		}
-		dir_entry = (struct directory_entry*)(buf + offset_blk);
-#if _DEBUG
-		printf("i_num of curr dir entry = %d\n", dir_entry->inode_num);
-#endif
-		if (dir_entry->inode_num != BAD_I_NUM
-		  && dir_entry->inode_num != EMPTY_I_NUM)
-		{ // meaning current dir entry is occupied.
-			continue;
+		if (offset_blk + (size - count) <= BLK_SZ)
+		{ // the left bytes to copy doesn't exceeds blk_size
+			memcpy(buf + count, blk_buf + offset_blk, size - count);
+			count = size;
 		}
-		// there is dir entry space left starting from this
-		struct in_core_inode* new_inode = ialloc();
-		if (new_inode == NULL)
+		else
 		{
-			fprintf(stderr, "ialloc error in mkdir_v2\n");
-			return -1;
+			int to_copy = BLK_SZ - offset_blk;
+			memcpy(buf + count, blk_buf + offset_blk, to_copy);
+			count += to_copy;
 		}
-		new_inode->file_type = DIRECTORY;
-		new_inode->file_size = BLK_SZ;
-		new_inode->blks_in_use = 1;
-		// need to add ".", ".." and -1 (end) to a new directory inode.
-		int new_dir_blk = balloc();
-		if (new_dir_blk == -1)
+	}
+	touch_atime(ci);
+	return count;
+}
+
+int read_v2(struct in_core_inode* ci, char* buf, int size, int offset)
+{
+	// from offset, copy size of bytes from the file indicated by path to buf
+        if (ci == NULL)
+                return -ENOENT;
+	struct range_lock rl;
+	ilock(ci, 0);
+	range_lock(ci, &rl, offset, size, 0);
+	int res = read_range(ci, buf, size, offset);
+	range_unlock(ci, &rl);
+	if (iunlock_put(ci) != 0)
+	{
+		fprintf(stderr, "iput error in read_v2\n");
+		return -EIO;
+	}
+	else
+	{
+#if _DEBUG
+		printf("iput is successful\n");
+#endif
+	}
+	return res;
+}
+
+static int alloc_blks_for_write(struct in_core_inode *ci, int blks_to_alloc)
+{
+	//int bytes_to_alloc = offset + size - ;
+	//int blks_to_alloc = (bytes_to_alloc + BLK_SZ) / BLK_SZ;
+	int i;
+	int count = ci->blks_in_use; // blks allocated.
+	ag_hint_inode(ci->i_num);
+	int limit = ci->blks_in_use + blks_to_alloc;
+
+	// first alloc disk blks for direct blks.
+	while (count < limit && count < DIRECT_BLKS_PER_INODE)
+	{
+		int blk_num = balloc();
+		if (blk_num == -1)
 		{
-			fprintf(stderr, "balloc error in mknod_v2\n");
-			return -1;
+			fprintf(stderr, "balloc error blk# %d in alloc_blks\n", blk_num);
+			return -ENOMEM;
 		}
-		new_inode->block_addr[0] = new_dir_blk;
-		char new_buf[BLK_SZ];
-		memset(new_buf, 0, sizeof(buf));
-		struct directory_entry *new_dir_entry;
-		new_dir_entry = (struct directory_entry*)new_buf;
-		strncpy(new_dir_entry->file_name, ".", FILE_NAME_LEN);
-		new_dir_entry->inode_num = new_inode->i_num;  // himself
-		new_dir_entry++;
-		strncpy(new_dir_entry->file_name, "..", FILE_NAME_LEN);
-		new_dir_entry->inode_num = ci->i_num;   // his parent inode
-		// indicate the end of a directory
-		new_dir_entry++;
-		new_dir_entry->inode_num = BAD_I_NUM;
-		if (bwrite(new_dir_blk, new_buf) == -1)
+		ci->block_addr[count] = blk_num;
+		ci->blks_in_use += 1;
+		count += 1;
+	}
+	// if count < limit, alloc blks for single indirect.
+	while (count < limit && count < max_single)
+	{
+		int blk_num;
+		if (ci->single_ind_blk == 0) // single hasn't been alloc
 		{
-			fprintf(stderr, "bwrite error in mknod_v2\n");
-			return -1;
+			blk_num = balloc();
+			if (blk_num == -1)
+			{
+				fprintf(stderr, "balloc error blk# %d in alloc_blks\n", blk_num);
+				return -ENOMEM;
+			}
+			// init blk
+			char sub_buf[BLK_SZ];
+			memset(sub_buf, 0, sizeof(sub_buf));
+			if (bwrite_meta(blk_num, sub_buf) == -1)
+			{
+				fprintf(stderr, "bwrite error blk# %d in alloc_blks\n", blk_num);
+				return -EFAULT;
+			}
+			ci->single_ind_blk = blk_num;
+			//ci->blks_in_use += 1; // count should not be incremented.
 		}
-
-		// the last step is to update to the disk
-		if (iput(new_inode) == -1)
+		else
+			blk_num = ci->single_ind_blk;
+		char buf[BLK_SZ];
+		memset(buf, 0, sizeof(buf));
+		if (bread(blk_num, buf) == -1)
 		{
-			fprintf(stderr, "iput error in mknod_v2\n");
-			return -1;
+			fprintf(stderr, "bread error blk# %d in alloc_blks\n", blk_num);
+			return -EFAULT;
 		}
-		if (dir_entry->inode_num == EMPTY_I_NUM)
+		int *p = (int*)buf;
+		i = count - DIRECT_BLKS_PER_INODE;
+		if (i < 0 || i >= RANGE_SINGLE)
 		{
-			dir_entry->inode_num = (new_inode->i_num);
-			strncpy(dir_entry->file_name, node_name, FILE_NAME_LEN);
+			fprintf(stderr, "index error %d for single indirect in alloc_blks\n", i);
+			return -EFAULT;
 		}
-		else if (dir_entry->inode_num == BAD_I_NUM)
+		p[i] = balloc();
+		if (p[i] == -1)
 		{
-			dir_entry->inode_num = (new_inode->i_num);
-			strncpy(dir_entry->file_name, node_name, FILE_NAME_LEN);
-			// if the dir has the last space for a bad inode num, then
-			// write a BAD_I_NUM indicating the end of the directory.
-			dir_entry ++;
-			dir_entry->inode_num = BAD_I_NUM;
+			fprintf(stderr, "balloc error blk# %d in alloc_blks\n", p[i]);
+			return -ENOMEM;
 		}
-		else
+		// init blk
+		char sub_buf[BLK_SZ];
+		memset(sub_buf, 0, sizeof(sub_buf));
+		if (bwrite(p[i], sub_buf) == -1)
 		{
-			fprintf(stderr, "fatal error: dir_entry->inode_num %d wrong in mkdir_v2\n", dir_entry->inode_num);
-			return -1;
+			fprintf(stderr, "bwrite error blk# %d in alloc_blks\n", blk_num);
+			return -EFAULT;
 		}
-
-		if (bwrite(blk_num, buf) == -1)
+		//
+		if (bwrite_meta(blk_num, buf) == -1)
 		{
-			fprintf(stderr, "bwrite error in mknod_v2\n");
-			return -1;
+			fprintf(stderr, "bwrite error blk# %d in alloc_blks\n", blk_num);
+			return -EFAULT;
 		}
-		break;
-	}
-	if (off == MAX_ENTRY_OFFSET - DIR_ENTRY_LENGTH)
-	{
-		fprintf(stderr, "error: directory is full, no entries can be added\n");
-		return -1;
+		count ++;
+		ci->blks_in_use += 1;
 	}
+	// TODO: double indirect blocks.
+
 	return 0;
 }
 
-// removes a directory and a file
-int unlink(const char *path_name)
+static int alloc_blks_for_truncate(struct in_core_inode *ci, int new_blks_in_use);
+// on success: returns the number of bytes written is returned. 0: nothing is written.
+// on failure: returns -1.
+// writes under a shared rwlock and an exclusive range lock, like read_range().
+// the block map and the size change under imap_begin().
+static int write_range(struct in_core_inode* ci, const char* buf, int size, int offset)
 {
-	struct in_core_inode *ci;
-	char path[MAX_PATH_LEN];
-	strncpy(path, path_name, MAX_PATH_LEN);
-	char node_name[strlen(path_name)];
-	char node_path[strlen(path_name)];
-	if (path == NULL)
+	int res;
+	imap_begin(ci);
+#if INLINE_DATA
+	if (ci->blks_in_use == 0 && ci->file_type == REGULAR)
 	{
-		fprintf(stderr, "error: path = NULL in unlink\n");
-		return -1;
+		if (offset + size <= INLINE_DATA_LEN)
+		{
+			res = write_inline(ci, buf, size, offset);
+			imap_end(ci);
+			return res;
+		}
+		// outgrows the inode.
+		if (ci->file_size > 0 && inline_unpack(ci) != 0)
+		{
+			imap_end(ci);
+			return -EIO;
+		}
 	}
-	// seperate node and path to node in 2 strings (mkdir needs this)
-	separate_node_name(path, node_name);
-	separate_node_path(path, node_path);
-#if _DEBUG
-	printf("node_path = %s\n", node_path);
-	printf("node_name = %s\n", node_name);
 #endif
-
-	ci = namei_v2(node_path);
-	if (ci == NULL)
+	if (offset + size > ci->file_size)
 	{
-		fprintf(stderr, "rmdir: cannot find path to directory %s\n", path);
-		return -ENOENT;
-	}
 #if _DEBUG
-	printf("i_num of working_dir = %d\n", ci->i_num);
+		printf("offset+size = %d exceeds file_size %d\n", offset+size, ci->file_size);
 #endif
-	// create a directory node_path under inode ci
-
-	int off = 2 * DIR_ENTRY_LENGTH; // start from the 3rd entry.
-	struct directory_entry* dir_entry;
-	// TODO: needs optimization: read a block at a time for several dir entries look-up.
-	for (; off < MAX_ENTRY_OFFSET - DIR_ENTRY_LENGTH; off += DIR_ENTRY_LENGTH)
+		// the new blks start as holes, only the blks written get allocated.
+		int new_blks_in_use = (offset + size + BLK_SZ - 1 )/BLK_SZ;
+		if (new_blks_in_use > ci->blks_in_use)
+		{
+			ci->blks_in_use = new_blks_in_use;
+			ci->modified = 1;
+		}
+	}
+	imap_end(ci);
+	int count = 0; // the bytes that are copied to buf
+	while (count < size)
 	{
-#if _DEBUG
-		printf("offset = %d\n", off);
-#endif
 		int blk_num;
 		int offset_blk;
-		if (bmap(ci, off, &blk_num, &offset_blk) == -1)
+		int fresh;
+#if ZERO_BLK_HOLES
+		if ((offset + count) % BLK_SZ == 0 && size - count >= BLK_SZ
+		  && blk_is_zero(buf + count))
+		{ // store a blk of zeros as a hole.
+			imap_begin(ci);
+			res = bmap_punch(ci, (offset + count) / BLK_SZ);
+			imap_end(ci);
+			if (res != 0)
+			{
+				fprintf(stderr, "punch error in write\n");
+				return -EIO;
+			}
+			count += BLK_SZ;
+			continue;
+		}
+#endif
+		imap_begin(ci);
+		res = bmap_alloc(ci, offset + count, &blk_num, &offset_blk, &fresh);
+		imap_end(ci);
+		if (res != 0)
 		{
-			fprintf(stderr, "bmap error in unlink\n");
-			return -EFAULT; // bad address
+			fprintf(stderr, "bmap error in write\n");
+			if (count > 0)
+				break;
+			return -ENOSPC;
 		}
 #if _DEBUG
 		printf("blk_num = %d\n", blk_num);
 		printf("offset_blk = %d\n", offset_blk);
 #endif
-		char buf[BLK_SZ];
-		if (bread(blk_num, buf) == -1)
-		{
-			fprintf(stderr, "bread error in unlink\n");
-			return -EIO; // cannot read disk
+                char blk_buf[BLK_SZ];
+		if (fresh)
+			memset(blk_buf, 0, sizeof(blk_buf));
+		else if (offset_blk != 0 || size - count < BLK_SZ)
+		{ // a partial blk write keeps the rest of the blk.
+			res = bread(blk_num, blk_buf);
+			if (res != 0)
+			{
+				fprintf(stderr, "bread error blk# %d in write\n", blk_num);
+				return -EIO;
+			}
 		}
-		dir_entry = (struct directory_entry*)(buf + offset_blk);
+		if (offset_blk + (size - count) <= BLK_SZ)
+		{
+			memcpy(blk_buf + offset_blk, buf + count, size - count);
 #if _DEBUG
-		printf("i_num of curr dir entry = %d\n", dir_entry->inode_num);
+			printf("%d copied to disk buf\n", size - count);
 #endif
-		if (dir_entry->inode_num == BAD_I_NUM)
-		{
-			fprintf(stderr, "reaches the end, cannot find dir %s", path);
-			return -ENOENT;
-		}
-		if (dir_entry->inode_num == EMPTY_I_NUM)
-			continue;
-		if (strcmp(dir_entry->file_name, node_name) != 0)
-			continue;
-		// find the directory. read it and delete it.
-		int i_num = dir_entry->inode_num;
-		struct in_core_inode *target_inode = iget(i_num);
-		if (target_inode == NULL)
-		{
-			fprintf(stderr, "no disk inode corresponding to this i_num %d\n", i_num);
-			return -ENOENT;
+			count = size;
 		}
-#if 0		// not necessary, since we are now also deleting files.
-		if (target_inode->file_type != DIRECTORY)
+		else
 		{
-			fprintf(stderr, "the inode is not a dir\n");
-			return -ENOTDIR;
-		}
+			int to_copy = BLK_SZ - offset_blk;
+			memcpy(blk_buf + offset_blk, buf + count, to_copy);
+#if _DEBUG
+			printf("%d copied to disk buf\n", to_copy);
 #endif
-		// TODO: remove all entries in the target_inode as a directory if it contains entries.
-		// remove the directory
-		if (target_inode->link_count > 0)
-			target_inode->link_count --;
-		if (iput(target_inode) == -1)
-		{
-			fprintf(stderr, "iput error i_num = %d in unlink\n", i_num);
-			return -EIO;
+			count += to_copy;
 		}
-		dir_entry->inode_num = EMPTY_I_NUM; // reset inode num to indicate it is free.
-		if (bwrite(blk_num, buf) == -1)
+		res = bwrite(blk_num, blk_buf);
+#if _DEBUG
+		printf("bwriting to blk #%d\n", blk_num);
+#endif
+		if (res != 0)
 		{
-			fprintf(stderr, "bwrite error in unlink\n");
+			fprintf(stderr, "bwrite error blk# %d in write\n", blk_num);
 			return -EIO;
 		}
-		break;
-	}
-	if (off == MAX_ENTRY_OFFSET - DIR_ENTRY_LENGTH)
-	{
-		fprintf(stderr, "cannot find the directory to delete\n");
-		return -ENOENT;
 	}
-	return 0;
+	imap_begin(ci);
+	if (offset + count > ci->file_size)
+		ci->file_size = offset + count;
+	touch_mtime(ci);
+	imap_end(ci);
+	return count;
 }
 
-/* use separate utilities to split the end of the path and the rest of the path.
-   the end of the path should exist in the current filesystem, and should be a directory
-*/
-int mknod_v2(const char* path_name, int mode, int dev)
+static int do_write(struct in_core_inode* ci, const char* buf, int size, int offset)
 {
-	struct in_core_inode *ci;
-	char path[MAX_PATH_LEN];
-	strncpy(path, path_name, MAX_PATH_LEN);
-	char node_name[strlen(path_name)];
-	char node_path[strlen(path_name)];
-	if (path == NULL)
+	// copy buf to the file from the offset, update to size of bytes.
+        if (ci == NULL)
+                return -ENOENT;
+	struct range_lock rl;
+	int res;
+	ilock(ci, 0);
+	if (offset + size > MAX_FILE_SIZE)
 	{
-		fprintf(stderr, "error: path = NULL during mknod_v2\n");
+		fprintf(stderr, "new file size exceeds maximum file size\n");
+		iunlock_put(ci);
 		return -1;
 	}
-	separate_node_name(path, node_name);
-	separate_node_path(path, node_path);
-#if _DEBUG
-	printf("node_path = %s\n", node_path);
-	printf("node_name = %s\n", node_name);
-#endif
-
-	ci = namei_v2(node_path);
-	if (ci == NULL)
+	range_lock(ci, &rl, offset, size, 1);
+	res = write_range(ci, buf, size, offset);
+	range_unlock(ci, &rl);
+	if (iunlock_put(ci) != 0)
 	{
-		fprintf(stderr, "mknod_v2: cannot create directory %s: No such file or directory\n", path);
-		return -1;
+		fprintf(stderr, "iput error in write\n");
+		return -EIO;
 	}
-#if _DEBUG
-	printf("i_num of working_dir = %d\n", ci->i_num);
-#endif
-	// create a directory node_path under inode ci
-
-	int off;
-	struct directory_entry* dir_entry;
-	// TODO: needs optimization: read a block at a time for several dir entries look-up.
-	for (off = 0; off < MAX_ENTRY_OFFSET - DIR_ENTRY_LENGTH; off += DIR_ENTRY_LENGTH)
+	else
 	{
 #if _DEBUG
-		printf("offset = %d\n", off);
+		printf("iput is successful\n");
 #endif
-		int blk_num;
-		int offset_blk;
-		if (bmap(ci, off, &blk_num, &offset_blk) == -1)
-		{
-			fprintf(stderr, "bmap error in mknod_v2\n");
-			return -1;
-		}
+	}
+	return res;
+}
+
+int write_v2(struct in_core_inode* ci, const char* buf, int size, int offset)
+{
+	journal_start(1);
+	int res = do_write(ci, buf, size, offset);
+	journal_stop(1);
+	return res;
+}
+
+// start is included, end is not. Free [start, end).
+static int free_direct_blks(struct in_core_inode *ci, int abs_start, int abs_end)
+{
+	if (abs_start < 0)
+		return -1;
+	else if (abs_end > DIRECT_BLKS_PER_INODE)
+		return -1;
+	else if (abs_start > abs_end)
+		return -1;
+	int i;
+	int blk_num;
+	int start = abs_start;
+	int end = abs_end;
 #if _DEBUG
-		printf("blk_num = %d\n", blk_num);
-		printf("offset_blk = %d\n", offset_blk);
+	printf("free_direct_blks, start = %d, end = %d\n", start, end);
 #endif
-		char buf[BLK_SZ];
-		if (bread(blk_num, buf) == -1)
+	for (i = start; i < end; i++)
+	{
+		blk_num = ci->block_addr[i];
+		if (blk_num == 0)
+			continue;
+		if (bfree(blk_num) == -1)
 		{
-			fprintf(stderr, "bread error in mknod_v2\n");
+			fprintf(stderr, "bfree error blk# %d when free direct blks\n", blk_num);
 			return -1;
 		}
-		dir_entry = (struct directory_entry*)(buf + offset_blk);
+		ci->block_addr[i] = 0;
+	}
+	return 0;
+}
+
+static int alloc_direct_blks(struct in_core_inode *ci, int abs_start, int abs_end)
+{
+	if (abs_start < 0)
+		return -1;
+	else if (abs_end > DIRECT_BLKS_PER_INODE)
+		return -1;
+	else if (abs_start > abs_end)
+		return -1;
+	int i;
+	int blk_num;
+	int start = abs_start;
+	int end = abs_end;
 #if _DEBUG
-		printf("i_num of curr dir entry = %d\n", dir_entry->inode_num);
+	printf("alloc_direct_blks, start = %d, end = %d\n", start, end);
 #endif
-		if (dir_entry->inode_num != BAD_I_NUM
-		  && dir_entry->inode_num != EMPTY_I_NUM)
-		{ // meaning current dir entry is occupied.
-			continue;
-		}
-		// there is dir entry space left starting from this
-		struct in_core_inode* new_inode = ialloc();
-		if (new_inode == NULL)
-		{
-			fprintf(stderr, "ialloc error in mknod_v2\n");
-			return -1;
-		}
-		new_inode->file_type = REGULAR;
-		new_inode->file_size = 0;
-		new_inode->blks_in_use = 0;
-		// the last step is to update to the disk
-		if (iput(new_inode) == -1)
+	for (i = start; i < end; i++)
+	{
+		blk_num = balloc();
+		if (blk_num == -1)
 		{
-			fprintf(stderr, "iput error in mknod_v2\n");
+			fprintf(stderr, "balooc error when alloc direct blks\n");
 			return -1;
 		}
-                if (dir_entry->inode_num == EMPTY_I_NUM)
-                {
-                        dir_entry->inode_num = (new_inode->i_num);
-                        strncpy(dir_entry->file_name, node_name, FILE_NAME_LEN);
-                }
-                else if (dir_entry->inode_num == BAD_I_NUM)
-                {
-                        dir_entry->inode_num = (new_inode->i_num);
-                        strncpy(dir_entry->file_name, node_name, FILE_NAME_LEN);
-                        // if the dir has the last space for a bad inode num, then
-                        // write a BAD_I_NUM indicating the end of the directory.
-                        dir_entry ++;
-                        dir_entry->inode_num = BAD_I_NUM;
-                }
-                else
-                {
-                        fprintf(stderr, "fatal error: dir_entry->inode_num %d wrong in mkdir_v2\n", dir_entry->inode_num);
-                        return -1;
-                }
+		ci->block_addr[i] = blk_num;
+	}
+	return 0;
+}
 
-		if (bwrite(blk_num, buf) == -1)
+static int multi_bfree(int s_blk_num, int start, int end)
+{
+	char buf[BLK_SZ];
+	if (s_blk_num == 0)
+		return 0;
+	if (bread(s_blk_num, buf) == -1)
+	{
+		fprintf(stderr, "bread error blk#%d in multi_bfree\n", s_blk_num);
+		return -1;
+	}
+	int *p = (int*)buf;
+	int i;
+	int blk_num;
+	for (i = start; i < end; i++)
+	{
+		blk_num = p[i];
+		if (blk_num == 0)
+			continue;
+		if (bfree(blk_num) == -1)
 		{
-			fprintf(stderr, "bwrite error in mknod_v2\n");
+			fprintf(stderr, "bfree error blk#%d when multi_bfree\n", blk_num);
 			return -1;
 		}
-		break;
+		p[i] = 0;
 	}
-	if (off == MAX_ENTRY_OFFSET - DIR_ENTRY_LENGTH)
+	if (bwrite_meta(s_blk_num, buf) == -1)
 	{
-		fprintf(stderr, "error: directory is full, no entries can be added\n");
+		fprintf(stderr, "bwrite error blk#%d when multi_bfree\n", s_blk_num);
 		return -1;
 	}
 	return 0;
 }
 
-int rmdir(const char* path)
-{
-	return unlink(path);
-}
-
-/******************* file operations *************************************/
-
-#if 0
-int open_v2(const char* path, int mode)
+static int multi_balloc(int s_blk_num, int start, int end)
 {
-	struct in_core_inode* ci;
-	struct file_table_entry* ft_ent;
-	int fd;
-
-	ci = namei_v2(path);
-	if (ci == NULL)
+	char buf[BLK_SZ];
+	if (bread(s_blk_num, buf) == -1)
 	{
-		fprintf(stderr, "error: file not found\n");
+		fprintf(stderr, "bread error blk#%d in multi_balloc\n", s_blk_num);
 		return -1;
 	}
-	// TODO: check permissions
-
-	// allocate file table entry for inode
-
-	// TODO: how to truncate a file
-
-	ci->locked = 0;
-	return fd;
-}
-#endif
-
-// on success: returns the number of bytes read is returned. 0: end of file
-// on failure: returns -1
-int read_v2(struct in_core_inode* ci, char* buf, int size, int offset)
-{
-	// from offset, copy size of bytes from the file indicated by path to buf
-        if (ci == NULL)
-                return -ENOENT;
-	int res;
-	int count = 0; // the bytes that are copied to buf
-	if (offset > ci->file_size)
+	int *p = (int*)buf;
+	int i;
+	int blk_num;
+	for (i = start; i < end; i++)
 	{
-		fprintf(stderr, "read error: offset %d exceeds file size %d\n", offset, ci->file_size);
-		return 0;
+		blk_num = balloc();
+		if (blk_num == -1)
+		{
+			fprintf(stderr, "balloc error when multi_balloc\n");
+			return -1;
+		}
+		p[i] = blk_num;
 	}
-	if (offset + size > ci->file_size)
+	if (bwrite_meta(s_blk_num, buf) == -1)
 	{
-		size = ci->file_size - offset;  // update the max bytes to read.
-#if _DEBUG
-		printf("the bytes to read exceeds file_size %d, size updated = %d\n", ci->file_size, size);
-#endif
+		fprintf(stderr, "bwrite error blk#%d when multi_balloc\n", s_blk_num);
+		return -1;
 	}
-	while (count < size)
+	return 0;
+}
+
+// start is included, end is not. Free [start, end).
+static int free_single_ind_blks(struct in_core_inode *ci, int abs_start, int abs_end)
+{
+	if ((abs_start < DIRECT_BLKS_PER_INODE) || (abs_end > max_single) || (abs_start > abs_end))
 	{
-		int blk_num;
-		int offset_blk;  // offset in disk block
-		res = bmap(ci, offset + count, &blk_num, &offset_blk);
-		if (res != 0)
-		{
-			fprintf(stderr, "bmap error in read\n");
-			memset(buf + count, 0, size - count);
-			return -EFAULT;
-		}
-#if _DEBUG
-		printf("blk_num = %d\n", blk_num);
-		printf("offset_blk = %d\n", offset_blk);
-#endif
-		char blk_buf[BLK_SZ];
-		res = bread(blk_num, blk_buf);
-		if (res != 0)
-		{
-			fprintf(stderr, "bread error blk# %d in read\n", blk_num);
-			memset(buf + count, 0, size - count);
-			return -EIO;
-		}
-		if (offset_blk + (size - count) <= BLK_SZ)
-		{ // the left bytes to copy doesn't exceeds blk_size
-			memcpy(buf + count, blk_buf + offset_blk, size - count);
-			count = size;
-		}
-		else
-		{
-			int to_copy = BLK_SZ - offset_blk;
-			memcpy(buf + count, blk_buf + offset_blk, to_copy);
-			count += to_copy;
-		}
+		fprintf(stderr, "range error when free single indirect blks: start %d, end %d\n", abs_start, abs_end);
+		return -1;
+	}
+	// start, end is relative to single indirect blocks
+	int start = abs_start - DIRECT_BLKS_PER_INODE;
+	int end = abs_end - DIRECT_BLKS_PER_INODE;
+	int i;
+	int s_blk_num;
+	int blk_num;
+	s_blk_num = ci->single_ind_blk;
+	if (multi_bfree(s_blk_num, start, end) == -1)
+	{
+		fprintf(stderr, "multi_bfree error blk#%d when free single indirect blks\n", s_blk_num);
+		return -1;
 	}
-	ci->last_accessed = get_time();
-	ci->modified = 1;
-	res = iput(ci);
-	if (res != 0)
+	if (start == 0 && s_blk_num != 0)
+	{// no blks left in the table, need to release the single indirect table blk.
+                if (bfree(s_blk_num) == -1)
+                {
+                        fprintf(stderr, "bfree error blk#%d when free single indirect blks\n", s_blk_num);
+                        return -1;
+                }
+		ci->single_ind_blk = 0;
+		ci->modified = 1;
+	}
+	ci->modified = 1; // written back by the caller's iput().
+	return 0;
+}
+
+// start is included, end is not. Free [start, end).
+static int alloc_single_ind_blks(struct in_core_inode *ci, int abs_start, int abs_end)
+{
+	if ((abs_start < DIRECT_BLKS_PER_INODE) || (abs_end > max_single) || (abs_start > abs_end))
 	{
-		fprintf(stderr, "iput error in read_v2\n");
-		return -EIO;
+		fprintf(stderr, "range error when alloc single indirect blks: start %d, end %d\n", abs_start, abs_end);
+		return -1;
 	}
-	else
+	// start, end is relative to single indirect blocks
+	int start = abs_start - DIRECT_BLKS_PER_INODE;
+	int end = abs_end - DIRECT_BLKS_PER_INODE;
+	int i;
+	int s_blk_num;
+	int blk_num;
+	// need to alloc a blk for single ind.
+	if (hole_fill(&ci->single_ind_blk, 1) == -1)
 	{
-#if _DEBUG
-		printf("iput is successful\n");
-#endif
+		fprintf(stderr, "balloc error when alloc single indirect blks\n");
+		return -1;
 	}
-	return count;
+	ci->modified = 1;
+	s_blk_num = ci->single_ind_blk;
+
+	if (multi_balloc(s_blk_num, start, end) == -1)
+	{
+		fprintf(stderr, "multi_balloc error blk#%d when alloc single indirect blks\n", s_blk_num);
+		return -1;
+	}
+	ci->modified = 1; // written back by the caller's iput().
+	return 0;
 }
 
-static int alloc_blks_for_write(struct in_core_inode *ci, int blks_to_alloc)
+static int free_double_ind_blks(struct in_core_inode *ci, int abs_start, int abs_end)
 {
-	//int bytes_to_alloc = offset + size - ;
-	//int blks_to_alloc = (bytes_to_alloc + BLK_SZ) / BLK_SZ;
+	if ((abs_start < max_single) || (abs_end > max_double) || (abs_start > abs_end))
+	{
+		fprintf(stderr, "range error when free double indirect blks: start %d, end %d\n", abs_start, abs_end);
+		return -1;
+	}
+	// start, end is relative to double indirect blocks
+	int start = abs_start - max_single;
+	int end = abs_end - max_single;
+	int first_ind_blk_idx = start / RANGE_SINGLE;
+	int first_ind_blk_off = start % RANGE_SINGLE;
+	int last_ind_blk_idx = end / RANGE_SINGLE;
+	int last_ind_blk_off = end % RANGE_SINGLE;
 	int i;
-	int count = ci->blks_in_use; // blks allocated.
-	int limit = ci->blks_in_use + blks_to_alloc;
-
-	// first alloc disk blks for direct blks.
-	while (count < limit && count < DIRECT_BLKS_PER_INODE)
+	int d_blk_num; // double indirect blk num.
+	d_blk_num = ci->double_ind_blk;
+	if (d_blk_num == 0) // the whole range is a hole.
+		return 0;
+	char d_ind_buf[BLK_SZ];
+	if (bread(d_blk_num, d_ind_buf) == -1)
 	{
-		int blk_num = balloc();
-		if (blk_num == -1)
+		fprintf(stderr, "bread error blk# %d when free double ind blks\n", d_blk_num);
+		return -1;
+	}
+	int *d_p = (int*)d_ind_buf;
+	int s_blk_num;
+	// get the first ind blk and free from the off until the end;
+	if (first_ind_blk_idx == last_ind_blk_idx)
+	{  // just free blks in one indirect block
+		s_blk_num = d_p[first_ind_blk_idx];
+		if (multi_bfree(s_blk_num, first_ind_blk_off, last_ind_blk_off) == -1)
 		{
-			fprintf(stderr, "balloc error blk# %d in alloc_blks\n", blk_num);
-			return -ENOMEM;
+			fprintf(stderr, "multi_bfree error blk# %d when free double ind blks\n", s_blk_num);
+			return -1;
+		}
+		if (s_blk_num != 0 && first_ind_blk_off == 0)
+		{
+                	if (bfree(s_blk_num) == -1)
+                	{
+                	        fprintf(stderr, "bfree error blk#%d when free double indirect blks\n", s_blk_num);
+                	        return -1;
+                	}
+			d_p[first_ind_blk_idx] = 0;
 		}
-		ci->block_addr[count] = blk_num;
-		ci->blks_in_use += 1;
-		count += 1;
 	}
-	// if count < limit, alloc blks for single indirect.
-	while (count < limit && count < max_single)
-	{
-		int blk_num;
-		if (ci->single_ind_blk == 0) // single hasn't been alloc
+	else if (first_ind_blk_idx < last_ind_blk_idx)
+	{ // free blks in the first, the last and full middle indirect blocks
+		// free blks in the first_ind_blk
+		s_blk_num = d_p[first_ind_blk_idx];
+		if (multi_bfree(s_blk_num, first_ind_blk_off, RANGE_SINGLE) == -1)
 		{
-			blk_num = balloc();
-			if (blk_num == -1)
-			{
-				fprintf(stderr, "balloc error blk# %d in alloc_blks\n", blk_num);
-				return -ENOMEM;
-			}
-			// init blk
-			char sub_buf[BLK_SZ];
-			memset(sub_buf, 0, sizeof(sub_buf));
-			if (bwrite(blk_num, sub_buf) == -1)
-			{
-				fprintf(stderr, "bwrite error blk# %d in alloc_blks\n", blk_num);
-				return -EFAULT;
-			}
-			ci->single_ind_blk = blk_num;
-			//ci->blks_in_use += 1; // count should not be incremented.
+			fprintf(stderr, "multi_bfree error blk# %d when free double ind blks\n", s_blk_num);
+			return -1;
 		}
-		else
-			blk_num = ci->single_ind_blk;
-		char buf[BLK_SZ];
-		memset(buf, 0, sizeof(buf));
-		if (bread(blk_num, buf) == -1)
+		if (s_blk_num != 0 && first_ind_blk_off == 0)
 		{
-			fprintf(stderr, "bread error blk# %d in alloc_blks\n", blk_num);
-			return -EFAULT;
+                	if (bfree(s_blk_num) == -1)
+                	{
+                	        fprintf(stderr, "bfree error blk#%d when free double indirect blks\n", s_blk_num);
+                	        return -1;
+                	}
+			d_p[first_ind_blk_idx] = 0;
 		}
-		int *p = (int*)buf;
-		i = count - DIRECT_BLKS_PER_INODE;
-		if (i < 0 || i >= RANGE_SINGLE)
+		// free blks in the middle ind blks
+		for (i = first_ind_blk_idx + 1; i <= last_ind_blk_idx - 1; i++)
 		{
-			fprintf(stderr, "index error %d for single indirect in alloc_blks\n", i);
-			return -EFAULT;
+			s_blk_num = d_p[i];
+			if (s_blk_num == 0)
+				continue;
+			if (multi_bfree(s_blk_num, 0, RANGE_SINGLE) == -1)
+			{
+				fprintf(stderr, "multi_bfree error blk# %d when free double ind blks\n", s_blk_num);
+				return -1;
+			}
+                	if (bfree(s_blk_num) == -1)
+                	{
+                	        fprintf(stderr, "bfree error blk#%d when free double indirect blks\n", s_blk_num);
+                	        return -1;
+                	}
+			d_p[i] = 0;
+
 		}
-		p[i] = balloc();
-		if (p[i] == -1)
+		// free blks in the last_ind_blk, none if end is on a table boundary.
+		s_blk_num = last_ind_blk_off ? d_p[last_ind_blk_idx] : 0;
+		if (multi_bfree(s_blk_num, 0, last_ind_blk_off) == -1)
 		{
-			fprintf(stderr, "balloc error blk# %d in alloc_blks\n", p[i]);
-			return -ENOMEM;
+			fprintf(stderr, "multi_bfree error blk# %d when free double ind blks\n", s_blk_num);
+			return -1;
 		}
-		// init blk
-		char sub_buf[BLK_SZ];
-		memset(sub_buf, 0, sizeof(sub_buf));
-		if (bwrite(p[i], sub_buf) == -1)
+		if (s_blk_num != 0)
 		{
-			fprintf(stderr, "bwrite error blk# %d in alloc_blks\n", blk_num);
-			return -EFAULT;
+                	if (bfree(s_blk_num) == -1)
+                	{
+                	        fprintf(stderr, "bfree error blk#%d when free double indirect blks\n", s_blk_num);
+                	        return -1;
+                	}
+			d_p[last_ind_blk_idx] = 0;
 		}
-		//
-		if (bwrite(blk_num, buf) == -1)
+	}
+	else
+	{
+		fprintf(stderr, "error: first_ind_blk_idx > last_ind_blk_idx\n");
+		return -1;
+	}
+
+	// write d_ind_buf back to disk.
+	if (bwrite_meta(d_blk_num, d_ind_buf) == -1)
+	{
+		fprintf(stderr, "bwrite error blk# %d when free double ind blks\n", d_blk_num);
+		return -1;
+	}
+
+	if (start == 0)
+	{ // no blks left in the table, free the double indirect table
+		if (bfree(d_blk_num) == -1)
 		{
-			fprintf(stderr, "bwrite error blk# %d in alloc_blks\n", blk_num);
-			return -EFAULT;
+			fprintf(stderr, "bfree error blk# %d when free double ind blks\n", d_blk_num);
+			return -1;
 		}
-		count ++;
-		ci->blks_in_use += 1;
+		ci->double_ind_blk = 0;
+		ci->modified = 1;
 	}
-	// TODO: double indirect blocks.
+	ci->modified = 1; // written back by the caller's iput().
 
 	return 0;
-}
+} // free_double_ind_blks()
 
-static int alloc_blks_for_truncate(struct in_core_inode *ci, int new_blks_in_use);
-// on success: returns the number of bytes written is returned. 0: nothing is written.
-// on failure: returns -1.
-int write_v2(struct in_core_inode* ci, const char* buf, int size, int offset)
+static int alloc_double_ind_blks(struct in_core_inode *ci, int abs_start, int abs_end)
 {
-	int res;
-	// copy buf to the file from the offset, update to size of bytes.
-        if (ci == NULL)
-                return -ENOENT;
-	if (offset + size > MAX_FILE_SIZE)
+	if ((abs_start < max_single) || (abs_end > max_double) || (abs_start > abs_end))
 	{
-		fprintf(stderr, "new file size exceeds maximum file size\n");
+		fprintf(stderr, "range error when alloc double indirect blks: start %d, end %d\n", abs_start, abs_end);
 		return -1;
 	}
-	if (offset + size > ci->file_size)
+	// start, end is relative to double indirect blocks
+	int start = abs_start - max_single;
+	int end = abs_end - max_single;
+	int first_ind_blk_idx = start / RANGE_SINGLE;
+	int first_ind_blk_off = start % RANGE_SINGLE;
+	int last_ind_blk_idx = end / RANGE_SINGLE;
+	int last_ind_blk_off = end % RANGE_SINGLE;
+	int i;
+	int d_blk_num; // double indirect blk num.
+	if (hole_fill(&ci->double_ind_blk, 1) == -1)
 	{
-#if _DEBUG
-		printf("offset+size = %d exceeds file_size %d\n", offset+size, ci->file_size);
-#endif
-		int new_blks_in_use = (offset + size + BLK_SZ - 1 )/BLK_SZ;
-		if (new_blks_in_use > ci->blks_in_use)
+		fprintf(stderr, "balloc error in alloc double ind blks\n");
+		return -1;
+	}
+	ci->modified = 1;
+	d_blk_num = ci->double_ind_blk;
+	char d_ind_buf[BLK_SZ];
+	if (bread(d_blk_num, d_ind_buf) == -1)
+	{
+		fprintf(stderr, "bread error blk# %d when alloc double ind blks\n", d_blk_num);
+		return -1;
+	}
+	int *d_p = (int*)d_ind_buf;
+	int s_blk_num;
+	// get the first ind blk and alloc from the off until one blk less than the end;
+	if (first_ind_blk_idx == last_ind_blk_idx)
+	{  // just alloc blks in one indirect block
+		if (hole_fill(&d_p[first_ind_blk_idx], 1) == -1)
 		{
-                        // allocate more blks.
-                        if (alloc_blks_for_truncate(ci, new_blks_in_use) != 0)
-                        {
-                                fprintf(stderr, "alloc blks error in write\n");
-				dump_super();
-				dump_datablks();
-				exit(0);
-                                return -1;
-                        }
-			ci->blks_in_use = new_blks_in_use;
-			ci->modified = 1;
+			fprintf(stderr, "balloc error in alloc double ind blks\n");
+			return -1;
+		}
+		s_blk_num = d_p[first_ind_blk_idx];
+		if (multi_balloc(s_blk_num, first_ind_blk_off, last_ind_blk_off) == -1)
+		{
+			fprintf(stderr, "multi_balloc error blk# %d when alloc double ind blks - place 1, d_blk_num = %d, first_ind_blk_idx = %d\n", s_blk_num, d_blk_num, first_ind_blk_idx);
+			return -1;
 		}
 	}
-	int count = 0; // the bytes that are copied to buf
-	while (count < size)
-	{
-		int blk_num;
-		int offset_blk;
-		res = bmap(ci, offset + count, &blk_num, &offset_blk);
-		if (res != 0)
+	else if (first_ind_blk_idx < last_ind_blk_idx)
+	{ // alloc blks in the first, the last and full middle indirect blocks
+		// alloc blks in the first_ind_blk
+		if (hole_fill(&d_p[first_ind_blk_idx], 1) == -1)
 		{
-			fprintf(stderr, "bmap error in write\n");
-			return -EFAULT;
+			fprintf(stderr, "balloc error in alloc double ind blks\n");
+			return -1;
 		}
-#if _DEBUG
-		printf("blk_num = %d\n", blk_num);
-		printf("offset_blk = %d\n", offset_blk);
-#endif
-                char blk_buf[BLK_SZ];
-                res = bread(blk_num, blk_buf);
-                if (res != 0)
-                {
-                        fprintf(stderr, "bread error blk# %d in write\n", blk_num);
-                        return -EIO;
-                }
-		if (offset_blk + (size - count) <= BLK_SZ)
+		s_blk_num = d_p[first_ind_blk_idx];
+		if (multi_balloc(s_blk_num, first_ind_blk_off, RANGE_SINGLE) == -1)
 		{
-			memcpy(blk_buf + offset_blk, buf + count, size - count);
-#if _DEBUG
-			printf("%d copied to disk buf\n", size - count);
-#endif
-			count = size;
+			fprintf(stderr, "multi_balloc error blk# %d when alloc double ind blks - place 2\n", s_blk_num);
+			return -1;
 		}
-		else
+		// free blks in the middle ind blks
+		for (i = first_ind_blk_idx + 1; i <= last_ind_blk_idx - 1; i++)
 		{
-			int to_copy = BLK_SZ - offset_blk;
-			memcpy(blk_buf + offset_blk, buf + count, to_copy);
-#if _DEBUG
-			printf("%d copied to disk buf\n", to_copy);
-#endif
-			count += to_copy;
+			if (hole_fill(&d_p[i], 1) == -1)
+			{
+				fprintf(stderr, "balloc error in alloc double ind blks\n");
+				return -1;
+			}
+			s_blk_num = d_p[i];
+			if (multi_balloc(s_blk_num, 0, RANGE_SINGLE) == -1)
+			{
+				fprintf(stderr, "multi_balloc error blk# %d when alloc double ind blks - place 3\n", s_blk_num);
+				return -1;
+			}
 		}
-		res = bwrite(blk_num, blk_buf);
-#if _DEBUG
-		printf("bwriting to blk #%d\n", blk_num);
-#endif
-		if (res != 0)
+		// free blks in the last_ind_blk
+		if (hole_fill(&d_p[last_ind_blk_idx], 1) == -1)
 		{
-			fprintf(stderr, "bwrite error blk# %d in write\n", blk_num);
-			return -EIO;
+			fprintf(stderr, "balloc error in alloc double ind blks\n");
+			return -1;
+		}
+		s_blk_num = d_p[last_ind_blk_idx];
+		if (multi_balloc(s_blk_num, 0, last_ind_blk_off) == -1)
+		{
+			fprintf(stderr, "multi_balloc error blk# %d when alloc double ind blks - place 4\n", s_blk_num);
+			return -1;
 		}
-	}
-	ci->file_size = offset + size;
-	ci->last_modified = get_time();
-	ci->inode_last_mod = get_time();
-	ci->modified = 1;
-	res = iput(ci);
-	if (res != 0)
-	{
-		fprintf(stderr, "iput error in write\n");
-		return -EIO;
 	}
 	else
 	{
-#if _DEBUG
-		printf("iput is successful\n");
-#endif
+		fprintf(stderr, "error: first_ind_blk_idx > last_ind_blk_idx\n");
+		return -1;
 	}
-	return count;
-}
 
-// start is included, end is not. Free [start, end).
-static int free_direct_blks(struct in_core_inode *ci, int abs_start, int abs_end)
-{
-	if (abs_start < 0)
-		return -1;
-	else if (abs_end > DIRECT_BLKS_PER_INODE)
-		return -1;
-	else if (abs_start > abs_end)
-		return -1;
-	int i;
-	int blk_num;
-	int start = abs_start;
-	int end = abs_end;
-#if _DEBUG
-	printf("free_direct_blks, start = %d, end = %d\n", start, end);
-#endif
-	for (i = start; i < end; i++)
+	// write d_ind_buf back to disk.
+	if (bwrite_meta(d_blk_num, d_ind_buf) == -1)
 	{
-		blk_num = ci->block_addr[i];
-		if (blk_num == 0)
-			continue;
-		if (bfree(blk_num) == -1)
-		{
-			fprintf(stderr, "bfree error blk# %d when free direct blks\n", blk_num);
-			return -1;
-		}
-		ci->block_addr[i] = 0;
+		fprintf(stderr, "bwrite error blk# %d when alloc double ind blks\n", d_blk_num);
+		return -1;
 	}
+
+	ci->modified = 1; // written back by the caller's iput().
+
 	return 0;
-}
+} // alloc_double_ind_blks()
 
-static int alloc_direct_blks(struct in_core_inode *ci, int abs_start, int abs_end)
+
+// new_blks_in_use < ci->blks_in_use
+// (x, y): x and y belong to {A, B, C}
+// A: x < DIRECT_BLKS_PER_INODE
+// B: DIRECT_BLKS_PER_INODE < x < max_single
+// C: max_single < x < max_double
+static int free_blks_for_truncate(struct in_core_inode *ci, int new_blks_in_use)
 {
-	if (abs_start < 0)
-		return -1;
-	else if (abs_end > DIRECT_BLKS_PER_INODE)
-		return -1;
-	else if (abs_start > abs_end)
-		return -1;
-	int i;
-	int blk_num;
-	int start = abs_start;
-	int end = abs_end;
 #if _DEBUG
-	printf("alloc_direct_blks, start = %d, end = %d\n", start, end);
+	printf("curr blks_in_use = %d, new_blks_in_use = %d\n", ci->blks_in_use, new_blks_in_use);
 #endif
-	for (i = start; i < end; i++)
+	int abs_start = new_blks_in_use;
+	int abs_end = ci->blks_in_use;
+	if (abs_start >= max_double)
 	{
-		blk_num = balloc();
-		if (blk_num == -1)
-		{
-			fprintf(stderr, "balooc error when alloc direct blks\n");
-			return -1;
-		}
-		ci->block_addr[i] = blk_num;
+		fprintf(stderr, "abs_start %d exceeds max_double %d in free_blks_for_truncate\n", abs_start, max_double);
+		return -1;
 	}
-	return 0;
-}
-
-static int multi_bfree(int s_blk_num, int start, int end)
-{
-	char buf[BLK_SZ];
-	if (s_blk_num == 0)
-		return 0;
-	if (bread(s_blk_num, buf) == -1)
+	if (abs_end > max_double)
 	{
-		fprintf(stderr, "bread error blk#%d in multi_bfree\n", s_blk_num);
+		fprintf(stderr, "abs_end %d exceeds max_double %d in free_blks_for_truncate\n", abs_end, max_double);
 		return -1;
 	}
-	int *p = (int*)buf;
-	int i;
-	int blk_num;
-	for (i = start; i < end; i++)
+
+	if (abs_start >= 0 && abs_start < DIRECT_BLKS_PER_INODE)
 	{
-		blk_num = p[i];
-		if (blk_num == 0)
-			continue;
-		if (bfree(blk_num) == -1)
+		if (abs_end <= DIRECT_BLKS_PER_INODE)  // (A, A)
 		{
-			fprintf(stderr, "bfree error blk#%d when multi_bfree\n", blk_num);
-			return -1;
+			if (free_direct_blks(ci, abs_start, abs_end) != 0)
+			{
+				fprintf(stderr, "free_direct_blks error\n");
+				return -1;
+			}
+		}
+		else if (abs_end > DIRECT_BLKS_PER_INODE && abs_end <= max_single) // (A, B)
+		{
+			if (free_direct_blks(ci, abs_start, DIRECT_BLKS_PER_INODE) != 0)
+			{
+				fprintf(stderr, "free_direct_blks error\n");
+				return -1;
+			}
+			if (free_single_ind_blks(ci, DIRECT_BLKS_PER_INODE, abs_end) != 0)
+			{
+				fprintf(stderr, "free_single_ind_blks error\n");
+				return -1;
+			}
+		}
+		else if (abs_end > max_single && abs_end <= max_double) // (A, C)
+		{
+			if (free_direct_blks(ci, abs_start, DIRECT_BLKS_PER_INODE) != 0)
+			{
+				fprintf(stderr, "free_direct_blks error\n");
+				return -1;
+			}
+			if (free_single_ind_blks(ci, DIRECT_BLKS_PER_INODE, max_single) != 0)
+			{
+				fprintf(stderr, "free_single_ind_blks error\n");
+				return -1;
+			}
+			if (free_double_ind_blks(ci, max_single, abs_end) != 0)
+			{
+				fprintf(stderr, "free_double_ind_blks error\n");
+				return -1;
+			}
 		}
-		p[i] = 0;
-	}
-	if (bwrite(s_blk_num, buf) == -1)
-	{
-		fprintf(stderr, "bwrite error blk#%d when multi_bfree\n", s_blk_num);
-		return -1;
 	}
-	return 0;
-}
-
-static int multi_balloc(int s_blk_num, int start, int end)
-{
-	char buf[BLK_SZ];
-	if (bread(s_blk_num, buf) == -1)
+	else if (abs_start >= DIRECT_BLKS_PER_INODE && abs_start < max_single)
 	{
-		fprintf(stderr, "bread error blk#%d in multi_balloc\n", s_blk_num);
-		return -1;
+		if (abs_end > DIRECT_BLKS_PER_INODE && abs_end <= max_single) // (B, B)
+		{
+			if (free_single_ind_blks(ci, abs_start, abs_end) != 0)
+			{
+				fprintf(stderr, "free_single_ind_blks error\n");
+				return -1;
+			}
+		}
+		else if (abs_end > max_single && abs_end <= max_double) // (B, C)
+		{
+			if (free_single_ind_blks(ci, abs_start, max_single) != 0)
+			{
+				fprintf(stderr, "free_single_ind_blks error\n");
+				return -1;
+			}
+			if (free_double_ind_blks(ci, max_single, abs_end) != 0)
+			{
+				fprintf(stderr, "free_double_ind_blks error\n");
+				return -1;
+			}
+		}
 	}
-	int *p = (int*)buf;
-	int i;
-	int blk_num;
-	for (i = start; i < end; i++)
+	else if (abs_start >= max_single && abs_start < max_double)
 	{
-		blk_num = balloc();
-		if (blk_num == -1)
+		if (abs_end > max_single && abs_end <= max_double) // (C, C)
 		{
-			fprintf(stderr, "balloc error when multi_balloc\n");
-			return -1;
+			if (free_double_ind_blks(ci, abs_start, abs_end) != 0)
+			{
+				fprintf(stderr, "free_double_ind_blks error\n");
+				return -1;
+			}
 		}
-		p[i] = blk_num;
-	}
-	if (bwrite(s_blk_num, buf) == -1)
-	{
-		fprintf(stderr, "bwrite error blk#%d when multi_balloc\n", s_blk_num);
-		return -1;
 	}
+
 	return 0;
-}
+} // free_blks_for_truncate()
 
-// start is included, end is not. Free [start, end).
-static int free_single_ind_blks(struct in_core_inode *ci, int abs_start, int abs_end)
+// new_blks_in_use > ci->blks_in_use. the new data blks are not zeroed: the
+// caller writes them.
+// (x, y): x and y belong to {A, B, C}
+// A: x < DIRECT_BLKS_PER_INODE
+// B: DIRECT_BLKS_PER_INODE < x < max_single
+// C: max_single < x < max_double
+static int alloc_blks_for_truncate(struct in_core_inode *ci, int new_blks_in_use)
 {
-	if ((abs_start < DIRECT_BLKS_PER_INODE) || (abs_end > max_single) || (abs_start > abs_end))
-	{
-		fprintf(stderr, "range error when free single indirect blks: start %d, end %d\n", abs_start, abs_end);
-		return -1;
-	}
-	// start, end is relative to single indirect blocks
-	int start = abs_start - DIRECT_BLKS_PER_INODE;
-	int end = abs_end - DIRECT_BLKS_PER_INODE;
-	int i;
-	int s_blk_num;
-	int blk_num;
-	s_blk_num = ci->single_ind_blk;
-	if (multi_bfree(s_blk_num, start, end) == -1)
+#if _DEBUG
+	printf("curr blks_in_use = %d, new_blks_in_use = %d\n", ci->blks_in_use, new_blks_in_use);
+#endif
+	int abs_start = ci->blks_in_use;
+	int abs_end = new_blks_in_use;
+	ag_hint_inode(ci->i_num);
+	if (abs_start >= max_double)
 	{
-		fprintf(stderr, "multi_bfree error blk#%d when free single indirect blks\n", s_blk_num);
+		fprintf(stderr, "abs_start %d exceeds max_double %d in alloc_blks_for_truncate\n", abs_start, max_double);
 		return -1;
 	}
-	if (start == 0 && end == RANGE_SINGLE)
-	{// need to release the single indirect table blk.
-                if (bfree(s_blk_num) == -1)
-                {
-                        fprintf(stderr, "bfree error blk#%d when free single indirect blks\n", s_blk_num);
-                        return -1;
-                }
-		ci->single_ind_blk = 0;
-		ci->modified = 1;
-	}
-	if (iput(ci) == -1)
+	if (abs_end > max_double)
 	{
-		fprintf(stderr, "iput error in free_single_ind_blks\n");
+		fprintf(stderr, "abs_end %d exceeds max_double %d in alloc_blks_for_truncate\n", abs_end, max_double);
 		return -1;
 	}
-	return 0;
-}
 
-// start is included, end is not. Free [start, end).
-static int alloc_single_ind_blks(struct in_core_inode *ci, int abs_start, int abs_end)
-{
-	if ((abs_start < DIRECT_BLKS_PER_INODE) || (abs_end > max_single) || (abs_start > abs_end))
+	if (abs_start >= 0 && abs_start < DIRECT_BLKS_PER_INODE)
 	{
-		fprintf(stderr, "range error when alloc single indirect blks: start %d, end %d\n", abs_start, abs_end);
-		return -1;
-	}
-	// start, end is relative to single indirect blocks
-	int start = abs_start - DIRECT_BLKS_PER_INODE;
-	int end = abs_end - DIRECT_BLKS_PER_INODE;
-	int i;
-	int s_blk_num;
-	int blk_num;
-	if (ci->single_ind_blk == 0)
-	{ // need to alloc a blk for single ind.
-		s_blk_num = balloc();
-		if (s_blk_num == -1)
+		if (abs_end <= DIRECT_BLKS_PER_INODE)  // (A, A)
 		{
-			fprintf(stderr, "balloc error when alloc single indirect blks\n");
-			return -1;
+			if (alloc_direct_blks(ci, abs_start, abs_end) != 0)
+			{
+				fprintf(stderr, "alloc_direct_blks error\n");
+				return -1;
+			}
+		}
+		else if (abs_end > DIRECT_BLKS_PER_INODE && abs_end <= max_single) // (A, B)
+		{
+			if (alloc_direct_blks(ci, abs_start, DIRECT_BLKS_PER_INODE) != 0)
+			{
+				fprintf(stderr, "alloc_direct_blks error\n");
+				return -1;
+			}
+			if (alloc_single_ind_blks(ci, DIRECT_BLKS_PER_INODE, abs_end) != 0)
+			{
+				fprintf(stderr, "alloc_single_ind_blks error\n");
+				return -1;
+			}
+		}
+		else if (abs_end > max_single && abs_end <= max_double) // (A, C)
+		{
+			if (alloc_direct_blks(ci, abs_start, DIRECT_BLKS_PER_INODE) != 0)
+			{
+				fprintf(stderr, "alloc_direct_blks error\n");
+				return -1;
+			}
+			if (alloc_single_ind_blks(ci, DIRECT_BLKS_PER_INODE, max_single) != 0)
+			{
+				fprintf(stderr, "alloc_single_ind_blks error\n");
+				return -1;
+			}
+			if (alloc_double_ind_blks(ci, max_single, abs_end) != 0)
+			{
+				fprintf(stderr, "alloc_double_ind_blks error\n");
+				return -1;
+			}
 		}
-		ci->single_ind_blk = s_blk_num;
-		ci->modified = 1;
 	}
-	s_blk_num = ci->single_ind_blk;
-
-	if (multi_balloc(s_blk_num, start, end) == -1)
+	else if (abs_start >= DIRECT_BLKS_PER_INODE && abs_start < max_single)
 	{
-		fprintf(stderr, "multi_balloc error blk#%d when alloc single indirect blks\n", s_blk_num);
-		return -1;
+		if (abs_end > DIRECT_BLKS_PER_INODE && abs_end <= max_single) // (B, B)
+		{
+			if (alloc_single_ind_blks(ci, abs_start, abs_end) != 0)
+			{
+				fprintf(stderr, "alloc_single_ind_blks error\n");
+				return -1;
+			}
+		}
+		else if (abs_end > max_single && abs_end <= max_double) // (B, C)
+		{
+			if (alloc_single_ind_blks(ci, abs_start, max_single) != 0)
+			{
+				fprintf(stderr, "alloc_single_ind_blks error\n");
+				return -1;
+			}
+			if (alloc_double_ind_blks(ci, max_single, abs_end) != 0)
+			{
+				fprintf(stderr, "alloc_double_ind_blks error\n");
+				return -1;
+			}
+		}
 	}
-	if (iput(ci) == -1)
+	else if (abs_start >= max_single && abs_start < max_double)
 	{
-		fprintf(stderr, "iput error in alloc_single_ind_blks\n");
-		return -1;
+		if (abs_end > max_single && abs_end <= max_double) // (C, C)
+		{
+			if (alloc_double_ind_blks(ci, abs_start, abs_end) != 0)
+			{
+				fprintf(stderr, "alloc_double_ind_blks error\n");
+				return -1;
+			}
+		}
 	}
+
 	return 0;
-}
+} // alloc_blks_for_truncate()
 
-static int free_double_ind_blks(struct in_core_inode *ci, int abs_start, int abs_end)
+
+// zero the bytes past length in the last blk kept by a truncate, so a later
+// extension reads them as zeros. A hole is already zero.
+static int truncate_tail(struct in_core_inode *ci, int length)
 {
-	if ((abs_start < max_single) || (abs_end > max_double) || (abs_start > abs_end))
-	{
-		fprintf(stderr, "range error when free double indirect blks: start %d, end %d\n", abs_start, abs_end);
+	char blk_buf[BLK_SZ];
+	int blk_num;
+	int offset_blk;
+	if (bmap(ci, length, &blk_num, &offset_blk) == -1)
 		return -1;
-	}
-	// start, end is relative to double indirect blocks
-	int start = abs_start - max_single;
-	int end = abs_end - max_single;
-	int first_ind_blk_idx = start / RANGE_SINGLE;
-	int first_ind_blk_off = start % RANGE_SINGLE;
-	int last_ind_blk_idx = end / RANGE_SINGLE;
-	int last_ind_blk_off = end % RANGE_SINGLE;
-	int i;
-	int d_blk_num; // double indirect blk num.
-	d_blk_num = ci->double_ind_blk;
-	if (d_blk_num == 0)
+	if (blk_num == 0)
+		return 0;
+	if (bread(blk_num, blk_buf) == -1)
 	{
-		fprintf(stderr, "error: d_blk_num = 0, not possible in free_double_ind_blks\n");
+		fprintf(stderr, "bread error blk# %d in truncate_tail\n", blk_num);
 		return -1;
 	}
-	char d_ind_buf[BLK_SZ];
-	if (bread(d_blk_num, d_ind_buf) == -1)
+	memset(blk_buf + offset_blk, 0, BLK_SZ - offset_blk);
+	if (bwrite(blk_num, blk_buf) == -1)
 	{
-		fprintf(stderr, "bread error blk# %d when free double ind blks\n", d_blk_num);
+		fprintf(stderr, "bwrite error blk# %d in truncate_tail\n", blk_num);
 		return -1;
 	}
-	int *d_p = (int*)d_ind_buf;
-	int s_blk_num;
-	// get the first ind blk and free from the off until the end;
-	if (first_ind_blk_idx == last_ind_blk_idx)
-	{  // just free blks in one indirect block
-		s_blk_num = d_p[first_ind_blk_idx];
-		if (multi_bfree(s_blk_num, first_ind_blk_off, last_ind_blk_off) == -1)
-		{
-			fprintf(stderr, "multi_bfree error blk# %d when free double ind blks\n", s_blk_num);
-			return -1;
+	return 0;
+}
+
+/*If the file previously was larger than this size, the extra data is lost. If the file previously was shorter, it is extended, and the extended part reads as null bytes ('\0').*/
+static int do_truncate(struct in_core_inode* ci, int length)
+{
+#if _DEBUG
+	printf("\ntruncate_v2 called\n");
+#endif
+	int res;
+	if (ci == NULL)
+		return -ENOENT;
+	ilock(ci, 1);
+#if INLINE_DATA
+	if (ci->blks_in_use == 0 && ci->file_type == REGULAR)
+	{
+		if (length <= INLINE_DATA_LEN)
+		{ // stays inline. zero what is cut off, a later extension reads zeros.
+			if (length < ci->file_size)
+				memset(INODE_INLINE_DATA(ci) + length, 0, ci->file_size - length);
+			ci->file_size = length;
+			ci->modified = 1;
+			return iunlock_put(ci);
 		}
-		if (first_ind_blk_off == 0 && last_ind_blk_off == RANGE_SINGLE-1)
+		if (ci->file_size > 0 && inline_unpack(ci) != 0)
 		{
-                	if (bfree(s_blk_num) == -1)
-                	{
-                	        fprintf(stderr, "bfree error blk#%d when free double indirect blks\n", s_blk_num);
-                	        return -1;
-                	}
-			d_p[first_ind_blk_idx] = 0;
+			iunlock_put(ci);
+			return -1;
 		}
 	}
-	else if (first_ind_blk_idx < last_ind_blk_idx)
-	{ // free blks in the first, the last and full middle indirect blocks
-		// free blks in the first_ind_blk
-		s_blk_num = d_p[first_ind_blk_idx];
-		if (multi_bfree(s_blk_num, first_ind_blk_off, RANGE_SINGLE) == -1)
+#endif
+	if (length < ci->file_size)
+	{
+		int new_blks_in_use = (length-1 + BLK_SZ)/BLK_SZ;
+		if (length % BLK_SZ != 0 && truncate_tail(ci, length) != 0)
 		{
-			fprintf(stderr, "multi_bfree error blk# %d when free double ind blks\n", s_blk_num);
+			fprintf(stderr, "zero tail error in truncate\n");
+			iunlock_put(ci);
 			return -1;
 		}
-		if (first_ind_blk_off == 0)
-		{
-                	if (bfree(s_blk_num) == -1)
-                	{
-                	        fprintf(stderr, "bfree error blk#%d when free double indirect blks\n", s_blk_num);
-                	        return -1;
-                	}
-			d_p[first_ind_blk_idx] = 0;
-		}
-		// free blks in the middle ind blks
-		for (i = first_ind_blk_idx + 1; i <= last_ind_blk_idx - 1; i++)
+		if (new_blks_in_use < ci->blks_in_use)
 		{
-			s_blk_num = d_p[i];
-			if (multi_bfree(s_blk_num, 0, RANGE_SINGLE) == -1)
+			// truncate blks.
+			if (free_blks_for_truncate(ci, new_blks_in_use) != 0)
 			{
-				fprintf(stderr, "multi_bfree error blk# %d when free double ind blks\n", s_blk_num);
+				fprintf(stderr, "free blks error in truncate\n");
+				iunlock_put(ci);
 				return -1;
 			}
-                	if (bfree(s_blk_num) == -1)
-                	{
-                	        fprintf(stderr, "bfree error blk#%d when free double indirect blks\n", s_blk_num);
-                	        return -1;
-                	}
-			d_p[i] = 0;
-
 		}
-		// free blks in the last_ind_blk
-		s_blk_num = d_p[last_ind_blk_idx];
-		if (multi_bfree(s_blk_num, 0, last_ind_blk_off) == -1)
+		else if (new_blks_in_use == ci->blks_in_use)
 		{
-			fprintf(stderr, "multi_bfree error blk# %d when free double ind blks\n", s_blk_num);
-			return -1;
+			// truncate file.
+			ci->file_size = length;
 		}
-		if (last_ind_blk_off == RANGE_SINGLE - 1)
+		else
 		{
-                	if (bfree(s_blk_num) == -1)
-                	{
-                	        fprintf(stderr, "bfree error blk#%d when free double indirect blks\n", s_blk_num);
-                	        return -1;
-                	}
-			d_p[last_ind_blk_idx] = 0;
+			fprintf(stderr, "error: new_blks_in_use > blk_in_use, while length < file_size\n");
+			iunlock_put(ci);
+			return -1;
+		}
+		ci->blks_in_use = new_blks_in_use;
+		ci->file_size = length;
+		ci->modified = 1;
+	}
+	else if (length == ci->file_size)
+	{ // nothing to do.
+	}
+	else  // length > file_size
+	{ // the extension is a hole, blks are allocated when written.
+		int new_blks_in_use = (length-1 + BLK_SZ)/BLK_SZ;
+		if (new_blks_in_use < ci->blks_in_use)
+		{
+			fprintf(stderr, "error: new_blks_in_use < blks_in_use, while length > file_fize\n");
+			iunlock_put(ci);
+			return -1;
 		}
+		ci->blks_in_use = new_blks_in_use;
+		ci->file_size = length;
+		ci->modified = 1;
 	}
-	else
+	if (iunlock_put(ci) == -1)
 	{
-		fprintf(stderr, "error: first_ind_blk_idx > last_ind_blk_idx\n");
+		fprintf(stderr, "iput error when truncate\n");
 		return -1;
 	}
+	return 0;
+}
 
-	// write d_ind_buf back to disk.
-	if (bwrite(d_blk_num, d_ind_buf) == -1)
+// a long tail is freed a batch per transaction first, as reclaim() does,
+// but before truncate_v2() returns: the new size has no on-disk record that
+// would let the rest go in the background.
+int truncate_v2(struct in_core_inode* ci, int length)
+{
+	int res = 0;
+	if (ci == NULL)
+		journal_start(1);
+	else
+		res = free_blks_in_batches(ci, (length-1 + BLK_SZ)/BLK_SZ);
+	if (res == 0)
+		res = do_truncate(ci, length);
+	else
 	{
-		fprintf(stderr, "bwrite error blk# %d when free double ind blks\n", d_blk_num);
-		return -1;
+		fprintf(stderr, "free blks error in truncate\n");
+		iput(ci);
 	}
+	journal_stop(1);
+	return res;
+}
 
-	if (start == 0 && end == RANGE_DOUBLE)
-	{ // free the double indirect table
-		if (bfree(d_blk_num) == -1)
+// on success: returns the offset of the next data (SEEK_DATA) or hole
+// (SEEK_HOLE) at or after off. The end of file counts as a hole.
+// on failure: returns -ENXIO if off is at or past the end of file.
+int lseek_v2(struct in_core_inode* ci, int off, int whence)
+{
+	int lblk;
+	int blk_num;
+	int offset_blk;
+	int res = -ENXIO;
+	if (ci == NULL)
+		return -ENOENT;
+	ilock(ci, 0);
+	if (whence != SEEK_DATA && whence != SEEK_HOLE)
+	{
+		iunlock_put(ci);
+		return -EINVAL;
+	}
+	// writers may be changing the block map, see write_range().
+	pthread_mutex_lock(&ci->map_lock);
+	if (off < 0 || off >= ci->file_size)
+	{
+		pthread_mutex_unlock(&ci->map_lock);
+		iunlock_put(ci);
+		return -ENXIO;
+	}
+	if (INODE_IS_INLINE(ci))
+		res = whence == SEEK_DATA ? off : ci->file_size;
+	lblk = off / BLK_SZ;
+	while (res == -ENXIO && lblk < ci->blks_in_use)
+	{
+		if (bmap(ci, lblk * BLK_SZ, &blk_num, &offset_blk) == -1)
 		{
-			fprintf(stderr, "bfree error blk# %d when free double ind blks\n", d_blk_num);
-			return -1;
+			pthread_mutex_unlock(&ci->map_lock);
+			iunlock_put(ci);
+			return -EIO;
 		}
-		ci->double_ind_blk = 0;
-		ci->modified = 1;
+		if ((blk_num != 0) == (whence == SEEK_DATA))
+			res = lblk * BLK_SZ > off ? lblk * BLK_SZ : off;
+		else if (blk_num == 0)
+			lblk = bmap_hole_end(ci, lblk);
+		else
+			lblk++;
 	}
-	if (iput(ci) == -1)
+	if (res == -ENXIO && whence == SEEK_HOLE)
+		res = ci->file_size;
+	if (res > ci->file_size)
+		res = whence == SEEK_DATA ? -ENXIO : ci->file_size;
+	pthread_mutex_unlock(&ci->map_lock);
+	iunlock_put(ci);
+	return res;
+}
+
+/************************* Layer 1: consistency check *************************/
+
+/* fsck() checks a fs mounted with init_super() that serves no calls. A scan
+ * of the in-core inode table first weeds out the inodes whose type or size
+ * make no sense. Then worker threads take the inode blks a few at a time and
+ * walk the block map of each inode in them: every blk it reaches is claimed
+ * in a map of all blks, so one reached twice or not a data blk shows up, and
+ * each dir has its entries checked and counted as the links of the inodes
+ * they name. On one thread again, the inodes not reachable from the root are
+ * found, the link counts compared, and the free blk list and free inode
+ * count of each group checked against what nothing reaches. A repair fixes
+ * what a worker finds in place, frees the unreachable inodes, and rebuilds
+ * the free blk list of a group that is off from the blks nothing reaches. */
+
+#define FSCK_IBLKS	8	// inode blks a worker takes at a time
+
+// what a blk was found to be, see struct fsck.
+enum fsck_blk {
+	FSCK_UNSEEN = 0,  // nothing reaches it
+	FSCK_META,        // group header, inode blk or inode map blk
+	FSCK_USED,        // reached from an inode
+	FSCK_FREE,        // on a free blk list
+	FSCK_FREE_LINK    // a link blk of a free blk list
+};
+
+struct fsck {
+	struct volume *vol;
+	int repair;
+	int blks_only;         // only claim the blks of the block maps, see free_lists_recover()
+	int quiet;             // count the problems, do not print them
+	unsigned char *blks;   // enum fsck_blk of each blk; a claim is atomic
+	int nr_inodes;
+	unsigned char *type;   // file_type of each inode in use and sane, set before the workers run
+	unsigned char *dir_holes; // 1: a dir blk of the dir is a hole
+	int *nr_links;         // atomic: dir entries naming each inode, "." and ".." not counted
+	int *parent;           // the dir of the first entry naming each inode, -1: none
+	int *dotdot;           // ".." of each dir, -1: none
+	int *dotdot_at;        // where: blk * DIR_ENTRIES_PER_BLK + slot
+	int next_iblk;         // atomic: the next inode blks a worker takes
+	int nr_problems;       // atomic
+	int nr_fixed;          // atomic
+	int error;             // an I/O or memory error stopped the check
+};
+
+static void fsck_problem(struct fsck *f, int fixed, const char *fmt, ...)
+{
+	va_list ap;
+	char msg[160];
+	va_start(ap, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, ap);
+	va_end(ap);
+	if (!f->quiet)
+		printf("fsck: %s%s\n", msg, fixed ? ", fixed" : "");
+	__atomic_add_fetch(&f->nr_problems, 1, __ATOMIC_RELAXED);
+	if (fixed)
+		__atomic_add_fetch(&f->nr_fixed, 1, __ATOMIC_RELAXED);
+}
+
+static void fsck_error(struct fsck *f)
+{
+	__atomic_store_n(&f->error, 1, __ATOMIC_RELAXED);
+}
+
+static struct disk_inode *fsck_inode(int i_num)
+{
+	return (struct disk_inode*)VOL->iblk_cache[i_num / INODES_PER_BLK] + i_num % INODES_PER_BLK;
+}
+
+// write the checked copy d of inode i_num back to the in-core inode table.
+// An inactive in-core copy of it is dropped, the next iget() reads d; one
+// still referenced gets d too.
+static void fsck_inode_put(int i_num, const struct disk_inode *d)
+{
+	namei_cache_forget(i_num);
+	pthread_mutex_lock(&VOL->itable_lock);
+	struct in_core_inode *ci = ifind(i_num);
+	if (ci != NULL && ci->ref_count == 0)
 	{
-		fprintf(stderr, "iput error in free_double_ind_blks\n");
-		return -1;
+		ihash_remove(ci);
+		ifree_list_remove(ci);
+		ifree_list_add(ci, 1);
 	}
+	else if (ci != NULL)
+		ci->disk = *d;
+	pthread_mutex_lock(&VOL->iblk_lock);
+	*fsck_inode(i_num) = *d;
+	iblk_write(i_num / INODES_PER_BLK);
+	pthread_mutex_unlock(&VOL->iblk_lock);
+	pthread_mutex_unlock(&VOL->itable_lock);
+}
 
+// check block pointer *slot of inode i_num. past_end: the pointer covers
+// only logical blks from blks_in_use on. A good pointer claims its blk. A
+// bad one is cleared by a repair, which makes it a hole. returns 1 if the
+// pointer is good and not a hole.
+static int fsck_ptr(struct fsck *f, int i_num, int *slot, int past_end, const char *what)
+{
+	int blk = *slot;
+	const char *why = NULL;
+	if (blk == 0)
+		return 0;
+	if (past_end)
+		why = "is past the end of the file";
+	else if (blk < 0 || ag_of_blk(blk) == -1)
+		why = "is not a data blk";
+	else
+	{
+		unsigned char seen = FSCK_UNSEEN;
+		if (!__atomic_compare_exchange_n(&f->blks[blk], &seen, FSCK_USED, 0,
+		  __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			why = seen == FSCK_META ? "is a group header or inode blk" : "is used twice";
+	}
+	if (why == NULL)
+		return 1;
+	fsck_problem(f, f->repair, "inode %d: %s blk %d %s", i_num, what, blk, why);
+	if (f->repair)
+		*slot = 0;
 	return 0;
-} // free_double_ind_blks()
+}
 
-static int alloc_double_ind_blks(struct in_core_inode *ci, int abs_start, int abs_end)
+// check the pointers of indirect table tbl, whose first entry maps logical
+// blk lblk0. lblks: where the dir blks found go, NULL for a file.
+static int fsck_table(struct fsck *f, int i_num, const struct disk_inode *d,
+	int tbl, int lblk0, int *lblks)
 {
-	if ((abs_start < max_single) || (abs_end > max_double) || (abs_start > abs_end))
+	int buf[FREE_BLKS_PER_LINK];
+	int i;
+	int dirty = 0;
+	if (bread(tbl, (char*)buf) == -1)
 	{
-		fprintf(stderr, "range error when alloc double indirect blks: start %d, end %d\n", abs_start, abs_end);
+		fsck_error(f);
 		return -1;
 	}
-	// start, end is relative to double indirect blocks
-	int start = abs_start - max_single;
-	int end = abs_end - max_single;
-	int first_ind_blk_idx = start / RANGE_SINGLE;
-	int first_ind_blk_off = start % RANGE_SINGLE;
-	int last_ind_blk_idx = end / RANGE_SINGLE;
-	int last_ind_blk_off = end % RANGE_SINGLE;
+	for (i = 0; i < RANGE_SINGLE; i++)
+	{
+		int old = buf[i];
+		if (fsck_ptr(f, i_num, &buf[i], lblk0 + i >= d->blks_in_use, "data") && lblks != NULL)
+			lblks[lblk0 + i] = buf[i];
+		dirty |= buf[i] != old;
+	}
+	if (dirty && bwrite_meta(tbl, (char*)buf) == -1)
+	{
+		fsck_error(f);
+		return -1;
+	}
+	return 0;
+}
+
+// walk the block map of inode copy d. lblks: where the dir blks go.
+static int fsck_bmap(struct fsck *f, int i_num, struct disk_inode *d, int *lblks)
+{
 	int i;
-	int d_blk_num; // double indirect blk num.
-	if (ci->double_ind_blk == 0)
+	for (i = 0; i < DIRECT_BLKS_PER_INODE; i++)
 	{
-		d_blk_num = balloc();
-		if (d_blk_num == -1)
-		{
-			fprintf(stderr, "balloc error in alloc double ind blks\n");
+		if (fsck_ptr(f, i_num, &d->block_addr[i], i >= d->blks_in_use, "data") && lblks != NULL)
+			lblks[i] = d->block_addr[i];
+	}
+	if (fsck_ptr(f, i_num, &d->single_ind_blk, d->blks_in_use <= DIRECT_BLKS_PER_INODE, "single indirect")
+	  && fsck_table(f, i_num, d, d->single_ind_blk, DIRECT_BLKS_PER_INODE, lblks) == -1)
+		return -1;
+	if (!fsck_ptr(f, i_num, &d->double_ind_blk, d->blks_in_use <= max_single, "double indirect"))
+		return 0;
+	int buf[FREE_BLKS_PER_LINK];
+	int dirty = 0;
+	if (bread(d->double_ind_blk, (char*)buf) == -1)
+	{
+		fsck_error(f);
+		return -1;
+	}
+	for (i = 0; i < RANGE_SINGLE; i++)
+	{
+		int old = buf[i];
+		int lblk0 = max_single + i * RANGE_SINGLE;
+		if (fsck_ptr(f, i_num, &buf[i], lblk0 >= d->blks_in_use, "indirect")
+		  && fsck_table(f, i_num, d, buf[i], lblk0, lblks) == -1)
 			return -1;
-		}
-		ci->double_ind_blk = d_blk_num;
-		ci->modified = 1;
+		dirty |= buf[i] != old;
 	}
-	d_blk_num = ci->double_ind_blk;
-	char d_ind_buf[BLK_SZ];
-	if (bread(d_blk_num, d_ind_buf) == -1)
+	if (dirty && bwrite_meta(d->double_ind_blk, (char*)buf) == -1)
 	{
-		fprintf(stderr, "bread error blk# %d when alloc double ind blks\n", d_blk_num);
+		fsck_error(f);
 		return -1;
 	}
-	int *d_p = (int*)d_ind_buf;
-	int s_blk_num;
-	// get the first ind blk and alloc from the off until one blk less than the end;
-	if (first_ind_blk_idx == last_ind_blk_idx)
-	{  // just alloc blks in one indirect block
-		if (d_p[first_ind_blk_idx] == 0)
+	return 0;
+}
+
+// check the entries of dir blk db, blk blk_num of dir i_num. returns 1 if a
+// repair changed db.
+static int fsck_dir_block(struct fsck *f, int i_num, int blk_num, struct dir_block *db)
+{
+	int slot;
+	int nr_used = 0;
+	int dirty = 0;
+	for (slot = 0; slot < DIR_ENTRIES_PER_BLK; slot++)
+	{
+		int n = db->inode_num[slot];
+		if (n == EMPTY_I_NUM)
+			continue;
+		char *name = db->file_name[slot];
+		int len = strnlen(name, FILE_NAME_LEN);
+		if (len == 0 || len == FILE_NAME_LEN || n < 0 || n >= f->nr_inodes || f->type[n] == UNUSED)
 		{
-			s_blk_num = balloc();
-			if (s_blk_num == -1)
+			fsck_problem(f, f->repair, "dir %d: entry %d in blk %d names %s inode %d",
+			  i_num, slot, blk_num, len == 0 || len == FILE_NAME_LEN ? "with a bad name" : "no", n);
+			if (f->repair)
 			{
-				fprintf(stderr, "balloc error in alloc double ind blks\n");
-				return -1;
+				db->inode_num[slot] = EMPTY_I_NUM;
+				dirty = 1;
 			}
-			d_p[first_ind_blk_idx] = s_blk_num;
-		}
-		s_blk_num = d_p[first_ind_blk_idx];
-		if (multi_balloc(s_blk_num, first_ind_blk_off, last_ind_blk_off) == -1)
-		{
-			fprintf(stderr, "multi_balloc error blk# %d when alloc double ind blks - place 1, d_blk_num = %d, first_ind_blk_idx = %d\n", s_blk_num, d_blk_num, first_ind_blk_idx);
-			return -1;
+			else
+				nr_used++;
+			continue;
 		}
-	}
-	else if (first_ind_blk_idx < last_ind_blk_idx)
-	{ // alloc blks in the first, the last and full middle indirect blocks
-		// alloc blks in the first_ind_blk
-		if (d_p[first_ind_blk_idx] == 0)
+		nr_used++;
+		unsigned int hash = dir_name_hash(name, len);
+		if (db->name_len[slot] != len || db->name_hash[slot] != hash)
 		{
-			s_blk_num = balloc();
-			if (s_blk_num == -1)
+			fsck_problem(f, f->repair, "dir %d: entry %s with a wrong length or hash", i_num, name);
+			if (f->repair)
 			{
-				fprintf(stderr, "balloc error in alloc double ind blks\n");
-				return -1;
+				db->name_len[slot] = len;
+				db->name_hash[slot] = hash;
+				dirty = 1;
 			}
-			d_p[first_ind_blk_idx] = s_blk_num;
-		}
-		s_blk_num = d_p[first_ind_blk_idx];
-		if (multi_balloc(s_blk_num, first_ind_blk_off, RANGE_SINGLE) == -1)
-		{
-			fprintf(stderr, "multi_balloc error blk# %d when alloc double ind blks - place 2\n", s_blk_num);
-			return -1;
 		}
-		// free blks in the middle ind blks
-		for (i = first_ind_blk_idx + 1; i <= last_ind_blk_idx - 1; i++)
+		int type = f->type[n];
+		if (db->file_type[slot] != type)
 		{
-			s_blk_num = balloc();
-			if (s_blk_num == -1)
-			{
-				fprintf(stderr, "balloc error in alloc double ind blks\n");
-				return -1;
-			}
-			d_p[i] = s_blk_num;
-			if (multi_balloc(s_blk_num, 0, RANGE_SINGLE) == -1)
+			fsck_problem(f, f->repair, "dir %d: entry %s has type %d, inode %d %d",
+			  i_num, name, db->file_type[slot], n, type);
+			if (f->repair)
 			{
-				fprintf(stderr, "multi_balloc error blk# %d when alloc double ind blks - place 3\n", s_blk_num);
-				return -1;
+				db->file_type[slot] = type;
+				dirty = 1;
 			}
 		}
-		// free blks in the last_ind_blk
-		s_blk_num = balloc();
-		if (s_blk_num == -1)
+		if (strcmp(name, ".") == 0)
 		{
-			fprintf(stderr, "balloc error in alloc double ind blks\n");
-			return -1;
+			if (n != i_num)
+			{
+				fsck_problem(f, f->repair, "dir %d: \".\" names inode %d", i_num, n);
+				if (f->repair)
+				{
+					db->inode_num[slot] = i_num;
+					db->file_type[slot] = DIRECTORY;
+					dirty = 1;
+				}
+			}
+			continue;
 		}
-		d_p[last_ind_blk_idx] = s_blk_num;
-		if (multi_balloc(s_blk_num, 0, last_ind_blk_off) == -1)
+		if (strcmp(name, "..") == 0)
 		{
-			fprintf(stderr, "multi_balloc error blk# %d when alloc double ind blks - place 4\n", s_blk_num);
-			return -1;
+			f->dotdot[i_num] = n;
+			f->dotdot_at[i_num] = blk_num * DIR_ENTRIES_PER_BLK + slot;
+			continue;
 		}
+		__atomic_add_fetch(&f->nr_links[n], 1, __ATOMIC_RELAXED);
+		int none = -1;
+		__atomic_compare_exchange_n(&f->parent[n], &none, i_num, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
 	}
-	else
+	if (db->nr_used != nr_used)
 	{
-		fprintf(stderr, "error: first_ind_blk_idx > last_ind_blk_idx\n");
-		return -1;
+		fsck_problem(f, f->repair, "dir %d: blk %d counts %d entries, has %d", i_num, blk_num, db->nr_used, nr_used);
+		if (f->repair)
+		{
+			db->nr_used = nr_used;
+			dirty = 1;
+		}
 	}
+	return dirty;
+}
 
-	// write d_ind_buf back to disk.
-	if (bwrite(d_blk_num, d_ind_buf) == -1)
+// read the dir blks of dir i_num, each run of them that lie next to each
+// other on disk in one request, and check them.
+static int fsck_dir(struct fsck *f, int i_num, const int *lblks, int nr)
+{
+	char *run = (char*)malloc((size_t)READ_RUN_BLKS * BLK_SZ);
+	int lblk, n, k;
+	if (run == NULL)
 	{
-		fprintf(stderr, "bwrite error blk# %d when alloc double ind blks\n", d_blk_num);
+		fsck_error(f);
 		return -1;
 	}
-
-	if (iput(ci) == -1)
+	for (lblk = 0; lblk < nr; lblk += n)
 	{
-		fprintf(stderr, "iput error in alloc_double_ind_blks\n");
-		return -1;
+		if (lblks[lblk] == 0)
+		{ // filled with an empty dir blk once the free lists are right.
+			fsck_problem(f, f->repair, "dir %d: dir blk %d is a hole", i_num, lblk);
+			f->dir_holes[i_num] = 1;
+			n = 1;
+			continue;
+		}
+		for (n = 1; n < READ_RUN_BLKS && lblk + n < nr && lblks[lblk + n] == lblks[lblk] + n; n++)
+			;
+		if (bread_run(lblks[lblk], run, n) == -1)
+		{
+			fsck_error(f);
+			free(run);
+			return -1;
+		}
+		for (k = 0; k < n; k++)
+		{
+			struct dir_block *db = (struct dir_block*)(run + (size_t)k * BLK_SZ);
+			if (fsck_dir_block(f, i_num, lblks[lblk + k], db)
+			  && bwrite_meta(lblks[lblk + k], (char*)db) == -1)
+			{
+				fsck_error(f);
+				free(run);
+				return -1;
+			}
+		}
 	}
-
+	free(run);
 	return 0;
-} // alloc_double_ind_blks()
-
+}
 
-// new_blks_in_use < ci->blks_in_use
-// (x, y): x and y belong to {A, B, C}
-// A: x < DIRECT_BLKS_PER_INODE
-// B: DIRECT_BLKS_PER_INODE < x < max_single
-// C: max_single < x < max_double
-static int free_blks_for_truncate(struct in_core_inode *ci, int new_blks_in_use)
+// check inode i_num, known to be in use: its block map, and its entries if
+// it is a dir.
+static int fsck_check_inode(struct fsck *f, int i_num)
 {
-#if _DEBUG
-	printf("curr blks_in_use = %d, new_blks_in_use = %d\n", ci->blks_in_use, new_blks_in_use);
-#endif
-	int abs_start = new_blks_in_use;
-	int abs_end = ci->blks_in_use;
-	if (abs_start >= max_double)
-	{
-		fprintf(stderr, "abs_start %d exceeds max_double %d in free_blks_for_truncate\n", abs_start, max_double);
-		return -1;
-	}
-	if (abs_end > max_double)
+	struct disk_inode d = *fsck_inode(i_num);
+	int *lblks = NULL;
+	int res = 0;
+	if (INODE_IS_INLINE(&d))
+		return 0; // the block map holds the data
+	if (d.file_type == DIRECTORY && !f->blks_only)
 	{
-		fprintf(stderr, "abs_end %d exceeds max_double %d in free_blks_for_truncate\n", abs_end, max_double);
-		return -1;
+		lblks = (int*)calloc(d.blks_in_use, sizeof(int));
+		if (lblks == NULL)
+		{
+			fsck_error(f);
+			return -1;
+		}
 	}
+	res = fsck_bmap(f, i_num, &d, lblks);
+	if (memcmp(&d, fsck_inode(i_num), sizeof(d)) != 0)
+		fsck_inode_put(i_num, &d);
+	if (res == 0 && lblks != NULL)
+		res = fsck_dir(f, i_num, lblks, d.blks_in_use);
+	free(lblks);
+	return res;
+}
 
-	if (abs_start >= 0 && abs_start < DIRECT_BLKS_PER_INODE)
+static void *fsck_worker(void *arg)
+{
+	struct fsck *f = (struct fsck*)arg;
+	vol_enter(f->vol);
+	for (;;)
 	{
-		if (abs_end <= DIRECT_BLKS_PER_INODE)  // (A, A)
+		int iblk = __atomic_fetch_add(&f->next_iblk, FSCK_IBLKS, __ATOMIC_RELAXED);
+		int i_num, end;
+		if (iblk >= VOL->nr_iblks || __atomic_load_n(&f->error, __ATOMIC_RELAXED))
+			break;
+		end = (iblk + FSCK_IBLKS) * INODES_PER_BLK;
+		if (end > f->nr_inodes)
+			end = f->nr_inodes;
+		for (i_num = iblk * INODES_PER_BLK; i_num < end; i_num++)
 		{
-			if (free_direct_blks(ci, abs_start, abs_end) != 0)
-			{
-				fprintf(stderr, "free_direct_blks error\n");
-				return -1;
-			}
+			if (f->type[i_num] != UNUSED && fsck_check_inode(f, i_num) == -1)
+				break;
 		}
-		else if (abs_end > DIRECT_BLKS_PER_INODE && abs_end <= max_single) // (A, B)
+	}
+	return NULL;
+}
+
+// an inode to be freed gives its blks back: they are no longer claimed.
+static void fsck_unclaim(struct fsck *f, const struct disk_inode *d)
+{
+	int buf[FREE_BLKS_PER_LINK], buf2[FREE_BLKS_PER_LINK];
+	int i, j;
+	if (d->blks_in_use == 0)
+		return;
+	for (i = 0; i < DIRECT_BLKS_PER_INODE; i++)
+		if (d->block_addr[i] > 0 && f->blks[d->block_addr[i]] == FSCK_USED)
+			f->blks[d->block_addr[i]] = FSCK_UNSEEN;
+	if (d->single_ind_blk > 0 && f->blks[d->single_ind_blk] == FSCK_USED
+	  && bread(d->single_ind_blk, (char*)buf) == 0)
+	{
+		for (i = 0; i < RANGE_SINGLE; i++)
+			if (buf[i] > 0 && buf[i] < NUM_BLKS && f->blks[buf[i]] == FSCK_USED)
+				f->blks[buf[i]] = FSCK_UNSEEN;
+		f->blks[d->single_ind_blk] = FSCK_UNSEEN;
+	}
+	if (d->double_ind_blk > 0 && f->blks[d->double_ind_blk] == FSCK_USED
+	  && bread(d->double_ind_blk, (char*)buf) == 0)
+	{
+		for (i = 0; i < RANGE_SINGLE; i++)
 		{
-			if (free_direct_blks(ci, abs_start, DIRECT_BLKS_PER_INODE) != 0)
-			{
-				fprintf(stderr, "free_direct_blks error\n");
-				return -1;
-			}
-			if (free_single_ind_blks(ci, DIRECT_BLKS_PER_INODE, abs_end) != 0)
-			{
-				fprintf(stderr, "free_single_ind_blks error\n");
-				return -1;
-			}
+			if (buf[i] <= 0 || buf[i] >= NUM_BLKS || f->blks[buf[i]] != FSCK_USED
+			  || bread(buf[i], (char*)buf2) == -1)
+				continue;
+			for (j = 0; j < RANGE_SINGLE; j++)
+				if (buf2[j] > 0 && buf2[j] < NUM_BLKS && f->blks[buf2[j]] == FSCK_USED)
+					f->blks[buf2[j]] = FSCK_UNSEEN;
+			f->blks[buf[i]] = FSCK_UNSEEN;
 		}
-		else if (abs_end > max_single && abs_end <= max_double) // (A, C)
+		f->blks[d->double_ind_blk] = FSCK_UNSEEN;
+	}
+}
+
+// 1 if inode i_num is reachable from the root through the entries naming
+// it. reach: 0 not known yet, 1 reachable, 2 not, 3 on the path walked.
+static int fsck_reachable(struct fsck *f, unsigned char *reach, int i_num)
+{
+	int n = i_num;
+	int r;
+	while (reach[n] == 0)
+	{
+		reach[n] = 3;
+		if (f->parent[n] < 0)
 		{
-			if (free_direct_blks(ci, abs_start, DIRECT_BLKS_PER_INODE) != 0)
-			{
-				fprintf(stderr, "free_direct_blks error\n");
-				return -1;
-			}
-			if (free_single_ind_blks(ci, DIRECT_BLKS_PER_INODE, max_single) != 0)
-			{
-				fprintf(stderr, "free_single_ind_blks error\n");
-				return -1;
-			}
-			if (free_double_ind_blks(ci, max_single, abs_end) != 0)
-			{
-				fprintf(stderr, "free_double_ind_blks error\n");
-				return -1;
-			}
+			reach[n] = 2;
+			break;
 		}
+		n = f->parent[n];
 	}
-	else if (abs_start >= DIRECT_BLKS_PER_INODE && abs_start < max_single)
+	r = reach[n] == 1 ? 1 : 2; // 3: a loop of dirs
+	for (n = i_num; reach[n] == 3; n = f->parent[n])
+		reach[n] = r;
+	return r == 1;
+}
+
+// the links: inodes no dir reaches from the root, link counts, "..".
+static int fsck_links(struct fsck *f)
+{
+	unsigned char *reach = (unsigned char*)calloc(f->nr_inodes, 1);
+	int i;
+	if (reach == NULL)
+		return -1;
+	reach[VOL->root_i_num] = 1;
+	for (i = 0; i < f->nr_inodes; i++)
 	{
-		if (abs_end > DIRECT_BLKS_PER_INODE && abs_end <= max_single) // (B, B)
+		if (f->type[i] == UNUSED || i == VOL->root_i_num)
+			continue;
+		struct disk_inode d = *fsck_inode(i);
+		if (!fsck_reachable(f, reach, i))
 		{
-			if (free_single_ind_blks(ci, abs_start, abs_end) != 0)
+			if (d.link_count == 0 && VOL->read_only)
+			{ // a mount frees it, see orphan_scan().
+				printf("fsck: inode %d: an orphan, freed at the next mount\n", i);
+				continue;
+			}
+			fsck_problem(f, f->repair, "inode %d: %s, reached from no dir", i,
+			  d.link_count == 0 ? "an orphan" : "lost");
+			if (f->repair)
 			{
-				fprintf(stderr, "free_single_ind_blks error\n");
-				return -1;
+				fsck_unclaim(f, &d);
+				memset(&d, 0, sizeof(d));
+				fsck_inode_put(i, &d);
 			}
+			continue;
 		}
-		else if (abs_end > max_single && abs_end <= max_double) // (B, C)
+		if (d.link_count != f->nr_links[i])
 		{
-			if (free_single_ind_blks(ci, abs_start, max_single) != 0)
-			{
-				fprintf(stderr, "free_single_ind_blks error\n");
-				return -1;
-			}
-			if (free_double_ind_blks(ci, max_single, abs_end) != 0)
+			fsck_problem(f, f->repair, "inode %d: link count %d, %d entries", i, d.link_count, f->nr_links[i]);
+			if (f->repair)
 			{
-				fprintf(stderr, "free_double_ind_blks error\n");
-				return -1;
+				d.link_count = f->nr_links[i];
+				fsck_inode_put(i, &d);
 			}
 		}
 	}
-	else if (abs_start >= max_single && abs_start < max_double)
+	// "..", of the dirs that stay.
+	for (i = 0; i < f->nr_inodes; i++)
 	{
-		if (abs_end > max_single && abs_end <= max_double) // (C, C)
+		if (f->type[i] != DIRECTORY || reach[i] != 1)
+			continue;
+		int want = i == VOL->root_i_num ? i : f->parent[i];
+		if (f->dotdot[i] == want)
+			continue;
+		if (f->dotdot[i] == -1 && f->dir_holes[i] && f->repair)
+			continue; // comes with the first dir blk
+		if (f->dotdot[i] == -1)
 		{
-			if (free_double_ind_blks(ci, abs_start, abs_end) != 0)
-			{
-				fprintf(stderr, "free_double_ind_blks error\n");
-				return -1;
-			}
+			fsck_problem(f, 0, "dir %d: no \"..\"", i);
+			continue;
 		}
+		fsck_problem(f, f->repair, "dir %d: \"..\" names %d, not %d", i, f->dotdot[i], want);
+		if (!f->repair)
+			continue;
+		struct dir_block db;
+		int blk = f->dotdot_at[i] / DIR_ENTRIES_PER_BLK;
+		if (bread(blk, (char*)&db) == -1)
+			return -1;
+		db.inode_num[f->dotdot_at[i] % DIR_ENTRIES_PER_BLK] = want;
+		db.file_type[f->dotdot_at[i] % DIR_ENTRIES_PER_BLK] = DIRECTORY;
+		if (bwrite_meta(blk, (char*)&db) == -1)
+			return -1;
 	}
-
+	free(reach);
 	return 0;
-} // free_blks_for_truncate()
+}
 
-// new_blks_in_use > ci->blks_in_use
-// (x, y): x and y belong to {A, B, C}
-// A: x < DIRECT_BLKS_PER_INODE
-// B: DIRECT_BLKS_PER_INODE < x < max_single
-// C: max_single < x < max_double
-static int alloc_blks_for_truncate(struct in_core_inode *ci, int new_blks_in_use)
+// build the free blk list of group ag anew from the blks nothing uses.
+static int fsck_free_list_rebuild(struct fsck *f, struct ag *ag)
 {
-#if _DEBUG
-	printf("curr blks_in_use = %d, new_blks_in_use = %d\n", ci->blks_in_use, new_blks_in_use);
-#endif
-	int abs_start = ci->blks_in_use;
-	int abs_end = new_blks_in_use;
-	if (abs_start >= max_double)
+	int buf[FREE_BLKS_PER_LINK];
+	int end = ag->d.first_blk + ag->d.nr_blks;
+	int blk;
+	int link = 0;
+	int i = 0;
+	int n = 0;
+	ag->d.free_blk_list_head = 0;
+	ag->d.next_free_blk_idx = 1;
+	for (blk = ag->d.first_blk + 1; blk < end; blk++)
 	{
-		fprintf(stderr, "abs_start %d exceeds max_double %d in alloc_blks_for_truncate\n", abs_start, max_double);
-		return -1;
+		if (f->blks[blk] == FSCK_USED || f->blks[blk] == FSCK_META)
+			continue;
+		n++;
+		if (link != 0 && i < FREE_BLKS_PER_LINK)
+		{
+			buf[i++] = blk;
+			continue;
+		}
+		// blk links the next FREE_BLKS_PER_LINK - 1 free blks.
+		if (link == 0)
+			ag->d.free_blk_list_head = blk;
+		else
+		{
+			buf[0] = blk;
+			if (bwrite_meta(link, (char*)buf) == -1)
+				return -1;
+		}
+		link = blk;
+		memset(buf, 0, sizeof(buf));
+		i = 1;
 	}
-	if (abs_end > max_double)
-	{
-		fprintf(stderr, "abs_end %d exceeds max_double %d in alloc_blks_for_truncate\n", abs_end, max_double);
+	if (link != 0 && bwrite_meta(link, (char*)buf) == -1)
 		return -1;
-	}
+	ag->d.num_free_blks = n;
+	return 0;
+}
 
-	if (abs_start >= 0 && abs_start < DIRECT_BLKS_PER_INODE)
+// a dir blk that is a hole gets an empty one, the first one with "." and
+// "..". Through the regular allocation path: the free lists are right now.
+static int fsck_dir_fill(struct fsck *f, int i_num)
+{
+	struct in_core_inode *ci = iget(i_num);
+	struct dir_block db;
+	int lblk, blk_num, offset_blk, fresh;
+	int res = 0;
+	if (ci == NULL)
+		return -1;
+	ilock(ci, 1);
+	for (lblk = 0; lblk < ci->blks_in_use && res == 0; lblk++)
 	{
-		if (abs_end <= DIRECT_BLKS_PER_INODE)  // (A, A)
+		if (bmap(ci, lblk * BLK_SZ, &blk_num, &offset_blk) == -1)
+			res = -1;
+		else if (blk_num == 0)
 		{
-			if (alloc_direct_blks(ci, abs_start, abs_end) != 0)
+			dir_block_init(&db);
+			if (lblk == 0)
 			{
-				fprintf(stderr, "alloc_direct_blks error\n");
-				return -1;
+				dir_block_set(&db, 0, ".", i_num, DIRECTORY);
+				dir_block_set(&db, 1, "..", f->parent[i_num] >= 0 ? f->parent[i_num] : i_num, DIRECTORY);
 			}
+			if (bmap_alloc(ci, lblk * BLK_SZ, &blk_num, &offset_blk, &fresh) == -1
+			  || bwrite_meta(blk_num, (char*)&db) == -1)
+				res = -1;
 		}
-		else if (abs_end > DIRECT_BLKS_PER_INODE && abs_end <= max_single) // (A, B)
+	}
+	if (iunlock_put(ci) != 0)
+		res = -1;
+	return res;
+}
+
+static const char *fsck_blk_what(int state)
+{
+	if (state == FSCK_USED)
+		return "is in a file";
+	if (state == FSCK_META)
+		return "is a group header or inode blk";
+	return "is listed twice";
+}
+
+// check the free blk list of group ag against the blks nothing uses.
+// returns 1 if the list has to be rebuilt.
+static int fsck_free_list(struct fsck *f, struct ag *ag)
+{
+	int buf[FREE_BLKS_PER_LINK];
+	int first = ag->d.first_blk + 1;
+	int end = ag->d.first_blk + ag->d.nr_blks;
+	int link = ag->d.free_blk_list_head;
+	int e = ag->d.num_free_blks > 0 ? ag->d.next_free_blk_idx : FREE_BLKS_PER_LINK;
+	int n = 0;
+	int bad = 0;
+	int blk;
+	if (ag->d.num_free_blks == 0)
+		link = 0;
+	else if (e < 0 || e >= FREE_BLKS_PER_LINK)
+	{
+		fsck_problem(f, f->repair, "group %d: bad free list index %d", ag->idx, e);
+		bad = 1;
+	}
+	while (link != 0 && !bad)
+	{
+		if (link < first || link >= end || f->blks[link] != FSCK_UNSEEN)
 		{
-			if (alloc_direct_blks(ci, abs_start, DIRECT_BLKS_PER_INODE) != 0)
-			{
-				fprintf(stderr, "alloc_direct_blks error\n");
-				return -1;
-			}
-			if (alloc_single_ind_blks(ci, DIRECT_BLKS_PER_INODE, abs_end) != 0)
-			{
-				fprintf(stderr, "alloc_single_ind_blks error\n");
-				return -1;
-			}
+			fsck_problem(f, f->repair, "group %d: free list link blk %d %s", ag->idx, link,
+			  link < first || link >= end ? "is outside the group" : fsck_blk_what(f->blks[link]));
+			bad = 1;
+			break;
 		}
-		else if (abs_end > max_single && abs_end <= max_double) // (A, C)
+		f->blks[link] = FSCK_FREE_LINK;
+		n++;
+		if (bread(link, (char*)buf) == -1)
+			return -1;
+		for (e = e == 0 ? FREE_BLKS_PER_LINK : e; e < FREE_BLKS_PER_LINK && buf[e] != 0; e++)
 		{
-			if (alloc_direct_blks(ci, abs_start, DIRECT_BLKS_PER_INODE) != 0)
+			blk = buf[e];
+			if (blk < first || blk >= end || f->blks[blk] != FSCK_UNSEEN)
 			{
-				fprintf(stderr, "alloc_direct_blks error\n");
-				return -1;
-			}
-			if (alloc_single_ind_blks(ci, DIRECT_BLKS_PER_INODE, max_single) != 0)
-			{
-				fprintf(stderr, "alloc_single_ind_blks error\n");
-				return -1;
-			}
-			if (alloc_double_ind_blks(ci, max_single, abs_end) != 0)
-			{
-				fprintf(stderr, "alloc_double_ind_blks error\n");
-				return -1;
+				fsck_problem(f, f->repair, "group %d: free blk %d %s", ag->idx, blk,
+				  blk < first || blk >= end ? "is outside the group" : fsck_blk_what(f->blks[blk]));
+				bad = 1;
+				break;
 			}
+			f->blks[blk] = FSCK_FREE;
+			n++;
 		}
+		link = buf[0];
+		e = 1;
 	}
-	else if (abs_start >= DIRECT_BLKS_PER_INODE && abs_start < max_single)
+	if (!bad && n != ag->d.num_free_blks)
 	{
-		if (abs_end > DIRECT_BLKS_PER_INODE && abs_end <= max_single) // (B, B)
+		fsck_problem(f, f->repair, "group %d: %d free blks listed, %d counted", ag->idx, n, ag->d.num_free_blks);
+		bad = 1;
+	}
+	int lost = 0;
+	for (blk = first; blk < end; blk++)
+		lost += f->blks[blk] == FSCK_UNSEEN;
+	if (lost > 0 && !bad)
+	{
+		fsck_problem(f, f->repair, "group %d: %d blks neither used nor free", ag->idx, lost);
+		bad = 1;
+	}
+	return bad;
+}
+
+// check the free inode count and the free ilist of group ag. returns 1 if
+// they have to be made anew.
+static int fsck_free_inodes(struct fsck *f, struct ag *ag)
+{
+	int iblk, k;
+	int nr_free = 0;
+	for (iblk = ag->idx; iblk < VOL->nr_iblks; iblk += VOL->super->nr_ags)
+	{
+		struct disk_inode *di = (struct disk_inode*)VOL->iblk_cache[iblk];
+		for (k = 0; k < INODES_PER_BLK; k++)
+			nr_free += di[k].file_type == UNUSED;
+	}
+	if (nr_free != ag->d.num_free_inodes)
+	{
+		fsck_problem(f, f->repair, "group %d: %d free inodes counted, %d found", ag->idx, ag->d.num_free_inodes, nr_free);
+		return 1;
+	}
+	if (ag->d.next_free_inode_idx < 0 || ag->d.next_free_inode_idx > AG_ILIST_SIZE)
+	{
+		fsck_problem(f, f->repair, "group %d: bad free ilist index %d", ag->idx, ag->d.next_free_inode_idx);
+		return 1;
+	}
+	for (k = ag->d.next_free_inode_idx; k < AG_ILIST_SIZE; k++)
+	{
+		int i_num = ag->d.free_ilist[k];
+		if (i_num < 0 || i_num >= f->nr_inodes || ag_of_inode(i_num) != ag->idx
+		  || fsck_inode(i_num)->file_type != UNUSED)
 		{
-			if (alloc_single_ind_blks(ci, abs_start, abs_end) != 0)
-			{
-				fprintf(stderr, "alloc_single_ind_blks error\n");
-				return -1;
-			}
+			fsck_problem(f, f->repair, "group %d: inode %d on the free ilist is not free", ag->idx, i_num);
+			return 1;
 		}
-		else if (abs_end > max_single && abs_end <= max_double) // (B, C)
+	}
+	return 0;
+}
+
+// mark the blks of the groups and inode table as such. returns 0, or -1 if
+// the layout itself is broken, beyond what a repair can fix.
+static int fsck_layout(struct fsck *f)
+{
+	int g, i;
+	for (i = 0; i < VOL->super->data_blk_offset; i++)
+		f->blks[i] = FSCK_META;
+	for (g = 0; g < VOL->super->nr_ags; g++)
+	{
+		struct ag_desc *d = &VOL->ags[g].d;
+		if (d->first_blk != VOL->super->data_blk_offset + g * VOL->super->ag_blks
+		  || d->nr_blks < 1 || d->first_blk + d->nr_blks > VOL->super->num_blks)
 		{
-			if (alloc_single_ind_blks(ci, abs_start, max_single) != 0)
-			{
-				fprintf(stderr, "alloc_single_ind_blks error\n");
-				return -1;
-			}
-			if (alloc_double_ind_blks(ci, max_single, abs_end) != 0)
-			{
-				fprintf(stderr, "alloc_double_ind_blks error\n");
-				return -1;
-			}
+			fsck_problem(f, 0, "group %d: header says blks %d-%d", g, d->first_blk, d->first_blk + d->nr_blks - 1);
+			return -1;
 		}
+		f->blks[d->first_blk] = FSCK_META;
 	}
-	else if (abs_start >= max_single && abs_start < max_double)
+	for (i = 0; i < IMAP_BLKS; i++)
 	{
-		if (abs_end > max_single && abs_end <= max_double) // (C, C)
+		int blk = VOL->super->imap_blks[i];
+		if (blk == 0)
+			continue;
+		if (ag_of_blk(blk) == -1 || f->blks[blk] != FSCK_UNSEEN)
 		{
-			if (alloc_double_ind_blks(ci, abs_start, abs_end) != 0)
-			{
-				fprintf(stderr, "alloc_double_ind_blks error\n");
-				return -1;
-			}
+			fsck_problem(f, 0, "inode map blk %d is not a data blk of its own", blk);
+			return -1;
 		}
+		f->blks[blk] = FSCK_META;
+	}
+	for (i = ILIST_SPACE; i < VOL->nr_iblks; i++)
+	{
+		int blk = VOL->iblk_loc[i];
+		if (ag_of_blk(blk) == -1 || f->blks[blk] != FSCK_UNSEEN)
+		{
+			fsck_problem(f, 0, "inode blk %d at blk %d is not a data blk of its own", i, blk);
+			return -1;
+		}
+		f->blks[blk] = FSCK_META;
 	}
-
 	return 0;
-} // alloc_blks_for_truncate()
-
+}
 
-/*If the file previously was larger than this size, the extra data is lost. If the file previously was shorter, it is extended, and the extended part reads as null bytes ('\0').*/
-int truncate_v2(struct in_core_inode* ci, int length)
+// the inodes in use, with a type and size that make sense.
+static void fsck_scan_inodes(struct fsck *f)
 {
-#if _DEBUG
-	printf("\ntruncate_v2 called\n");
-#endif
-	int res;
-	if (ci == NULL)
-		return -ENOENT;
-	if (length < ci->file_size)
+	int i;
+	for (i = 0; i < f->nr_inodes; i++)
 	{
-		int new_blks_in_use = (length-1 + BLK_SZ)/BLK_SZ;
-		if (new_blks_in_use < ci->blks_in_use)
+		struct disk_inode d = *fsck_inode(i);
+		const char *why = NULL;
+		if (d.file_type == UNUSED)
+			continue;
+		if (d.file_type < REGULAR || d.file_type > FIFO)
+			why = "has no valid type";
+		else if (d.blks_in_use < 0 || d.blks_in_use > max_double)
+			why = "has a bad blk count";
+		else if (d.file_size < 0 || d.file_size > MAX_FILE_SIZE)
+			why = "has a bad size";
+		else if (d.file_type == DIRECTORY && d.blks_in_use == 0)
+			why = "is a dir without blks";
+		if (why != NULL)
 		{
-			// truncate blks.
-			if (free_blks_for_truncate(ci, new_blks_in_use) != 0)
+			// its blks are claimed by nothing, so a repair frees them.
+			fsck_problem(f, f->repair, "inode %d: %s", i, why);
+			if (f->repair)
 			{
-				fprintf(stderr, "free blks error in truncate\n");
-				return -1;
+				memset(&d, 0, sizeof(d));
+				fsck_inode_put(i, &d);
 			}
+			continue;
 		}
-		else if (new_blks_in_use == ci->blks_in_use)
+		f->type[i] = d.file_type;
+		if (d.file_type == DIRECTORY && d.file_size != d.blks_in_use * BLK_SZ)
 		{
-			// truncate file.
-			ci->file_size = length;
+			fsck_problem(f, f->repair, "dir %d: size %d, %d blks", i, d.file_size, d.blks_in_use);
+			d.file_size = d.blks_in_use * BLK_SZ;
 		}
-		else
+		else if (d.blks_in_use == 0 && d.file_size > INLINE_DATA_LEN)
 		{
-			fprintf(stderr, "error: new_blks_in_use > blk_in_use, while length < file_size\n");
-			return -1;
+			fsck_problem(f, f->repair, "inode %d: size %d, no blks", i, d.file_size);
+			d.file_size = INLINE_DATA_LEN;
 		}
-		ci->blks_in_use = new_blks_in_use;
-		ci->modified = 1;
+		else if (d.blks_in_use > 0 && d.file_size > d.blks_in_use * BLK_SZ)
+		{
+			fsck_problem(f, f->repair, "inode %d: size %d past its %d blks", i, d.file_size, d.blks_in_use);
+			d.blks_in_use = (d.file_size + BLK_SZ - 1) / BLK_SZ;
+		}
+		else
+			continue;
+		if (f->repair)
+			fsck_inode_put(i, &d);
 	}
-	else if (length == ci->file_size)
-	{ // nothing to do.
+}
+
+int fsck(int repair, int nr_threads, int *nr_fixed)
+{
+	struct fsck f;
+	pthread_t *workers;
+	int i, g;
+	int res = 0;
+	memset(&f, 0, sizeof(f));
+	f.vol = VOL;
+	f.repair = repair;
+	f.nr_inodes = VOL->nr_iblks * INODES_PER_BLK;
+	if (nr_threads < 1)
+		nr_threads = 1;
+	if (repair && VOL->read_only)
+	{
+		fprintf(stderr, "error: fsck cannot repair a read-only volume\n");
+		return -1;
 	}
-	else  // length > file_size
-	{ // TODO
-		int new_blks_in_use = (length-1 + BLK_SZ)/BLK_SZ;
-		if (new_blks_in_use > ci->blks_in_use)
+	f.blks = (unsigned char*)calloc(VOL->super->num_blks, 1);
+	f.type = (unsigned char*)calloc(f.nr_inodes, 1);
+	f.dir_holes = (unsigned char*)calloc(f.nr_inodes, 1);
+	f.nr_links = (int*)calloc(f.nr_inodes, sizeof(int));
+	f.parent = (int*)malloc(f.nr_inodes * sizeof(int));
+	f.dotdot = (int*)malloc(f.nr_inodes * sizeof(int));
+	f.dotdot_at = (int*)calloc(f.nr_inodes, sizeof(int));
+	workers = (pthread_t*)calloc(nr_threads, sizeof(pthread_t));
+	if (f.blks == NULL || f.type == NULL || f.dir_holes == NULL || f.nr_links == NULL || f.parent == NULL
+	  || f.dotdot == NULL || f.dotdot_at == NULL || workers == NULL)
+	{
+		fprintf(stderr, "error: no memory for fsck\n");
+		res = -1;
+		goto fsck_out;
+	}
+	for (i = 0; i < f.nr_inodes; i++)
+		f.parent[i] = f.dotdot[i] = -1;
+	// the orphans are freed, the blks threads have reserved are on the free
+	// lists again, so are the blks the journal kept back, and all the inode
+	// table is in core. a read-only volume has nothing of the kind to write
+	// back.
+	if (!VOL->read_only
+	  && (reclaim_pending(RECLAIM_QUEUE_SZ) == -1 || blk_mags_drain(0) == -1 || iflush(1) == -1
+	    || journal_checkpoint() == -1))
+	{
+		res = -1;
+		goto fsck_out;
+	}
+	pthread_mutex_lock(&VOL->iblk_lock);
+	for (i = 0; i < VOL->nr_iblks && res == 0; i++)
+		if (iblk_read(i) == NULL)
+			res = -1;
+	pthread_mutex_unlock(&VOL->iblk_lock);
+	if (res == -1)
+		goto fsck_out;
+	if (fsck_layout(&f) == -1)
+		goto fsck_out;
+	fsck_scan_inodes(&f);
+	if (f.type[VOL->root_i_num] != DIRECTORY)
+	{
+		fsck_problem(&f, 0, "root inode %d is not a dir", VOL->root_i_num);
+		goto fsck_out;
+	}
+	// the block maps and dirs, on nr_threads threads.
+	for (i = 0; i < nr_threads; i++)
+	{
+		if (pthread_create(&workers[i], NULL, fsck_worker, &f) != 0)
+			break;
+	}
+	if (i == 0)
+		fsck_worker(&f);
+	while (i > 0)
+		pthread_join(workers[--i], NULL);
+	if (f.error || fsck_links(&f) == -1)
+	{
+		fprintf(stderr, "error: I/O error in fsck\n");
+		res = -1;
+		goto fsck_out;
+	}
+	// the groups' free blks and inodes.
+	int nr_free_blks = 0, nr_free_inodes = 0;
+	for (g = 0; g < VOL->super->nr_ags; g++)
+	{
+		struct ag *ag = &VOL->ags[g];
+		int blks_bad = fsck_free_list(&f, ag);
+		int inodes_bad = fsck_free_inodes(&f, ag);
+		if (blks_bad == -1)
 		{
-			// allocate more blks.
-			if (alloc_blks_for_truncate(ci, new_blks_in_use) != 0)
+			res = -1;
+			goto fsck_out;
+		}
+		if (f.repair && blks_bad && fsck_free_list_rebuild(&f, ag) == -1)
+		{
+			res = -1;
+			goto fsck_out;
+		}
+		if (f.repair && inodes_bad)
+		{
+			int iblk, k;
+			ag->d.num_free_inodes = 0;
+			for (iblk = g; iblk < VOL->nr_iblks; iblk += VOL->super->nr_ags)
+				for (k = 0; k < INODES_PER_BLK; k++)
+					ag->d.num_free_inodes += fsck_inode(iblk * INODES_PER_BLK + k)->file_type == UNUSED;
+			ag->d.next_free_inode_idx = AG_ILIST_SIZE;
+			ag->d.remembered_inode = g * INODES_PER_BLK;
+			pthread_mutex_lock(&ag->lock);
+			int filled = fill_free_ilist(ag);
+			pthread_mutex_unlock(&ag->lock);
+			if (filled == -1)
 			{
-				fprintf(stderr, "alloc blks error in truncate\n");
-				return -1;
+				res = -1;
+				goto fsck_out;
 			}
 		}
-		else if (new_blks_in_use == ci->blks_in_use)
+		if (f.repair && (blks_bad || inodes_bad) && ag_write(ag) == -1)
 		{
-			// just update the file size;
-			ci->file_size = length;
+			res = -1;
+			goto fsck_out;
 		}
-		else
+		nr_free_blks += ag->d.num_free_blks;
+		nr_free_inodes += ag->d.num_free_inodes;
+	}
+	if (f.repair)
+	{
+		VOL->super->num_free_blks = nr_free_blks;
+		VOL->super->num_free_inodes = nr_free_inodes;
+		if (update_super() == -1)
+			res = -1;
+		for (i = 0; i < f.nr_inodes && res == 0; i++)
 		{
-			fprintf(stderr, "error: new_blks_in_use < blks_in_use, while length > file_fize\n");
-			return -1;
+			if (f.dir_holes[i] && f.type[i] == DIRECTORY && fsck_inode(i)->file_type == DIRECTORY
+			  && fsck_dir_fill(&f, i) == -1)
+				res = -1;
 		}
-		ci->blks_in_use = new_blks_in_use;
-		ci->modified = 1;
+		if (res == 0 && (blk_mags_drain(0) == -1 || iflush(1) == -1))
+			res = -1;
 	}
-	if (iput(ci) == -1)
+fsck_out:
+	if (res == 0)
 	{
-		fprintf(stderr, "iput error when truncate\n");
-		return -1;
+		int used = 0;
+		for (i = 0; i < VOL->super->num_blks; i++)
+			used += f.blks[i] == FSCK_USED;
+		printf("fsck: %d inodes, %d blks in files; %d problems, %d fixed\n",
+		  f.nr_inodes - VOL->super->num_free_inodes, used, f.nr_problems, f.nr_fixed);
+		res = f.nr_problems;
+		if (nr_fixed != NULL)
+			*nr_fixed = f.nr_fixed;
 	}
-	return 0;
+	free(f.blks);
+	free(f.type);
+	free(f.dir_holes);
+	free(f.nr_links);
+	free(f.parent);
+	free(f.dotdot);
+	free(f.dotdot_at);
+	free(workers);
+	return res;
 }
 
-
-
-
-
-
-
+/* After a crash, the blks threads had taken into their magazines are off the
+ * free lists of their groups but in no file, see blk_mags_drain(). A mount of
+ * a fs not unmounted cleanly walks the block maps like fsck() does and puts
+ * every blk nothing reaches back on the free list of its group. A fs found
+ * with any other problem is left as it is, for fsck. */
+static int free_lists_recover(void)
+{
+	struct fsck f;
+	int g;
+	int res = 0;
+	int nr_groups = 0, nr_blks = 0;
+	memset(&f, 0, sizeof(f));
+	f.vol = VOL;
+	f.blks_only = 1;
+	f.nr_inodes = VOL->nr_iblks * INODES_PER_BLK;
+	f.blks = (unsigned char*)calloc(VOL->super->num_blks, 1);
+	f.type = (unsigned char*)calloc(f.nr_inodes, 1);
+	if (f.blks == NULL || f.type == NULL)
+	{
+		fprintf(stderr, "error: no memory to recover the free blk lists\n");
+		res = -1;
+		goto recover_out;
+	}
+	if (fsck_layout(&f) == -1)
+		goto recover_out;
+	fsck_scan_inodes(&f);
+	fsck_worker(&f);
+	if (f.error)
+	{
+		res = -1;
+		goto recover_out;
+	}
+	if (f.nr_problems > 0)
+	{
+		printf("recovery: free blk lists not checked, %d problems found: run fsck.monsterfs\n", f.nr_problems);
+		goto recover_out;
+	}
+	f.quiet = 1;
+	for (g = 0; g < VOL->super->nr_ags && res == 0; g++)
+	{
+		struct ag *ag = &VOL->ags[g];
+		int nr_free = ag->d.num_free_blks;
+		int bad = fsck_free_list(&f, ag);
+		if (bad == -1)
+			res = -1;
+		else if (bad)
+		{
+			if (fsck_free_list_rebuild(&f, ag) == -1 || ag_write(ag) == -1)
+				res = -1;
+			nr_groups++;
+			nr_blks += ag->d.num_free_blks - nr_free;
+		}
+	}
+	if (res == 0 && nr_groups > 0)
+	{
+		VOL->super->num_free_blks = 0;
+		for (g = 0; g < VOL->super->nr_ags; g++)
+			VOL->super->num_free_blks += VOL->ags[g].d.num_free_blks;
+		if (update_super() == -1 || iflush(1) == -1)
+			res = -1;
+		printf("recovery: %d blks put back on the free lists of %d groups\n", nr_blks, nr_groups);
+	}
+recover_out:
+	free(f.blks);
+	free(f.type);
+	return res;
+}
@@ -2,6 +2,8 @@
 
 #define MONSTERFS_FUNS
 
+#include <pthread.h>
+
 #define IN_MEM_STORE    0     // 1, using in-memory storage emulator
                               // 0, attaching to block device storage
 #define BLOCK_DEV_PATH  "/dev/vdc"
@@ -16,50 +18,144 @@
 #define IN_MEM_FD       -2    // in-memory fake file descriptor
 #define FREE_BLKS_PER_LINK (BLK_SZ>>2)     // # of blk idx #s in a block
 
-#define ILIST_SPACE (64)                  // # of blocks that contains inodes
+#define ILIST_SPACE (64)                  // # of blocks that contains inodes at mkfs
+#define IMAP_BLKS   (64)                  // max # of inode map blks, each maps FREE_BLKS_PER_LINK inode blks
+#define IGROW_BLKS  (8)                   // # of inode blks added when free inodes run out
+
+#define NR_AGS      (8)                   // allocation groups the data blks are split into, see struct ag_desc
+#define JOURNAL_BLKS (1024)               // blks of the metadata journal after the inode blks, its header included
 
-#define MAX_FREE_ILIST_SIZE (32)          // # of free inodes in superblk ilist
+#define MAX_FREE_ILIST_SIZE (512)         // # of free inodes listed over all the groups
+#define AG_ILIST_SIZE (MAX_FREE_ILIST_SIZE/NR_AGS) // # of free inodes in a group's ilist, a group header must fit in a blk
+#define ILIST_LOW_WATER   (MAX_FREE_ILIST_SIZE/4) // the inode table grows ahead below this many free inodes
+#define AG_ILIST_LOW_WATER (AG_ILIST_SIZE/4)      // a group's free ilist refilled ahead below this
 #define FILE_OWNER_ID_LEN 16              // length of file owner's ID
 #define DIRECT_BLKS_PER_INODE 10             // # of direct block addr in an inode
 #define RANGE_SINGLE   (BLK_SZ>>2)            // blk range of single indirect
 #define RANGE_DOUBLE   (RANGE_SINGLE*RANGE_SINGLE)   // bLK range of double indirect
 #define INODES_PER_BLK  (BLK_SZ/sizeof(struct disk_inode))    // # of inodes per block
-#define DIR_ENTRY_LENGTH  256  // in bytes
-#define DIR_ENTRIES_PER_BLK   (BLK_SZ/DIR_ENTRY_LENGTH)
-#define FILE_NAME_LEN     (DIR_ENTRY_LENGTH-4)    // file name size in a dir entry
-#define MAX_ENTRY_OFFSET  (100*DIR_ENTRY_LENGTH) // max entries in a directory
-#define BAD_I_NUM         (-1)    // inode num indicates the end of a dir entry
+#define DIR_ENTRIES_PER_BLK   16    // # of dir entries (slots) in a dir block
+// the slot header takes 16 bytes of each of the 256-byte slots, so names are
+// 239 characters at most, down from 252 when a slot was an i_num and a name.
+#define FILE_NAME_LEN     240   // file name size in a dir entry, '\0' included
+#define DIR_HEADER_LEN    (BLK_SZ - DIR_ENTRIES_PER_BLK*FILE_NAME_LEN) // 256 bytes
 #define EMPTY_I_NUM         (-2)    // inode num indicates an unused dir entry
 #define MAX_PATH_LEN      (100)   // max characters in a path
 #define MAX_FILE_SIZE     (1<<30)//(2147483647)  // 2GB
+#define MAX_DIR_BLKS      (MAX_FILE_SIZE/BLK_SZ)  // max blks of a directory
 
 #define NAMEI_CACHE_SZ		32	// number of path->inode mappings
+#define INODE_TABLE_SZ		256	// number of in-core inodes
+#define INODE_HASH_SZ		64	// hash chains of the in-core inode table
+#define CACHE_LINE_SZ		64
+#define POOL_SLAB_OBJS		16	// objects carved from one slab malloc
+#define POOL_MAGAZINE_SZ	8	// free objects a thread keeps per pool
+#define BLK_MAGAZINE_SZ		32	// free blks a thread keeps reserved per allocation group
+#define DIR_HINT_SZ		64	// number of dirs with an in-core free-slot hint
+#define DIR_COMPACT_QUEUE_SZ	64	// max dirs waiting for compaction
+#define DIR_LISTING_SZ		64	// max dirs with open listings, see dir_listing_begin()
+#define DIR_COMPACT_HOLES	DIR_ENTRIES_PER_BLK // unlinks before a dir is queued for compaction
+#define RECLAIM_QUEUE_SZ	64	// max unlinked files waiting for their blks to be freed
+#define RECLAIM_MIN_BLKS	64	// an unlinked file with more blks is freed in the background
+#define RECLAIM_BATCH		1024	// blks an unlinked file gives back per journal transaction
+#define RANGE_LOCK_HASH_SZ	64	// wait queues shared by the byte-range locks of all inodes
+#define JOURNAL_HASH_SZ		256	// hash chains of the journaled blks in core
+#define JOURNAL_COMMIT_OPS	64	// ops grouped into one journal commit at most
+#define JOURNAL_TRANS_BLKS	128	// a transaction this many blks big is committed at the end of its op, or before the next op
+#define READ_RUN_BLKS		64	// max blks read in one request when loading the inode table or checking the fs
 
 #define _DEBUG       0 // 1: show debug info
 #define USE_NAMEI_CACHE		1
+#define DEFAULT_ATIME_MODE	ATIME_RELATIME
+#define RELATIME_MAX_AGE	(24*60*60)	// seconds
+#define ILIST_ASYNC_REFILL	1	// 1: refill the free ilist ahead of ialloc(), see fill_free_ilist_ahead()
+#define INLINE_DATA		1	// 1: store tiny files in the inode, see INLINE_DATA_LEN
+#define IPREFETCH_ON_READDIR	1	// 1: read the inode blks of a dir blk in one pass for readdirplus
+#define ZERO_BLK_HOLES		1	// 1: a full-blk write of zeros leaves a hole, see blk_is_zero()
+
+/* An allocation group: a run of data blks, the first of which holds this
+ * header, and the inode blks iblk with iblk % nr_ags equal to the group's
+ * index. Each group has its own free blk list and free ilist, locked on
+ * their own in core, so threads allocating in different groups do not wait
+ * for each other. */
+struct ag_desc {
+        int first_blk;          // the header blk, the group's data blks follow it
+        int nr_blks;            // blks in the group, header included
+        int num_free_blks;      // current number of free blocks in the group
+        /* free block list */
+        int free_blk_list_head; // the blk # that contains free blk list numbers.
+        int next_free_blk_idx;  // the index which points to the first available free blk
+        /* list of free inodes*/
+        int num_free_inodes;    // free inodes in the inode blks of the group
+        int remembered_inode;   // starting from this inode, a search routine can find as many
+				// free inodes to fill the free_ilist. Before this number, there
+				// should be no free inode of the group.
+        int free_ilist[AG_ILIST_SIZE];  // a cache for the list of free inodes
+        int next_free_inode_idx;        // the index which points to the next available inode.
+};
+
+#define FS_DIRTY	0	// super_block state: in use, or not unmounted cleanly
+#define FS_CLEAN	1	// super_block state: unmounted cleanly, nothing to recover
+#define SUPER_MAGIC	0x4d465342	// "MFSB"
+#define FS_VERSION	1	// on-disk format version, bumped whenever the layout changes
 
 struct super_block {
+        int magic;              // SUPER_MAGIC
+        int version;            // FS_VERSION of the mkfs that made the fs
         int blk_size;           // the block size
         int num_blks;           // total number of blks on the disk.
         long long fs_size;            // file system size
         int max_free_blks;      // max number of free blocks
-        int num_free_blks;      // current number of free blocks
+        int num_free_blks;      // current number of free blocks, summed over the groups
         int data_blk_offset;    // the blk number of the first data block on the file system
-        /* free block list */
-        int free_blk_list_head; // the blk # that contains free blk list numbers.
-        int next_free_blk_idx;  // the index which points to the first available free blk
-        /*TODO: int free_blk_list_cache[FREE_BLKS_PER_LINK];*/
-        /* list of free inodes*/
+        /* allocation groups */
+        int nr_ags;             // groups the data blks are split into
+        int ag_blks;            // blks per group, the last one also takes the rest
+        /* inodes */
         int max_free_inodes;    // max number of free inodes on disk
-        int num_free_inodes;    // current number of free inodes on disk
-        int remembered_inode;   // starting from this inode, a search routine can find as many
-				// free inodes to fill the free_ilist. Before this number, there
-				// should be no free inode.
-        int free_ilist[MAX_FREE_ILIST_SIZE];    // a cache for the list of free inodes
-        int next_free_inode_idx;                // the index which points to the next available inode.
-        /*TODO: lock fields for free blks and ilists.*/
-//        int modified; /* 0: original, 1: modified */
-//        int locked; /* 0: free, 1: locked */
+        int num_free_inodes;    // current number of free inodes on disk, summed over the groups
+        /* inode table */
+        int nr_iblks;           // inode blks: ILIST_SPACE fixed ones, then the ones added later
+        int imap_blks[IMAP_BLKS]; // blks mapping the added inode blks to data blks, 0: none yet
+        /* metadata journal */
+        int journal_blk;        // the journal header blk, the journal follows it
+        int journal_blks;       // blks of the journal, header included
+        int state;              // FS_CLEAN or FS_DIRTY, written home directly at mount and unmount
+        // the free counts are exact in core; on disk they are as of the last
+        // superblk write, and init_super() sums them up again from the groups.
+};
+
+/* The metadata journal. Metadata blk writes go to the journal first and
+ * reach their home blks at a checkpoint. A transaction is written behind the
+ * previous one as a descriptor blk, the images of the blks it changed, and a
+ * commit blk; it counts once its commit blk is on disk. A checkpoint writes
+ * the journaled blks home and starts the journal over, empty, with the next
+ * sequence number in its header. Mounting a fs that is not FS_CLEAN replays
+ * the transactions from the header on, up to the first one with a wrong
+ * sequence number or checksum. */
+#define JOURNAL_HEADER_MAGIC	0x4d464a48	// "MFJH"
+#define JOURNAL_DESC_MAGIC	0x4d464a44	// "MFJD"
+#define JOURNAL_COMMIT_MAGIC	0x4d464a43	// "MFJC"
+#define JOURNAL_DESC_MAX	(BLK_SZ/4 - 3)	// blks one transaction can log
+
+struct journal_header {
+        int magic;
+        unsigned int seq;       // of the first transaction after the header
+        int nr_blks;            // blks of the journal, header included
+};
+
+struct journal_desc {
+        int magic;
+        unsigned int seq;
+        int nr;                 // images following this blk
+        int blks[JOURNAL_DESC_MAX]; // their home blks
+};
+
+struct journal_commit {
+        int magic;
+        unsigned int seq;
+        int nr;
+        unsigned int csum;      // journal_csum() of the descriptor and the images
 };
 
 enum FILE_TYPE {
@@ -71,63 +167,113 @@ enum FILE_TYPE {
         FIFO           // not used in our fs
 };
 
+/* The disk inode, hot fields first: the ones every read, write and lookup
+ * touches fill the first 56 bytes, so that together with the in-core hot
+ * fields they take one cache line of the in-core inode. The field list is
+ * shared with struct in_core_inode, which embeds it whole, so converting
+ * between the two is one struct copy. */
+#define DISK_INODE_FIELDS \
+        /* hot */ \
+        enum FILE_TYPE file_type; \
+        int file_size; \
+        int block_addr[DIRECT_BLKS_PER_INODE];  /* direct blks on the inode */ \
+        int single_ind_blk;         /* single indirect block addr */ \
+        int double_ind_blk;         /* double indirect block addr */ \
+        /* cold */ \
+        int blks_in_use;            /* blks the block map covers, holes included. indexing blks not counted. */ \
+        int link_count;             /* hard link for the inode. */ \
+        int access_permission;      /* default is 0777 */ \
+        int last_accessed;          /* last access time of the file */ \
+        int last_modified;          /* last modification time of the file */ \
+        int inode_last_mod;         /* last modification time to the inode */ \
+        char owner_id[FILE_OWNER_ID_LEN];     /* the id of inode owner */
+
 struct disk_inode {
-        enum FILE_TYPE file_type;
-        char owner_id[FILE_OWNER_ID_LEN];     // the id of inode owner
-        int access_permission;      // default is 0777
-        int last_accessed;          // last access time of the file    
-        int last_modified;          // last modification time of the file
-        int inode_last_mod;         // last modification time to the inode
-        int link_count;             // hard link for the inode.
-        int file_size;
-	int blks_in_use;  // currently allocated blks. indexing blks not counted.
-        int block_addr[DIRECT_BLKS_PER_INODE];    // direct blks on the inode
-	int single_ind_blk;  // single indirect block addr
-	int double_ind_blk;  // double indirect block addr
-}; //size = 96 bytes?
-
-struct in_core_inode { // the same version of disk inode except it is in-core.
-        enum FILE_TYPE file_type;
-        char owner_id[FILE_OWNER_ID_LEN];
-        int access_permission;
-        int last_accessed;
-        int last_modified;
-        int inode_last_mod;
-        int link_count;
-        int file_size;
-	int blks_in_use;  // allocated blks, doesn't count indexing blks.
+        DISK_INODE_FIELDS
+}; //size = 96 bytes
+
+struct range_lock;
+
+struct in_core_inode { // the disk inode plus in-core fields.
+	// hot: first cache line together with the hot disk inode fields.
+        int i_num;                  // the inode number
+        unsigned short ref_count;   // # of iget() without matching iput().
+        unsigned char modified;     // if modified == 1, then write disk when iput() is called.
+        union {
+                struct { DISK_INODE_FIELDS };
+                struct disk_inode disk;  // the same fields as a whole
+        };
 	// for directory, file_size is always a multiple of blks_in_use.
 	// but file doesn't.
-        int block_addr[DIRECT_BLKS_PER_INODE];
-	int single_ind_blk;  // single indirect block addr
-	int double_ind_blk;  // double indirect block addr
-	// below are in-core fields
-        int locked;         // TODO: currently not in meaningful use.
-        int modified;       // if modified == 1, then write disk when iput() is called.
-        int i_num;          // the inode number
-        //int ref_count;      // reference count is used by open file table.
-};
-
-struct directory_entry {
-  int inode_num;
-  char file_name[FILE_NAME_LEN];
+	// cold in-core fields
+        unsigned int seq;           // seqcount, odd while the inode changes, see getattr_v2()
+        unsigned char atime_dirty;  // lazytime: last_accessed changed, nothing else
+        unsigned char excl;         // rwlock held exclusive
+        pthread_rwlock_t rwlock;    // see ilock()
+        pthread_mutex_t map_lock;   // block map and size, when changed under a shared rwlock
+        struct range_lock *ranges;  // byte ranges held by reads and writes, see range_lock()
+	// in-core inode table links, see iget().
+	struct in_core_inode *hash_next;  // next inode on the same hash chain
+	struct in_core_inode *free_prev;  // free list of inodes with ref_count 0
+	struct in_core_inode *free_next;
+} __attribute__((aligned(CACHE_LINE_SZ)));
+
+// a regular file of up to INLINE_DATA_LEN bytes keeps its data in the inode,
+// in place of the block map (block_addr, single and double indirect).
+#define INLINE_DATA_LEN         ((DIRECT_BLKS_PER_INODE + 2) * ADDR_SZ)
+#define INODE_IS_INLINE(ci)     ((ci)->blks_in_use == 0 && (ci)->file_size > 0)
+#define INODE_INLINE_DATA(ci)   ((char*)(ci)->block_addr)
+
+/* A directory block. The slot header sits in front of the names and keeps
+ * each field in its own contiguous array, so a lookup can compare the name
+ * hashes of 4 slots at once and only strcmp() a name on a hash hit. */
+struct dir_block {
+	unsigned int name_hash[DIR_ENTRIES_PER_BLK]; // dir_name_hash() of the name
+	int inode_num[DIR_ENTRIES_PER_BLK];          // EMPTY_I_NUM: slot unused
+	unsigned char name_len[DIR_ENTRIES_PER_BLK]; // strlen() of the name
+	unsigned char file_type[DIR_ENTRIES_PER_BLK]; // file_type of the inode
+	int nr_used;                                 // # of slots in use
+	char pad[DIR_HEADER_LEN - DIR_ENTRIES_PER_BLK*10 - 4];
+	char file_name[DIR_ENTRIES_PER_BLK][FILE_NAME_LEN];
 };
 
 struct namei_cache_element {
-	char path[DIR_ENTRY_LENGTH];
-	struct in_core_inode *iNode;
+	char path[MAX_PATH_LEN];
+	int i_num;
 	int timestamp;
+	struct in_core_inode *ci;   // in-core copy of i_num when cached, may be taken since
+	unsigned int seq;           // seqcount, odd while the entry changes
 };
 
+// a mounted fs image: its device, superblk, allocators and in-core caches.
+// All calls below work on the volume the calling thread entered, or else on
+// the one init_storage() opened, so one process can serve several images
+// with a thread (or more) on each.
+struct volume;
+
+// open the device at dev_path (a fresh in-memory one with IN_MEM_STORE) as a
+// volume, with empty in-core caches. mkfs() or init_super() comes next, on a
+// thread that entered it. returns NULL on failure.
+struct volume* vol_open(const char *dev_path);
+
+// make v the volume the calling thread works on, NULL for the one of
+// init_storage(). returns the volume entered before.
+struct volume* vol_enter(struct volume *v);
+
+// write back what is in core, close the device and free v. no other thread
+// may be working on v. returns 0 on success and -1 on failure.
+int vol_close(struct volume *v);
+
 // TODO: init_storage(), cleanup_storage(), bread() and bwrite() should
 //  be declared static once testing is complete
 
-// Procedures required to prepare a storage device for mounting. Returns
-// 0 on success and -1 on failure.
+// Procedures required to prepare a storage device for mounting: opens
+// BLOCK_DEV_PATH as the default volume. Returns its storage fd on success
+// and -1 on failure.
 int init_storage();
 
-// Procedures required to prepare for demounting. Returns 0 on success and
-// -1 on failure.
+// Procedures required to prepare for demounting: closes the default volume.
+// Returns 0 on success and -1 on failure.
 int cleanup_storage();
 
 // Reads block at specified storage block number. Fills provided buffer
@@ -135,9 +281,33 @@ int cleanup_storage();
 int bread(unsigned int blk, char *buffer);
 
 // Writes contents of buffer to specified storage block offset. Returns
-// 0 on success and -1 on failure.
+// 0 on success and -1 on failure. File data goes here; a blk that is in the
+// metadata journal is written through it.
 int bwrite(unsigned int blk, const char *buffer);
 
+// bwrite() of a metadata blk, through the journal once it is on.
+int bwrite_meta(unsigned int blk, const char *buffer);
+
+// write the journaled blks home and empty the journal. return 0 on success,
+// -1 on failure.
+int journal_checkpoint(void);
+
+// checksum of a journal transaction, one blk at a time, starting from 0.
+unsigned int journal_csum(unsigned int csum, const char *blk);
+
+// fixed-size object pools. objects come from slabs that are never returned
+// to malloc; each thread keeps a small magazine of free objects per pool, so
+// the pool lock is only taken to refill or drain a magazine.
+enum obj_pool_id {
+	POOL_BLK_BUF,     // BLK_SZ buffers of the in-core caches
+	POOL_INODE,       // in-core inodes of the inode table
+	NR_OBJ_POOLS
+};
+
+void* pool_alloc(enum obj_pool_id id);
+void pool_free(enum obj_pool_id id, void *obj);
+void dump_pools(void); // slabs and objects in use per pool
+
 // dump info about superblk, free lists, and disk data
 void dump(void); 
 void dump_super(void); // only dump super
@@ -153,20 +323,73 @@ int mkfs(void);
 // initialize superblk in memory. This function doesn't write to disk.
 int init_super(void);
 
+// like init_super(), but nothing is ever written to the volume: the journal
+// is not replayed, orphans are left for the next mount, and vol_close()
+// leaves the fs as it was. for a check that must not change the fs.
+int init_super_ro(void);
+
+// check the consistency of the fs init_super() mounted, with nr_threads
+// threads walking the inodes; repair: fix what is found, not on a volume of
+// init_super_ro(). nothing else may use the fs meanwhile. returns the # of
+// problems found, -1 on error; *nr_fixed (if not NULL): how many of them the
+// repair fixed.
+int fsck(int repair, int nr_threads, int *nr_fixed);
+
 // allocate a block
 int balloc(void);
 
 // free a block
 int bfree(int);
 
-// read inode from disk, and make an in-core copy
+// give the free blks all threads keep reserved back to the allocation groups,
+// or with discard, forget them (the fs they came from is gone).
+// return 0: successful; return -1: failure.
+int blk_mags_drain(int discard);
+
+// get the in-core copy of an inode, reading it from disk if it is not in
+// the in-core inode table, and take a reference to it.
 struct in_core_inode* iget(int i_num);
 
-// called when the kernel releases an inode
+// read the inode blks holding i_nums into core, each blk once and in blk
+// order; negative i_nums are skipped. return # of blks read, -1 on error.
+int iprefetch(const int *i_nums, int n);
+
+// iget n inodes after prefetching their blks. return 0, or -1 with none held.
+int iget_batch(const int *i_nums, int n, struct in_core_inode **out);
+
+// inode updates stay in core until this writes the dirty inode blks back to
+// disk, in blk order, and commits the journal transaction they end. lazy:
+// also the blks with only lazytime access time updates. return 0 on
+// success, -1 on failure.
+int iflush(int lazy);
+
+// how reads update the access time. lazy: the update is kept in core and
+// only reaches disk with other inode changes or with iflush(1).
+enum atime_mode {
+	ATIME_STRICT,     // every read
+	ATIME_RELATIME,   // if not newer than mtime/ctime, or older than RELATIME_MAX_AGE
+	ATIME_NOATIME,    // never
+};
+void set_atime_opts(enum atime_mode mode, int lazy);
+
+// drop a reference taken by iget()/ialloc()/namei_v2(). the last one writes
+// a modified inode back to disk, or frees an inode with no links left.
 int iput(struct in_core_inode* pi);
 
+// lock an inode held with iget()/namei_v2(). excl = 0: shared, to read the
+// inode and its data or search a dir; excl = 1: to change them. read_v2,
+// write_v2, truncate_v2, readdir_v2 and the namespace calls lock for themselves.
+// iunlock() copies the changes made under the lock to the inode blk, so the
+// next commit has them while other references to ci remain.
+void ilock(struct in_core_inode* ci, int excl);
+void iunlock(struct in_core_inode* ci);
+
 void dump_in_core_inode(struct in_core_inode* ci);
 
+// top up the free ilist if ialloc() found it running low, so a burst of
+// creates does not wait for the refill. return # of inodes added, -1 on error.
+int fill_free_ilist_ahead(void);
+
 // alloc an in-core inode from free ilist
 struct in_core_inode* ialloc(void);
 
@@ -182,6 +405,26 @@ int ifree(struct in_core_inode* ci);
 int bmap(const struct in_core_inode* ci, const int off, int* blk_num, 
 	int* offset_blk);
 
+// setup the in-core dir free-slot hints
+void init_dir_hints(void);
+
+// dir i_num is listed through an open dir handle, until dir_listing_end().
+// dir_compact_pending() leaves it alone meanwhile, so the entry offsets a
+// listing resumes from stay valid. The handle holds no reference: a dir
+// removed while open is freed at once. returns 0, or -ENFILE if
+// DIR_LISTING_SZ dirs are listed already.
+int dir_listing_begin(int i_num);
+void dir_listing_end(int i_num);
+
+// compact up to max_dirs of the dirs queued for compaction: squeeze out the
+// unused slots left by unlink and free the emptied dir blks at the end.
+// returns the number of dirs compacted, -1 on error.
+int dir_compact_pending(int max_dirs);
+
+// free the blks of up to max_inodes of the unlinked files queued by their
+// last iput(), and the inodes. returns the number freed, -1 on error.
+int reclaim_pending(int max_inodes);
+
 // setup namei cache
 void init_namei_cache();
 
@@ -192,6 +435,20 @@ struct namei_cache_element *find_namei_cache_by_oldest();
 // a slight modified version of namei
 struct in_core_inode* namei_v2(const char *path);
 
+// copy the attributes of the inode at path to attr, without taking a lock or
+// a reference when the path is in the namei cache. returns 0 or -ENOENT.
+int getattr_v2(const char *path, struct in_core_inode *attr);
+
+// called by readdir_v2 for each entry. next_off is the offset to resume the
+// listing after this entry. attr is NULL unless a plus listing was asked for.
+// Returns nonzero when no more entries can be taken.
+typedef int (*dir_filler_t)(void *arg, const char *name, int i_num,
+	int file_type, const struct in_core_inode *attr, int next_off);
+
+// list directory ci from entry offset off (0: from the start) and release ci
+// like read_v2. Only a plus listing reads inodes, one bread per inode blk.
+int readdir_v2(struct in_core_inode* ci, int off, int plus, dir_filler_t filler, void *arg);
+
 // a slight modified version of mkdir
 int mkdir_v2(const char *path, int mode);
 
@@ -236,4 +493,13 @@ int write_v2(struct in_core_inode* ci, const char* buf, int size, int offset1);
 /*If the file previously was larger than this size, the extra data is lost. If the file previously was shorter, it is extended, and the extended part reads as null bytes ('\0').*/
 int truncate_v2(struct in_core_inode* ci, int length);
 
+#ifndef SEEK_DATA
+#define SEEK_DATA	3	// next offset with data, see lseek_v2()
+#define SEEK_HOLE	4	// next offset in a hole
+#endif
+
+// find the next data (SEEK_DATA) or hole (SEEK_HOLE) of a sparse file at or after off.
+// on success: returns the offset. on failure: -ENXIO past the end of file, -EINVAL, -EIO.
+int lseek_v2(struct in_core_inode* ci, int off, int whence);
+
 #endif
@@ -5,9 +5,40 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
 
 #include "monsterfs_funs.h"
 
+static int nr_failed;
+
+static void expect(int ok, const char *what)
+{
+	if (ok)
+		printf("%s passed\n", what);
+	else
+	{
+		printf("%s FAILED\n", what);
+		nr_failed++;
+	}
+}
+
+// write blks blocks of byte c to the new file path.
+static int make_file(const char *path, int blks, char c)
+{
+	char buf[BLK_SZ];
+	int i;
+	if (mknod_v2(path, 0, 0) == -1)
+		return -1;
+	memset(buf, c, sizeof(buf));
+	for (i = 0; i < blks; i++)
+	{
+		if (write_v2(namei_v2(path), buf, BLK_SZ, i * BLK_SZ) != BLK_SZ)
+			return -1;
+	}
+	return 0;
+}
+
 void test_write(void)
 {
 	init_storage();
@@ -417,6 +448,492 @@ int test_storage()
   return 0;
 }
 
+// a repair fixes all it finds, and a check after it finds nothing.
+static int repaired(void)
+{
+	int fixed = -1;
+	int found = fsck(1, 2, &fixed);
+	return found > 0 && fixed == found && fsck(0, 2, NULL) == 0;
+}
+
+// break the fs one way at a time, and check that fsck finds it, that a
+// repair fixes it, and that a check after the repair finds nothing: the exit
+// status of fsck.monsterfs -n goes back to 0.
+void test_fsck(void)
+{
+	struct in_core_inode *ci;
+	int blk;
+	init_storage();
+	mkfs();
+	mkdir_v2("/foo", 0);
+	make_file("/foo/file1", 4, 'a');
+	make_file("/file2", 2, 'b');
+	expect(fsck(0, 2, NULL) == 0, "fsck of a fresh fs");
+
+	// a wrong link count.
+	ci = namei_v2("/file2");
+	ci->link_count = 3;
+	ci->modified = 1;
+	iput(ci);
+	expect(fsck(0, 2, NULL) > 0, "fsck finds a wrong link count");
+	expect(repaired(), "fsck repairs a wrong link count");
+
+	// a block map pointing off the data blks: the blk it held is lost too.
+	ci = namei_v2("/foo/file1");
+	ci->block_addr[0] = NUM_BLKS + 7;
+	ci->modified = 1;
+	iput(ci);
+	expect(fsck(0, 2, NULL) > 0, "fsck finds a corrupted block map");
+	expect(repaired(), "fsck repairs a corrupted block map");
+
+	// a blk neither in a file nor on a free list.
+	ci = namei_v2("/foo/file1");
+	ci->block_addr[1] = 0;
+	ci->modified = 1;
+	iput(ci);
+	expect(fsck(0, 2, NULL) > 0, "fsck finds a leaked block");
+	expect(repaired(), "fsck repairs a leaked block");
+
+	// a blk in a file and on a free list: the free lists are rebuilt.
+	ci = namei_v2("/foo/file1");
+	blk = ci->block_addr[2];
+	iput(ci);
+	bfree(blk);
+	expect(fsck(0, 2, NULL) > 0, "fsck finds a broken free list");
+	expect(repaired(), "fsck rebuilds the free lists");
+	ci = namei_v2("/foo/file1");
+	expect(ci->block_addr[2] == blk && balloc() != blk, "fsck keeps the file blk off the free lists");
+	iput(ci);
+
+	// a dir without "..": found, not fixed, so fsck.monsterfs -y exits 4.
+	struct dir_block db;
+	int slot, found, fixed = -1;
+	ci = namei_v2("/foo");
+	blk = ci->block_addr[0];
+	iput(ci);
+	bread(blk, (char*)&db);
+	for (slot = 0; slot < DIR_ENTRIES_PER_BLK; slot++)
+	{
+		if (db.inode_num[slot] != EMPTY_I_NUM && strcmp(db.file_name[slot], "..") == 0)
+		{
+			db.inode_num[slot] = EMPTY_I_NUM;
+			db.nr_used--;
+		}
+	}
+	bwrite_meta(blk, (char*)&db);
+	found = fsck(1, 2, &fixed);
+	expect(found > 0 && fixed < found && fsck(0, 2, NULL) > 0, "fsck reports a problem it leaves");
+	cleanup_storage();
+}
+
+// blks_in_use of the inode at path.
+static int blks_of(const char *path)
+{
+	struct in_core_inode *ci = namei_v2(path);
+	int blks = ci != NULL ? ci->blks_in_use : -1;
+	if (ci != NULL)
+		iput(ci);
+	return blks;
+}
+
+// name entry i of /dir, long enough that names differ past the hash prefilter.
+static void dir_entry_path(char *path, int i)
+{
+	sprintf(path, "/dir/a-rather-long-file-name-shared-by-all-entries-%d", i);
+}
+
+// fill a dir past a few dir blks, then empty most of it: compaction moves
+// the last entries to the front and gives the emptied dir blks back.
+void test_dir_grow_shrink(void)
+{
+	char path[MAX_PATH_LEN + 8];
+	struct in_core_inode *ci;
+	int i, ok = 1;
+	int n = 3 * DIR_ENTRIES_PER_BLK + 5;
+	init_storage();
+	mkfs();
+	mkdir_v2("/dir", 0);
+	for (i = 0; i < n; i++)
+	{
+		dir_entry_path(path, i);
+		ok &= mknod_v2(path, 0, 0) == 0;
+	}
+	expect(ok, "create dir entries");
+	// . and .. take a slot each.
+	expect(blks_of("/dir") == (n + 2 + DIR_ENTRIES_PER_BLK - 1) / DIR_ENTRIES_PER_BLK, "dir grows a blk at a time");
+	memset(path, 'x', sizeof(path));
+	strcpy(path, "/dir/");
+	path[5] = 'x';
+	path[MAX_PATH_LEN] = '\0';
+	expect(mknod_v2(path, 0, 0) == -ENAMETOOLONG, "a path too long is refused");
+	for (i = 0; i < n - 3; i++)
+	{
+		dir_entry_path(path, i);
+		ok &= unlink(path) == 0;
+	}
+	expect(ok, "unlink most dir entries");
+	expect(dir_compact_pending(8) >= 1, "dir is queued for compaction");
+	expect(blks_of("/dir") == 1, "dir shrinks to one blk");
+	for (i = 0; i < n; i++)
+	{
+		dir_entry_path(path, i);
+		ci = namei_v2(path);
+		ok &= (ci != NULL) == (i >= n - 3);
+		if (ci != NULL)
+			iput(ci);
+	}
+	expect(ok, "lookups after the compaction");
+	expect(fsck(0, 2, NULL) == 0, "fsck after the compaction");
+	cleanup_storage();
+}
+
+struct listing {
+	int max;          // entries to take per readdir_v2() call
+	int taken;        // entries taken by this call
+	int next_off;     // where the next call resumes
+	int seen[64];     // times entry i was listed
+	int bad;          // entries with a wrong name or attributes
+};
+
+static int list_filler(void *arg, const char *name, int i_num, int file_type,
+	const struct in_core_inode *attr, int next_off)
+{
+	struct listing *l = (struct listing*)arg;
+	int i;
+	if (l->taken == l->max)
+		return 1;
+	l->taken++;
+	l->next_off = next_off;
+	if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+		return 0;
+	if (sscanf(name, "e%d", &i) != 1 || i < 0 || i >= 64 || attr == NULL || attr->i_num != i_num)
+		l->bad++;
+	else
+		l->seen[i]++;
+	return 0;
+}
+
+// list a dir a few entries per call, resuming from the offset handed to the
+// filler, while entries already listed are unlinked: every entry left is
+// listed once, and the dir is not compacted under the open listing.
+void test_readdir_resume(void)
+{
+	struct listing l;
+	struct in_core_inode *dir;
+	char path[32];
+	int i, i_num, ok = 1;
+	int n = 2 * DIR_ENTRIES_PER_BLK + 7;
+	init_storage();
+	mkfs();
+	mkdir_v2("/ls", 0);
+	for (i = 0; i < n; i++)
+	{
+		sprintf(path, "/ls/e%d", i);
+		mknod_v2(path, 0, 0);
+	}
+	memset(&l, 0, sizeof(l));
+	l.max = 5;
+	dir = namei_v2("/ls");
+	i_num = dir->i_num;
+	iput(dir);
+	dir_listing_begin(i_num);
+	do
+	{
+		l.taken = 0;
+		readdir_v2(namei_v2("/ls"), l.next_off, 1, list_filler, &l);
+		if (l.next_off == 4 * l.max)
+		{ // e0..e17 are listed: unlink enough of them to queue the dir.
+			for (i = 0; i < DIR_COMPACT_HOLES + 1; i++)
+			{
+				sprintf(path, "/ls/e%d", i);
+				unlink(path);
+			}
+			dir_compact_pending(8);
+			expect(blks_of("/ls") == 3, "no compaction under an open listing");
+		}
+	}
+	while (l.taken > 0);
+	dir_listing_end(i_num);
+	for (i = 0; i < n; i++)
+		ok &= l.seen[i] == 1;
+	expect(ok && l.bad == 0, "each entry listed once across resumed calls");
+	expect(dir_compact_pending(8) == 1 && blks_of("/ls") == 2, "compaction once the listing ends");
+
+	// an open listing does not keep a removed dir.
+	mkdir_v2("/gone", 0);
+	dir = namei_v2("/gone");
+	i_num = dir->i_num;
+	iput(dir);
+	dir_listing_begin(i_num);
+	expect(rmdir("/gone") == 0 && namei_v2("/gone") == NULL && fsck(0, 2, NULL) == 0,
+	  "a dir removed while listed is freed at once");
+	dir_listing_end(i_num);
+	cleanup_storage();
+}
+
+// a tiny file keeps its data in the inode, and moves it to a blk when it
+// grows past INLINE_DATA_LEN, by a write or by a truncate.
+void test_inline_data(void)
+{
+#if !INLINE_DATA
+	printf("inline data test skipped: INLINE_DATA is off\n");
+#else
+	char buf[2 * INLINE_DATA_LEN], zeros[2 * INLINE_DATA_LEN];
+	int n = INLINE_DATA_LEN - 4;
+	init_storage();
+	mkfs();
+	memset(zeros, 0, sizeof(zeros));
+	mknod_v2("/tiny", 0, 0);
+	write_v2(namei_v2("/tiny"), "hello", 6, 0);
+	expect(blks_of("/tiny") == 0, "a tiny file takes no blk");
+	expect(read_v2(namei_v2("/tiny"), buf, sizeof(buf), 0) == 6 && strcmp(buf, "hello") == 0, "read inline data");
+
+	// the write ends past INLINE_DATA_LEN: the data moves to a blk.
+	write_v2(namei_v2("/tiny"), "0123456789", 10, n);
+	expect(blks_of("/tiny") == 1, "a write past the inode moves the data to a blk");
+	expect(read_v2(namei_v2("/tiny"), buf, sizeof(buf), 0) == n + 10 && strcmp(buf, "hello") == 0
+	  && memcmp(buf + 6, zeros, n - 6) == 0 && memcmp(buf + n, "0123456789", 10) == 0,
+	  "read the data moved to a blk");
+
+	// a truncate up to past the inode moves it too, the rest reads zeros.
+	mknod_v2("/tiny2", 0, 0);
+	memset(buf, 'z', INLINE_DATA_LEN);
+	write_v2(namei_v2("/tiny2"), buf, INLINE_DATA_LEN, 0);
+	expect(blks_of("/tiny2") == 0, "a file of INLINE_DATA_LEN bytes stays in the inode");
+	truncate_v2(namei_v2("/tiny2"), 2 * INLINE_DATA_LEN);
+	memset(buf, 0, sizeof(buf));
+	expect(read_v2(namei_v2("/tiny2"), buf, sizeof(buf), 0) == 2 * INLINE_DATA_LEN
+	  && buf[0] == 'z' && buf[INLINE_DATA_LEN - 1] == 'z'
+	  && memcmp(buf + INLINE_DATA_LEN, zeros, INLINE_DATA_LEN) == 0,
+	  "a truncate past the inode keeps the data and adds zeros");
+	expect(fsck(0, 2, NULL) == 0, "fsck of inline and moved data");
+	cleanup_storage();
+#endif
+}
+
+// offset of the next data or hole of path at or after off.
+static int seek(const char *path, int off, int whence)
+{
+	return lseek_v2(namei_v2(path), off, whence);
+}
+
+// a sparse file: blks written in the direct, single and double indirect
+// ranges, holes between them that take no blk and read as zeros.
+void test_holes(void)
+{
+	char buf[BLK_SZ], zeros[BLK_SZ];
+	struct in_core_inode *ci;
+	int blk_num, offset_blk;
+	int far = DIRECT_BLKS_PER_INODE + RANGE_SINGLE + 5; // in the double indirect range
+	init_storage();
+	mkfs();
+	memset(zeros, 0, sizeof(zeros));
+	mknod_v2("/sparse", 0, 0);
+	memset(buf, 'a', sizeof(buf));
+	write_v2(namei_v2("/sparse"), buf, BLK_SZ, 0);
+	write_v2(namei_v2("/sparse"), buf, BLK_SZ, DIRECT_BLKS_PER_INODE * BLK_SZ);
+	write_v2(namei_v2("/sparse"), buf, BLK_SZ, far * BLK_SZ);
+
+	ci = namei_v2("/sparse");
+	expect(bmap(ci, 5 * BLK_SZ, &blk_num, &offset_blk) == 0 && blk_num == 0
+	  && bmap(ci, (far - 1) * BLK_SZ, &blk_num, &offset_blk) == 0 && blk_num == 0, "holes take no blk");
+	expect(ci->file_size == (far + 1) * BLK_SZ, "the size covers the holes");
+	iput(ci);
+	expect(read_v2(namei_v2("/sparse"), buf, BLK_SZ, 5 * BLK_SZ) == BLK_SZ
+	  && memcmp(buf, zeros, BLK_SZ) == 0, "a hole reads as zeros");
+
+	expect(seek("/sparse", 0, SEEK_DATA) == 0 && seek("/sparse", 0, SEEK_HOLE) == BLK_SZ,
+	  "SEEK_DATA and SEEK_HOLE at the first blk");
+	expect(seek("/sparse", BLK_SZ + 1, SEEK_DATA) == DIRECT_BLKS_PER_INODE * BLK_SZ
+	  && seek("/sparse", DIRECT_BLKS_PER_INODE * BLK_SZ, SEEK_HOLE) == (DIRECT_BLKS_PER_INODE + 1) * BLK_SZ,
+	  "SEEK_DATA and SEEK_HOLE into the single indirect range");
+	expect(seek("/sparse", (DIRECT_BLKS_PER_INODE + 1) * BLK_SZ, SEEK_DATA) == far * BLK_SZ
+	  && seek("/sparse", far * BLK_SZ + 7, SEEK_HOLE) == (far + 1) * BLK_SZ,
+	  "SEEK_DATA and SEEK_HOLE into the double indirect range, the end counts as a hole");
+	expect(seek("/sparse", (far + 1) * BLK_SZ, SEEK_DATA) == -ENXIO, "SEEK_DATA at the end of file");
+
+	// a truncate up adds a hole at the end.
+	truncate_v2(namei_v2("/sparse"), (far + 100) * BLK_SZ);
+	expect(seek("/sparse", (far + 1) * BLK_SZ, SEEK_DATA) == -ENXIO
+	  && seek("/sparse", (far + 1) * BLK_SZ, SEEK_HOLE) == (far + 1) * BLK_SZ, "a truncate up adds a hole");
+	expect(fsck(0, 2, NULL) == 0, "fsck of a sparse file");
+	cleanup_storage();
+}
+
+#define NR_WRITERS	8
+#define WRITER_BLKS	(DIRECT_BLKS_PER_INODE + 20)	// one single indirect table too
+
+// the free blk count in the superblk on disk.
+static int super_free_blks(void)
+{
+	char buf[BLK_SZ];
+	if (bread(0, buf) == -1)
+		return -1;
+	return ((struct super_block*)buf)->num_free_blks;
+}
+
+static void *writer(void *arg)
+{
+	char path[32], buf[BLK_SZ];
+	int i, w = (int)(long)arg;
+	sprintf(path, "/w%d", w);
+	memset(buf, 'a' + w, sizeof(buf));
+	for (i = 0; i < WRITER_BLKS; i++)
+		write_v2(namei_v2(path), buf, BLK_SZ, i * BLK_SZ);
+	return NULL;
+}
+
+// threads write files side by side, each allocating from its own magazine
+// and the groups behind it: after an unmount, the free blk count is down by
+// exactly the blks the files took.
+void test_concurrent_writers(void)
+{
+	pthread_t threads[NR_WRITERS];
+	char path[32], buf[BLK_SZ];
+	int i, j, free_before, ok = 1;
+	init_storage();
+	mkfs();
+	for (i = 0; i < NR_WRITERS; i++)
+	{
+		sprintf(path, "/w%d", i);
+		mknod_v2(path, 0, 0);
+	}
+	cleanup_storage();
+	init_storage();
+	init_super();
+	free_before = super_free_blks();
+	for (i = 0; i < NR_WRITERS; i++)
+		pthread_create(&threads[i], NULL, writer, (void*)(long)i);
+	for (i = 0; i < NR_WRITERS; i++)
+		pthread_join(threads[i], NULL);
+	for (i = 0; i < NR_WRITERS; i++)
+	{
+		sprintf(path, "/w%d", i);
+		for (j = 0; j < WRITER_BLKS; j++)
+			ok &= read_v2(namei_v2(path), buf, BLK_SZ, j * BLK_SZ) == BLK_SZ
+			  && buf[0] == 'a' + i && buf[BLK_SZ - 1] == 'a' + i;
+	}
+	expect(ok, "read what the writers wrote");
+	cleanup_storage();
+	init_storage();
+	init_super_ro();
+	expect(free_before - super_free_blks() == NR_WRITERS * (WRITER_BLKS + 1), "exact free blk count after the writers");
+	expect(fsck(0, 4, NULL) == 0, "fsck after the writers");
+	cleanup_storage();
+}
+
+// the fs state in the superblk on disk.
+static int super_state(void)
+{
+	char buf[BLK_SZ];
+	if (bread(0, buf) == -1)
+		return -1;
+	return ((struct super_block*)buf)->state;
+}
+
+// commit some work, then crash: the volume is never closed. The next mount
+// replays the journal, and puts the blks the crash left reserved back on the
+// free lists; an unmount after it leaves the fs clean.
+void test_crash_replay(void)
+{
+#if IN_MEM_STORE
+	printf("crash replay test skipped: the in-memory storage goes with the crash\n");
+#else
+	struct in_core_inode *ci;
+	char path[32], buf[BLK_SZ];
+	int i, ok = 1;
+	struct volume *v = vol_open(BLOCK_DEV_PATH);
+	vol_enter(v);
+	mkfs();
+	mkdir_v2("/crash", 0);
+	for (i = 0; i < 20; i++)
+	{
+		sprintf(path, "/crash/f%d", i);
+		make_file(path, 2, 'a' + i);
+	}
+	for (i = 0; i < 20; i += 4)
+	{
+		sprintf(path, "/crash/f%d", i);
+		unlink(path);
+	}
+	iflush(1); // commits the running transaction
+	expect(super_state() == FS_DIRTY, "a mounted fs is dirty on disk");
+
+	v = vol_open(BLOCK_DEV_PATH);
+	vol_enter(v);
+	expect(init_super() == 0, "mount after a crash");
+	for (i = 0; i < 20; i++)
+	{
+		sprintf(path, "/crash/f%d", i);
+		ci = namei_v2(path);
+		if (i % 4 == 0)
+		{
+			ok &= ci == NULL;
+			if (ci != NULL)
+				iput(ci);
+		}
+		else
+			ok &= ci != NULL && read_v2(ci, buf, BLK_SZ, BLK_SZ) == BLK_SZ
+			  && buf[0] == 'a' + i && buf[BLK_SZ - 1] == 'a' + i;
+	}
+	expect(ok, "the files after the journal replay");
+	expect(fsck(0, 2, NULL) == 0, "no blks lost to the crash");
+	vol_close(v);
+
+	v = vol_open(BLOCK_DEV_PATH);
+	vol_enter(v);
+	init_super_ro();
+	expect(super_state() == FS_CLEAN, "the fs is clean after an unmount");
+	vol_close(v);
+	vol_enter(NULL);
+#endif
+}
+
+// grow a dir while it is listed and a reference to it is held, commit and
+// crash: the new entries and dir blks are in the commit although the dir
+// inode was never released.
+void test_crash_open_dir(void)
+{
+#if IN_MEM_STORE
+	printf("open dir crash test skipped: the in-memory storage goes with the crash\n");
+#else
+	struct in_core_inode *dir, *ci;
+	char path[32];
+	int i, ok = 1;
+	int n = 2 * DIR_ENTRIES_PER_BLK;
+	struct volume *v = vol_open(BLOCK_DEV_PATH);
+	vol_enter(v);
+	mkfs();
+	mkdir_v2("/open", 0);
+	dir = namei_v2("/open");
+	dir_listing_begin(dir->i_num);
+	for (i = 0; i < n; i++)
+	{
+		sprintf(path, "/open/f%d", i);
+		mknod_v2(path, 0, 0);
+	}
+	iflush(1); // what fsync() does
+	expect(blks_of("/open") == 3, "dir grows under an open listing");
+
+	v = vol_open(BLOCK_DEV_PATH);
+	vol_enter(v);
+	expect(init_super() == 0, "mount after a crash with an open dir");
+	expect(blks_of("/open") == 3, "the grown dir inode after the replay");
+	for (i = 0; i < n; i++)
+	{
+		sprintf(path, "/open/f%d", i);
+		ci = namei_v2(path);
+		ok &= ci != NULL;
+		if (ci != NULL)
+			iput(ci);
+	}
+	expect(ok, "the entries made under an open listing after the replay");
+	expect(fsck(0, 2, NULL) == 0, "no dir blks lost to the crash");
+	vol_close(v);
+	vol_enter(NULL);
+#endif
+}
+
 int main()
 {
 	//test_storage();
@@ -428,5 +945,13 @@ int main()
 	//test_rmdir();
 	//test_open();
 	test_write();
-	return 0;
+	test_fsck();
+	test_crash_replay();
+	test_crash_open_dir();
+	test_dir_grow_shrink();
+	test_readdir_resume();
+	test_inline_data();
+	test_holes();
+	test_concurrent_writers();
+	return nr_failed > 0;
 }